@@ -273,7 +273,11 @@ bser_object_get(bser_t* bser, const char* key)
     assert(bser_is_object(bser));
     for (int i = 0; i < bser->value.object.length; ++i) {
         bser_key_value_pair_t* pair = bser_object_pair_at(bser, i);
-        bser_parse_if_necessary(&pair->key);
+        if (bser_is_unparsed(&pair->key)) {
+            /* The key follows the whole of the previous value */
+            bser_parse_object_fields_to(bser, i);
+            bser_parse_if_necessary(&pair->key);
+        }
         assert(bser_is_string(&pair->key));
         bser_parse_if_necessary(&pair->value);
         if (!bser_string_strcmp(key, &pair->key)) {
@@ -0,0 +1,847 @@
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bser.h"
+#include "bser_json.h"
+
+/**
+ * The transcoder reads BSER from a 'source' and writes JSON text to a
+ * 'sink'.  Both are tiny interfaces (in the style of the streams used by
+ * bser_write.c) so that the same walker serves memory buffers and FILEs on
+ * the input side and fds, fixed buffers and growable buffers on the output
+ * side.  The raw walker consumes the input strictly in order and keeps no
+ * per-value state beyond the recursion itself; the only allocation is the
+ * scratch used to hold object keys and compact array headers.
+ */
+
+#define SINK_BUFFER_SIZE 65536
+#define STRING_CHUNK_SIZE 4096
+
+typedef struct source {
+    /* Reads exactly 'bytes' bytes into 'buffer'.  Returns 0 on success. */
+    int (*read)(struct source*, void* buffer, size_t bytes);
+    /* Returns non-zero when there is no more input at all */
+    int (*at_end)(struct source*);
+    size_t consumed;
+    /* Where the current PDU ends, by its header */
+    size_t limit;
+} source_t;
+
+typedef struct sink {
+    /* Hands off 'bytes' bytes from 'buffer'.  Returns 0 on success. */
+    int (*flush)(struct sink*, const char* buffer, size_t bytes);
+    size_t used;
+    size_t total;
+    char buffer[SINK_BUFFER_SIZE];
+} sink_t;
+
+static void
+fill_in_error(const char* msg, json_error_t* err)
+{
+    if (err != NULL) {
+        memset(err, 0, sizeof(*err));
+        strncpy(err->text, msg, JSON_ERROR_TEXT_LENGTH - 1);
+    }
+}
+
+static int
+sink_drain(sink_t* sink)
+{
+    int ret = 0;
+    if (sink->used > 0) {
+        ret = sink->flush(sink, sink->buffer, sink->used);
+        sink->used = 0;
+    }
+    return ret;
+}
+
+static int
+sink_write(sink_t* sink, const char* data, size_t bytes)
+{
+    sink->total += bytes;
+    while (bytes > 0) {
+        size_t room = SINK_BUFFER_SIZE - sink->used;
+        size_t chunk = bytes < room ? bytes : room;
+        memcpy(sink->buffer + sink->used, data, chunk);
+        sink->used += chunk;
+        data += chunk;
+        bytes -= chunk;
+        if (sink->used == SINK_BUFFER_SIZE && sink_drain(sink)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+sink_puts(sink_t* sink, const char* str)
+{
+    return sink_write(sink, str, strlen(str));
+}
+
+static int
+write_escaped(sink_t* sink, const char* chars, size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t start = 0;
+
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = (unsigned char)chars[i];
+        const char* escape = NULL;
+        char unicode[7];
+
+        switch (c) {
+            case '"':  escape = "\\\""; break;
+            case '\\': escape = "\\\\"; break;
+            case '\b': escape = "\\b"; break;
+            case '\f': escape = "\\f"; break;
+            case '\n': escape = "\\n"; break;
+            case '\r': escape = "\\r"; break;
+            case '\t': escape = "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    memcpy(unicode, "\\u00", 4);
+                    unicode[4] = hex[c >> 4];
+                    unicode[5] = hex[c & 0xf];
+                    unicode[6] = '\0';
+                    escape = unicode;
+                }
+                break;
+        }
+        if (escape != NULL) {
+            if (sink_write(sink, chars + start, i - start) ||
+                sink_puts(sink, escape)) {
+                return -1;
+            }
+            start = i + 1;
+        }
+    }
+    return sink_write(sink, chars + start, length - start);
+}
+
+static int
+write_quoted(sink_t* sink, const char* chars, size_t length)
+{
+    return sink_write(sink, "\"", 1) ||
+           write_escaped(sink, chars, length) ||
+           sink_write(sink, "\"", 1);
+}
+
+static int
+write_integer(sink_t* sink, int64_t value)
+{
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%lld", (long long)value);
+    return sink_write(sink, text, len);
+}
+
+static int
+write_real(sink_t* sink, double value, json_error_t* err)
+{
+    char text[32];
+    if (isnan(value) || isinf(value)) {
+        fill_in_error("Real value cannot be represented in JSON", err);
+        return -1;
+    }
+    int len = snprintf(text, sizeof(text), "%.17g", value);
+    /* Keep reals recognizable as reals, as jansson does */
+    if (strpbrk(text, ".eE") == NULL) {
+        text[len++] = '.';
+        text[len++] = '0';
+    }
+    return sink_write(sink, text, len);
+}
+
+static int
+sink_error(json_error_t* err)
+{
+    fill_in_error("Could not write JSON output", err);
+    return -1;
+}
+
+/* Raw walker -- reads tags and values directly from the source */
+
+typedef struct scratch {
+    char* data;
+    size_t used;
+    size_t cap;
+} scratch_t;
+
+static int
+read_tagged_integer(source_t* src, uint8_t tag, int64_t* value)
+{
+    int8_t  v8;
+    int16_t v16;
+    int32_t v32;
+
+    switch (tag) {
+        case BSER_TAG_INT8:
+            if (src->read(src, &v8, sizeof(v8))) return -1;
+            *value = v8;
+            return 0;
+        case BSER_TAG_INT16:
+            if (src->read(src, &v16, sizeof(v16))) return -1;
+            *value = v16;
+            return 0;
+        case BSER_TAG_INT32:
+            if (src->read(src, &v32, sizeof(v32))) return -1;
+            *value = v32;
+            return 0;
+        case BSER_TAG_INT64:
+            return src->read(src, value, sizeof(*value));
+        default:
+            return -1;
+    }
+}
+
+static int
+read_integer(source_t* src, int64_t* value)
+{
+    uint8_t tag;
+    return src->read(src, &tag, 1) || read_tagged_integer(src, tag, value);
+}
+
+/* The bytes left in the current PDU */
+static size_t
+remaining(const source_t* src)
+{
+    return src->consumed < src->limit ? src->limit - src->consumed : 0;
+}
+
+/* Reads the length of a string, array or object.  Each character or
+ * element takes at least a byte, so a length larger than what is left of
+ * the PDU can't be right, and is rejected before anything is sized by it. */
+static int
+read_length(source_t* src, size_t* length, const char* what,
+            json_error_t* err)
+{
+    int64_t value;
+    if (read_integer(src, &value) || value < 0 ||
+        (uint64_t)value > remaining(src)) {
+        fill_in_error(what, err);
+        return -1;
+    }
+    *length = (size_t)value;
+    return 0;
+}
+
+/* Appends a string (tag included) to 'scratch', followed by a NUL.  Sets
+ * '*offset' to where the characters start. */
+static int
+read_string_to_scratch(source_t* src, scratch_t* scratch, size_t* offset,
+                       size_t* length, json_error_t* err)
+{
+    uint8_t tag;
+    if (src->read(src, &tag, 1) || tag != BSER_TAG_STRING) {
+        fill_in_error("Expected a string", err);
+        return -1;
+    }
+    if (read_length(src, length, "String does not have an integer length",
+                    err)) {
+        return -1;
+    }
+    if (scratch->used + *length + 1 > scratch->cap) {
+        size_t cap = scratch->cap ? scratch->cap : 256;
+        while (cap < scratch->used + *length + 1) {
+            cap *= 2;
+        }
+        char* data = realloc(scratch->data, cap);
+        if (data == NULL) {
+            fill_in_error("Could not allocate memory for string", err);
+            return -1;
+        }
+        scratch->data = data;
+        scratch->cap = cap;
+    }
+    *offset = scratch->used;
+    if (src->read(src, scratch->data + scratch->used, *length)) {
+        fill_in_error("Truncated string", err);
+        return -1;
+    }
+    scratch->used += *length;
+    scratch->data[scratch->used++] = '\0';
+    return 0;
+}
+
+static int walk_tagged(source_t* src, sink_t* sink, uint8_t tag,
+                       json_error_t* err);
+
+static int
+walk_value(source_t* src, sink_t* sink, json_error_t* err)
+{
+    uint8_t tag;
+    if (src->read(src, &tag, 1)) {
+        fill_in_error("out of data", err);
+        return -1;
+    }
+    return walk_tagged(src, sink, tag, err);
+}
+
+static int
+walk_string(source_t* src, sink_t* sink, json_error_t* err)
+{
+    char chunk[STRING_CHUNK_SIZE];
+    size_t length;
+
+    if (read_length(src, &length, "String does not have an integer length",
+                    err)) {
+        return -1;
+    }
+    if (sink_write(sink, "\"", 1)) {
+        return sink_error(err);
+    }
+    while (length > 0) {
+        size_t bytes = length < sizeof(chunk) ? length : sizeof(chunk);
+        if (src->read(src, chunk, bytes)) {
+            fill_in_error("Truncated string", err);
+            return -1;
+        }
+        if (write_escaped(sink, chunk, bytes)) {
+            return sink_error(err);
+        }
+        length -= bytes;
+    }
+    return sink_write(sink, "\"", 1) ? sink_error(err) : 0;
+}
+
+static int
+walk_array(source_t* src, sink_t* sink, json_error_t* err)
+{
+    size_t length;
+    if (read_length(src, &length, "Array does not have an integer length",
+                    err)) {
+        return -1;
+    }
+    if (sink_write(sink, "[", 1)) {
+        return sink_error(err);
+    }
+    for (size_t i = 0; i < length; ++i) {
+        if (i > 0 && sink_write(sink, ",", 1)) {
+            return sink_error(err);
+        }
+        if (walk_value(src, sink, err)) {
+            return -1;
+        }
+    }
+    return sink_write(sink, "]", 1) ? sink_error(err) : 0;
+}
+
+static int
+walk_object(source_t* src, sink_t* sink, json_error_t* err)
+{
+    scratch_t key = { NULL, 0, 0 };
+    size_t length;
+    size_t written = 0;
+    int ret = -1;
+
+    if (read_length(src, &length, "Object does not have an integer length",
+                    err)) {
+        return -1;
+    }
+    if (sink_write(sink, "{", 1)) {
+        return sink_error(err);
+    }
+    for (size_t i = 0; i < length; ++i) {
+        size_t offset, key_length;
+        uint8_t tag;
+
+        key.used = 0;
+        if (read_string_to_scratch(src, &key, &offset, &key_length, err)) {
+            goto done;
+        }
+        if (src->read(src, &tag, 1)) {
+            fill_in_error("out of data", err);
+            goto done;
+        }
+        if (tag == BSER_TAG_NO_FIELD) {
+            continue;
+        }
+        if ((written++ > 0 && sink_write(sink, ",", 1)) ||
+            write_quoted(sink, key.data + offset, key_length) ||
+            sink_write(sink, ":", 1)) {
+            sink_error(err);
+            goto done;
+        }
+        if (walk_tagged(src, sink, tag, err)) {
+            goto done;
+        }
+    }
+    ret = sink_write(sink, "}", 1) ? sink_error(err) : 0;
+done:
+    free(key.data);
+    return ret;
+}
+
+static int
+walk_compact_array(source_t* src, sink_t* sink, json_error_t* err)
+{
+    scratch_t keys = { NULL, 0, 0 };
+    size_t* offsets = NULL;
+    size_t* lengths = NULL;
+    size_t header_length, rows;
+    uint8_t tag;
+    int ret = -1;
+
+    if (src->read(src, &tag, 1) || tag != BSER_TAG_ARRAY ||
+        read_length(src, &header_length,
+                    "Compact array does not have a header array", err)) {
+        fill_in_error("Compact array does not have a header array", err);
+        return -1;
+    }
+    /* Each key takes at least a tag, a length and a character */
+    if (header_length > remaining(src) / 3) {
+        fill_in_error("Compact array header is longer than the data", err);
+        return -1;
+    }
+    offsets = malloc(sizeof(*offsets) * (header_length + 1));
+    lengths = malloc(sizeof(*lengths) * (header_length + 1));
+    if (offsets == NULL || lengths == NULL) {
+        fill_in_error("Could not allocate enough memory to hold "
+                      "compact array header", err);
+        goto done;
+    }
+    for (size_t i = 0; i < header_length; ++i) {
+        if (read_string_to_scratch(src, &keys, &offsets[i], &lengths[i],
+                                   err)) {
+            goto done;
+        }
+    }
+    if (read_length(src, &rows,
+                    "Compact array does not have an integer length", err)) {
+        goto done;
+    }
+    if (sink_write(sink, "[", 1)) {
+        sink_error(err);
+        goto done;
+    }
+    for (size_t row = 0; row < rows; ++row) {
+        size_t written = 0;
+        if ((row > 0 && sink_write(sink, ",", 1)) ||
+            sink_write(sink, "{", 1)) {
+            sink_error(err);
+            goto done;
+        }
+        for (size_t i = 0; i < header_length; ++i) {
+            if (src->read(src, &tag, 1)) {
+                fill_in_error("out of data", err);
+                goto done;
+            }
+            if (tag == BSER_TAG_NO_FIELD) {
+                continue;
+            }
+            if ((written++ > 0 && sink_write(sink, ",", 1)) ||
+                write_quoted(sink, keys.data + offsets[i], lengths[i]) ||
+                sink_write(sink, ":", 1)) {
+                sink_error(err);
+                goto done;
+            }
+            if (walk_tagged(src, sink, tag, err)) {
+                goto done;
+            }
+        }
+        if (sink_write(sink, "}", 1)) {
+            sink_error(err);
+            goto done;
+        }
+    }
+    ret = sink_write(sink, "]", 1) ? sink_error(err) : 0;
+done:
+    free(offsets);
+    free(lengths);
+    free(keys.data);
+    return ret;
+}
+
+static int
+walk_tagged(source_t* src, sink_t* sink, uint8_t tag, json_error_t* err)
+{
+    int64_t integer;
+    double real;
+
+    switch (tag) {
+        case BSER_TAG_ARRAY:
+            return walk_array(src, sink, err);
+        case BSER_TAG_OBJECT:
+            return walk_object(src, sink, err);
+        case BSER_TAG_STRING:
+            return walk_string(src, sink, err);
+        case BSER_TAG_INT8:
+        case BSER_TAG_INT16:
+        case BSER_TAG_INT32:
+        case BSER_TAG_INT64:
+            if (read_tagged_integer(src, tag, &integer)) {
+                fill_in_error("out of data", err);
+                return -1;
+            }
+            return write_integer(sink, integer) ? sink_error(err) : 0;
+        case BSER_TAG_REAL:
+            if (src->read(src, &real, sizeof(real))) {
+                fill_in_error("out of data", err);
+                return -1;
+            }
+            return write_real(sink, real, err);
+        case BSER_TAG_TRUE:
+            return sink_puts(sink, "true") ? sink_error(err) : 0;
+        case BSER_TAG_FALSE:
+            return sink_puts(sink, "false") ? sink_error(err) : 0;
+        case BSER_TAG_NULL:
+            return sink_puts(sink, "null") ? sink_error(err) : 0;
+        case BSER_TAG_COMPACT_ARRAY:
+            return walk_compact_array(src, sink, err);
+        default:
+            fill_in_error("unknown tag in data stream", err);
+            return -1;
+    }
+}
+
+static int
+walk_pdus(source_t* src, sink_t* sink, json_error_t* err)
+{
+    int count = 0;
+
+    while (!src->at_end(src)) {
+        uint8_t magic[2];
+        int64_t length;
+
+        if (src->read(src, magic, sizeof(magic)) ||
+            magic[0] != 0 || magic[1] != 1) {
+            fill_in_error("Could not read bser magic values", err);
+            return -1;
+        }
+        if (read_integer(src, &length) || length <= 0 ||
+            (uint64_t)length > SIZE_MAX - src->consumed) {
+            fill_in_error("Could not read bser length", err);
+            return -1;
+        }
+        size_t start = src->consumed;
+        src->limit = start + (size_t)length;
+        if (walk_value(src, sink, err)) {
+            return -1;
+        }
+        if (src->consumed - start != (size_t)length) {
+            fill_in_error("bser length does not match content", err);
+            return -1;
+        }
+        if (sink_write(sink, "\n", 1)) {
+            return sink_error(err);
+        }
+        ++count;
+    }
+    if (sink_drain(sink)) {
+        return sink_error(err);
+    }
+    return count;
+}
+
+/* Memory buffer source */
+struct buffer_source {
+    source_t source;
+    const uint8_t* data;
+    size_t datalen;
+};
+
+static int
+buffer_source_read(source_t* s, void* buffer, size_t bytes)
+{
+    struct buffer_source* src = (struct buffer_source*)s;
+    if (bytes > src->datalen - src->source.consumed) {
+        return -1;
+    }
+    memcpy(buffer, src->data + src->source.consumed, bytes);
+    src->source.consumed += bytes;
+    return 0;
+}
+
+static int
+buffer_source_at_end(source_t* s)
+{
+    struct buffer_source* src = (struct buffer_source*)s;
+    return src->source.consumed >= src->datalen;
+}
+
+static void
+init_buffer_source(struct buffer_source* src, const void* data, size_t len)
+{
+    src->source.read = buffer_source_read;
+    src->source.at_end = buffer_source_at_end;
+    src->source.consumed = 0;
+    src->data = data;
+    src->datalen = len;
+}
+
+/* FILE source */
+struct file_source {
+    source_t source;
+    FILE* file;
+};
+
+static int
+file_source_read(source_t* s, void* buffer, size_t bytes)
+{
+    struct file_source* src = (struct file_source*)s;
+    if (fread(buffer, 1, bytes, src->file) != bytes) {
+        return -1;
+    }
+    src->source.consumed += bytes;
+    return 0;
+}
+
+static int
+file_source_at_end(source_t* s)
+{
+    struct file_source* src = (struct file_source*)s;
+    int c = fgetc(src->file);
+    if (c == EOF) {
+        return 1;
+    }
+    ungetc(c, src->file);
+    return 0;
+}
+
+/* fd sink */
+struct fd_sink {
+    sink_t sink;
+    int fd;
+};
+
+static int
+fd_sink_flush(sink_t* s, const char* buffer, size_t bytes)
+{
+    struct fd_sink* sink = (struct fd_sink*)s;
+    while (bytes > 0) {
+        ssize_t wrote = write(sink->fd, buffer, bytes);
+        if (wrote < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += wrote;
+        bytes -= wrote;
+    }
+    return 0;
+}
+
+static struct fd_sink*
+new_fd_sink(int fd)
+{
+    struct fd_sink* sink = malloc(sizeof(*sink));
+    if (sink != NULL) {
+        sink->sink.flush = fd_sink_flush;
+        sink->sink.used = 0;
+        sink->sink.total = 0;
+        sink->fd = fd;
+    }
+    return sink;
+}
+
+/* Fixed buffer sink; silently truncates, but keeps counting */
+struct buffer_sink {
+    sink_t sink;
+    char* out;
+    size_t outlen;
+    size_t cursor;
+};
+
+static int
+buffer_sink_flush(sink_t* s, const char* buffer, size_t bytes)
+{
+    struct buffer_sink* sink = (struct buffer_sink*)s;
+    if (sink->cursor < sink->outlen) {
+        size_t room = sink->outlen - sink->cursor;
+        memcpy(sink->out + sink->cursor, buffer, bytes < room ? bytes : room);
+    }
+    sink->cursor += bytes;
+    return 0;
+}
+
+/* Growable buffer sink */
+struct alloc_sink {
+    sink_t sink;
+    char* out;
+    size_t cursor;
+    size_t cap;
+};
+
+static int
+alloc_sink_flush(sink_t* s, const char* buffer, size_t bytes)
+{
+    struct alloc_sink* sink = (struct alloc_sink*)s;
+    if (sink->cursor + bytes + 1 > sink->cap) {
+        size_t cap = sink->cap ? sink->cap : 256;
+        while (cap < sink->cursor + bytes + 1) {
+            cap *= 2;
+        }
+        char* out = realloc(sink->out, cap);
+        if (out == NULL) {
+            return -1;
+        }
+        sink->out = out;
+        sink->cap = cap;
+    }
+    memcpy(sink->out + sink->cursor, buffer, bytes);
+    sink->cursor += bytes;
+    return 0;
+}
+
+int
+bser_transcode_to_fd(const void* data, size_t datalen, int fd,
+                     json_error_t* err)
+{
+    struct buffer_source src;
+    struct fd_sink* sink = new_fd_sink(fd);
+    if (sink == NULL) {
+        fill_in_error("Could not allocate output buffer", err);
+        return -1;
+    }
+    init_buffer_source(&src, data, datalen);
+    int count = walk_pdus(&src.source, &sink->sink, err);
+    free(sink);
+    return count;
+}
+
+int
+bser_transcode_file_to_fd(FILE* file, int fd, json_error_t* err)
+{
+    struct file_source src;
+    struct fd_sink* sink = new_fd_sink(fd);
+    if (sink == NULL) {
+        fill_in_error("Could not allocate output buffer", err);
+        return -1;
+    }
+    src.source.read = file_source_read;
+    src.source.at_end = file_source_at_end;
+    src.source.consumed = 0;
+    src.file = file;
+    int count = walk_pdus(&src.source, &sink->sink, err);
+    free(sink);
+    return count;
+}
+
+int
+bser_transcode_to_buffer(const void* data, size_t datalen,
+                         char* out, size_t outlen, size_t* needed,
+                         json_error_t* err)
+{
+    struct buffer_source src;
+    struct buffer_sink* sink = malloc(sizeof(*sink));
+    if (sink == NULL) {
+        fill_in_error("Could not allocate output buffer", err);
+        return -1;
+    }
+    sink->sink.flush = buffer_sink_flush;
+    sink->sink.used = 0;
+    sink->sink.total = 0;
+    sink->out = out;
+    sink->outlen = outlen;
+    sink->cursor = 0;
+
+    init_buffer_source(&src, data, datalen);
+    int count = walk_pdus(&src.source, &sink->sink, err);
+    if (outlen > 0) {
+        out[sink->cursor < outlen ? sink->cursor : outlen - 1] = '\0';
+    }
+    if (needed != NULL) {
+        *needed = sink->sink.total;
+    }
+    free(sink);
+    return count;
+}
+
+/* Node walker -- writes an already (lazily) parsed bser_t */
+
+static int
+dump_node(bser_t* bser, sink_t* sink, json_error_t* err)
+{
+    if (bser_is_integer(bser)) {
+        return write_integer(sink, bser_integer_value(bser)) ?
+            sink_error(err) : 0;
+    } else if (bser_is_real(bser)) {
+        return write_real(sink, bser_real_value(bser), err);
+    } else if (bser_is_true(bser)) {
+        return sink_puts(sink, "true") ? sink_error(err) : 0;
+    } else if (bser_is_false(bser)) {
+        return sink_puts(sink, "false") ? sink_error(err) : 0;
+    } else if (bser_is_null(bser)) {
+        return sink_puts(sink, "null") ? sink_error(err) : 0;
+    } else if (bser_is_string(bser)) {
+        size_t length;
+        const char* chars = bser_string_value(bser, &length);
+        return write_quoted(sink, chars, length) ? sink_error(err) : 0;
+    } else if (bser_is_array(bser)) {
+        size_t length = bser_array_size(bser);
+        if (sink_write(sink, "[", 1)) {
+            return sink_error(err);
+        }
+        for (size_t i = 0; i < length; ++i) {
+            if ((i > 0 && sink_write(sink, ",", 1))) {
+                return sink_error(err);
+            }
+            if (dump_node(bser_array_get(bser, i), sink, err)) {
+                return -1;
+            }
+        }
+        return sink_write(sink, "]", 1) ? sink_error(err) : 0;
+    } else if (bser_is_object(bser)) {
+        size_t length = bser_object_size(bser);
+        size_t written = 0;
+        if (sink_write(sink, "{", 1)) {
+            return sink_error(err);
+        }
+        for (size_t i = 0; i < length; ++i) {
+            size_t key_length;
+            bser_t* key = bser_object_key_at(bser, i);
+            bser_t* value = bser_object_value_at(bser, i);
+            if (value == NULL) {
+                continue;
+            }
+            const char* key_chars = bser_string_value(key, &key_length);
+            if ((written++ > 0 && sink_write(sink, ",", 1)) ||
+                write_quoted(sink, key_chars, key_length) ||
+                sink_write(sink, ":", 1)) {
+                return sink_error(err);
+            }
+            if (dump_node(value, sink, err)) {
+                return -1;
+            }
+        }
+        return sink_write(sink, "}", 1) ? sink_error(err) : 0;
+    } else if (bser_is_error(bser)) {
+        fill_in_error(bser_error_message(bser), err);
+        return -1;
+    } else {
+        fill_in_error("Unknown bser node type", err);
+        return -1;
+    }
+}
+
+char*
+bser_dumps(bser_t* bser, json_error_t* err)
+{
+    struct alloc_sink* sink = malloc(sizeof(*sink));
+    char* result = NULL;
+    if (sink == NULL) {
+        fill_in_error("Could not allocate output buffer", err);
+        return NULL;
+    }
+    sink->sink.flush = alloc_sink_flush;
+    sink->sink.used = 0;
+    sink->sink.total = 0;
+    sink->out = NULL;
+    sink->cursor = 0;
+    sink->cap = 0;
+
+    if (dump_node(bser, &sink->sink, err) == 0) {
+        if (sink_drain(&sink->sink) || alloc_sink_flush(&sink->sink, "", 1)) {
+            sink_error(err);
+        } else {
+            result = sink->out;
+            sink->out = NULL;
+        }
+    }
+    free(sink->out);
+    free(sink);
+    return result;
+}
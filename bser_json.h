@@ -0,0 +1,41 @@
+#ifndef LIBWATCHMAN_BSER_JSON_H_
+#define LIBWATCHMAN_BSER_JSON_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <jansson.h>
+
+#include "bser.h"
+
+/**
+ * Streaming BSER to JSON transcoding.  Unlike bser2json(), these functions
+ * never build a jansson tree and never copy strings out of the input: BSER
+ * data is walked in order and escaped JSON text is written straight to the
+ * output through a small fixed-size buffer, so memory use does not depend on
+ * the size of the input.  Each PDU in the input is written as one line of
+ * compact JSON.  Object fields are written in wire order.
+ */
+
+/* Transcode every PDU in 'data' (one or more concatenated PDUs) to the
+ * file descriptor 'fd'.  Returns the number of PDUs written, or -1 on error
+ * with 'err' filled in. */
+int bser_transcode_to_fd(const void* data, size_t datalen, int fd,
+                         json_error_t* err);
+
+/* Like bser_transcode_to_fd(), but PDUs are read from 'file' until EOF. */
+int bser_transcode_file_to_fd(FILE* file, int fd, json_error_t* err);
+
+/* Like bser_transcode_to_fd(), but the text is written to 'out'.  As with
+ * snprintf(), output is truncated (and always NUL-terminated if 'outlen' is
+ * non-zero) when 'out' is too small, and '*needed' is set to the length the
+ * full text would have had. */
+int bser_transcode_to_buffer(const void* data, size_t datalen,
+                             char* out, size_t outlen, size_t* needed,
+                             json_error_t* err);
+
+/* Write a (possibly partially parsed) node as compact JSON text to a newly
+ * allocated, NUL-terminated string.  Returns NULL on error with 'err' filled
+ * in. */
+char* bser_dumps(bser_t* bser, json_error_t* err);
+
+#endif /* ndef LIBWATCHMAN_BSER_JSON_H_ */
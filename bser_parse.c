@@ -1,7 +1,14 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "bser.h"
+#include "bser_parse.h"
 
 /**
  * BSER parsing is done lazily, and does not copy strings out of the buffer.
@@ -73,11 +80,12 @@ new_read_buffer(void* data, size_t buflen, int offset)
     buffer->data = data;
     buffer->datalen = buflen;
     buffer->cursor = offset;
+    buffer->is_json = 0;
     return buffer;
 }
 
 bser_t*
-bser_parse_content(void* data, size_t buflen, bser_t* fill)
+bser_parse_content(uint8_t* data, size_t buflen, bser_t* fill)
 {
     bser_buffer_t* read_buffer = new_read_buffer(data, buflen, 0);
     /* Create lazily-parsed node that will self-parse when it is accessed */
@@ -118,7 +126,7 @@ integer_from_file(FILE* fp, int64_t* value)
 }
 
 bser_t*
-bser_parse_buffer(void* buffer, size_t buflen, bser_t* fill)
+bser_parse_buffer(uint8_t* buffer, size_t buflen, bser_t* fill)
 {
     uint8_t* magic = buffer;
     if (buflen < 2 || magic[0] != 0 || magic[1] != 1) {
@@ -166,6 +174,149 @@ bser_parse_from_file(FILE* fp, bser_t* fill)
     }
 }
 
+static int
+integer_from_buffer(const uint8_t* data, size_t datalen, size_t* cursor,
+                    int64_t* value)
+{
+    int8_t  v8;
+    int16_t v16;
+    int32_t v32;
+    size_t size;
+
+    if (*cursor >= datalen) {
+        return -1;
+    }
+    switch (data[*cursor]) {
+        case BSER_TAG_INT8:  size = sizeof(v8);  break;
+        case BSER_TAG_INT16: size = sizeof(v16); break;
+        case BSER_TAG_INT32: size = sizeof(v32); break;
+        case BSER_TAG_INT64: size = sizeof(*value); break;
+        default: return -1;
+    }
+    if (datalen - *cursor - 1 < size) {
+        return -1;
+    }
+    const uint8_t* src = data + *cursor + 1;
+    switch (size) {
+        case sizeof(v8):  memcpy(&v8, src, size);  *value = v8;  break;
+        case sizeof(v16): memcpy(&v16, src, size); *value = v16; break;
+        case sizeof(v32): memcpy(&v32, src, size); *value = v32; break;
+        default:          memcpy(value, src, size); break;
+    }
+    *cursor += 1 + size;
+    return 0;
+}
+
+static const char*
+index_pdus(bser_file_t* file)
+{
+    const uint8_t* data = file->data;
+    size_t cursor = 0;
+    size_t cap = 0;
+
+    while (cursor < file->datalen) {
+        int64_t length;
+        if (file->datalen - cursor < 2 ||
+            data[cursor] != 0 || data[cursor + 1] != 1) {
+            return "Could not read bser magic values";
+        }
+        cursor += 2;
+        if (integer_from_buffer(data, file->datalen, &cursor, &length)) {
+            return "Could not read bser length";
+        }
+        if (length <= 0) {
+            return "Invalid bser length";
+        }
+        if ((uint64_t)length > file->datalen - cursor) {
+            return "Truncated buffer";
+        }
+        if (file->nr_pdus == cap) {
+            cap = cap ? cap * 2 : 16;
+            bser_pdu_t* pdus = realloc(file->pdus, sizeof(*pdus) * cap);
+            if (pdus == NULL) {
+                return "Could not allocate memory to index PDUs";
+            }
+            file->pdus = pdus;
+        }
+        bser_pdu_t* pdu = &file->pdus[file->nr_pdus++];
+        pdu->offset = cursor;
+        pdu->length = (size_t)length;
+        cursor += (size_t)length;
+    }
+    return NULL;
+}
+
+bser_file_t*
+bser_file_open(const char* path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st)) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+    bser_file_t* file = calloc(1, sizeof(*file));
+    if (file == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    file->datalen = (size_t)st.st_size;
+    if (file->datalen > 0) {
+        file->data = mmap(NULL, file->datalen, PROT_READ, MAP_SHARED, fd, 0);
+        if (file->data == MAP_FAILED) {
+            int saved = errno;
+            close(fd);
+            free(file);
+            errno = saved;
+            return NULL;
+        }
+    }
+    /* The mapping keeps the file alive */
+    close(fd);
+    file->error_message = index_pdus(file);
+    return file;
+}
+
+bser_t*
+bser_file_pdu(bser_file_t* file, size_t index, bser_t* fill)
+{
+    if (index >= file->nr_pdus) {
+        return new_error("PDU index out of range", fill);
+    }
+    bser_pdu_t* pdu = &file->pdus[index];
+    /* Parsing never writes to the data, so the read-only mapping is safe */
+    pdu->buffer.data = (uint8_t*)file->data + pdu->offset;
+    pdu->buffer.datalen = pdu->length;
+    pdu->buffer.cursor = 0;
+    pdu->buffer.is_json = 0;
+    return new_unparsed(&pdu->buffer, fill);
+}
+
+void
+bser_file_close(bser_file_t* file)
+{
+    if (file->datalen > 0) {
+        munmap(file->data, file->datalen);
+    }
+    free(file->pdus);
+    free(file);
+}
+
+/* The bytes left to parse; the data need not be trusted, so lengths read
+ * from it are checked against this before they are used */
+static size_t
+bytes_left(bser_buffer_t* buffer)
+{
+    return buffer->cursor < buffer->datalen ?
+        buffer->datalen - buffer->cursor : 0;
+}
+
 static void
 parse_array(bser_t* fill, bser_buffer_t* buffer)
 {
@@ -173,8 +324,11 @@ parse_array(bser_t* fill, bser_buffer_t* buffer)
      new_unparsed(buffer, &length);
      if (bser_is_integer(&length)) {
         size_t sz = (size_t)bser_integer_value(&length);
-        bser_t* array = malloc(sizeof(*array) * sz);
-        if (array == NULL) {
+        bser_t* array = NULL;
+        /* Each element takes at least its tag */
+        if (sz > bytes_left(buffer)) {
+            new_error("Array is longer than the data", fill);
+        } else if ((array = malloc(sizeof(*array) * sz)) == NULL) {
             new_error("Could not allocate enough memory to hold "
                       "array elements", fill);
         } else {
@@ -195,8 +349,11 @@ parse_object(bser_t* fill, bser_buffer_t* buffer)
      new_unparsed(buffer, &length);
      if (bser_is_integer(&length)) {
         size_t sz = (size_t)bser_integer_value(&length);
-        bser_key_value_pair_t* array = malloc(sizeof(*array) * sz);
-        if (array == NULL) {
+        bser_key_value_pair_t* array = NULL;
+        /* Each field takes at least a tag for its key and its value */
+        if (sz > bytes_left(buffer) / 2) {
+            new_error("Object is longer than the data", fill);
+        } else if ((array = malloc(sizeof(*array) * sz)) == NULL) {
             new_error("Could not allocate enough memory to hold "
                       "object fields", fill);
         } else {
@@ -218,9 +375,13 @@ parse_string(bser_t* fill, bser_buffer_t* buffer)
      new_unparsed(buffer, &length);
      if (bser_is_integer(&length)) {
         size_t sz = (size_t)bser_integer_value(&length);
-        const char* chars = (const char*)buffer->data + buffer->cursor;
-        buffer->cursor += sz;
-        bser_new_string(chars, sz, fill);
+        if (sz > bytes_left(buffer)) {
+            new_error("String is longer than the data", fill);
+        } else {
+            const char* chars = (const char*)buffer->data + buffer->cursor;
+            buffer->cursor += sz;
+            bser_new_string(chars, sz, fill);
+        }
      } else {
         new_error("String does not have an integer length", fill);
      }
@@ -240,8 +401,13 @@ parse_compact_array(bser_t* fill, bser_buffer_t* buffer)
         new_unparsed(buffer, &length);
         if (bser_is_integer(&length)) {
             size_t sz = (size_t)bser_integer_value(&length);
-            bser_t* array = malloc(sizeof(*array) * sz);
-            if (array == NULL) {
+            /* Each row takes at least a tag per key */
+            size_t max_rows = bytes_left(buffer) /
+                (header_length ? header_length : 1);
+            bser_t* array = NULL;
+            if (sz > max_rows) {
+                new_error("Compact array is longer than the data", fill);
+            } else if ((array = malloc(sizeof(*array) * sz)) == NULL) {
                 new_error("Could not allocate enough memory to hold "
                           "compact array elements", fill);
             } else {
@@ -259,10 +425,432 @@ parse_compact_array(bser_t* fill, bser_buffer_t* buffer)
     bser_free_contents(&header);
 }
 
+/**
+ * JSON text is parsed into the same lazy nodes as BSER.  Since JSON has no
+ * length prefixes, a container's first access scans ahead (without moving
+ * the cursor) to count its top-level items; the items are then parsed in
+ * order exactly as BSER items are.  The scan also checks that commas and
+ * colons are where the grammar allows them, so that separators can simply
+ * be skipped before each value is read; a nested container is checked when
+ * it is reached.  Strings point into the text; escaped strings are decoded
+ * in place, which never makes them longer.
+ */
+
+static int
+json_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* Skips to the next value.  The separators before it were checked by its
+ * container's scan; a value that starts the text has none. */
+static void
+json_skip_separators(bser_buffer_t* buffer)
+{
+    const char* text = buffer->data;
+    int in_container = buffer->cursor > 0;
+    while (buffer->cursor < buffer->datalen) {
+        char c = text[buffer->cursor];
+        if (json_is_space(c) || (in_container && (c == ',' || c == ':' ||
+                                                  c == ']' || c == '}'))) {
+            ++buffer->cursor;
+        } else {
+            break;
+        }
+    }
+}
+
+/* Returns the index of the closing quote of the string whose contents start
+ * at 'pos', or 'len' if it is unterminated. */
+static size_t
+json_string_end(const char* text, size_t len, size_t pos)
+{
+    size_t start = pos;
+    while (pos < len) {
+        const char* quote = memchr(text + pos, '"', len - pos);
+        if (quote == NULL) {
+            return len;
+        }
+        /* An odd run of backslashes escapes the quote */
+        size_t end = quote - text;
+        size_t slashes = 0;
+        while (end - slashes > start && text[end - slashes - 1] == '\\') {
+            ++slashes;
+        }
+        if (slashes % 2 == 0) {
+            return end;
+        }
+        pos = end + 1;
+    }
+    return len;
+}
+
+/* Where a container's scan is, between its own items */
+enum json_scan_state {
+    JSON_SCAN_FIRST,        /* Just after the opening bracket */
+    JSON_SCAN_KEY,          /* After a comma in an object */
+    JSON_SCAN_COLON,        /* After a key */
+    JSON_SCAN_VALUE,        /* After a colon, or a comma in an array */
+    JSON_SCAN_SCALAR,       /* In a number or literal */
+    JSON_SCAN_AFTER_VALUE   /* After a string or container value */
+};
+
+/* Counts the items of the array or object whose contents start at the
+ * cursor, checking its separators.  Returns NULL, or what is wrong. */
+static const char*
+json_count_items(bser_buffer_t* buffer, int is_object, size_t* count)
+{
+    const char* text = buffer->data;
+    size_t len = buffer->datalen;
+    size_t depth = 0;
+    size_t items = 0;
+    enum json_scan_state state = JSON_SCAN_FIRST;
+    char close = is_object ? '}' : ']';
+
+    for (size_t i = buffer->cursor; i < len; ++i) {
+        char c = text[i];
+        int want_key = is_object &&
+            (state == JSON_SCAN_FIRST || state == JSON_SCAN_KEY);
+        int want_value = state == JSON_SCAN_VALUE ||
+            (!is_object && state == JSON_SCAN_FIRST);
+        int ended = state == JSON_SCAN_SCALAR ||
+            state == JSON_SCAN_AFTER_VALUE;
+
+        if (c == '"') {
+            i = json_string_end(text, len, i + 1);
+            if (i == len) {
+                break;
+            }
+            if (depth > 0) {
+                continue;
+            }
+            if (want_key) {
+                state = JSON_SCAN_COLON;
+            } else if (want_value) {
+                ++items;
+                state = JSON_SCAN_AFTER_VALUE;
+            } else {
+                return "Misplaced string";
+            }
+        } else if (c == '[' || c == '{') {
+            if (depth == 0) {
+                if (!want_value) {
+                    return "Misplaced container";
+                }
+                ++items;
+                /* Where the scan is once the container ends */
+                state = JSON_SCAN_AFTER_VALUE;
+            }
+            ++depth;
+        } else if (c == ']' || c == '}') {
+            if (depth > 0) {
+                --depth;
+            } else if (c != close) {
+                return "Mismatched brackets";
+            } else if (state != JSON_SCAN_FIRST && !ended) {
+                return "Missing value before closing bracket";
+            } else {
+                *count = items;
+                return NULL;
+            }
+        } else if (depth > 0) {
+            continue;
+        } else if (json_is_space(c)) {
+            if (state == JSON_SCAN_SCALAR) {
+                state = JSON_SCAN_AFTER_VALUE;
+            }
+        } else if (c == ',') {
+            if (!ended) {
+                return "Misplaced comma";
+            }
+            state = is_object ? JSON_SCAN_KEY : JSON_SCAN_VALUE;
+        } else if (c == ':') {
+            if (state != JSON_SCAN_COLON) {
+                return "Misplaced colon";
+            }
+            state = JSON_SCAN_VALUE;
+        } else if (want_value) {
+            ++items;
+            state = JSON_SCAN_SCALAR;
+        } else if (state != JSON_SCAN_SCALAR) {
+            return "Unexpected token";
+        }
+    }
+    return is_object ? "Unterminated object" : "Unterminated array";
+}
+
+static int
+json_hex4(const char* text, unsigned* value)
+{
+    *value = 0;
+    for (int i = 0; i < 4; ++i) {
+        char c = text[i];
+        *value <<= 4;
+        if (c >= '0' && c <= '9') {
+            *value |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            *value |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            *value |= c - 'A' + 10;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Decodes text[pos, end) in place; returns the decoded length or -1 */
+static ssize_t
+json_unescape(char* text, size_t pos, size_t end)
+{
+    size_t out = pos;
+    while (pos < end) {
+        char c = text[pos++];
+        if (c != '\\') {
+            text[out++] = c;
+            continue;
+        }
+        if (pos >= end) {
+            return -1;
+        }
+        c = text[pos++];
+        switch (c) {
+            case '"':  text[out++] = '"';  break;
+            case '\\': text[out++] = '\\'; break;
+            case '/':  text[out++] = '/';  break;
+            case 'b':  text[out++] = '\b'; break;
+            case 'f':  text[out++] = '\f'; break;
+            case 'n':  text[out++] = '\n'; break;
+            case 'r':  text[out++] = '\r'; break;
+            case 't':  text[out++] = '\t'; break;
+            case 'u': {
+                unsigned cp, low;
+                if (end - pos < 4 || json_hex4(text + pos, &cp)) {
+                    return -1;
+                }
+                pos += 4;
+                if (cp >= 0xd800 && cp < 0xdc00) {
+                    if (end - pos < 6 || text[pos] != '\\' ||
+                        text[pos + 1] != 'u' ||
+                        json_hex4(text + pos + 2, &low) ||
+                        low < 0xdc00 || low >= 0xe000) {
+                        return -1;
+                    }
+                    pos += 6;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                }
+                if (cp < 0x80) {
+                    text[out++] = cp;
+                } else if (cp < 0x800) {
+                    text[out++] = 0xc0 | (cp >> 6);
+                    text[out++] = 0x80 | (cp & 0x3f);
+                } else if (cp < 0x10000) {
+                    text[out++] = 0xe0 | (cp >> 12);
+                    text[out++] = 0x80 | ((cp >> 6) & 0x3f);
+                    text[out++] = 0x80 | (cp & 0x3f);
+                } else {
+                    text[out++] = 0xf0 | (cp >> 18);
+                    text[out++] = 0x80 | ((cp >> 12) & 0x3f);
+                    text[out++] = 0x80 | ((cp >> 6) & 0x3f);
+                    text[out++] = 0x80 | (cp & 0x3f);
+                }
+                break;
+            }
+            default:
+                return -1;
+        }
+    }
+    return out;
+}
+
+static void
+json_parse_string(bser_t* fill, bser_buffer_t* buffer)
+{
+    char* text = buffer->data;
+    size_t start = buffer->cursor + 1;
+    size_t end = json_string_end(text, buffer->datalen, start);
+
+    if (end == buffer->datalen) {
+        new_error("Unterminated string", fill);
+        return;
+    }
+    buffer->cursor = end + 1;
+    if (memchr(text + start, '\\', end - start) != NULL) {
+        ssize_t decoded = json_unescape(text, start, end);
+        if (decoded < 0) {
+            new_error("Invalid escape in string", fill);
+        } else {
+            bser_new_string(text + start, decoded - start, fill);
+        }
+    } else {
+        bser_new_string(text + start, end - start, fill);
+    }
+}
+
+static void
+json_parse_number(bser_t* fill, bser_buffer_t* buffer)
+{
+    const char* text = buffer->data;
+    size_t pos = buffer->cursor;
+    size_t len = buffer->datalen;
+    int negative = 0;
+    uint64_t value = 0;
+
+    if (text[pos] == '-') {
+        negative = 1;
+        ++pos;
+    }
+    size_t digits = pos;
+    while (pos < len && text[pos] >= '0' && text[pos] <= '9' &&
+           value <= (UINT64_MAX - 9) / 10) {
+        value = value * 10 + (text[pos++] - '0');
+    }
+    if (pos == digits) {
+        new_error("Invalid number", fill);
+        return;
+    }
+    if (pos < len && (text[pos] == '.' || text[pos] == 'e' ||
+                      text[pos] == 'E' || isdigit((unsigned char)text[pos]) ||
+                      value > (uint64_t)INT64_MAX + negative)) {
+        /* Reals, and integers too big for int64, go through strtod(); the
+         * text always ends at a newline or NUL, which stops it. */
+        char* stop;
+        double real = strtod(text + buffer->cursor, &stop);
+        buffer->cursor = stop - text;
+        bser_new_real(real, fill);
+        return;
+    }
+    buffer->cursor = pos;
+    bser_new_integer(negative ? (int64_t)(0 - value) : (int64_t)value, fill);
+}
+
+static void
+json_parse_literal(bser_t* fill, bser_buffer_t* buffer)
+{
+    const char* text = (const char*)buffer->data + buffer->cursor;
+    size_t left = buffer->datalen - buffer->cursor;
+
+    if (left >= 4 && !memcmp(text, "true", 4)) {
+        bser_new_true(fill);
+        buffer->cursor += 4;
+    } else if (left >= 5 && !memcmp(text, "false", 5)) {
+        bser_new_false(fill);
+        buffer->cursor += 5;
+    } else if (left >= 4 && !memcmp(text, "null", 4)) {
+        bser_new_null(fill);
+        buffer->cursor += 4;
+    } else {
+        new_error("Invalid JSON token", fill);
+    }
+}
+
+static void
+json_parse_array(bser_t* fill, bser_buffer_t* buffer)
+{
+    size_t sz;
+    const char* problem = json_count_items(buffer, 0, &sz);
+    if (problem != NULL) {
+        new_error(problem, fill);
+        return;
+    }
+    bser_t* array = malloc(sizeof(*array) * sz);
+    if (array == NULL && sz > 0) {
+        new_error("Could not allocate enough memory to hold "
+                  "array elements", fill);
+    } else {
+        for (int i = 0; i < sz; ++i) {
+            new_unparsed(buffer, &array[i]);
+        }
+        bser_new_array(array, sz, fill);
+    }
+}
+
+static void
+json_parse_object(bser_t* fill, bser_buffer_t* buffer)
+{
+    size_t sz;
+    const char* problem = json_count_items(buffer, 1, &sz);
+    if (problem != NULL) {
+        new_error(problem, fill);
+        return;
+    }
+    bser_key_value_pair_t* array = malloc(sizeof(*array) * sz);
+    if (array == NULL && sz > 0) {
+        new_error("Could not allocate enough memory to hold "
+                  "object fields", fill);
+    } else {
+        for (int i = 0; i < sz; ++i) {
+            new_unparsed(buffer, &array[i].key);
+            new_unparsed(buffer, &array[i].value);
+        }
+        bser_new_object(array, sz, fill);
+    }
+}
+
+static void
+json_parse_generic(bser_t* fill, bser_buffer_t* buffer)
+{
+    json_skip_separators(buffer);
+    if (buffer->cursor >= buffer->datalen) {
+        new_error("out of data", fill);
+        return;
+    }
+    char c = ((const char*)buffer->data)[buffer->cursor];
+    switch (c) {
+        case '"':
+            json_parse_string(fill, buffer);
+            break;
+        case '[':
+            ++buffer->cursor;
+            json_parse_array(fill, buffer);
+            break;
+        case '{':
+            ++buffer->cursor;
+            json_parse_object(fill, buffer);
+            break;
+        case 't':
+        case 'f':
+        case 'n':
+            json_parse_literal(fill, buffer);
+            break;
+        default:
+            if (c == '-' || (c >= '0' && c <= '9')) {
+                json_parse_number(fill, buffer);
+            } else {
+                new_error("Invalid JSON token", fill);
+            }
+            break;
+    }
+}
+
+bser_t*
+bser_parse_json(char* text, size_t length, bser_t* fill)
+{
+    bser_buffer_t* read_buffer = new_read_buffer(text, length, 0);
+    read_buffer->is_json = 1;
+    return new_unparsed(read_buffer, fill);
+}
+
+/* The size of the value that follows 'tag', for fixed-size values */
+static size_t
+scalar_size(uint8_t tag)
+{
+    switch (tag) {
+        case BSER_TAG_INT8:  return sizeof(int8_t);
+        case BSER_TAG_INT16: return sizeof(int16_t);
+        case BSER_TAG_INT32: return sizeof(int32_t);
+        case BSER_TAG_INT64: return sizeof(int64_t);
+        case BSER_TAG_REAL:  return sizeof(double);
+        default:             return 0;
+    }
+}
+
 void
 bser_parse_generic(bser_t* fill, bser_buffer_t* buffer)
 {
-    if (buffer->cursor >= buffer->datalen) {
+    if (buffer->is_json) {
+        json_parse_generic(fill, buffer);
+    } else if (buffer->cursor >= buffer->datalen) {
         fill->type = BSER_TAG_ERROR;
         fill->value.error_message = "out of data";
     } else {
@@ -270,6 +858,10 @@ bser_parse_generic(bser_t* fill, bser_buffer_t* buffer)
         uint8_t tag = as_int[buffer->cursor++];
         void* data = (char *)buffer->data + buffer->cursor;
 
+        if (bytes_left(buffer) < scalar_size(tag)) {
+            new_error("Truncated value", fill);
+            return;
+        }
         switch (tag) {
             case BSER_TAG_ARRAY:
                 parse_array(fill, buffer);
@@ -2,6 +2,7 @@
 #define LIBWATCHMAN_BSER_PARSE_H_
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "bser.h"
 
@@ -14,8 +15,48 @@ bser_t* bser_parse_content(uint8_t* buffer, size_t buflen, bser_t* fill);
  * integer which indicates the length of the content data. */
 bser_t* bser_parse_buffer(uint8_t* buffer, size_t buflen, bser_t* fill);
 
+/* Fills in 'bser' with the top-level value parsed from JSON text.  The
+ * result is made of the same lazy nodes as BSER parsing produces, and
+ * strings point into 'text'.  Escaped strings are decoded in place, so
+ * 'text' may be modified.  The text must end with a newline or a NUL. */
+bser_t* bser_parse_json(char* text, size_t length, bser_t* fill);
+
 /* Fills in 'bser' with top-level object parsed from a PDU read from a file.
  * If 'fill' is NULL, it will be allocated.  */
 bser_t* bser_parse_from_file(FILE* file, bser_t* fill);
 
+/* A file of one or more concatenated PDUs, mapped read-only into memory.
+ * PDU boundaries are indexed when the file is opened; the content of each
+ * PDU is only touched when it is parsed, and nodes point straight into the
+ * mapping, so nothing is copied and the pages are shared with every other
+ * process mapping the same file. */
+typedef struct bser_pdu {
+    size_t offset;          /* start of the content, after the header */
+    size_t length;          /* content length from the header */
+    bser_buffer_t buffer;
+} bser_pdu_t;
+
+typedef struct bser_file {
+    void* data;
+    size_t datalen;
+    size_t nr_pdus;
+    bser_pdu_t* pdus;
+    /* If indexing stopped before the end of the file, why */
+    const char* error_message;
+} bser_file_t;
+
+/* Maps and indexes the file at 'path'.  Returns NULL with errno set if the
+ * file cannot be opened or mapped.  Malformed framing is not fatal: the
+ * PDUs before it are indexed and 'error_message' is set. */
+bser_file_t* bser_file_open(const char* path);
+
+/* Fills in 'fill' with the lazily-parsed content of PDU 'index'.  If 'fill'
+ * is NULL, it will be allocated.  Parsing state lives in the file, so the
+ * returned node is valid until the same PDU is requested again or the file
+ * is closed. */
+bser_t* bser_file_pdu(bser_file_t* file, size_t index, bser_t* fill);
+
+/* Unmaps the file.  Nodes obtained from it must not be used afterwards. */
+void bser_file_close(bser_file_t* file);
+
 #endif /* ndef LIBWATCHMAN_BSER_PARSE_H_ */
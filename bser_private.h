@@ -27,6 +27,8 @@ typedef struct bser_buffer {
     void* data;
     size_t datalen;
     size_t cursor;
+    /* Non-zero if 'data' holds JSON text rather than BSER */
+    int is_json;
 } bser_buffer_t;
 
 struct bser_key_value_pair;
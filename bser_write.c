@@ -429,16 +429,15 @@ static size_t
 write_header(size_t content_size, stream_t* stream)
 {
     const uint8_t magic[] = { 0x00, 0x01 };
-    size_t node_bytes;
+    size_t node_bytes = 0;
 
     json_t* content_size_node = json_integer(content_size);
 
-    if (stream->write(stream, magic, SIZE_MAGIC) == SIZE_MAGIC &&
-        (node_bytes = write_json(content_size_node, stream)) > 0) {
-        return SIZE_MAGIC + node_bytes;
-    } else {
-        return 0;
+    if (stream->write(stream, magic, SIZE_MAGIC) == SIZE_MAGIC) {
+        node_bytes = write_json(content_size_node, stream);
     }
+    json_decref(content_size_node);
+    return node_bytes > 0 ? SIZE_MAGIC + node_bytes : 0;
 }
 
 static size_t
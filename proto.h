@@ -1,37 +1,35 @@
 #ifndef LIBWATCHMAN_PROTO_H_
 #define LIBWATCHMAN_PROTO_H_
 
-#include <jansson.h>
 #include "bser.h"
+#include "bser_json.h"
 #include "bser_parse.h"
 
-/* A wrapper around json (jansson) or bser */
-
-enum { PROTO_BSER, PROTO_JSON };
+/* A wrapper around a parsed watchman response.  Both BSER and JSON
+ * responses are parsed into the same lazy bser nodes; the wrapper also
+ * keeps track of the buffer the nodes point into, so that it can be
+ * released along with them. */
 
 typedef struct proto_ptr {
-    union {
-        json_t* json;
-        bser_t* bser;
-    } u;
-    int type;
+    bser_t* bser;
+    /* Parsing state of the top-level node, if owned */
+    bser_buffer_t* buffer;
+    /* If set, buffer->data is owned as well */
+    int owns_data;
 } proto_t;
 
+/* Must be called before the top-level node is accessed */
 proto_t
-proto_from_json(json_t* json)
+proto_from_bser(bser_t* bser, int owns_data)
 {
     proto_t proto;
-    proto.u.json = json;
-    proto.type = PROTO_JSON;
-    return proto;
-}
-
-proto_t
-proto_from_bser(bser_t* bser)
-{
-    proto_t proto;
-    proto.u.bser = bser;
-    proto.type = PROTO_BSER;
+    proto.bser = bser;
+    proto.buffer = NULL;
+    proto.owns_data = 0;
+    if (bser != NULL && bser_is_unparsed(bser)) {
+        proto.buffer = bser->value.unparsed;
+        proto.owns_data = owns_data;
+    }
     return proto;
 }
 
@@ -39,49 +37,52 @@ proto_t
 proto_null()
 {
     proto_t proto;
-    proto.u.json = NULL;
+    proto.bser = NULL;
+    proto.buffer = NULL;
+    proto.owns_data = 0;
     return proto;
 }
 
 int
 proto_is_null(proto_t p)
 {
-    return p.u.json == NULL;
+    return p.bser == NULL;
+}
+
+/* Missing fields are represented by null protos, which are of no type */
+#define PROTO_DISPATCH_IS(name) \
+int \
+proto_##name(proto_t p) \
+{ \
+    return p.bser != NULL && bser_##name(p.bser); \
 }
 
 #define PROTO_DISPATCH(ret, name) \
 ret \
 proto_##name(proto_t p) \
 { \
-    return p.type == PROTO_JSON ? \
-        json_##name(p.u.json) : \
-        bser_##name(p.u.bser); \
+    return bser_##name(p.bser); \
 }
 
-PROTO_DISPATCH(int, is_boolean)
-PROTO_DISPATCH(int, is_integer)
-PROTO_DISPATCH(int, is_real)
-PROTO_DISPATCH(int, is_string)
-PROTO_DISPATCH(int, is_array)
-PROTO_DISPATCH(int, is_object)
-PROTO_DISPATCH(int, is_true)
+PROTO_DISPATCH_IS(is_boolean)
+PROTO_DISPATCH_IS(is_integer)
+PROTO_DISPATCH_IS(is_real)
+PROTO_DISPATCH_IS(is_string)
+PROTO_DISPATCH_IS(is_array)
+PROTO_DISPATCH_IS(is_object)
+PROTO_DISPATCH_IS(is_true)
 PROTO_DISPATCH(int64_t, integer_value)
 PROTO_DISPATCH(double, real_value)
 PROTO_DISPATCH(int, array_size)
 
 #undef PROTO_DISPATCH
+#undef PROTO_DISPATCH_IS
 
 /* Returns a potentially non-null-terminated read-only string, with a length */
 const char*
 proto_string_value(proto_t p, size_t* length)
 {
-    if (p.type == PROTO_JSON) {
-        const char* v = json_string_value(p.u.json);
-        *length = strlen(v);
-        return v;
-    } else {
-        return bser_string_value(p.u.bser, length);
-    }
+    return bser_string_value(p.bser, length);
 }
 
 /* Returns a dynamically-allocated null-terminated c-string (caller-owned) */
@@ -90,63 +91,55 @@ proto_strdup(proto_t p)
 {
     size_t length;
     const char* v = proto_string_value(p, &length);
-    if (v[length] == '\0') {
-        return strdup(v);
-    } else {
-        char* res = malloc(length + 1);
-        memcpy(res, v, length);
-        res[length] = '\0';
-        return res;
-    }
+    char* res = malloc(length + 1);
+    memcpy(res, v, length);
+    res[length] = '\0';
+    return res;
+}
+
+/* Children share their parent's buffer and never own it */
+static proto_t
+proto_child(bser_t* bser)
+{
+    proto_t proto = proto_null();
+    proto.bser = bser;
+    return proto;
 }
 
 proto_t
 proto_array_get(proto_t p, int index)
 {
-    return p.type == PROTO_JSON ?
-        proto_from_json(json_array_get(p.u.json, index)) :
-        proto_from_bser(bser_array_get(p.u.bser, index));
+    return proto_child(bser_array_get(p.bser, index));
 }
 
 proto_t
 proto_object_get(proto_t p, const char* key)
 {
-    return p.type == PROTO_JSON ?
-        proto_from_json(json_object_get(p.u.json, key)) :
-        proto_from_bser(bser_object_get(p.u.bser, key));
+    return proto_child(bser_object_get(p.bser, key));
 }
 
+/* Returns the compact JSON text of a node (caller-owned), for diagnostics */
 char*
-proto_dumps(proto_t p, int flags)
+proto_dumps(proto_t p)
 {
-    json_t* json = p.u.json;
+    json_error_t err;
     char* result;
-    if (p.type == PROTO_BSER) {
-        json_error_t err;
-        json = bser2json(p.u.bser, &err);
-        if (json == NULL) {
-            json = json_string(err.text);
-            flags |= JSON_ENCODE_ANY;
-        }
+    if (proto_is_null(p)) {
+        return strdup("null");
     }
-    result = json_dumps(json, flags);
-    if (p.type == PROTO_BSER) {
-        json_decref(json);
-    }
-    return result;
+    result = bser_dumps(p.bser, &err);
+    return result != NULL ? result : strdup(err.text);
 }
 
-/* The proto_free command only decrefs the json object in json mode, so
- * it's only a true free if the json only has one reference. */
 void
 proto_free(proto_t p)
 {
-    if (p.type == PROTO_JSON) {
-        json_decref(p.u.json);
-        p.u.json = NULL;
-    } else {
-        bser_free(p.u.bser);
-        p.u.bser = NULL;
+    bser_free(p.bser);
+    if (p.buffer != NULL) {
+        if (p.owns_data) {
+            free(p.buffer->data);
+        }
+        free(p.buffer);
     }
 }
 
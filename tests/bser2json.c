@@ -1,16 +1,27 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <jansson.h>
 
+#include "bser_json.h"
 #include "bser_parse.h"
 
 int main(int argc, char* argv[]) {
+    json_error_t err;
+    if (argc > 1 && !strcmp(argv[1], "-s")) {
+        /* Stream every PDU on stdin without building a json tree */
+        if (bser_transcode_file_to_fd(stdin, STDOUT_FILENO, &err) < 0) {
+            fprintf(stderr, "Could not convert BSER: %s\n", err.text);
+            return 1;
+        }
+        return 0;
+    }
 #if JANSSON_VERSION_HEX >= 0x020600
     json_object_seed(1); /* make test results repeatable */
 #endif
     bser_t bser;
-    json_error_t err;
     bser_parse_from_file(stdin, &bser);
     json_t* root = bser2json(&bser, &err);
     if (root == NULL) {
@@ -1,9 +1,12 @@
 #include <assert.h>
 #include <check.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <jansson.h>
 #include "bser.h"
+#include "bser_json.h"
 #include "bser_parse.h"
 #include "bser_write.h"
 
@@ -135,7 +138,303 @@ START_TEST(test_bser_in_order_parse_compact)
 }
 END_TEST
 
+START_TEST(test_bser_transcode_stream)
+{
+    json_error_t err;
+    json_t* first = json_loads(
+        "[ { \"name\": \"a\\\"b\\n\", \"size\": 300 }, "
+          "{ \"name\": \"c\", \"exists\": true } ]",
+        JSON_DISABLE_EOF_CHECK, &err);
+    json_t* second = json_loads("{ \"clock\": \"c:1:2\", \"real\": 1.5 }",
+                                JSON_DISABLE_EOF_CHECK, &err);
+    ck_assert_msg(first != NULL && second != NULL, "Parse error on input json");
+
+    /* Two concatenated PDUs */
+    size_t first_size = bser_encoding_size(first);
+    size_t second_size = bser_encoding_size(second);
+    size_t first_pdu = bser_header_size(first_size) + first_size;
+    size_t second_pdu = bser_header_size(second_size) + second_size;
+    uint8_t* buffer = malloc(first_pdu + second_pdu);
+    ck_assert(bser_write_to_buffer(first, first_size, buffer, first_pdu) > 0);
+    ck_assert(bser_write_to_buffer(second, second_size, buffer + first_pdu,
+                                   second_pdu) > 0);
+
+    char out[256];
+    size_t needed;
+    int count = bser_transcode_to_buffer(buffer, first_pdu + second_pdu,
+                                         out, sizeof(out), &needed, &err);
+    ck_assert_msg(count == 2, err.text);
+    ck_assert_int_eq(strlen(out), needed);
+
+    /* One line of JSON per PDU, each equal to what was encoded */
+    char* newline = strchr(out, '\n');
+    ck_assert_msg(newline != NULL, "Missing newline after first PDU");
+    json_t* line = json_loadb(out, newline - out, 0, &err);
+    ck_assert_msg(line != NULL, err.text);
+    ck_assert(json_equal(first, line));
+    json_decref(line);
+    line = json_loads(newline + 1, JSON_DISABLE_EOF_CHECK, &err);
+    ck_assert_msg(line != NULL, err.text);
+    ck_assert(json_equal(second, line));
+    json_decref(line);
+
+    /* Truncated output still reports the full length */
+    char small[8];
+    count = bser_transcode_to_buffer(buffer, first_pdu, small, sizeof(small),
+                                     &needed, &err);
+    ck_assert_int_eq(1, count);
+    ck_assert_int_eq(7, strlen(small));
+    ck_assert(needed > sizeof(small));
+
+    /* A truncated PDU is an error */
+    count = bser_transcode_to_buffer(buffer, first_pdu - 1, out, sizeof(out),
+                                     &needed, &err);
+    ck_assert_int_eq(-1, count);
+
+    /* The node walker writes a lazily parsed tree the same way */
+    bser_t* bser = bser_parse_buffer(buffer + first_pdu, second_pdu, NULL);
+    char* dumped = bser_dumps(bser, &err);
+    ck_assert_msg(dumped != NULL, err.text);
+    line = json_loads(dumped, 0, &err);
+    ck_assert_msg(line != NULL, err.text);
+    ck_assert(json_equal(second, line));
+    json_decref(line);
+    free(dumped);
+    bser_free(bser);
+
+    json_decref(first);
+    json_decref(second);
+    free(buffer);
+}
+END_TEST
+
+/* Lengths in a PDU larger than the PDU itself are rejected before
+ * anything is sized by them */
+START_TEST(test_bser_transcode_bad_lengths)
+{
+    /* A compact array with a header of 2^61 keys */
+    static const uint8_t huge_header[] = {
+        0x00, 0x01, 0x03, 0x19,
+        0x0b, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20,
+        0x02, 0x03, 0x01, 'a', 0x02, 0x03, 0x01, 'b', 0x02, 0x03, 0x01, 'c',
+        0x03, 0x00
+    };
+    /* A compact array whose one key is 2^63 - 1 characters long */
+    static const uint8_t huge_key[] = {
+        0x00, 0x01, 0x03, 0x10,
+        0x0b, 0x00, 0x03, 0x01,
+        0x02, 0x06, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f,
+        'a', 'b'
+    };
+    json_error_t err;
+    char out[64];
+    size_t needed;
+
+    ck_assert_int_eq(-1, bser_transcode_to_buffer(huge_header,
+                                                  sizeof(huge_header), out,
+                                                  sizeof(out), &needed,
+                                                  &err));
+    ck_assert_int_eq(-1, bser_transcode_to_buffer(huge_key, sizeof(huge_key),
+                                                  out, sizeof(out), &needed,
+                                                  &err));
+}
+END_TEST
+
+START_TEST(test_bser_file_mmap)
+{
+    json_error_t err;
+    json_t* root = json_loads("{ \"files\": [ \"a\", \"b\" ], \"n\": 7 }",
+                              JSON_DISABLE_EOF_CHECK, &err);
+    ck_assert_msg(root != NULL, "Parse error on input json");
+
+    char path[] = "/tmp/check_bser_XXXXXX";
+    int fd = mkstemp(path);
+    ck_assert(fd >= 0);
+    FILE* fp = fdopen(fd, "w");
+    ck_assert(bser_write_to_file(root, fp) > 0);
+    ck_assert(bser_write_to_file(root, fp) > 0);
+    /* trailing partial header */
+    fputc(0, fp);
+    fclose(fp);
+    json_decref(root);
+
+    bser_file_t* file = bser_file_open(path);
+    unlink(path);
+    ck_assert_msg(file != NULL, "Could not map file");
+    ck_assert_int_eq(2, file->nr_pdus);
+    ck_assert_msg(file->error_message != NULL, "Trailing garbage not reported");
+
+    for (int i = 0; i < 2; ++i) {
+        bser_t pdu;
+        bser_file_pdu(file, i, &pdu);
+        ck_assert_msg(bser_is_object(&pdu), "Did not parse root object");
+        bser_t* files = bser_object_get(&pdu, "files");
+        ck_assert(files != NULL && bser_array_size(files) == 2);
+        ck_assert_int_eq(0, bser_string_strcmp("b", bser_array_get(files, 1)));
+        bser_t* n = bser_object_get(&pdu, "n");
+        ck_assert(n != NULL && bser_integer_value(n) == 7);
+        bser_free_contents(&pdu);
+    }
+
+    bser_t out_of_range;
+    bser_file_pdu(file, 2, &out_of_range);
+    ck_assert(bser_is_error(&out_of_range));
+    bser_file_close(file);
+}
+END_TEST
+
+START_TEST(test_bser_file_bad_lengths)
+{
+    /* Well framed, but claiming more than each PDU holds */
+    static const uint8_t data[] = {
+        /* A string of 100 bytes that has 2 */
+        0x00, 0x01, 0x03, 0x05, 0x02, 0x03, 0x64, 'a', 'b',
+        /* An array of 2^63 - 1 elements */
+        0x00, 0x01, 0x03, 0x0a,
+        0x00, 0x06, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f,
+        /* An int32 with one byte */
+        0x00, 0x01, 0x03, 0x02, 0x05, 0x01
+    };
+    char path[] = "/tmp/check_bser_XXXXXX";
+    int fd = mkstemp(path);
+    ck_assert(fd >= 0);
+    ck_assert(write(fd, data, sizeof(data)) == (ssize_t)sizeof(data));
+    close(fd);
+
+    bser_file_t* file = bser_file_open(path);
+    unlink(path);
+    ck_assert_msg(file != NULL, "Could not map file");
+    ck_assert_msg(file->error_message == NULL, "Framing not accepted");
+    ck_assert_int_eq(3, file->nr_pdus);
+    for (int i = 0; i < 3; ++i) {
+        bser_t pdu;
+        bser_file_pdu(file, i, &pdu);
+        ck_assert(bser_is_error(&pdu));
+        bser_free_contents(&pdu);
+    }
+    bser_file_close(file);
+}
+END_TEST
+
+START_TEST(test_bser_parse_json)
+{
+    json_error_t err;
+    const char* input =
+        "{\"version\": \"4.9.0\", \"clock\": \"c:1:2\", "
+        "\"is_fresh_instance\": false, \"files\": ["
+        "{\"name\": \"a\\\"b\\\\c\\n\", \"size\": 12, \"exists\": true}, "
+        "{\"name\": \"\\u00e9\\ud83d\\ude00\", \"size\": -3, "
+        "\"mtime_f\": 1.5e3, \"x\": null}, "
+        "[], {}, [[1, [2]], 3]]}\n";
+    char* text = strdup(input);
+    bser_t* bser = bser_parse_json(text, strlen(text), NULL);
+    ck_assert_msg(bser_is_object(bser), "Did not parse root object");
+
+    /* Fields can be fetched out of order */
+    bser_t* files = bser_object_get(bser, "files");
+    ck_assert(files != NULL && bser_array_size(files) == 5);
+    bser_t* clock = bser_object_get(bser, "clock");
+    ck_assert_int_eq(0, bser_string_strcmp("c:1:2", clock));
+
+    bser_t* second = bser_array_get(files, 1);
+    size_t length;
+    const char* name = bser_string_value(bser_object_get(second, "name"),
+                                         &length);
+    ck_assert_int_eq(6, length);
+    ck_assert(!memcmp("\xc3\xa9\xf0\x9f\x98\x80", name, length));
+    ck_assert(bser_integer_value(bser_object_get(second, "size")) == -3);
+    ck_assert(bser_real_value(bser_object_get(second, "mtime_f")) == 1500.0);
+    ck_assert(bser_is_null(bser_object_get(second, "x")));
+
+    bser_t* first = bser_array_get(files, 0);
+    name = bser_string_value(bser_object_get(first, "name"), &length);
+    ck_assert_int_eq(6, length);
+    ck_assert(!memcmp("a\"b\\c\n", name, length));
+    ck_assert(bser_is_true(bser_object_get(first, "exists")));
+
+    ck_assert_int_eq(0, bser_array_size(bser_array_get(files, 2)));
+    ck_assert_int_eq(0, bser_object_size(bser_array_get(files, 3)));
+    bser_t* nested = bser_array_get(files, 4);
+    ck_assert_int_eq(2, bser_array_size(nested));
+    ck_assert(bser_integer_value(bser_array_get(nested, 1)) == 3);
+
+    /* The whole tree round trips through the JSON writer */
+    char* dumped = bser_dumps(bser, &err);
+    ck_assert_msg(dumped != NULL, err.text);
+    json_t* expected = json_loads(input, 0, &err);
+    json_t* actual = json_loads(dumped, 0, &err);
+    ck_assert(expected != NULL && actual != NULL);
+    ck_assert(json_equal(expected, actual));
+    json_decref(expected);
+    json_decref(actual);
+    free(dumped);
+    bser_free(bser);
+    free(text);
+
+    char bad[] = "{\"a\": [1, 2}\n";
+    bser = bser_parse_json(bad, strlen(bad), NULL);
+    ck_assert_msg(bser_is_error(bser), "Unbalanced JSON was not an error");
+    bser_free(bser);
+
+    /* Separators only go where the grammar puts them */
+    static const char* malformed[] = {
+        "[1 2]\n", "[1,,2]\n", "[,1]\n", "[1,]\n", "[1:2]\n",
+        "[\"a\" \"b\"]\n", "[1 [2]]\n", "[1}\n", "{\"a\" 1}\n",
+        "{\"a\"::1}\n", "{\"a\",1}\n", "{\"a\":1 \"b\":2}\n",
+        "{\"a\":1,}\n", "{\"a\"}\n", "{1:2}\n", ",[1]\n", ":1\n"
+    };
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(*malformed); ++i) {
+        text = strdup(malformed[i]);
+        bser = bser_parse_json(text, strlen(text), NULL);
+        ck_assert_msg(bser_is_error(bser), "%s was not an error",
+                      malformed[i]);
+        bser_free(bser);
+        free(text);
+    }
+
+    /* A nested container is checked when it is reached */
+    text = strdup("{ \"a\" : [ 1 , 2 ] , \"b\" : [1 2] }\n");
+    bser = bser_parse_json(text, strlen(text), NULL);
+    ck_assert(bser_is_object(bser));
+    ck_assert_int_eq(2, bser_array_size(bser_object_get(bser, "a")));
+    ck_assert(bser_is_error(bser_object_get(bser, "b")));
+    bser_free(bser);
+    free(text);
+}
+END_TEST
+
+
+START_TEST(test_bser_object_get_after_container)
+{
+    json_error_t err;
+    const char* input =
+        "{\"files\": [[1, {\"a\": 2}], {\"b\": [3]}], \"nested\": {\"c\": 4}, "
+        "\"after\": 5}";
+    json_t* root = json_loads(input, 0, &err);
+    ck_assert_msg(root != NULL, err.text);
 
+    size_t content_size = bser_encoding_size(root);
+    size_t buf_size = bser_header_size(content_size) + content_size;
+    uint8_t* buffer = malloc(buf_size);
+    ck_assert(bser_write_to_buffer(root, content_size, buffer, buf_size) > 0);
+    json_decref(root);
+
+    char* text = strdup(input);
+    bser_t* parsed[2];
+    parsed[0] = bser_parse_buffer(buffer, buf_size, NULL);
+    parsed[1] = bser_parse_json(text, strlen(text), NULL);
+    for (int i = 0; i < 2; ++i) {
+        /* Keys after unparsed containers are found without touching them */
+        bser_t* after = bser_object_get(parsed[i], "after");
+        ck_assert(after != NULL && bser_integer_value(after) == 5);
+        bser_t* nested = bser_object_get(parsed[i], "nested");
+        ck_assert(bser_integer_value(bser_object_get(nested, "c")) == 4);
+        bser_free(parsed[i]);
+    }
+    free(text);
+    free(buffer);
+}
+END_TEST
 
 Suite *
 bser_suite(void)
@@ -148,6 +447,12 @@ bser_suite(void)
     tcase_add_test(tc_core, test_bser_parse_simple);
     tcase_add_test(tc_core, test_bser_in_order_parse);
     tcase_add_test(tc_core, test_bser_in_order_parse_compact);
+    tcase_add_test(tc_core, test_bser_transcode_stream);
+    tcase_add_test(tc_core, test_bser_transcode_bad_lengths);
+    tcase_add_test(tc_core, test_bser_file_mmap);
+    tcase_add_test(tc_core, test_bser_file_bad_lengths);
+    tcase_add_test(tc_core, test_bser_parse_json);
+    tcase_add_test(tc_core, test_bser_object_get_after_container);
     suite_add_tcase(s, tc_core);
 
     return s;
@@ -0,0 +1,177 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../watchman.h"
+
+struct watchman_dir_index *index_;
+
+void
+setup(void)
+{
+    index_ = watchman_dir_index_create();
+    ck_assert(index_ != NULL);
+}
+
+void
+teardown(void)
+{
+    watchman_dir_index_free(index_);
+}
+
+/* Applies one entry; a negative size deletes the file */
+static void
+apply(int fresh, const char *name, int64_t size, int64_t mtime_ns)
+{
+    struct watchman_error error;
+    struct watchman_stat stat = {0};
+    struct watchman_query_result result = {0};
+    stat.name = (char *)name;
+    stat.exists = size >= 0;
+    stat.size = size;
+    stat.mtime_ns = mtime_ns;
+    stat.mode = S_IFREG | 0644;
+    result.is_fresh_instance = fresh;
+    result.nr = 1;
+    result.stats = &stat;
+    ck_assert(!watchman_dir_index_apply(index_, &result, &error));
+}
+
+static void
+check_totals(const char *dir, int64_t nr_files, int64_t size,
+             int64_t max_mtime_ns)
+{
+    struct watchman_dir_totals totals;
+    watchman_dir_index_totals(index_, dir, &totals);
+    ck_assert_msg(totals.nr_files == nr_files, "%s: %lld files", dir,
+                  (long long)totals.nr_files);
+    ck_assert_msg(totals.size == size, "%s: %lld bytes", dir,
+                  (long long)totals.size);
+    ck_assert_msg(totals.max_mtime_ns == max_mtime_ns, "%s: mtime %lld", dir,
+                  (long long)totals.max_mtime_ns);
+}
+
+START_TEST(test_dir_index_deltas)
+{
+    apply(1, "top", 1, 10);
+    apply(0, "a/one", 10, 100);
+    apply(0, "a/b/two", 20, 300);
+    apply(0, "a/b/c/three", 30, 200);
+    check_totals("", 4, 61, 300);
+    check_totals("a", 3, 60, 300);
+    check_totals("a/b/", 2, 50, 300);
+    check_totals("a/b/c", 1, 30, 200);
+    check_totals("a/one", 0, 0, 0);
+    check_totals("nowhere", 0, 0, 0);
+
+    /* The newest file getting older and then going away */
+    apply(0, "a/b/two", 25, 50);
+    check_totals("a", 3, 65, 200);
+    check_totals("a/b", 2, 55, 200);
+    apply(0, "a/b/c/three", -1, 0);
+    check_totals("", 3, 36, 100);
+    check_totals("a/b", 1, 25, 50);
+    check_totals("a/b/c", 0, 0, 0);
+
+    /* A directory entry doesn't count as a file */
+    struct watchman_error error;
+    struct watchman_stat stat = {0};
+    struct watchman_query_result result = {0};
+    stat.name = "a/b";
+    stat.exists = 1;
+    stat.size = 4096;
+    stat.mode = S_IFDIR | 0755;
+    result.nr = 1;
+    result.stats = &stat;
+    ck_assert(!watchman_dir_index_apply(index_, &result, &error));
+    check_totals("a", 2, 35, 100);
+
+    apply(0, "a/b/two", -1, 0);
+    apply(0, "a/one", -1, 0);
+    check_totals("a", 0, 0, 0);
+    check_totals("", 1, 1, 10);
+
+    /* A fresh instance replaces everything */
+    apply(1, "x/y", 5, 7);
+    check_totals("", 1, 5, 7);
+    check_totals("top", 0, 0, 0);
+}
+END_TEST
+
+#define NR_NAMES 200
+
+/* Random changes, checked against totals worked out from scratch */
+START_TEST(test_dir_index_random)
+{
+    static const char *dirs[] = {"", "d0/", "d0/d1/", "d0/d2/",
+                                 "d0/d1/d3/", "d4/"};
+    char names[NR_NAMES][32];
+    int64_t sizes[NR_NAMES], mtimes[NR_NAMES];
+    int i, round;
+
+    srand(1234);
+    for (i = 0; i < NR_NAMES; ++i) {
+        snprintf(names[i], sizeof(names[i]), "%sf%d", dirs[i % 6], i);
+        sizes[i] = -1;
+    }
+    apply(1, "d0/d1/d3/f3", -1, 0);
+    for (round = 0; round < 5000; ++round) {
+        i = rand() % NR_NAMES;
+        int64_t size = rand() % 4 ? rand() % 1000 : -1;
+        int64_t mtime = rand() % 100 + 1;
+        apply(0, names[i], size, mtime);
+        sizes[i] = size;
+        mtimes[i] = mtime;
+
+        if (round % 50) {
+            continue;
+        }
+        int d;
+        for (d = 0; d < 6; ++d) {
+            size_t len = strlen(dirs[d]);
+            int64_t nr = 0, total = 0, newest = 0;
+            int j;
+            for (j = 0; j < NR_NAMES; ++j) {
+                if (sizes[j] < 0 || strncmp(names[j], dirs[d], len)) {
+                    continue;
+                }
+                nr++;
+                total += sizes[j];
+                if (mtimes[j] > newest) {
+                    newest = mtimes[j];
+                }
+            }
+            check_totals(dirs[d], nr, total, newest);
+        }
+    }
+}
+END_TEST
+
+Suite *
+dir_index_suite(void)
+{
+    Suite *s = suite_create("Tests");
+
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    tcase_add_test(tc_core, test_dir_index_deltas);
+    tcase_add_test(tc_core, test_dir_index_random);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite *s = dir_index_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
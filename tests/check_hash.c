@@ -0,0 +1,180 @@
+#include <check.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../watchman.h"
+
+char root[64];
+
+/* What the callback was told, by file */
+struct seen {
+    pthread_mutex_t lock;
+    int nr;
+    struct watchman_file_hash hashes[8];
+    char names[8][16];
+};
+
+static void
+record(const struct watchman_file_hash *hash, void *arg)
+{
+    struct seen *seen = arg;
+    pthread_mutex_lock(&seen->lock);
+    ck_assert(seen->nr < 8);
+    seen->hashes[seen->nr] = *hash;
+    snprintf(seen->names[seen->nr], sizeof(seen->names[0]), "%s",
+             hash->name);
+    seen->nr++;
+    pthread_mutex_unlock(&seen->lock);
+}
+
+static const struct watchman_file_hash *
+find(struct seen *seen, const char *name)
+{
+    int i;
+    for (i = 0; i < seen->nr; ++i) {
+        if (!strcmp(seen->names[i], name)) {
+            return &seen->hashes[i];
+        }
+    }
+    ck_abort_msg("no hash for %s", name);
+    return NULL;
+}
+
+static void
+write_file(const char *name, const char *data, size_t len)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    FILE *fp = fopen(path, "w");
+    ck_assert(fp != NULL);
+    ck_assert(fwrite(data, 1, len, fp) == len);
+    fclose(fp);
+}
+
+void
+setup(void)
+{
+    snprintf(root, sizeof(root), "/tmp/check_hash.%d", (int)getpid());
+    ck_assert(!mkdir(root, 0755));
+}
+
+void
+teardown(void)
+{
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    ck_assert(!system(cmd));
+}
+
+START_TEST(test_xxh64)
+{
+    ck_assert(watchman_xxh64("", 0) == 0xEF46DB3751D8E999ULL);
+    ck_assert(watchman_xxh64("abc", 3) == 0x44BC2CF5AD770999ULL);
+    const char *text = "Nobody inspects the spammish repetition";
+    ck_assert(watchman_xxh64(text, strlen(text)) == 0xFBCEA83C8A378BF1ULL);
+}
+END_TEST
+
+START_TEST(test_hasher)
+{
+    struct watchman_error error;
+    struct seen seen = {PTHREAD_MUTEX_INITIALIZER};
+    /* Larger than the chunks files are read in, and not a multiple */
+    size_t big_len = 200003;
+    char *big = malloc(big_len);
+    size_t i;
+    for (i = 0; i < big_len; ++i) {
+        big[i] = i * 7 + (i >> 9);
+    }
+    write_file("abc", "abc", 3);
+    write_file("big", big, big_len);
+    write_file("empty", "", 0);
+    char path[128];
+    snprintf(path, sizeof(path), "%s/dir", root);
+    ck_assert(!mkdir(path, 0755));
+
+    struct watchman_hasher *hasher =
+        watchman_hasher_create(root, 2, 1, WATCHMAN_HASH_SHA1, record, &seen,
+                               &error);
+    ck_assert_msg(hasher != NULL, error.message);
+    const char *names[] = {"abc", "big", "empty", "dir", "missing"};
+    for (i = 0; i < 5; ++i) {
+        ck_assert(!watchman_hasher_add(hasher, names[i]));
+    }
+    watchman_hasher_wait(hasher);
+    ck_assert_int_eq(5, seen.nr);
+
+    const struct watchman_file_hash *hash = find(&seen, "abc");
+    ck_assert(!hash->error && !hash->cached);
+    ck_assert(hash->hash == 0x44BC2CF5AD770999ULL);
+    ck_assert_int_eq(3, hash->size);
+    ck_assert(!memcmp(hash->sha1,
+                      "\xa9\x99\x3e\x36\x47\x06\x81\x6a\xba\x3e"
+                      "\x25\x71\x78\x50\xc2\x6c\x9c\xd0\xd8\x9d", 20));
+    hash = find(&seen, "big");
+    ck_assert(hash->hash == watchman_xxh64(big, big_len));
+    hash = find(&seen, "empty");
+    ck_assert(hash->hash == 0xEF46DB3751D8E999ULL);
+    ck_assert(!memcmp(hash->sha1,
+                      "\xda\x39\xa3\xee\x5e\x6b\x4b\x0d\x32\x55"
+                      "\xbf\xef\x95\x60\x18\x90\xaf\xd8\x07\x09", 20));
+    ck_assert_int_eq(EINVAL, find(&seen, "dir")->error);
+    ck_assert_int_eq(ENOENT, find(&seen, "missing")->error);
+
+    /* Unchanged files are not read again; changed and deleted ones are
+     * noticed */
+    seen.nr = 0;
+    write_file("empty", "x", 1);
+    snprintf(path, sizeof(path), "%s/big", root);
+    ck_assert(!unlink(path));
+    struct watchman_query_result result = {0};
+    struct watchman_stat stats[3] = {{0}};
+    stats[0].name = "abc";
+    stats[1].name = "big";
+    stats[2].name = "empty";
+    result.nr = 3;
+    result.stats = stats;
+    ck_assert(!watchman_hasher_add_result(hasher, &result));
+    watchman_hasher_wait(hasher);
+    ck_assert_int_eq(3, seen.nr);
+    ck_assert(find(&seen, "abc")->cached);
+    ck_assert_int_eq(ENOENT, find(&seen, "big")->error);
+    hash = find(&seen, "empty");
+    ck_assert(!hash->cached && hash->hash == watchman_xxh64("x", 1));
+
+    watchman_hasher_free(hasher);
+    free(big);
+}
+END_TEST
+
+Suite *
+hash_suite(void)
+{
+    Suite *s = suite_create("Tests");
+
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    tcase_add_test(tc_core, test_xxh64);
+    tcase_add_test(tc_core, test_hasher);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite *s = hash_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,216 @@
+#include <check.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../watchman.h"
+#include "fixtures.h"
+
+char path[64];
+
+void
+setup(void)
+{
+    snprintf(path, sizeof(path), "/tmp/check_journal.%d", (int)getpid());
+}
+
+void
+teardown(void)
+{
+    unlink(path);
+}
+
+/* A result with 'clock' for the 'nr' files in 'names' */
+static struct watchman_query_result *
+make_result(const char *clock, int fresh, const char **names, int nr)
+{
+    struct watchman_query_result *result = fixture_result(nr, names, NULL);
+    result->clock = strdup(clock);
+    result->is_fresh_instance = fresh;
+    return result;
+}
+
+static void
+append(struct watchman_journal *journal, struct watchman_query_result *result)
+{
+    struct watchman_error error;
+    ck_assert_msg(!watchman_journal_append(journal, result, &error),
+                  error.message);
+    watchman_free_query_result(result);
+}
+
+static struct watchman_query_result *
+since(const char *clock)
+{
+    struct watchman_error error;
+    struct watchman_query_result *result =
+        watchman_journal_since(path, clock, &error);
+    ck_assert_msg(result != NULL, error.message);
+    return result;
+}
+
+START_TEST(test_journal_since)
+{
+    struct watchman_error error;
+    struct watchman_journal *journal =
+        watchman_journal_open(path, "/root", &error);
+    ck_assert_msg(journal != NULL, error.message);
+
+    const char *all[] = {"dir/f0", "dir/f1", "dir/f2"};
+    append(journal, make_result("c:1:10", 1, all, 3));
+    const char *changed[] = {"dir/f1", "dir/new"};
+    struct watchman_query_result *result = make_result("c:1:11", 0,
+                                                       changed, 2);
+    result->stats[1].newer = 1;
+    append(journal, result);
+    result = make_result("c:1:12", 0, changed + 1, 1);
+    result->stats[0].exists = 0;
+    append(journal, result);
+    append(journal, make_result("c:1:13", 0, NULL, 0));
+
+    /* Everything, as a fresh instance */
+    result = since(NULL);
+    ck_assert(result->is_fresh_instance);
+    ck_assert_str_eq("c:1:13", result->clock);
+    ck_assert_int_eq(4, result->nr);
+    watchman_free_query_result(result);
+
+    /* Each file once, as last recorded */
+    result = since("c:1:10");
+    ck_assert(!result->is_fresh_instance);
+    ck_assert_str_eq("c:1:13", result->clock);
+    ck_assert_int_eq(2, result->nr);
+    ck_assert_str_eq("dir/f1", result->stats[0].name);
+    ck_assert(result->stats[0].exists && !result->stats[0].newer);
+    ck_assert_str_eq("dir/new", result->stats[1].name);
+    ck_assert(!result->stats[1].exists && result->stats[1].newer);
+    watchman_free_query_result(result);
+
+    result = since("c:1:12");
+    ck_assert(!result->is_fresh_instance);
+    ck_assert_int_eq(0, result->nr);
+    watchman_free_query_result(result);
+
+    /* A clock from before the journal, or from another instance */
+    result = since("c:1:5");
+    ck_assert(result->is_fresh_instance);
+    watchman_free_query_result(result);
+    result = since("c:2:50");
+    ck_assert(result->is_fresh_instance);
+    watchman_free_query_result(result);
+
+    /* watchman restarted since the clock */
+    append(journal, make_result("c:2:1", 0, all, 1));
+    result = since("c:1:12");
+    ck_assert(result->is_fresh_instance);
+    ck_assert_int_eq(1, result->nr);
+    watchman_free_query_result(result);
+    result = since("c:2:1");
+    ck_assert(!result->is_fresh_instance);
+    ck_assert_int_eq(0, result->nr);
+    watchman_free_query_result(result);
+
+    watchman_journal_close(journal);
+}
+END_TEST
+
+START_TEST(test_journal_reopen)
+{
+    struct watchman_error error;
+    struct watchman_journal *journal =
+        watchman_journal_open(path, "/root", &error);
+    ck_assert_msg(journal != NULL, error.message);
+    const char *names[] = {"a", "b"};
+    append(journal, make_result("c:1:1", 1, names, 2));
+
+    /* One writer at a time */
+    ck_assert(watchman_journal_open(path, "/root", &error) == NULL);
+    watchman_release_error(&error);
+    watchman_journal_close(journal);
+
+    /* A torn entry is skipped by readers, and dropped by the next writer */
+    int fd = open(path, O_WRONLY | O_APPEND);
+    ck_assert(fd >= 0);
+    ck_assert(write(fd, "\x00\x01\x03\x40\x01", 5) == 5);
+    close(fd);
+    struct watchman_query_result *result = since("c:1:1");
+    ck_assert_int_eq(0, result->nr);
+    watchman_free_query_result(result);
+
+    ck_assert(watchman_journal_open(path, "/other", &error) == NULL);
+    watchman_release_error(&error);
+    journal = watchman_journal_open(path, "/root", &error);
+    ck_assert_msg(journal != NULL, error.message);
+    append(journal, make_result("c:1:2", 0, names + 1, 1));
+    watchman_journal_close(journal);
+
+    result = since("c:1:1");
+    ck_assert(!result->is_fresh_instance);
+    ck_assert_str_eq("c:1:2", result->clock);
+    ck_assert_int_eq(1, result->nr);
+    ck_assert_str_eq("b", result->stats[0].name);
+    watchman_free_query_result(result);
+
+    /* Not a journal at all */
+    ck_assert(watchman_journal_since("/dev/null", NULL, &error) == NULL);
+    watchman_release_error(&error);
+}
+END_TEST
+
+START_TEST(test_journal_restart)
+{
+    struct watchman_error error;
+    struct watchman_journal *journal =
+        watchman_journal_open(path, "/root", &error);
+    ck_assert_msg(journal != NULL, error.message);
+    const char *names[] = {"a", "b", "c"};
+    append(journal, make_result("c:1:1", 1, names, 2));
+    append(journal, make_result("c:1:2", 0, names + 2, 1));
+    /* "a" went away while watchman was down, so the new instance's
+     * listing just leaves it out */
+    append(journal, make_result("c:2:1", 1, names + 1, 2));
+    watchman_journal_close(journal);
+
+    const char *clocks[] = {NULL, "c:1:0", "c:1:1"};
+    int i;
+    for (i = 0; i < 3; ++i) {
+        struct watchman_query_result *result = since(clocks[i]);
+        ck_assert(result->is_fresh_instance);
+        ck_assert_str_eq("c:2:1", result->clock);
+        ck_assert_int_eq(2, result->nr);
+        ck_assert_str_eq("b", result->stats[0].name);
+        ck_assert_str_eq("c", result->stats[1].name);
+        watchman_free_query_result(result);
+    }
+}
+END_TEST
+
+Suite *
+journal_suite(void)
+{
+    Suite *s = suite_create("Tests");
+
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    tcase_add_test(tc_core, test_journal_since);
+    tcase_add_test(tc_core, test_journal_reopen);
+    tcase_add_test(tc_core, test_journal_restart);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite *s = journal_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
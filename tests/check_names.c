@@ -0,0 +1,152 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../watchman.h"
+
+#define NR_NAMES 1000
+
+static char *names[NR_NAMES];
+
+void
+setup(void)
+{
+    int i;
+    for (i = 0; i < NR_NAMES; ++i) {
+        names[i] = malloc(64);
+        /* Reverse order, so that the store has to sort them */
+        int n = NR_NAMES - 1 - i;
+        snprintf(names[i], 64, "src/dir%d/sub%d/file%04d.c", n % 7, n % 3, n);
+    }
+}
+
+void
+teardown(void)
+{
+    int i;
+    for (i = 0; i < NR_NAMES; ++i) {
+        free(names[i]);
+    }
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+START_TEST(test_name_store_find)
+{
+    struct watchman_name_store *store =
+        watchman_name_store((const char *const *)names, NR_NAMES);
+    ck_assert(store != NULL);
+    ck_assert_int_eq(NR_NAMES, watchman_name_store_size(store));
+
+    char *sorted[NR_NAMES];
+    memcpy(sorted, names, sizeof(sorted));
+    qsort(sorted, NR_NAMES, sizeof(*sorted), compare_names);
+    int i;
+    for (i = 0; i < NR_NAMES; ++i) {
+        ck_assert_int_eq(i, watchman_name_store_find(store, sorted[i]));
+        char *name = watchman_name_store_get(store, i);
+        ck_assert_str_eq(sorted[i], name);
+        free(name);
+    }
+    ck_assert_int_eq(-1, watchman_name_store_find(store, ""));
+    ck_assert_int_eq(-1, watchman_name_store_find(store, "src/dir1"));
+    ck_assert_int_eq(-1, watchman_name_store_find(store, "zzz"));
+    ck_assert(watchman_name_store_get(store, NR_NAMES) == NULL);
+
+    /* The shared prefixes are only stored once per block */
+    size_t total = 0;
+    for (i = 0; i < NR_NAMES; ++i) {
+        total += strlen(names[i]) + 1;
+    }
+    ck_assert(watchman_name_store_bytes(store) < total / 2);
+    watchman_free_name_store(store);
+}
+END_TEST
+
+START_TEST(test_name_store_prefix)
+{
+    struct watchman_name_store *store =
+        watchman_name_store((const char *const *)names, NR_NAMES);
+    struct watchman_name_cursor cursor;
+    const char *name;
+    int i, expected = 0;
+
+    for (i = 0; i < NR_NAMES; ++i) {
+        expected += !strncmp(names[i], "src/dir3/sub1/", 14);
+    }
+    ck_assert(!watchman_name_store_seek(store, "src/dir3/sub1/", &cursor));
+    char *prev = NULL;
+    int found = 0;
+    while ((name = watchman_name_cursor_next(&cursor))) {
+        ck_assert(!strncmp(name, "src/dir3/sub1/", 14));
+        ck_assert(!prev || strcmp(prev, name) < 0);
+        free(prev);
+        prev = strdup(name);
+        ++found;
+    }
+    free(prev);
+    ck_assert_int_eq(expected, found);
+    watchman_name_cursor_release(&cursor);
+
+    ck_assert(!watchman_name_store_seek(store, "", &cursor));
+    for (found = 0; watchman_name_cursor_next(&cursor); ++found) {
+    }
+    ck_assert_int_eq(NR_NAMES, found);
+    watchman_name_cursor_release(&cursor);
+
+    ck_assert(!watchman_name_store_seek(store, "src/dir9", &cursor));
+    ck_assert(watchman_name_cursor_next(&cursor) == NULL);
+    watchman_name_cursor_release(&cursor);
+    watchman_free_name_store(store);
+}
+END_TEST
+
+START_TEST(test_name_store_duplicates)
+{
+    const char *dups[] = {"b", "a", "b", "", "a/b", "a"};
+    struct watchman_name_store *store = watchman_name_store(dups, 6);
+    ck_assert_int_eq(4, watchman_name_store_size(store));
+    ck_assert_int_eq(0, watchman_name_store_find(store, ""));
+    ck_assert_int_eq(1, watchman_name_store_find(store, "a"));
+    ck_assert_int_eq(2, watchman_name_store_find(store, "a/b"));
+    ck_assert_int_eq(3, watchman_name_store_find(store, "b"));
+    watchman_free_name_store(store);
+
+    store = watchman_name_store(NULL, 0);
+    ck_assert_int_eq(-1, watchman_name_store_find(store, "a"));
+    watchman_free_name_store(store);
+}
+END_TEST
+
+Suite *
+names_suite(void)
+{
+    Suite *s = suite_create("Tests");
+
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    tcase_add_test(tc_core, test_name_store_find);
+    tcase_add_test(tc_core, test_name_store_prefix);
+    tcase_add_test(tc_core, test_name_store_duplicates);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite *s = names_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,159 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../watchman.h"
+#include "fixtures.h"
+
+char path[64];
+
+void
+setup(void)
+{
+    snprintf(path, sizeof(path), "/tmp/check_shm.%d", (int)getpid());
+}
+
+void
+teardown(void)
+{
+    unlink(path);
+}
+
+/* A result of 'nr' files named f<i>, each with 'size' + i for its size
+ * and mtime */
+static struct watchman_query_result *
+make_result(int nr, int64_t size, int fresh)
+{
+    struct watchman_query_result *result =
+        fixture_result(nr, NULL, "dir/f%d");
+    int i;
+    result->is_fresh_instance = fresh;
+    for (i = 0; i < nr; ++i) {
+        result->stats[i].size = size + i;
+        result->stats[i].mtime_ns = size + i;
+    }
+    return result;
+}
+
+START_TEST(test_shm_lookup)
+{
+    struct watchman_error error;
+    struct watchman_shm_stat stat;
+    struct watchman_shm_table *writer =
+        watchman_shm_create(path, "/root", 64, 4096, &error);
+    ck_assert_msg(writer != NULL, error.message);
+    struct watchman_shm_table *reader = watchman_shm_open(path, &error);
+    ck_assert_msg(reader != NULL, error.message);
+
+    /* Nothing is answered until every file has been loaded */
+    ck_assert_int_eq(-1, watchman_shm_lookup(reader, "dir/f1", &stat));
+    struct watchman_query_result *result = make_result(10, 100, 1);
+    ck_assert(!watchman_shm_apply(writer, result, &error));
+    watchman_free_query_result(result);
+    ck_assert_int_eq(1, watchman_shm_lookup(reader, "dir/f1", &stat));
+    ck_assert_int_eq(101, stat.size);
+    ck_assert_int_eq(0, watchman_shm_lookup(reader, "dir/f10", &stat));
+
+    /* Changes only list what changed */
+    result = make_result(2, 200, 0);
+    result->stats[0].exists = 0;
+    ck_assert(!watchman_shm_apply(writer, result, &error));
+    watchman_free_query_result(result);
+    ck_assert_int_eq(0, watchman_shm_lookup(reader, "dir/f0", &stat));
+    ck_assert_int_eq(1, watchman_shm_lookup(reader, "dir/f1", &stat));
+    ck_assert_int_eq(201, stat.size);
+    ck_assert_int_eq(1, watchman_shm_lookup(reader, "dir/f9", &stat));
+
+    /* A fresh instance replaces everything */
+    result = make_result(5, 300, 1);
+    ck_assert(!watchman_shm_apply(writer, result, &error));
+    watchman_free_query_result(result);
+    ck_assert_int_eq(1, watchman_shm_lookup(reader, "dir/f0", &stat));
+    ck_assert_int_eq(0, watchman_shm_lookup(reader, "dir/f9", &stat));
+
+    /* Running out of room sends readers to watchman */
+    result = make_result(100, 0, 0);
+    ck_assert(watchman_shm_apply(writer, result, &error));
+    watchman_release_error(&error);
+    watchman_free_query_result(result);
+    ck_assert_int_eq(-1, watchman_shm_lookup(reader, "dir/f0", &stat));
+
+    watchman_shm_close(reader);
+    watchman_shm_close(writer);
+}
+END_TEST
+
+START_TEST(test_shm_concurrent)
+{
+    struct watchman_error error;
+    struct watchman_shm_table *writer =
+        watchman_shm_create(path, "/root", 1024, 65536, &error);
+    ck_assert_msg(writer != NULL, error.message);
+    struct watchman_query_result *result = make_result(500, 0, 1);
+    ck_assert(!watchman_shm_apply(writer, result, &error));
+    watchman_free_query_result(result);
+
+    pid_t pid = fork();
+    ck_assert(pid >= 0);
+    if (pid == 0) {
+        /* Every snapshot must have size == mtime, as every write does */
+        struct watchman_shm_table *reader = watchman_shm_open(path, NULL);
+        struct watchman_shm_stat stat;
+        int i, lookups = 0;
+        while (reader && lookups < 200000) {
+            for (i = 0; i < 500; ++i, ++lookups) {
+                int ret = watchman_shm_lookup(reader, "dir/f7", &stat);
+                if (ret == -1) {
+                    _exit(0);
+                }
+                if (ret != 1 || stat.size != stat.mtime_ns) {
+                    _exit(1);
+                }
+            }
+        }
+        _exit(reader ? 0 : 2);
+    }
+
+    int round;
+    for (round = 1; round <= 200; ++round) {
+        result = make_result(500, round * 1000, 0);
+        ck_assert(!watchman_shm_apply(writer, result, &error));
+        watchman_free_query_result(result);
+    }
+    int status;
+    ck_assert(waitpid(pid, &status, 0) == pid);
+    watchman_shm_close(writer);
+    ck_assert(WIFEXITED(status));
+    ck_assert_int_eq(0, WEXITSTATUS(status));
+}
+END_TEST
+
+Suite *
+shm_suite(void)
+{
+    Suite *s = suite_create("Tests");
+
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    tcase_add_test(tc_core, test_shm_lookup);
+    tcase_add_test(tc_core, test_shm_concurrent);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite *s = shm_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
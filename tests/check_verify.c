@@ -0,0 +1,129 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../watchman.h"
+#include "fixtures.h"
+
+char root[64];
+
+static void
+create_file(const char *name, const char *body)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    FILE *fp = fopen(path, "w");
+    ck_assert(fp != NULL);
+    fputs(body, fp);
+    fclose(fp);
+}
+
+void
+setup(void)
+{
+    snprintf(root, sizeof(root), "/tmp/check_verify.%d", (int)getpid());
+    ck_assert(!mkdir(root, 0755));
+}
+
+void
+teardown(void)
+{
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    ck_assert(!system(cmd));
+}
+
+/* A result listing files f0 .. f<nr - 1> as they are now */
+static struct watchman_query_result *
+make_result(int nr)
+{
+    struct watchman_query_result *result = fixture_result(nr, NULL, "f%d");
+    struct watchman_error error;
+    int i;
+    for (i = 0; i < nr; ++i) {
+        create_file(result->stats[i].name, "body");
+    }
+    ck_assert_int_eq(0, watchman_verify_result(root, result, 0, 1, 1, NULL,
+                                               &error));
+    return result;
+}
+
+#define FIELDS                                                             \
+    (WATCHMAN_FIELD_NAME | WATCHMAN_FIELD_EXISTS | WATCHMAN_FIELD_SIZE |   \
+     WATCHMAN_FIELD_MTIME_NS | WATCHMAN_FIELD_INO | WATCHMAN_FIELD_MODE)
+
+START_TEST(test_verify_mismatches)
+{
+    struct watchman_error error;
+    int nr = 1000;
+    struct watchman_query_result *result = make_result(nr);
+    unsigned *mismatches = calloc(nr, sizeof(*mismatches));
+
+    ck_assert_int_eq(0, watchman_verify_result(root, result, FIELDS, 4, 0,
+                                               mismatches, &error));
+
+    create_file("f3", "longer body");
+    char path[128];
+    snprintf(path, sizeof(path), "%s/f500", root);
+    ck_assert(!unlink(path));
+    snprintf(path, sizeof(path), "%s/f999", root);
+    ck_assert(!chmod(path, 0600));
+    result->stats[7].exists = 0;
+    ck_assert_int_eq(4, watchman_verify_result(root, result, FIELDS, 4, 0,
+                                               mismatches, &error));
+    ck_assert(mismatches[3] & WATCHMAN_MISMATCH_SIZE);
+    ck_assert_int_eq(WATCHMAN_MISMATCH_EXISTS, mismatches[7]);
+    ck_assert_int_eq(WATCHMAN_MISMATCH_EXISTS, mismatches[500]);
+    ck_assert_int_eq(WATCHMAN_MISMATCH_MODE, mismatches[999]);
+    ck_assert_int_eq(0, mismatches[998]);
+
+    /* Only what was asked for is compared */
+    ck_assert_int_eq(3, watchman_verify_result(root, result,
+                                               FIELDS & ~WATCHMAN_FIELD_MODE,
+                                               0, 0, NULL, &error));
+
+    /* Refreshed, the result matches */
+    ck_assert_int_eq(4, watchman_verify_result(root, result, FIELDS, 4, 1,
+                                               NULL, &error));
+    ck_assert(!result->stats[500].exists);
+    ck_assert(result->stats[7].exists);
+    ck_assert_int_eq(11, result->stats[3].size);
+    ck_assert_int_eq(0, watchman_verify_result(root, result, FIELDS, 4, 0,
+                                               mismatches, &error));
+
+    ck_assert_int_eq(-1, watchman_verify_result("/nonexistent", result,
+                                                FIELDS, 0, 0, NULL, &error));
+    watchman_release_error(&error);
+    free(mismatches);
+    watchman_free_query_result(result);
+}
+END_TEST
+
+Suite *
+verify_suite(void)
+{
+    Suite *s = suite_create("Tests");
+
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    tcase_add_test(tc_core, test_verify_mismatches);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int
+main(void)
+{
+    int number_failed;
+    Suite *s = verify_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,12 +1,25 @@
 #include "../watchman.h"
+#include "../bser.h"
 #include <assert.h>
 #include <check.h>
 #include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 char test_dir[L_tmpnam];
@@ -253,6 +266,1283 @@ START_TEST(test_watchman_misc)
 }
 END_TEST
 
+START_TEST(test_watchman_json_protocol)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    setenv("LIBWATCHMAN_USE_JSON_PROTOCOL", "1", 1);
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    unsetenv("LIBWATCHMAN_USE_JSON_PROTOCOL");
+    ck_assert_msg(conn != NULL, error.message);
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+
+    create_file("quoted \"name\".txt", "body");
+
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_FIELD_NAME |
+                              WATCHMAN_FIELD_SIZE | WATCHMAN_FIELD_EXISTS);
+    struct watchman_query_result *result =
+        watchman_do_query(conn, test_dir, query,
+                          watchman_true_expression(), &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(1, result->nr);
+    ck_assert_str_eq("quoted \"name\".txt", result->stats[0].name);
+    ck_assert_int_eq(4, result->stats[0].size);
+    ck_assert(result->stats[0].exists);
+    watchman_free_query_result(result);
+    watchman_free_query(query);
+
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_deadline)
+{
+    struct watchman_error error;
+    struct timeval tv = {10, 0};
+    struct timespec deadline = watchman_deadline(tv);
+    struct watchman_connection *conn =
+        watchman_connect_deadline(&deadline, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    ck_assert_msg(!watchman_watch_deadline(conn, test_dir, &deadline, &error),
+                  error.message);
+
+    char *clock = watchman_clock_deadline(conn, test_dir, 0, &deadline,
+                                          &error);
+    ck_assert_msg(clock != NULL, error.message);
+    free(clock);
+
+    struct watchman_query *query = watchman_query();
+    struct watchman_query_result *result =
+        watchman_do_query_deadline(conn, test_dir, query,
+                                   watchman_true_expression(), &deadline,
+                                   &error);
+    ck_assert_msg(result != NULL, error.message);
+    watchman_free_query_result(result);
+
+    /* A deadline that has already passed fails without blocking */
+    struct timeval tv_zero = {0};
+    struct timespec expired = watchman_deadline(tv_zero);
+    result = watchman_do_query_deadline(conn, test_dir, query,
+                                        watchman_true_expression(), &expired,
+                                        &error);
+    ck_assert(result == NULL);
+    ck_assert_int_eq(WATCHMAN_ERR_TIMEOUT, error.code);
+    watchman_release_error(&error);
+    watchman_free_query(query);
+
+    /* The query's response is still to come, so the connection can't be
+     * used again without reconnecting, or that would be taken for the
+     * response to the next command */
+    clock = watchman_clock_deadline(conn, test_dir, 0, &deadline, &error);
+    ck_assert(clock == NULL);
+    ck_assert_int_eq(WATCHMAN_ERR_CONNECT, error.code);
+    watchman_release_error(&error);
+    struct watchman_reconnect_policy policy = {10, 100, 3};
+    ck_assert(!watchman_connection_enable_reconnect(conn, &policy));
+    struct watchman_watch_list *roots = watchman_watch_list(conn, &error);
+    ck_assert_msg(roots != NULL, error.message);
+    int found = 0;
+    for (int i = 0; i < roots->nr; ++i) {
+        found |= !strcmp(roots->roots[i], test_dir);
+    }
+    ck_assert(found);
+    watchman_free_watch_list(roots);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_reconnect)
+{
+    struct watchman_error error;
+    struct timeval tv = {10, 0};
+    struct watchman_connection *conn = watchman_connect(tv, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    struct watchman_reconnect_policy policy = {10, 100, 3};
+    ck_assert(!watchman_connection_enable_reconnect(conn, &policy));
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+
+    /* A dropped connection is replaced by the next command */
+    shutdown(fileno(conn->fp), SHUT_RDWR);
+    char *clock = watchman_clock(conn, test_dir, 0, &error);
+    ck_assert_msg(clock != NULL, error.message);
+    free(clock);
+
+    /* When no new connection can be made, every call reports it rather
+     * than touching the missing socket */
+    char *real_sock = getenv("WATCHMAN_SOCK");
+    if (real_sock) {
+        real_sock = strdup(real_sock);
+    }
+    setenv("WATCHMAN_SOCK", "/nonexistent/watchman.sock", 1);
+    shutdown(fileno(conn->fp), SHUT_RDWR);
+    clock = watchman_clock(conn, test_dir, 0, &error);
+    ck_assert(clock == NULL);
+    ck_assert_int_eq(WATCHMAN_ERR_CONNECT, error.code);
+    watchman_release_error(&error);
+    ck_assert(conn->fp == NULL);
+
+    struct watchman_query *query = watchman_query();
+    struct watchman_query_result *result =
+        watchman_do_query_timeout(conn, test_dir, query,
+                                  watchman_true_expression(), &tv, &error);
+    ck_assert(result == NULL);
+    watchman_release_error(&error);
+    watchman_free_query(query);
+
+    struct timespec deadline = watchman_deadline(tv);
+    ck_assert(watchman_read_notification(conn, &deadline, &error) == NULL);
+    watchman_release_error(&error);
+    int readable;
+    ck_assert_int_eq(1, watchman_wait(&conn, 1, &readable, &deadline,
+                                      &error));
+    ck_assert(readable);
+
+    if (real_sock) {
+        setenv("WATCHMAN_SOCK", real_sock, 1);
+        free(real_sock);
+    } else {
+        unsetenv("WATCHMAN_SOCK");
+    }
+    clock = watchman_clock(conn, test_dir, 0, &error);
+    ck_assert_msg(clock != NULL, error.message);
+    free(clock);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+/* Moves 'fd' above FD_SETSIZE if the fd limit allows it */
+static int
+high_fd(int fd)
+{
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < FD_SETSIZE + 8 &&
+        lim.rlim_max >= FD_SETSIZE + 8) {
+        lim.rlim_cur = FD_SETSIZE + 8;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+    int moved = fcntl(fd, F_DUPFD, FD_SETSIZE);
+    if (moved < 0) {
+        return fd;
+    }
+    close(fd);
+    return moved;
+}
+
+START_TEST(test_watchman_wait)
+{
+    struct watchman_error error;
+    struct watchman_connection conn[2];
+    struct watchman_connection *conns[2] = { &conn[0], &conn[1] };
+    int peer[2];
+    int readable[2];
+    int i;
+
+    memset(conn, 0, sizeof(conn));
+    for (i = 0; i < 2; ++i) {
+        int sv[2];
+        ck_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+        conn[i].fp = fdopen(high_fd(sv[0]), "r+");
+        peer[i] = sv[1];
+    }
+
+    struct timeval tv = {0, 10000};
+    struct timespec deadline = watchman_deadline(tv);
+    ck_assert_int_eq(0, watchman_wait(conns, 2, readable, &deadline, &error));
+
+    ck_assert_int_eq(1, write(peer[1], "x", 1));
+    deadline = watchman_deadline(tv);
+    ck_assert_int_eq(1, watchman_wait(conns, 2, readable, &deadline, &error));
+    ck_assert(!readable[0]);
+    ck_assert(readable[1]);
+
+    close(peer[0]);
+    ck_assert_int_eq(2, watchman_wait(conns, 2, readable, NULL, &error));
+    ck_assert(readable[0] && readable[1]);
+
+    close(peer[1]);
+    for (i = 0; i < 2; ++i) {
+        fclose(conn[i].fp);
+    }
+}
+END_TEST
+
+START_TEST(test_watchman_io_uring)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    if (watchman_connection_use_io_uring(conn, &error)) {
+        /* Not built in, or not allowed here; nothing else changes */
+        ck_assert(error.message != NULL);
+        watchman_release_error(&error);
+    }
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+
+    struct watchman_query *query = watchman_query();
+    struct watchman_query_result *result =
+        watchman_do_query(conn, test_dir, query,
+                          watchman_true_expression(), &error);
+    ck_assert_msg(result != NULL, error.message);
+    watchman_free_query_result(result);
+    watchman_free_query(query);
+
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_connection_from_fd)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+
+    int pipefd[2];
+    ck_assert(pipe(pipefd) == 0);
+    ck_assert(watchman_connection_from_fd(pipefd[0], &error) == NULL);
+    watchman_release_error(&error);
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    struct watchman_connection *adopted =
+        watchman_connection_from_fd(dup(fileno(conn->fp)), &error);
+    ck_assert_msg(adopted != NULL, error.message);
+    ck_assert_msg(!watchman_watch(adopted, test_dir, &error), error.message);
+    ck_assert_msg(!watchman_watch_del(adopted, test_dir, &error),
+                  error.message);
+    watchman_connection_close(adopted);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_query_changes)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    ck_assert(!watchman_connection_enable_reconnect(conn, NULL));
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+
+    create_file("before", "");
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_FIELD_NAME);
+    struct watchman_query_result *result =
+        watchman_query_changes(conn, test_dir, query,
+                               watchman_true_expression(), NULL, &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert(result->is_fresh_instance);
+    watchman_free_query_result(result);
+
+    create_file("after", "");
+    result = watchman_query_changes(conn, test_dir, query,
+                                    watchman_true_expression(), NULL, &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert(!result->is_fresh_instance);
+    ck_assert_int_eq(1, result->nr);
+    ck_assert_str_eq("after", result->stats[0].name);
+    watchman_free_query_result(result);
+    watchman_free_query(query);
+
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_cached_query)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+
+    create_file("one", "");
+    struct watchman_query_cache *cache = watchman_query_cache_create(4);
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_FIELD_NAME);
+    struct watchman_expression *expr = watchman_true_expression();
+    struct watchman_query_result *result =
+        watchman_cached_query(cache, conn, test_dir, query, expr, NULL,
+                              &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(1, result->nr);
+    watchman_free_query_result(result);
+
+    /* Unchanged, so served from the cache */
+    result = watchman_cached_query(cache, conn, test_dir, query, expr, NULL,
+                                   &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(1, result->nr);
+    ck_assert_str_eq("one", result->stats[0].name);
+    watchman_free_query_result(result);
+
+    create_file("two", "");
+    result = watchman_cached_query(cache, conn, test_dir, query, expr, NULL,
+                                   &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(2, result->nr);
+    watchman_free_query_result(result);
+
+    watchman_query_cache_free(cache);
+    watchman_free_expression(expr);
+    watchman_free_query(query);
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_cached_query_fields)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+    create_file("timed", "");
+
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/timed", test_dir);
+    ck_assert(!stat(path, &st));
+    int64_t ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+    /* Both are sent as mtime_ns, but each is decoded for its own fields */
+    struct watchman_query_cache *cache = watchman_query_cache_create(4);
+    struct watchman_query *seconds = watchman_query();
+    watchman_query_set_fields(seconds, WATCHMAN_FIELD_NAME |
+                              WATCHMAN_FIELD_MTIME | WATCHMAN_FIELD_MTIME_MS);
+    struct watchman_query *finer = watchman_query();
+    watchman_query_set_fields(finer, WATCHMAN_FIELD_NAME |
+                              WATCHMAN_FIELD_MTIME_US | WATCHMAN_FIELD_MTIME_F);
+    struct watchman_expression *expr = watchman_true_expression();
+    struct watchman_query_result *result =
+        watchman_cached_query(cache, conn, test_dir, seconds, expr, NULL,
+                              &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(1, result->nr);
+    ck_assert_int_eq(ns / 1000000, result->stats[0].mtime_ms);
+    watchman_free_query_result(result);
+
+    result = watchman_cached_query(cache, conn, test_dir, finer, expr, NULL,
+                                   &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(1, result->nr);
+    ck_assert_int_eq(ns / 1000, result->stats[0].mtime_us);
+    ck_assert(result->stats[0].mtime_f >= st.st_mtime &&
+              result->stats[0].mtime_f < st.st_mtime + 1);
+    watchman_free_query_result(result);
+
+    watchman_query_cache_free(cache);
+    watchman_free_expression(expr);
+    watchman_free_query(seconds);
+    watchman_free_query(finer);
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+struct cached_query_thread {
+    struct watchman_query_cache *cache;
+    const struct watchman_query *query;
+    const struct watchman_expression *expr;
+    pthread_t thread;
+    struct watchman_query_result *result;
+};
+
+static void *
+run_cached_query(void *arg)
+{
+    struct cached_query_thread *t = arg;
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    if (conn) {
+        t->result = watchman_cached_query(t->cache, conn, test_dir, t->query,
+                                          t->expr, NULL, &error);
+        watchman_connection_close(conn);
+    }
+    return NULL;
+}
+
+#define NR_CACHE_THREADS 8
+
+START_TEST(test_watchman_cached_query_shared)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+    create_file("one", "");
+
+    /* Attached, a result is only fetched once; each fetch would have
+     * its own clock */
+    struct watchman_query_cache *cache = watchman_query_cache_create(4);
+    ck_assert(!watchman_query_cache_attach(cache, test_dir, &error));
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_FIELD_NAME);
+    struct watchman_expression *expr = watchman_true_expression();
+    struct cached_query_thread threads[NR_CACHE_THREADS];
+    int i;
+    for (i = 0; i < NR_CACHE_THREADS; ++i) {
+        threads[i].cache = cache;
+        threads[i].query = query;
+        threads[i].expr = expr;
+        threads[i].result = NULL;
+        ck_assert(!pthread_create(&threads[i].thread, NULL, run_cached_query,
+                                  &threads[i]));
+    }
+    for (i = 0; i < NR_CACHE_THREADS; ++i) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    for (i = 0; i < NR_CACHE_THREADS; ++i) {
+        ck_assert(threads[i].result != NULL);
+        ck_assert_int_eq(1, threads[i].result->nr);
+        ck_assert_str_eq(threads[0].result->clock, threads[i].result->clock);
+    }
+    for (i = 0; i < NR_CACHE_THREADS; ++i) {
+        watchman_free_query_result(threads[i].result);
+    }
+
+    watchman_query_cache_free(cache);
+    watchman_free_expression(expr);
+    watchman_free_query(query);
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_cached_query_notify)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+    create_file("one", "");
+
+    /* Attached through a symlink; notifications name the real path */
+    char link[L_tmpnam + 8];
+    snprintf(link, sizeof(link), "%s.link", test_dir);
+    ck_assert(!symlink(test_dir, link));
+    char *real = realpath(test_dir, NULL);
+    ck_assert(real != NULL);
+    struct watchman_query_cache *cache = watchman_query_cache_create(4);
+    ck_assert(!watchman_query_cache_attach(cache, link, &error));
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_FIELD_NAME);
+    struct watchman_expression *expr = watchman_true_expression();
+    struct watchman_query_result *result =
+        watchman_cached_query(cache, conn, real, query, expr, NULL,
+                              &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(1, result->nr);
+    watchman_free_query_result(result);
+
+    /* Until a notification says otherwise, nothing has changed */
+    create_file("two", "");
+    result = watchman_cached_query(cache, conn, real, query, expr, NULL,
+                                   &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(1, result->nr);
+    watchman_free_query_result(result);
+
+    struct watchman_stat changed = {0};
+    changed.name = "two";
+    struct watchman_query_result changes = {0};
+    changes.nr = 1;
+    changes.stats = &changed;
+    struct watchman_notification note = {0};
+    note.root = real;
+    note.result = &changes;
+    watchman_query_cache_notify(cache, &note);
+    result = watchman_cached_query(cache, conn, real, query, expr, NULL,
+                                   &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(2, result->nr);
+    watchman_free_query_result(result);
+
+    /* Detached, results are checked with watchman again */
+    note.result = NULL;
+    note.canceled = 1;
+    watchman_query_cache_notify(cache, &note);
+    create_file("three", "");
+    result = watchman_cached_query(cache, conn, real, query, expr, NULL,
+                                   &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(3, result->nr);
+    watchman_free_query_result(result);
+
+    watchman_query_cache_free(cache);
+    ck_assert(!unlink(link));
+    free(real);
+    watchman_free_expression(expr);
+    watchman_free_query(query);
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_fanout_query)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conns[2];
+    int i;
+    for (i = 0; i < 2; ++i) {
+        conns[i] = watchman_connect(tv_zero, &error);
+        ck_assert_msg(conns[i] != NULL, error.message);
+    }
+    ck_assert_msg(!watchman_watch(conns[0], test_dir, &error),
+                  error.message);
+
+    create_dir("a");
+    create_dir("b");
+    create_dir("c");
+    create_file("a/1", "");
+    create_file("b/2", "");
+    create_file("c/3", "");
+    create_file("outside", "");
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_FIELD_NAME);
+    watchman_query_add_path(query, "a", -1);
+    watchman_query_add_path(query, "b", -1);
+    watchman_query_add_path(query, "c", -1);
+    struct watchman_expression *expr = watchman_type_expression('f');
+    struct watchman_query_result *result =
+        watchman_fanout_query(conns, 2, test_dir, query, expr, NULL, &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(3, result->nr);
+    ck_assert_str_eq("a/1", result->stats[0].name);
+    ck_assert_str_eq("c/3", result->stats[2].name);
+    watchman_free_query_result(result);
+
+    const char *roots[] = {test_dir, "/nonexistent"};
+    struct watchman_root_query_result results[2];
+    ck_assert_int_eq(1, watchman_query_roots(conns, 2, roots, 2, query, expr,
+                                             results, NULL));
+    ck_assert_msg(results[0].result != NULL, results[0].error.message);
+    ck_assert_int_eq(3, results[0].result->nr);
+    ck_assert(results[1].result == NULL);
+    ck_assert(results[1].error.message != NULL);
+    watchman_release_root_query_results(results, 2);
+
+    /* Files under overlapping paths are listed once */
+    create_dir("a/sub");
+    create_file("a/sub/4", "");
+    struct watchman_query *overlapping = watchman_query();
+    watchman_query_set_fields(overlapping, WATCHMAN_FIELD_NAME);
+    watchman_query_add_path(overlapping, "a", -1);
+    watchman_query_add_path(overlapping, "a/sub", -1);
+    result = watchman_fanout_query(conns, 2, test_dir, overlapping, expr,
+                                   NULL, &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(2, result->nr);
+    watchman_free_query_result(result);
+    watchman_free_query(overlapping);
+
+    watchman_free_expression(expr);
+    watchman_free_query(query);
+    ck_assert_msg(!watchman_watch_del(conns[0], test_dir, &error),
+                  error.message);
+    for (i = 0; i < 2; ++i) {
+        watchman_connection_close(conns[i]);
+    }
+}
+END_TEST
+
+START_TEST(test_watchman_embedded)
+{
+    struct watchman_error error;
+    struct watchman_connection *conn = watchman_connect_embedded(&error);
+    if (!conn) {
+        /* Not built in */
+        ck_assert(error.message != NULL);
+        watchman_release_error(&error);
+        return;
+    }
+    create_dir("dir");
+    create_file("dir/old.c", "old");
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_FIELD_NAME |
+                                     WATCHMAN_FIELD_EXISTS);
+    struct watchman_expression *expr = watchman_suffix_expression("c");
+    struct watchman_query_result *result =
+        watchman_do_query(conn, test_dir, query, expr, &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert(result->is_fresh_instance);
+    ck_assert_int_eq(1, result->nr);
+    ck_assert_str_eq("dir/old.c", result->stats[0].name);
+
+    /* Queries sync, so the changes are seen without waiting */
+    watchman_query_set_since_oclock(query, result->clock);
+    watchman_free_query_result(result);
+    create_file("dir/new.c", "new");
+    create_file("dir/new.h", "new");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/dir/old.c", test_dir);
+    ck_assert(!unlink(path));
+    result = watchman_do_query(conn, test_dir, query, expr, &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert(!result->is_fresh_instance);
+    ck_assert_int_eq(2, result->nr);
+    for (int i = 0; i < 2; ++i) {
+        int old = !strcmp(result->stats[i].name, "dir/old.c");
+        ck_assert(old || !strcmp(result->stats[i].name, "dir/new.c"));
+        ck_assert(result->stats[i].exists == !old);
+    }
+
+    /* The subdirectory's own event comes before its parent's */
+    create_dir("dir/sub");
+    create_file("dir/sub/deep.c", "deep");
+    watchman_query_set_since_oclock(query, result->clock);
+    watchman_free_query_result(result);
+    result = watchman_do_query(conn, test_dir, query, expr, &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(1, result->nr);
+    ck_assert_str_eq("dir/sub/deep.c", result->stats[0].name);
+    watchman_query_set_since_oclock(query, result->clock);
+    watchman_free_query_result(result);
+    snprintf(path, sizeof(path), "%s/dir/sub", test_dir);
+    rmdir_recursive(path);
+    result = watchman_do_query(conn, test_dir, query, expr, &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(1, result->nr);
+    ck_assert_str_eq("dir/sub/deep.c", result->stats[0].name);
+    ck_assert(!result->stats[0].exists);
+    watchman_free_query_result(result);
+    watchman_free_expression(expr);
+    watchman_free_query(query);
+
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_watch_many)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+
+    char paths[4][PATH_MAX];
+    const char *path_ptrs[4];
+    int i;
+    for (i = 0; i < 4; ++i) {
+        char name[2] = {'a' + i, 0};
+        if (i < 3) {
+            create_dir(name);
+        }
+        snprintf(paths[i], sizeof(paths[i]), "%s/%s", test_dir, name);
+        path_ptrs[i] = paths[i];
+    }
+
+    struct watchman_watch_result results[4];
+    ck_assert_int_eq(1, watchman_watch_many(conn, path_ptrs, 4, results, 2,
+                                            NULL));
+    for (i = 0; i < 3; ++i) {
+        ck_assert_msg(results[i].root != NULL, results[i].error.message);
+        ck_assert(results[i].error.message == NULL);
+    }
+    ck_assert(results[3].root == NULL);
+    ck_assert(results[3].error.message != NULL);
+    watchman_release_watch_results(results, 4);
+
+    for (i = 0; i < 3; ++i) {
+        ck_assert_msg(!watchman_watch_del(conn, paths[i], &error),
+                      error.message);
+    }
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_watch_project)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+
+    create_file(".watchmanconfig", "{}");
+    create_file("outside", "");
+    create_dir("sub");
+    create_file("sub/inside", "");
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/sub", test_dir);
+    struct watchman_watch_project *project =
+        watchman_watch_project(conn, path, &error);
+    ck_assert_msg(project != NULL, error.message);
+    ck_assert_str_eq("sub", project->relative_path);
+
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_FIELD_NAME);
+    watchman_query_set_relative_root(query, project->relative_path);
+    struct watchman_query_result *result =
+        watchman_do_query(conn, project->root, query,
+                          watchman_true_expression(), &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(1, result->nr);
+    ck_assert_str_eq("inside", result->stats[0].name);
+    watchman_free_query_result(result);
+    watchman_free_query(query);
+
+    ck_assert_msg(!watchman_watch_del(conn, project->root, &error),
+                  error.message);
+    watchman_free_watch_project(project);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_state_subscription)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct timeval tv = {10, 0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+
+    struct timespec deadline = watchman_deadline(tv);
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_FIELD_NAME);
+    ck_assert_msg(!watchman_query_add_defer(query, "checkout", &error),
+                  error.message);
+    ck_assert_msg(!watchman_subscribe(conn, test_dir, "sub", query,
+                                      watchman_true_expression(),
+                                      &deadline, &error),
+                  error.message);
+    watchman_free_query(query);
+
+    ck_assert_msg(!watchman_state_enter(conn, test_dir, "checkout", "rev1",
+                                        0, &deadline, &error),
+                  error.message);
+    create_file("deferred", "");
+    ck_assert_msg(!watchman_state_leave(conn, test_dir, "checkout", NULL, 0,
+                                        &deadline, &error),
+                  error.message);
+
+    /* Skip the initial results; the deferred change follows the leave */
+    int entered = 0, left = 0, found = 0;
+    while (!found) {
+        struct watchman_notification *note =
+            watchman_read_notification(conn, &deadline, &error);
+        ck_assert_msg(note != NULL, error.message);
+        ck_assert_str_eq("sub", note->subscription);
+        if (note->state_enter) {
+            ck_assert_str_eq("checkout", note->state_enter);
+            ck_assert_str_eq("\"rev1\"", note->metadata);
+            entered = 1;
+        } else if (note->state_leave) {
+            ck_assert(entered);
+            left = 1;
+        } else if (left && note->result) {
+            for (int i = 0; i < note->result->nr; ++i) {
+                if (!strcmp(note->result->stats[i].name, "deferred")) {
+                    found = 1;
+                }
+            }
+        }
+        watchman_free_notification(note);
+    }
+
+    ck_assert_msg(!watchman_unsubscribe(conn, test_dir, "sub", &deadline,
+                                        &error),
+                  error.message);
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_command)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+    create_file("found", "");
+
+    json_t *request = json_array();
+    json_array_append_new(request, json_string("find"));
+    json_array_append_new(request, json_string(test_dir));
+    struct watchman_response *response;
+    ck_assert_msg(!watchman_command(conn, request, &response, NULL, &error),
+                  error.message);
+    json_decref(request);
+
+    bser_t *files = bser_object_get(watchman_response_bser(response),
+                                    "files");
+    ck_assert(files != NULL && bser_is_array(files));
+    int found = 0;
+    for (size_t i = 0; i < bser_array_size(files); ++i) {
+        bser_t *name = bser_object_get(bser_array_get(files, i), "name");
+        found |= !bser_string_strcmp("found", name);
+    }
+    ck_assert(found);
+    watchman_free_response(response);
+
+    request = json_array();
+    json_array_append_new(request, json_string("no-such-command"));
+    ck_assert(watchman_command(conn, request, &response, NULL, &error));
+    ck_assert(response == NULL);
+    watchman_release_error(&error);
+    json_decref(request);
+
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+struct bound_file {
+    struct watchman_strview name;
+    int64_t size;
+    bool exists;
+};
+
+START_TEST(test_watchman_query_bound)
+{
+    static const struct watchman_binding bindings[] = {
+        {"name", offsetof(struct bound_file, name), WATCHMAN_BIND_STRVIEW},
+        {"size", offsetof(struct bound_file, size), WATCHMAN_BIND_I64},
+        {"exists", offsetof(struct bound_file, exists), WATCHMAN_BIND_BOOL},
+    };
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+    create_file("bound.txt", "abcde");
+
+    struct watchman_expression *expr = watchman_true_expression();
+    struct watchman_bound_result *result =
+        watchman_do_query_bound(conn, test_dir, NULL, expr, bindings, 3,
+                                sizeof(struct bound_file), NULL, &error);
+    ck_assert_msg(result != NULL, error.message);
+    struct bound_file *files = result->records;
+    int found = 0;
+    for (int i = 0; i < result->nr; ++i) {
+        if (files[i].name.len == strlen("bound.txt") &&
+            !memcmp(files[i].name.data, "bound.txt", files[i].name.len)) {
+            ck_assert_int_eq(5, files[i].size);
+            ck_assert(files[i].exists);
+            found = 1;
+        }
+    }
+    ck_assert(found);
+    watchman_free_bound_result(result);
+    watchman_free_expression(expr);
+
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_time_fields)
+{
+    struct watchman_error error;
+    struct timeval tv_zero = {0};
+    struct watchman_connection *conn = watchman_connect(tv_zero, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+    create_file("timed", "");
+
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/timed", test_dir);
+    ck_assert(!stat(path, &st));
+    int64_t ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+    /* Only mtime_ns goes over the wire; the rest are derived from it */
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_FIELD_NAME |
+                              WATCHMAN_FIELD_MTIME | WATCHMAN_FIELD_MTIME_MS |
+                              WATCHMAN_FIELD_MTIME_US | WATCHMAN_FIELD_MTIME_F);
+    struct watchman_expression *expr = watchman_name_expression("timed",
+                                        WATCHMAN_BASENAME_DEFAULT);
+    struct watchman_query_result *result =
+        watchman_do_query(conn, test_dir, query, expr, &error);
+    ck_assert_msg(result != NULL, error.message);
+    ck_assert_int_eq(1, result->nr);
+    struct watchman_stat *stat = &result->stats[0];
+    ck_assert_int_eq(st.st_mtime, stat->mtime);
+    ck_assert_int_eq(ns / 1000000, stat->mtime_ms);
+    ck_assert_int_eq(ns / 1000, stat->mtime_us);
+    ck_assert_int_eq(0, stat->mtime_ns);
+    ck_assert(stat->mtime_f >= st.st_mtime && stat->mtime_f < st.st_mtime + 1);
+    watchman_free_query_result(result);
+
+    /* Notifications derive them too, however the root was spelled */
+    struct timeval tv = {10, 0};
+    struct timespec deadline = watchman_deadline(tv);
+    char root[L_tmpnam + 8];
+    create_dir("sub");
+    snprintf(root, sizeof(root), "%s/sub/..", test_dir);
+    ck_assert_msg(!watchman_subscribe(conn, root, "timed", query, expr,
+                                      &deadline, &error),
+                  error.message);
+    int found = 0;
+    while (!found) {
+        struct watchman_notification *note =
+            watchman_read_notification(conn, &deadline, &error);
+        ck_assert_msg(note != NULL, error.message);
+        for (int i = 0; note->result && i < note->result->nr; ++i) {
+            stat = &note->result->stats[i];
+            if (!strcmp(stat->name, "timed")) {
+                ck_assert_int_eq(st.st_mtime, stat->mtime);
+                ck_assert_int_eq(ns / 1000000, stat->mtime_ms);
+                found = 1;
+            }
+        }
+        watchman_free_notification(note);
+    }
+    ck_assert_msg(!watchman_unsubscribe(conn, root, "timed", &deadline,
+                                        &error),
+                  error.message);
+    watchman_free_expression(expr);
+    watchman_free_query(query);
+
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
+START_TEST(test_watchman_connect_async)
+{
+    struct watchman_error error;
+    struct watchman_connect_op *op = watchman_connect_start(&error);
+    ck_assert_msg(op != NULL, error.message);
+
+    struct watchman_connection *conn = NULL;
+    int ret;
+    while ((ret = watchman_connect_poll(op, &conn, &error)) == 0) {
+        struct pollfd pfd;
+        pfd.fd = watchman_connect_fd(op, &pfd.events);
+        ck_assert(poll(&pfd, 1, 10000) == 1);
+    }
+    ck_assert_msg(ret == 1, error.message);
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+
+    op = watchman_connect_start(&error);
+    ck_assert_msg(op != NULL, error.message);
+    watchman_connect_cancel(op);
+
+    struct timeval tv = {10, 0};
+    struct timespec deadline = watchman_deadline(tv);
+    op = watchman_connect_start(&error);
+    ck_assert_msg(op != NULL, error.message);
+    conn = watchman_connect_finish(op, &deadline, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    watchman_connection_close(conn);
+
+    /* A get-sockname that won't stop talking is killed, not waited for */
+    char script[L_tmpnam + 16];
+    snprintf(script, sizeof(script), "%s/watchman", test_dir);
+    FILE *fp = fopen(script, "w");
+    ck_assert(fp != NULL);
+    fputs("#!/bin/sh\nhead -c 4096 /dev/zero\nexec sleep 60\n", fp);
+    fclose(fp);
+    ck_assert(chmod(script, 0700) == 0);
+
+    char *real_sock = getenv("WATCHMAN_SOCK");
+    char *real_path = strdup(getenv("PATH"));
+    char path[L_tmpnam + strlen(real_path) + 2];
+    if (real_sock) {
+        real_sock = strdup(real_sock);
+    }
+    snprintf(path, sizeof(path), "%s:%s", test_dir, real_path);
+    setenv("PATH", path, 1);
+    unsetenv("WATCHMAN_SOCK");
+
+    time_t start = time(NULL);
+    deadline = watchman_deadline(tv);
+    op = watchman_connect_start(&error);
+    ck_assert_msg(op != NULL, error.message);
+    conn = watchman_connect_finish(op, &deadline, &error);
+    ck_assert(conn == NULL);
+    ck_assert_int_eq(WATCHMAN_ERR_WATCHMAN_BROKEN, error.code);
+    watchman_release_error(&error);
+    ck_assert(time(NULL) - start < 10);
+
+    setenv("PATH", real_path, 1);
+    free(real_path);
+    if (real_sock) {
+        setenv("WATCHMAN_SOCK", real_sock, 1);
+        free(real_sock);
+    }
+}
+END_TEST
+
+/* Returns a socket connected to 'sock', or -1 */
+static int
+connect_unix(const char *sock)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/* Starts ../watchman-proxy on 'sock' and waits until it takes connections */
+static pid_t
+start_proxy(const char *sock)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("../watchman-proxy", "watchman-proxy", sock, (char *)NULL);
+        _exit(127);
+    }
+    ck_assert(pid > 0);
+
+    int tries;
+    for (tries = 0; tries < 500; ++tries) {
+        int fd = connect_unix(sock);
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        usleep(10000);
+    }
+    ck_abort_msg("watchman-proxy did not start");
+    return -1;
+}
+
+/* Sends a JSON request on a plain socket and returns the response.  It
+ * reads a byte at a time so as to leave any later responses unread. */
+static json_t *
+json_roundtrip(int fd, const char *request)
+{
+    char buf[4096];
+    size_t len = 0;
+    json_error_t err;
+
+    if (request) {
+        ck_assert(write(fd, request, strlen(request)) ==
+                  (ssize_t)strlen(request));
+    }
+    while (len == 0 || buf[len - 1] != '\n') {
+        ck_assert(len < sizeof(buf) - 1);
+        ssize_t got = read(fd, buf + len, 1);
+        ck_assert(got > 0);
+        len += got;
+    }
+    buf[len] = '\0';
+    json_t *response = json_loads(buf, 0, &err);
+    ck_assert_msg(response != NULL, err.text);
+    return response;
+}
+
+/* Reads notifications for 'sub' until one reports 'name' */
+static void
+wait_for_file(struct watchman_connection *conn, const char *sub,
+              const char *name, const struct timespec *deadline)
+{
+    struct watchman_error error;
+    int found = 0;
+    while (!found) {
+        struct watchman_notification *note =
+            watchman_read_notification(conn, deadline, &error);
+        ck_assert_msg(note != NULL, error.message);
+        ck_assert_str_eq(sub, note->subscription);
+        for (int i = 0; note->result && i < note->result->nr; ++i) {
+            if (!strcmp(note->result->stats[i].name, name)) {
+                found = 1;
+            }
+        }
+        watchman_free_notification(note);
+    }
+}
+
+START_TEST(test_watchman_proxy)
+{
+    struct watchman_error error;
+    struct timeval tv = {10, 0};
+    struct timespec deadline = watchman_deadline(tv);
+    char sock[L_tmpnam + 8];
+    char *real_sock = getenv("WATCHMAN_SOCK");
+
+    if (real_sock) {
+        real_sock = strdup(real_sock);
+    }
+    snprintf(sock, sizeof(sock), "%s.proxy", test_dir);
+    pid_t proxy = start_proxy(sock);
+    setenv("WATCHMAN_SOCK", sock, 1);
+
+    struct watchman_connection *a = watchman_connect(tv, &error);
+    ck_assert_msg(a != NULL, error.message);
+    struct watchman_connection *b = watchman_connect(tv, &error);
+    ck_assert_msg(b != NULL, error.message);
+    ck_assert_msg(!watchman_watch(a, test_dir, &error), error.message);
+
+    /* Both share one subscription upstream */
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_FIELD_NAME);
+    ck_assert_msg(!watchman_subscribe(a, test_dir, "a", query,
+                                      watchman_true_expression(),
+                                      &deadline, &error),
+                  error.message);
+    ck_assert_msg(!watchman_subscribe(b, test_dir, "b", query,
+                                      watchman_true_expression(),
+                                      &deadline, &error),
+                  error.message);
+    watchman_free_query(query);
+    create_file("shared", "");
+    wait_for_file(a, "a", "shared", &deadline);
+    wait_for_file(b, "b", "shared", &deadline);
+
+    ck_assert_msg(!watchman_unsubscribe(a, test_dir, "a", &deadline,
+                                        &error),
+                  error.message);
+    create_file("after", "");
+    wait_for_file(b, "b", "after", &deadline);
+    ck_assert_msg(!watchman_unsubscribe(b, test_dir, "b", &deadline,
+                                        &error),
+                  error.message);
+
+    /* The same request from two clients at once goes upstream once.  A
+     * synced clock moves on each time it is asked for, so both clients
+     * getting the same one shows that it was asked for only once. */
+    char request[PATH_MAX + 64];
+    int fds[2], i;
+    json_t *clocks[2];
+    snprintf(request, sizeof(request),
+             "[\"clock\", \"%s\", {\"sync_timeout\": 1000}]\n", test_dir);
+    for (i = 0; i < 2; ++i) {
+        fds[i] = connect_unix(sock);
+        ck_assert(fds[i] >= 0);
+        /* Once this is answered, the proxy has taken the connection */
+        json_decref(json_roundtrip(fds[i], "[\"version\"]\n"));
+    }
+    /* Both requests are waiting when the proxy next looks */
+    kill(proxy, SIGSTOP);
+    for (i = 0; i < 2; ++i) {
+        ck_assert(write(fds[i], request, strlen(request)) ==
+                  (ssize_t)strlen(request));
+    }
+    kill(proxy, SIGCONT);
+    for (i = 0; i < 2; ++i) {
+        clocks[i] = json_roundtrip(fds[i], NULL);
+        ck_assert(json_string_value(json_object_get(clocks[i], "clock")));
+    }
+    char *shared = strdup(json_string_value(json_object_get(clocks[0],
+                                                            "clock")));
+    ck_assert_str_eq(shared,
+                     json_string_value(json_object_get(clocks[1], "clock")));
+    for (i = 0; i < 2; ++i) {
+        json_decref(clocks[i]);
+    }
+    /* Asked for again, it has moved on */
+    clocks[0] = json_roundtrip(fds[0], request);
+    ck_assert(strcmp(shared,
+                     json_string_value(json_object_get(clocks[0], "clock"))));
+    json_decref(clocks[0]);
+    free(shared);
+
+    /* Responses come back in the order each client asked, even when a
+     * request is the same as one asked for earlier in the batch */
+    char pipelined[2 * sizeof(request) + 16];
+    snprintf(pipelined, sizeof(pipelined), "%s[\"version\"]\n%s", request,
+             request);
+    kill(proxy, SIGSTOP);
+    ck_assert(write(fds[0], request, strlen(request)) ==
+              (ssize_t)strlen(request));
+    ck_assert(write(fds[1], pipelined, strlen(pipelined)) ==
+              (ssize_t)strlen(pipelined));
+    kill(proxy, SIGCONT);
+    json_t *response = json_roundtrip(fds[0], NULL);
+    ck_assert(json_object_get(response, "clock") != NULL);
+    json_decref(response);
+    for (i = 0; i < 3; ++i) {
+        response = json_roundtrip(fds[1], NULL);
+        ck_assert((json_object_get(response, "clock") != NULL) == (i != 1));
+        json_decref(response);
+    }
+    for (i = 0; i < 2; ++i) {
+        close(fds[i]);
+    }
+
+    ck_assert_msg(!watchman_watch_del(a, test_dir, &error), error.message);
+    watchman_connection_close(a);
+    watchman_connection_close(b);
+
+    int status;
+    kill(proxy, SIGTERM);
+    ck_assert(waitpid(proxy, &status, 0) == proxy);
+    ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    if (real_sock) {
+        setenv("WATCHMAN_SOCK", real_sock, 1);
+        free(real_sock);
+    } else {
+        unsetenv("WATCHMAN_SOCK");
+    }
+}
+END_TEST
+
+START_TEST(test_watchman_subscribe_resolved_root)
+{
+    struct watchman_error error;
+    struct timeval tv = {10, 0};
+    struct watchman_connection *conn = watchman_connect(tv, &error);
+    ck_assert_msg(conn != NULL, error.message);
+    struct watchman_reconnect_policy policy = {10, 100, 3};
+    ck_assert(!watchman_connection_enable_reconnect(conn, &policy));
+    ck_assert_msg(!watchman_watch(conn, test_dir, &error), error.message);
+
+    /* Notifications name the root as watchman resolves it */
+    char root[L_tmpnam + 8];
+    create_dir("sub");
+    snprintf(root, sizeof(root), "%s/sub/..", test_dir);
+    struct timespec deadline = watchman_deadline(tv);
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_FIELD_NAME);
+    ck_assert_msg(!watchman_subscribe(conn, root, "sub", query,
+                                      watchman_true_expression(),
+                                      &deadline, &error),
+                  error.message);
+    watchman_free_query(query);
+    create_file("before", "");
+    wait_for_file(conn, "sub", "before", &deadline);
+
+    /* Resubscribing picks up after the last notification read, so
+     * nothing already seen comes back */
+    shutdown(fileno(conn->fp), SHUT_RDWR);
+    create_file("after", "");
+    int found = 0;
+    while (!found) {
+        struct watchman_notification *note =
+            watchman_read_notification(conn, &deadline, &error);
+        ck_assert_msg(note != NULL, error.message);
+        for (int i = 0; note->result && i < note->result->nr; ++i) {
+            ck_assert_str_ne("before", note->result->stats[i].name);
+            found |= !strcmp(note->result->stats[i].name, "after");
+        }
+        watchman_free_notification(note);
+    }
+
+    ck_assert_msg(!watchman_unsubscribe(conn, test_dir, "sub", &deadline,
+                                        &error),
+                  error.message);
+    ck_assert_msg(!watchman_watch_del(conn, test_dir, &error), error.message);
+    watchman_connection_close(conn);
+}
+END_TEST
+
 Suite *
 watchman_suite(void)
 {
@@ -266,6 +1556,28 @@ watchman_suite(void)
     tcase_add_test(tc_core, test_watchman_connect);
     tcase_add_test(tc_core, test_watchman_watch);
     tcase_add_test(tc_core, test_watchman_misc);
+    tcase_add_test(tc_core, test_watchman_json_protocol);
+    tcase_add_test(tc_core, test_watchman_deadline);
+    tcase_add_test(tc_core, test_watchman_reconnect);
+    tcase_add_test(tc_core, test_watchman_wait);
+    tcase_add_test(tc_core, test_watchman_io_uring);
+    tcase_add_test(tc_core, test_watchman_connection_from_fd);
+    tcase_add_test(tc_core, test_watchman_query_changes);
+    tcase_add_test(tc_core, test_watchman_cached_query);
+    tcase_add_test(tc_core, test_watchman_cached_query_fields);
+    tcase_add_test(tc_core, test_watchman_cached_query_shared);
+    tcase_add_test(tc_core, test_watchman_cached_query_notify);
+    tcase_add_test(tc_core, test_watchman_fanout_query);
+    tcase_add_test(tc_core, test_watchman_embedded);
+    tcase_add_test(tc_core, test_watchman_connect_async);
+    tcase_add_test(tc_core, test_watchman_watch_many);
+    tcase_add_test(tc_core, test_watchman_watch_project);
+    tcase_add_test(tc_core, test_watchman_state_subscription);
+    tcase_add_test(tc_core, test_watchman_command);
+    tcase_add_test(tc_core, test_watchman_query_bound);
+    tcase_add_test(tc_core, test_watchman_time_fields);
+    tcase_add_test(tc_core, test_watchman_proxy);
+    tcase_add_test(tc_core, test_watchman_subscribe_resolved_root);
     suite_add_tcase(s, tc_core);
 
     return s;
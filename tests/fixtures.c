@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixtures.h"
+
+struct watchman_query_result *
+fixture_result(int nr, const char **names, const char *format)
+{
+    struct watchman_query_result *result = calloc(1, sizeof(*result));
+    int i;
+    result->nr = nr;
+    result->stats = calloc(nr ? nr : 1, sizeof(*result->stats));
+    for (i = 0; i < nr; ++i) {
+        char name[32];
+        if (!names) {
+            snprintf(name, sizeof(name), format, i);
+        }
+        result->stats[i].name = strdup(names ? names[i] : name);
+        result->stats[i].exists = 1;
+    }
+    return result;
+}
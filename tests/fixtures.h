@@ -0,0 +1,11 @@
+#ifndef LIBWATCHMAN_TESTS_FIXTURES_H_
+#define LIBWATCHMAN_TESTS_FIXTURES_H_
+
+#include "../watchman.h"
+
+/* A result listing 'nr' files that exist, named names[i], or if 'names'
+ * is NULL, by 'format' with i; the rest of each stat is zero */
+struct watchman_query_result *
+fixture_result(int nr, const char **names, const char *format);
+
+#endif /* ndef LIBWATCHMAN_TESTS_FIXTURES_H_ */
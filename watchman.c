@@ -6,8 +6,9 @@
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <signal.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/un.h>
@@ -18,10 +19,57 @@
 
 #include "bser_write.h"
 #include "proto.h"
+#include "watchman_private.h"
+#include "watchman_transport.h"
 
 static int use_bser_encoding = 0;
 static FILE* error_handle = NULL;
 
+/* What a connection needs to remember to be re-established */
+struct watchman_root_state {
+    char *root;
+    /* Set for the clocks of queries scoped to a directory of the root */
+    char *relative_root;
+    /* Clock of the last watchman_query_changes() result, if any */
+    char *clock;
+    unsigned watched:1;
+};
+
+/* A subscription to establish again after reconnecting */
+struct watchman_subscription_state {
+    char *root;
+    /* The root as watchman names it in notifications, which resolves any
+     * symlinks or ".." in 'root' */
+    char *resolved;
+    char *name;
+    /* The subscribe command, its since kept at the last clock delivered */
+    json_t *cmd;
+    /* The fields the caller asked for; see wire_fields() */
+    int fields;
+};
+
+struct watchman_session {
+    unsigned reconnect:1;
+    /* Set when I/O fails in a way that a new connection could fix */
+    unsigned lost:1;
+    /* Set once the socket timeouts below have been read */
+    unsigned has_timeouts:1;
+    /* The socket's receive and send timeouts from watchman_connect() */
+    struct timeval timeouts[2];
+    struct watchman_reconnect_policy policy;
+    int nr_roots;
+    int cap_roots;
+    struct watchman_root_state *roots;
+    int nr_subs;
+    int cap_subs;
+    struct watchman_subscription_state *subs;
+    /* Unilateral PDUs that arrived while waiting for a response, oldest
+     * first */
+    int nr_pending;
+    int cap_pending;
+    proto_t *pending;
+};
+
 /* It's safe to have a small buffer here because watchman's socket name
  * is guaranteed to be under 108 bytes (see sockaddr_un).  The JSON only has
  * sockname and version fields.
@@ -65,12 +113,7 @@ static void error(const char* msg, ...) {
 }
 
 
-static void watchman_err(struct watchman_error *error,
-                         enum watchman_error_code code,
-                         const char *message, ...)
-    __attribute__ ((format(printf, 3, 4)));
-
-static void
+void
 watchman_err(struct watchman_error *error, enum watchman_error_code code,
              const char *message, ...)
 {
@@ -91,6 +134,93 @@ watchman_err(struct watchman_error *error, enum watchman_error_code code,
     va_end(argptr);
 }
 
+uint64_t
+watchman_fnv1a(const char *data, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int
+watchman_nr_cpus(void)
+{
+    long nr = sysconf(_SC_NPROCESSORS_ONLN);
+    return nr > 0 ? (nr < INT_MAX ? (int)nr : INT_MAX) : 1;
+}
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define WATCHMAN_READ_BUFFER_SIZE 65536
+
+static void
+monotonic_now(struct timespec *now)
+{
+    clock_gettime(CLOCK_MONOTONIC, now);
+}
+
+struct timespec
+watchman_deadline(struct timeval timeout)
+{
+    struct timespec deadline;
+    monotonic_now(&deadline);
+    deadline.tv_sec += timeout.tv_sec;
+    deadline.tv_nsec += (long)timeout.tv_usec * 1000;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+    }
+    return deadline;
+}
+
+/* Milliseconds left until 'deadline' (rounded up), 0 if it has passed, or
+ * -1 if there is no deadline.  Suitable as a poll() timeout. */
+static int
+deadline_remaining_ms(const struct timespec *deadline)
+{
+    struct timespec now;
+    if (deadline == NULL) {
+        return -1;
+    }
+    monotonic_now(&now);
+    if (now.tv_sec > deadline->tv_sec ||
+        (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec)) {
+        return 0;
+    }
+    int64_t ms = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000 +
+        (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+    return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+/**
+ * Waits until 'fd' is ready for 'events' or 'deadline' passes.  Returns 1
+ * if ready, 0 on timeout (with errno set to EAGAIN), and -1 on error.
+ */
+static int
+wait_for_fd(int fd, short events, const struct timespec *deadline)
+{
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    do {
+        pfd.revents = 0;
+        ret = poll(&pfd, 1, deadline_remaining_ms(deadline));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret == 0) {
+        errno = EAGAIN;
+    }
+    return ret > 0 ? 1 : ret;
+}
+
 static int unix_stream_socket(void)
 {
     int fd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -191,75 +321,70 @@ static int unix_sockaddr_cleanup(struct unix_sockaddr_context *ctx, struct watch
     return ret;
 }
 
-static int unix_stream_connect(const char *path, struct watchman_error *error)
+/* Wraps a connected socket.  Returns NULL with errno set (leaving 'fd'
+ * open) on failure. */
+static struct watchman_connection *
+connection_from_fd(int fd)
 {
-    struct sockaddr_un sa;
-    struct unix_sockaddr_context ctx;
-
-    if (unix_sockaddr_init(&sa, path, &ctx) < 0) {
-        return -1;
-    }
-    int fd = unix_stream_socket();
-    if (fd < 0) {
-        return -1;
-    }
-    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
-        watchman_err(error, WATCHMAN_ERR_CONNECT, "Connect error %s",
-                     strerror(errno));
+    use_bser_encoding = getenv("LIBWATCHMAN_USE_JSON_PROTOCOL") == NULL;
+    trace("Using bser encoding: %s", use_bser_encoding ? "yes" : "no");
 
-        if (unix_sockaddr_cleanup(&ctx, error)) {
-            error->code |= WATCHMAN_ERR_CWD;
-        }
-        close(fd);
-        return -1;
+    struct watchman_connection *conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        return NULL;
     }
-    if (unix_sockaddr_cleanup(&ctx, error)) {
-        close(fd);
-        return -1;
+    /* All I/O goes through the fd; the FILE is kept for compatibility */
+    conn->fp = fdopen(fd, "r+");
+    if (!conn->fp) {
+        free(conn);
+        return NULL;
     }
-    return fd;
+    return conn;
 }
 
-static struct watchman_connection *
-watchman_sock_connect(const char *sockname, struct timeval timeout, struct watchman_error *error)
+struct watchman_connection *
+watchman_connection_from_fd(int fd, struct watchman_error *error)
 {
-    use_bser_encoding = getenv("LIBWATCHMAN_USE_JSON_PROTOCOL") == NULL;
-    trace("Using bser encoding: %s", use_bser_encoding ? "yes" : "no");
-
-    int fd;
-
-    error->message = NULL;
-    fd = unix_stream_connect(sockname, error);
-    if (fd < 0 && !error->message) {
-        watchman_err(error, WATCHMAN_ERR_CONNECT, "Connect error %s",
-                     strerror(errno));
+    struct sockaddr_un peer;
+    socklen_t len = sizeof(peer);
+    int type;
+    socklen_t type_len = sizeof(type);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) < 0) {
+        watchman_err(error, WATCHMAN_ERR_CONNECT,
+                     "Can't use fd %d as a watchman connection: %s",
+                     fd, strerror(errno));
         return NULL;
     }
-
-    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) {
-        watchman_err(error, WATCHMAN_ERR_CONNECT, "Failed to set timeout %s",
-                     strerror(errno));
+    if (type != SOCK_STREAM) {
+        watchman_err(error, WATCHMAN_ERR_CONNECT,
+                     "Can't use fd %d as a watchman connection: "
+                     "not a stream socket", fd);
         return NULL;
     }
-
-    if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))) {
-        watchman_err(error, WATCHMAN_ERR_CONNECT, "Failed to set timeout %s",
-                     strerror(errno));
+    if (getpeername(fd, (struct sockaddr *)&peer, &len) < 0) {
+        watchman_err(error, WATCHMAN_ERR_CONNECT,
+                     "Can't use fd %d as a watchman connection: %s",
+                     fd, strerror(errno));
         return NULL;
     }
 
-    FILE *sockfp = fdopen(fd, "r+");
-    if (!sockfp) {
-        close(fd);
-        watchman_err(error, WATCHMAN_ERR_OTHER,
-                     "Failed to connect to watchman socket %s: %s.",
-                     sockname, strerror(errno));
+    /* Reads without a deadline expect to block */
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || ((flags & O_NONBLOCK) &&
+                      fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0)) {
+        watchman_err(error, WATCHMAN_ERR_CONNECT,
+                     "Can't use fd %d as a watchman connection: %s",
+                     fd, strerror(errno));
         return NULL;
     }
-    setlinebuf(sockfp);
 
-    struct watchman_connection *conn = malloc(sizeof(*conn));
-    conn->fp = sockfp;
+    struct watchman_connection *conn = connection_from_fd(fd);
+    if (!conn) {
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "Can't use fd %d as a watchman connection: %s",
+                     fd, strerror(errno));
+    }
     return conn;
 }
 
@@ -272,12 +397,13 @@ struct watchman_popen {
 #define WATCHMAN_EXEC_INTERNAL_ERROR 242
 
 static const char* get_sockname_msg = "Could not run watchman get-sockname: %s";
-/* Runs watchman get-sockname and returns a FILE from which the output
- can be read. */
-static struct watchman_popen *watchman_popen_getsockname(struct watchman_error *err)
+/* Runs watchman get-sockname, filling in 'ret' with its pid and a
+ non-blocking pipe from which the output can be read.  Returns 0, or -1
+ with 'err' filled in. */
+static int watchman_popen_getsockname(struct watchman_popen *ret,
+                                      struct watchman_error *err)
 {
     int pipefd[2];
-    static struct watchman_popen ret = {0, 0};
 
     if (pipe(pipefd) < 0) {
         goto fail;
@@ -285,6 +411,10 @@ static struct watchman_popen *watchman_popen_getsockname(struct watchman_error *
 
     pid_t pid = fork();
     if (pid < 0) {
+        int saved = errno;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        errno = saved;
         goto fail;
     } else if (pid == 0) {
         if (dup2(pipefd[1], 1) < 0) {
@@ -308,14 +438,19 @@ static struct watchman_popen *watchman_popen_getsockname(struct watchman_error *
         exit(WATCHMAN_EXEC_FAILED);
     } else {
         close(pipefd[1]);
-        ret.fd = pipefd[0];
-        ret.pid = pid;
-        return &ret;
+        ret->fd = pipefd[0];
+        ret->pid = pid;
+        /* The output is collected as it arrives */
+        int flags = fcntl(ret->fd, F_GETFL);
+        if (flags >= 0) {
+            fcntl(ret->fd, F_SETFL, flags | O_NONBLOCK);
+        }
+        return 0;
     }
 
 fail:
     watchman_err(err, WATCHMAN_ERR_OTHER, get_sockname_msg, strerror(errno));
-    return NULL;
+    return -1;
 }
 
 int watchman_pclose(struct watchman_error *error, struct watchman_popen *popen)
@@ -349,965 +484,3072 @@ int watchman_pclose(struct watchman_error *error, struct watchman_popen *popen)
 }
 
 /**
- * Calls select() on the given fd until it's ready to read from or
- * until the timeout expires. Updates timeout to indicate the
- * remaining time. Returns 1 if the socket is readable, 0 if the
- * socket is not readable, and -1 on error.
+ * Waits until the given fd is ready to read from or until the timeout
+ * expires. Updates timeout to indicate the remaining time. Returns 1
+ * if the socket is readable, 0 if the socket is not readable, and -1
+ * on error.
  */
 static int block_on_read(int fd, struct timeval *timeout)
 {
-    struct timeval now, start, elapsed, orig_timeout;
-    fd_set fds;
-    int ret = 0;
-
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
+    struct timespec deadline;
+    int ret;
 
-    if (timeout != NULL) {
-        gettimeofday(&start, NULL);
-        memcpy(&orig_timeout, timeout, sizeof(orig_timeout));
+    if (timeout == NULL) {
+        return wait_for_fd(fd, POLLIN, NULL);
     }
 
-    ret = select(fd + 1, &fds, NULL, NULL, timeout);
-
-    if (timeout != NULL) {
-        gettimeofday(&now, NULL);
-        timersub(&now, &start, &elapsed);
-        timersub(&orig_timeout, &elapsed, timeout);
-    }
+    deadline = watchman_deadline(*timeout);
+    ret = wait_for_fd(fd, POLLIN, &deadline);
 
+    int remaining = deadline_remaining_ms(&deadline);
+    timeout->tv_sec = remaining / 1000;
+    timeout->tv_usec = (remaining % 1000) * 1000;
     return ret;
 }
 
 /*
- * Read from fd into buf until either `bytes` bytes have been read, or
- * EOF, or the data that has been read can be parsed as JSON.  In the
- * event of a timeout or read error, returns NULL.
+ * Parses the 'len' bytes of get-sockname output in 'buf' (which has room
+ * for a terminating NUL) as JSON or BSER.  Returns the socket path
+ * (caller-owned), or NULL with 'error' filled in.
  */
-static proto_t read_with_timeout(int fd, char* buf, size_t bytes, struct timeval timeout)
+static char *
+parse_sockname(char *buf, size_t len, struct watchman_error *error)
 {
-    size_t read_so_far = 0;
-    ssize_t bytes_read = 0;
-
-    while (read_so_far < bytes) {
-        if (timeout.tv_sec || timeout.tv_usec) {
-            if (timeout.tv_sec < 0 || timeout.tv_usec < 0) {
-                /* Timeout */
-                return proto_null();
-            }
-
-            if (1 == block_on_read(fd, &timeout)) {
-                bytes_read = read(fd, buf, bytes - read_so_far);
-            } else {
-                return proto_null(); /* timeout or error */
-            }
-        } else {
-            bytes_read = read(fd, buf, bytes - read_so_far);
-        }
-        if (bytes_read < 0) {
-            return proto_null();
-        }
-        if (bytes_read == 0) {
-            /* EOF, but we couldn't parse the JSON we have so far */
-            return proto_null();
-        }
-        read_so_far += bytes_read;
+    proto_t proto = proto_null();
+    char *sockname = NULL;
 
-        /* try to parse this */
-        buf[read_so_far] = 0;
-        proto_t proto;
+    if (len > 0) {
+        buf[len] = 0;
+        bser_t* bser;
         if (buf[0] <= 0x0b) {
-            bser_t* bser = bser_parse_buffer((uint8_t*)buf, read_so_far, NULL);
-            proto = proto_from_bser(bser);
+            bser = bser_parse_buffer((uint8_t*)buf, len, NULL);
         } else {
-            json_error_t jerror;
-            json_t* json = json_loads(buf, JSON_DISABLE_EOF_CHECK, &jerror);
-            proto = proto_from_json(json);
+            bser = bser_parse_json(buf, len, NULL);
         }
-        return proto;
-    }
-    return proto_null();
-}
-
-/*
- * Connect to watchman's socket.  Sets a socket send and receive
- * timeout of `timeout`.  Pass a {0} for no-timeout.  On error,
- * returns NULL and, if `error` is non-NULL, fills it in.
- */
-struct watchman_connection *
-watchman_connect(struct timeval timeout, struct watchman_error *error)
-{
-    struct watchman_connection *conn = NULL;
-    /* If an environment variable WATCHMAN_SOCK is set, establish a connection
-       to that address. Otherwise, run `watchman get-sockname` to start the
-       daemon and retrieve its address. */
-    const char *sockname_env = getenv("WATCHMAN_SOCK");
-    if (sockname_env) {
-        conn = watchman_sock_connect(sockname_env, timeout, error);
-        goto done;
-    }
-    struct watchman_popen *p = watchman_popen_getsockname(error);
-    if (p == NULL) {
-        return NULL;
-    }
-
-    char buf[WATCHMAN_GET_SOCKNAME_MAX + 1];
-
-    proto_t proto = read_with_timeout(p->fd, buf, WATCHMAN_GET_SOCKNAME_MAX, timeout);
-
-    if (watchman_pclose(error, p)) {
-        goto done;
+        proto = proto_from_bser(bser, 0);
     }
     if (proto_is_null(proto)) {
         watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
                      "Got bad or no JSON/BSER from watchman get-sockname");
-        goto done;
+        return NULL;
     }
     if (!proto_is_object(proto)) {
         watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
                      "Got bad JSON/BSER from watchman get-sockname: object expected");
-        goto bad_proto;
+        goto done;
     }
     proto_t sockname_obj = proto_object_get(proto, "sockname");
     if (proto_is_null(sockname_obj)) {
         watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
                      "Got bad JSON/BSER from watchman get-sockname: "
                      "sockname element expected");
-        goto bad_proto;
+        goto done;
     }
     if (!proto_is_string(sockname_obj)) {
         watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
                      "Got bad JSON/BSER from watchman get-sockname:"
                      " sockname is not string");
-        goto bad_proto;
+        goto done;
     }
-    const char *sockname = proto_strdup(sockname_obj);
-    conn = watchman_sock_connect(sockname, timeout, error);
-bad_proto:
-    proto_free(proto);
+    sockname = proto_strdup(sockname_obj);
 done:
-    return conn;
+    proto_free(proto);
+    return sockname;
 }
 
+enum connect_step {
+    /* Reading the output of watchman get-sockname */
+    CONNECT_RESOLVING,
+    /* Waiting for the socket to connect */
+    CONNECT_CONNECTING,
+    /* Connected; the socket just needs wrapping */
+    CONNECT_DONE
+};
+
+struct watchman_connect_op {
+    enum connect_step step;
+    /* get-sockname, while it is running (pid is 0 once reaped) */
+    struct watchman_popen popen;
+    char buf[WATCHMAN_GET_SOCKNAME_MAX + 1];
+    size_t len;
+    char *sockname;
+    /* The non-blocking socket, or -1 */
+    int fd;
+    /* Set if the listen backlog was full, so the connect must be retried;
+     * unix sockets don't queue us */
+    unsigned retry:1;
+};
+
+/* Tries to connect op->fd.  Returns 1 if connected, 0 if the connect is
+ * still in progress (or must be retried), and -1 on error. */
 static int
-watchman_send_simple_command(struct watchman_connection *conn,
-                             struct watchman_error *error, ...)
+connect_attempt(struct watchman_connect_op *op, struct watchman_error *error)
 {
-    int result = 0;
-    json_t *cmd_array = json_array();
-    va_list argptr;
-    va_start(argptr, error);
-    char *arg;
-    while ((arg = va_arg(argptr, char *))) {
-        json_array_append_new(cmd_array, json_string(arg));
+    struct sockaddr_un sa;
+    struct unix_sockaddr_context ctx;
+    int ret;
+
+    if (unix_sockaddr_init(&sa, op->sockname, &ctx) < 0) {
+        watchman_err(error, WATCHMAN_ERR_CONNECT, "Connect error %s",
+                     strerror(errno));
+        return -1;
     }
-    if (use_bser_encoding) {
-        result = bser_write_to_file(cmd_array, conn->fp) == 0;
+    do {
+        ret = connect(op->fd, (struct sockaddr *)&sa, sizeof(sa));
+    } while (ret < 0 && errno == EINTR);
+
+    op->retry = 0;
+    if (ret == 0 || errno == EISCONN) {
+        ret = 1;
+    } else if (errno == EINPROGRESS || errno == EALREADY) {
+        ret = 0;
+    } else if (errno == EAGAIN) {
+        op->retry = 1;
+        ret = 0;
     } else {
-        result = json_dumpf(cmd_array, conn->fp, JSON_COMPACT);
-        fputc('\n', conn->fp);
+        watchman_err(error, WATCHMAN_ERR_CONNECT, "Connect error %s",
+                     strerror(errno));
+        ret = -1;
     }
-    if (result) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            watchman_err(error, WATCHMAN_ERR_TIMEOUT,
-                         "Timeout sending simple watchman command");
-        } else {
-            watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
-                         "Failed to send simple watchman command");
+
+    if (ret < 0) {
+        if (unix_sockaddr_cleanup(&ctx, NULL) && error) {
+            error->code |= WATCHMAN_ERR_CWD;
         }
-        result = 1;
+    } else if (unix_sockaddr_cleanup(&ctx, error)) {
+        ret = -1;
     }
-
-    json_decref(cmd_array);
-    return result;
+    return ret;
 }
 
-static proto_t
-watchman_read_with_timeout(struct watchman_connection *conn, struct timeval *timeout, struct watchman_error *error)
+/* Creates the socket and starts connecting it to op->sockname */
+static int
+begin_connect(struct watchman_connect_op *op, struct watchman_error *error)
 {
-    proto_t result;
-    json_error_t jerror;
-
-    int ret = 1;
-
-    if (!timeout || timeout->tv_sec || timeout->tv_usec)
-        ret = block_on_read(fileno(conn->fp), timeout);
-    if (ret == -1) {
-        watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
-                     "Error encountered blocking on watchman");
-        return proto_null();
-    }
-
-    if (ret != 1) {
-        watchman_err(error, WATCHMAN_ERR_TIMEOUT,
-                     "timed out waiting for watchman");
-        return proto_null();
+    op->step = CONNECT_CONNECTING;
+    op->fd = unix_stream_socket();
+    int flags = op->fd < 0 ? -1 : fcntl(op->fd, F_GETFL);
+    if (flags < 0 || fcntl(op->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        watchman_err(error, WATCHMAN_ERR_CONNECT, "Connect error %s",
+                     strerror(errno));
+        return -1;
     }
+    return connect_attempt(op, error);
+}
 
-    if (use_bser_encoding) {
-        bser_t* bser = bser_parse_from_file(conn->fp, NULL);
-        result = proto_from_bser(bser);
-    } else {
-        json_t* json = json_loadf(conn->fp, JSON_DISABLE_EOF_CHECK, &jerror);
-        result = proto_from_json(json);
-        if (fgetc(conn->fp) != '\n') {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                watchman_err(error, WATCHMAN_ERR_TIMEOUT,
-                             "Timeout reading EOL from watchman");
-            } else {
-                watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
-                             "No newline at end of reply");
-            }
-            json_decref(json);
-            return proto_null();
+/* Collects get-sockname's output; once it exits, starts connecting */
+static int
+resolve_step(struct watchman_connect_op *op, struct watchman_error *error)
+{
+    while (op->len < WATCHMAN_GET_SOCKNAME_MAX) {
+        ssize_t got = read(op->popen.fd, op->buf + op->len,
+                           WATCHMAN_GET_SOCKNAME_MAX - op->len);
+        if (got < 0 && errno == EINTR) {
+            continue;
         }
-    }
-    if (proto_is_null(result)) {
-        if (errno == EAGAIN) {
-            watchman_err(error, WATCHMAN_ERR_TIMEOUT,
-                         "Timeout:EAGAIN reading from watchman.");
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
         }
-        else if (errno == EWOULDBLOCK) {
-            watchman_err(error, WATCHMAN_ERR_TIMEOUT,
-                         "Timeout:EWOULDBLOCK reading from watchman");
-        } else {
-            watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
-                         "Can't parse result from watchman: %s",
-                         jerror.text);
+        if (got < 0) {
+            watchman_err(error, WATCHMAN_ERR_RUN_WATCHMAN, get_sockname_msg,
+                         strerror(errno));
+            return -1;
         }
-        return proto_null();
+        if (got == 0) {
+            break;
+        }
+        op->len += got;
+    }
+    if (op->len == WATCHMAN_GET_SOCKNAME_MAX) {
+        /* Still running, so it can't be reaped without waiting past the
+         * deadline; watchman_connect_cancel() kills it instead */
+        watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
+                     "Got too much output from watchman get-sockname");
+        return -1;
     }
-    return result;
-}
 
-static proto_t
-watchman_read(struct watchman_connection *conn, struct watchman_error *error)
-{
-  return watchman_read_with_timeout(conn, NULL, error);
+    int failed = watchman_pclose(error, &op->popen);
+    op->popen.pid = 0;
+    if (failed) {
+        return -1;
+    }
+    op->sockname = parse_sockname(op->buf, op->len, error);
+    if (!op->sockname) {
+        return -1;
+    }
+    return begin_connect(op, error);
 }
 
+/* Checks on a connect in progress */
 static int
-watchman_read_and_handle_errors(struct watchman_connection *conn,
-                                struct watchman_error *error)
+connect_step(struct watchman_connect_op *op, struct watchman_error *error)
 {
-    proto_t obj = watchman_read(conn, error);
-    if (proto_is_null(obj)) {
-        return 1;
+    if (op->retry) {
+        return connect_attempt(op, error);
     }
-    if (!proto_is_object(obj)) {
-        char *bogus_text = proto_dumps(obj, 0);
-        watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
-                     "Got non-object result from watchman : %s",
-                     bogus_text);
-        free(bogus_text);
-        proto_free(obj);
-        return 1;
+
+    struct pollfd pfd;
+    pfd.fd = op->fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0) {
+        return 0;
     }
-    proto_t error_node = proto_object_get(obj, "error");
-    if (!proto_is_null(error_node)) {
-        watchman_err(error, WATCHMAN_ERR_OTHER,
-                     "Got error result from watchman : %s",
-                     proto_strdup(error_node));
-        proto_free(obj);
-        return 1;
+    int soerr = 0;
+    socklen_t len = sizeof(soerr);
+    if (getsockopt(op->fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0) {
+        soerr = errno;
     }
-
-    proto_free(obj);
-    return 0;
+    if (soerr) {
+        errno = soerr;
+        watchman_err(error, WATCHMAN_ERR_CONNECT, "Connect error %s",
+                     strerror(errno));
+        return -1;
+    }
+    return 1;
 }
 
-int
-watchman_watch(struct watchman_connection *conn,
-               const char *path, struct watchman_error *error)
+/* Wraps the connected socket, which is put back in blocking mode */
+static struct watchman_connection *
+finish_connect(struct watchman_connect_op *op, struct watchman_error *error)
 {
-    if (watchman_send_simple_command(conn, error, "watch", path, NULL)) {
-        return 1;
+    int flags = fcntl(op->fd, F_GETFL);
+    if (flags < 0 || fcntl(op->fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        watchman_err(error, WATCHMAN_ERR_CONNECT, "Connect error %s",
+                     strerror(errno));
+        return NULL;
     }
-    if (watchman_read_and_handle_errors(conn, error)) {
-        return 1;
+    struct watchman_connection *conn = connection_from_fd(op->fd);
+    if (!conn) {
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "Failed to connect to watchman socket %s: %s.",
+                     op->sockname, strerror(errno));
+        return NULL;
     }
-    return 0;
+    op->fd = -1;
+    return conn;
 }
 
-int
-watchman_recrawl(struct watchman_connection *conn,
-               const char *path, struct watchman_error *error)
+struct watchman_connect_op *
+watchman_connect_start(struct watchman_error *error)
 {
-    if (watchman_send_simple_command(conn, error, "debug-recrawl", path, NULL)) {
-        return 1;
+    struct watchman_connect_op *op = calloc(1, sizeof(*op));
+    if (!op) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return NULL;
     }
-    if (watchman_read_and_handle_errors(conn, error)) {
-        return 1;
+    op->fd = -1;
+
+    /* If an environment variable WATCHMAN_SOCK is set, establish a connection
+       to that address. Otherwise, run `watchman get-sockname` to start the
+       daemon and retrieve its address. */
+    const char *sockname_env = getenv("WATCHMAN_SOCK");
+    if (sockname_env) {
+        op->sockname = strdup(sockname_env);
+        if (!op->sockname) {
+            watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+            free(op);
+            return NULL;
+        }
+        int ret = begin_connect(op, error);
+        if (ret < 0) {
+            watchman_connect_cancel(op);
+            return NULL;
+        }
+        if (ret == 1) {
+            op->step = CONNECT_DONE;
+        }
+        return op;
     }
-    return 0;
+
+    if (watchman_popen_getsockname(&op->popen, error)) {
+        free(op);
+        return NULL;
+    }
+    op->step = CONNECT_RESOLVING;
+    return op;
 }
 
 int
-watchman_watch_del(struct watchman_connection *conn,
-                   const char *path, struct watchman_error *error)
+watchman_connect_fd(const struct watchman_connect_op *op, short *events)
 {
-    if (watchman_send_simple_command(conn, error, "watch-del", path, NULL)) {
-        return 1;
+    if (op->step == CONNECT_RESOLVING) {
+        *events = POLLIN;
+        return op->popen.fd;
     }
-    if (watchman_read_and_handle_errors(conn, error)) {
-        return 1;
+    *events = POLLOUT;
+    return op->fd;
+}
+
+int
+watchman_connect_poll(struct watchman_connect_op *op,
+                      struct watchman_connection **conn,
+                      struct watchman_error *error)
+{
+    int ret = 1;
+
+    *conn = NULL;
+    if (op->step == CONNECT_RESOLVING) {
+        ret = resolve_step(op, error);
+    } else if (op->step == CONNECT_CONNECTING) {
+        ret = connect_step(op, error);
     }
-    return 0;
+    if (ret == 0) {
+        return 0;
+    }
+    if (ret == 1) {
+        op->step = CONNECT_DONE;
+        *conn = finish_connect(op, error);
+        ret = *conn ? 1 : -1;
+    }
+    watchman_connect_cancel(op);
+    return ret;
 }
 
-static struct watchman_expression *
-alloc_expr(enum watchman_expression_type ty)
+struct watchman_connection *
+watchman_connect_finish(struct watchman_connect_op *op,
+                        const struct timespec *deadline,
+                        struct watchman_error *error)
 {
-    struct watchman_expression *expr;
-    expr = calloc(1, sizeof(*expr));
-    expr->ty = ty;
-    return expr;
+    struct watchman_connection *conn;
+
+    while (!watchman_connect_poll(op, &conn, error)) {
+        int ret;
+        if (op->retry) {
+            /* Back off briefly while the backlog drains */
+            int left = deadline_remaining_ms(deadline);
+            if (left != 0) {
+                poll(NULL, 0, left < 0 || left > 10 ? 10 : left);
+                continue;
+            }
+            errno = EAGAIN;
+            ret = 0;
+        } else {
+            short events;
+            int fd = watchman_connect_fd(op, &events);
+            ret = wait_for_fd(fd, events, deadline);
+            if (ret == 1) {
+                continue;
+            }
+        }
+
+        if (ret < 0) {
+            watchman_err(error, WATCHMAN_ERR_CONNECT, "Connect error %s",
+                         strerror(errno));
+        } else if (op->step == CONNECT_RESOLVING) {
+            watchman_err(error, WATCHMAN_ERR_TIMEOUT,
+                         "Timeout running watchman get-sockname");
+        } else {
+            watchman_err(error, WATCHMAN_ERR_TIMEOUT,
+                         "Timeout connecting to watchman");
+        }
+        watchman_connect_cancel(op);
+        return NULL;
+    }
+    return conn;
 }
 
-struct watchman_expression *
-watchman_since_expression(const char *since, enum watchman_clockspec spec)
+void
+watchman_connect_cancel(struct watchman_connect_op *op)
 {
-    assert(since);
-    struct watchman_expression *expr = alloc_expr(WATCHMAN_EXPR_TY_SINCE);
-    expr->e.since_expr.is_str = 1;
-    expr->e.since_expr.t.since = strdup(since);
-    expr->e.since_expr.clockspec = spec;
-    return expr;
+    if (!op) {
+        return;
+    }
+    if (op->popen.pid > 0) {
+        /* Don't wait for a daemon that is still starting up */
+        kill(op->popen.pid, SIGKILL);
+        watchman_pclose(NULL, &op->popen);
+    }
+    if (op->fd >= 0) {
+        close(op->fd);
+    }
+    free(op->sockname);
+    free(op);
 }
 
-struct watchman_expression *
-watchman_since_expression_time_t(time_t time, enum watchman_clockspec
-                                 spec)
+/*
+ * Shared by watchman_connect() and watchman_connect_deadline().  A
+ * non-NULL 'timeout' is applied as the socket's send and receive
+ * timeout; 'deadline' bounds the whole connection process.
+ */
+static struct watchman_connection *
+connect_impl(const struct timeval *timeout, const struct timespec *deadline,
+             struct watchman_error *error)
 {
-    struct watchman_expression *expr = alloc_expr(WATCHMAN_EXPR_TY_SINCE);
-    expr->e.since_expr.is_str = 0;
-    expr->e.since_expr.t.time = time;
-    expr->e.since_expr.clockspec = spec;
-    return expr;
+    struct watchman_connect_op *op = watchman_connect_start(error);
+    if (!op) {
+        return NULL;
+    }
+    struct watchman_connection *conn =
+        watchman_connect_finish(op, deadline, error);
+    if (conn && timeout != NULL) {
+        int fd = fileno(conn->fp);
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, timeout,
+                       sizeof(*timeout)) ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, timeout,
+                       sizeof(*timeout))) {
+            watchman_err(error, WATCHMAN_ERR_CONNECT,
+                         "Failed to set timeout %s", strerror(errno));
+            watchman_connection_close(conn);
+            return NULL;
+        }
+    }
+    return conn;
 }
 
-/* corresponds to enum watchman_expression_type */
-static char *ty_str[] = {
-    "allof",
-    "anyof",
-    "not",
-    "true",
-    "false",
-    "since",
-    "suffix",
-    "match",
-    "imatch",
-    "pcre",
-    "ipcre",
-    "name",
-    "iname",
-    "type",
-    "empty",
-    "exists"
-};
+/*
+ * Connect to watchman's socket.  Sets a socket send and receive
+ * timeout of `timeout`.  Pass a {0} for no-timeout.  On error,
+ * returns NULL and, if `error` is non-NULL, fills it in.
+ */
+struct watchman_connection *
+watchman_connect(struct timeval timeout, struct watchman_error *error)
+{
+    struct timespec deadline;
+    if (timeout.tv_sec || timeout.tv_usec) {
+        /* The timeout bounds connecting as a whole, and each read and
+         * write on the socket after that */
+        deadline = watchman_deadline(timeout);
+        return connect_impl(&timeout, &deadline, error);
+    }
+    return connect_impl(&timeout, NULL, error);
+}
 
-/* corresponds to enum watchman_clockspec */
-static char *clockspec_str[] = {
-    NULL,
-    "oclock",
-    "cclock",
-    "mtime",
-    "ctime"
-};
+struct watchman_connection *
+watchman_connect_deadline(const struct timespec *deadline,
+                          struct watchman_error *error)
+{
+    return connect_impl(NULL, deadline, error);
+}
 
-/* corresponds to enum watchman_basename */
-static char *basename_str[] = {
+static ssize_t
+fd_send(struct watchman_connection *conn, const void *data, size_t len,
+        const struct timespec *deadline)
+{
+    int flags = MSG_NOSIGNAL | (deadline ? MSG_DONTWAIT : 0);
+
+    /* A failed reconnect leaves no socket */
+    if (!conn->fp) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    int fd = fileno(conn->fp);
+    for (;;) {
+        if (deadline && wait_for_fd(fd, POLLOUT, deadline) != 1) {
+            return -1;
+        }
+        ssize_t sent = send(fd, data, len, flags);
+        if (sent < 0 && (errno == EINTR ||
+                         (deadline && (errno == EAGAIN ||
+                                       errno == EWOULDBLOCK)))) {
+            continue;
+        }
+        return sent;
+    }
+}
+
+static ssize_t
+fd_recv(struct watchman_connection *conn, void *buf, size_t len,
+        const struct timespec *deadline)
+{
+    if (!conn->fp) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    int fd = fileno(conn->fp);
+    for (;;) {
+        if (deadline && wait_for_fd(fd, POLLIN, deadline) != 1) {
+            return -1;
+        }
+        ssize_t got = read(fd, buf, len);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        return got;
+    }
+}
+
+/* Connections without a transport use this one */
+static const struct watchman_transport fd_transport = {
+    fd_send,
+    fd_recv,
     NULL,
-    "basename",
-    "wholename"
+    NULL,
+    NULL
 };
 
-static json_t *
-json_string_from_char(char c)
+static const struct watchman_transport *
+conn_transport(struct watchman_connection *conn)
 {
-    char str[2] = { c, 0 };
-    return json_string(str);
+    return conn->transport ? conn->transport : &fd_transport;
+}
+
+/* Makes sure that anything the transport has queued has been sent */
+static int
+conn_flush(struct watchman_connection *conn, const struct timespec *deadline)
+{
+    const struct watchman_transport *transport = conn_transport(conn);
+    return transport->flush ? transport->flush(conn, deadline) : 0;
+}
+
+/*
+ * Writes all of 'data' to the connection.  Returns 0 on success, or -1
+ * with errno set (EAGAIN if 'deadline' passed first).
+ */
+static int
+conn_write(struct watchman_connection *conn, const char *data, size_t len,
+           const struct timespec *deadline)
+{
+    const struct watchman_transport *transport = conn_transport(conn);
+
+    while (len > 0) {
+        ssize_t sent = transport->send(conn, data, len, deadline);
+        if (sent < 0) {
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/* Encodes 'cmd' in the connection's protocol and writes it out */
+static int
+send_json(struct watchman_connection *conn, json_t *cmd,
+          const struct timespec *deadline)
+{
+    char *data;
+    size_t len;
+    int ret;
+
+    if (use_bser_encoding) {
+        size_t content_size = bser_encoding_size(cmd);
+        size_t buflen = bser_header_size(content_size) + content_size;
+        data = malloc(buflen);
+        if (data == NULL) {
+            return -1;
+        }
+        len = bser_write_to_buffer(cmd, content_size, data, buflen);
+        if (len == 0) {
+            free(data);
+            errno = EINVAL;
+            return -1;
+        }
+    } else {
+        char *text = json_dumps(cmd, JSON_COMPACT);
+        if (text == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        len = strlen(text);
+        data = realloc(text, len + 1);
+        if (data == NULL) {
+            free(text);
+            return -1;
+        }
+        data[len++] = '\n';
+    }
+    ret = conn_write(conn, data, len, deadline);
+    free(data);
+    return ret;
 }
 
+/* Builds a command from a NULL-terminated list of strings */
 static json_t *
-json_string_or_array(int nr, char **items)
+simple_command(const char *name, ...)
 {
-    if (nr == 1) {
-        return json_string(items[0]);
+    json_t *cmd_array = json_array();
+    va_list argptr;
+    va_start(argptr, name);
+    const char *arg = name;
+    while (arg) {
+        json_array_append_new(cmd_array, json_string(arg));
+        arg = va_arg(argptr, const char *);
     }
-    json_t *result = json_array();
-    int i;
-    for (i = 0; i < nr; ++i) {
-        json_array_append_new(result, json_string(items[i]));
+    va_end(argptr);
+    return cmd_array;
+}
+
+static struct watchman_session *
+conn_session(struct watchman_connection *conn)
+{
+    if (!conn->session) {
+        conn->session = calloc(1, sizeof(*conn->session));
     }
-    return result;
+    return conn->session;
 }
 
+/* Notes that the connection is gone, unless the failure was a timeout */
 static void
-since_to_json(json_t *result, const struct watchman_expression *expr)
+conn_check_lost(struct watchman_connection *conn)
 {
-    if (expr->e.since_expr.is_str) {
-        json_array_append_new(result, json_string(expr->e.since_expr.t.since));
+    if (errno != EAGAIN && errno != EWOULDBLOCK && conn->session) {
+        conn->session->lost = 1;
+    }
+}
+
+static void
+conn_drop_socket(struct watchman_connection *conn);
+
+/*
+ * Gives up on a connection whose stream is out of step, such as one
+ * where a timeout left a request half sent or a response unread: what
+ * is left of the response would be taken for the next one.  It has to
+ * reconnect before it can be used again.
+ */
+static void
+conn_mark_lost(struct watchman_connection *conn)
+{
+    struct watchman_session *session = conn_session(conn);
+    if (session) {
+        session->lost = 1;
     } else {
-        json_array_append_new(result, json_integer(expr->e.since_expr.t.time));
+        conn_drop_socket(conn);
     }
-    if (expr->e.since_expr.clockspec) {
-        char *clockspec = clockspec_str[expr->e.since_expr.clockspec];
-        json_array_append_new(result, json_string(clockspec));
+}
+
+/* Whether the connection has to reconnect before it can be used */
+static int
+conn_lost(struct watchman_connection *conn)
+{
+    return !conn->fp || (conn->session && conn->session->lost);
+}
+
+static int
+watchman_send_deadline(struct watchman_connection *conn, json_t *query,
+                       const struct timespec *deadline,
+                       struct watchman_error *error)
+{
+    if (send_json(conn, query, deadline)) {
+        conn_check_lost(conn);
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* Some of the request may have gone out */
+            conn_mark_lost(conn);
+            watchman_err(error, WATCHMAN_ERR_TIMEOUT,
+                         "Timeout sending to watchman");
+        } else {
+            char *dump = json_dumps(query, 0);
+            watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "Failed to send watchman query %s", dump);
+            free(dump);
+        }
+        return 1;
     }
+    return 0;
 }
 
-static json_t *
-to_json(const struct watchman_expression *expr)
+static size_t
+conn_buffered(struct watchman_connection *conn)
 {
-    json_t *result = json_array();
-    json_t *arg;
-    json_array_append_new(result, json_string(ty_str[expr->ty]));
+    return conn->rbuf_end - conn->rbuf_start;
+}
 
-    int i;
-    switch (expr->ty) {
-        case WATCHMAN_EXPR_TY_ALLOF:
-            /*-fallthrough*/
-        case WATCHMAN_EXPR_TY_ANYOF:
-            for (i = 0; i < expr->e.union_expr.nr; ++i) {
-                json_array_append_new(result,
-                                      to_json(expr->e.union_expr.clauses[i]));
-            }
-            break;
-        case WATCHMAN_EXPR_TY_NOT:
-            json_array_append_new(result, to_json(expr->e.not_expr.clause));
-            break;
-        case WATCHMAN_EXPR_TY_TRUE:
-            /*-fallthrough*/
-        case WATCHMAN_EXPR_TY_FALSE:
-            /*-fallthrough*/
-        case WATCHMAN_EXPR_TY_EMPTY:
-            /*-fallthrough*/
-        case WATCHMAN_EXPR_TY_EXISTS:
-            /* Nothing to do */
-            break;
-
-        case WATCHMAN_EXPR_TY_SINCE:
-            since_to_json(result, expr);
-            break;
-        case WATCHMAN_EXPR_TY_SUFFIX:
-            json_array_append_new(result,
-                                  json_string(expr->e.suffix_expr.suffix));
-            break;
-        case WATCHMAN_EXPR_TY_MATCH:
-                                   /*-fallthrough*/
-        case WATCHMAN_EXPR_TY_IMATCH:
-            /*-fallthrough*/
-        case WATCHMAN_EXPR_TY_PCRE:
-            /*-fallthrough*/
-        case WATCHMAN_EXPR_TY_IPCRE:
-            json_array_append_new(result,
-                                  json_string(expr->e.match_expr.match));
-            if (expr->e.match_expr.basename) {
-                char *base = basename_str[expr->e.match_expr.basename];
-                json_array_append_new(result, json_string(base));
-            }
-            break;
-        case WATCHMAN_EXPR_TY_NAME:
-            /*-fallthrough*/
-        case WATCHMAN_EXPR_TY_INAME:
-            arg =
-                json_string_or_array(expr->e.name_expr.nr,
-                                     expr->e.name_expr.names);
-            json_array_append_new(result, arg);
-            if (expr->e.name_expr.basename) {
-                char *base = basename_str[expr->e.name_expr.basename];
-                json_array_append_new(result, json_string(base));
-            }
-            break;
-        case WATCHMAN_EXPR_TY_TYPE:
-            json_array_append_new(result,
-                                  json_string_from_char(expr->e.
-                                                        type_expr.type));
-    }
-    return result;
+/* Whether a read can make progress without waiting for the socket */
+static int
+conn_has_input(struct watchman_connection *conn)
+{
+    const struct watchman_transport *transport = conn_transport(conn);
+    return conn_buffered(conn) > 0 ||
+        (transport->buffered && transport->buffered(conn) > 0);
 }
 
-/* corresponds to enum watchman_fields */
-static char *fields_str[] = {
-    "name",
-    "exists",
-    "cclock",
-    "oclock",
-    "ctime",
-    "ctime_ms",
-    "ctime_us",
-    "ctime_ns",
-    "ctime_f",
-    "mtime",
-    "mtime_ms",
-    "mtime_us",
-    "mtime_ns",
-    "mtime_f",
-    "size",
-    "uid",
-    "gid",
-    "ino",
-    "dev",
-    "nlink",
-    "new",
-    "mode"
-};
-
-json_t *
-fields_to_json(int fields)
+/*
+ * Reads whatever is available into the connection's buffer, waiting
+ * at most until 'deadline'.  Returns the number of bytes read, 0 at
+ * EOF, or -1 with errno set (EAGAIN on timeout).
+ */
+static ssize_t
+conn_fill(struct watchman_connection *conn, const struct timespec *deadline)
 {
-    json_t *result = json_array();
-    int i = 0;
-    int mask;
-    for (mask = 1; mask < WATCHMAN_FIELD_END; mask *= 2) {
-        if (fields & mask) {
-            json_array_append_new(result, json_string(fields_str[i]));
+    if (conn->rbuf_start > 0 && conn->rbuf_end == conn->rbuf_cap) {
+        memmove(conn->rbuf, conn->rbuf + conn->rbuf_start,
+                conn_buffered(conn));
+        conn->rbuf_end -= conn->rbuf_start;
+        conn->rbuf_start = 0;
+    }
+    if (conn->rbuf_end == conn->rbuf_cap) {
+        size_t cap = conn->rbuf_cap ? conn->rbuf_cap * 2
+                                    : WATCHMAN_READ_BUFFER_SIZE;
+        char *rbuf = realloc(conn->rbuf, cap);
+        if (rbuf == NULL) {
+            return -1;
         }
-        ++i;
+        conn->rbuf = rbuf;
+        conn->rbuf_cap = cap;
     }
-    return result;
+
+    ssize_t got = conn_transport(conn)->recv(conn, conn->rbuf + conn->rbuf_end,
+                                             conn->rbuf_cap - conn->rbuf_end,
+                                             deadline);
+    if (got > 0) {
+        conn->rbuf_end += got;
+    }
+    return got;
 }
 
-#define PROTO_ASSERT(cond, condarg, msg)                                \
-    if (!cond(condarg)) {                                               \
-        char *dump = proto_dumps(condarg, 0);                           \
-        watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN, msg, dump);   \
-        free(dump);                                                     \
-        goto done;                                                      \
+/* Fills the connection's buffer until it holds at least 'want' bytes */
+static int
+conn_want(struct watchman_connection *conn, size_t want,
+          const struct timespec *deadline)
+{
+    while (conn_buffered(conn) < want) {
+        ssize_t got = conn_fill(conn, deadline);
+        if (got <= 0) {
+            if (got == 0) {
+                errno = 0;
+            }
+            return -1;
+        }
     }
+    return 0;
+}
 
-struct watchman_watch_list *
-watchman_watch_list(struct watchman_connection *conn,
-                    struct watchman_error *error)
+/*
+ * Reads one BSER PDU.  Whatever part of the content is already
+ * buffered is copied; the rest is read straight into the content
+ * buffer.  Returns NULL with errno set (0 at EOF) if the PDU could not
+ * be read, and with '*problem' set if its header is malformed.
+ */
+static bser_t *
+read_bser_pdu(struct watchman_connection *conn,
+              const struct timespec *deadline, const char **problem)
 {
-    struct watchman_watch_list *res = NULL;
-    struct watchman_watch_list *result = NULL;
-    if (watchman_send_simple_command(conn, error, "watch-list", NULL)) {
+    int8_t v8;
+    int16_t v16;
+    int32_t v32;
+    int64_t size;
+    size_t int_size;
+
+    if (conn_want(conn, 3, deadline)) {
         return NULL;
     }
-
-    proto_t obj = watchman_read(conn, error);
-    if (proto_is_null(obj)) {
+    const char *header = conn->rbuf + conn->rbuf_start;
+    if (header[0] != 0 || header[1] != 1) {
+        *problem = "Could not read bser magic values";
         return NULL;
     }
-    PROTO_ASSERT(proto_is_object, obj, "Got bogus value from watch-list %s");
-    proto_t roots = proto_object_get(obj, "roots");
-    PROTO_ASSERT(proto_is_array, roots, "Got bogus value from watch-list %s");
-
-    res = malloc(sizeof(*res));
-    int nr = proto_array_size(roots);
-    res->nr = 0;
-    res->roots = calloc(nr, sizeof(*res->roots));
-    int i;
-    for (i = 0; i < nr; ++i) {
-        proto_t root = proto_array_get(roots, i);
-        PROTO_ASSERT(proto_is_string, root,
-                    "Got non-string root from watch-list %s");
-        res->nr++;
-        res->roots[i] = proto_strdup(root);
+    switch (header[2]) {
+    case BSER_TAG_INT8:  int_size = sizeof(v8);   break;
+    case BSER_TAG_INT16: int_size = sizeof(v16);  break;
+    case BSER_TAG_INT32: int_size = sizeof(v32);  break;
+    case BSER_TAG_INT64: int_size = sizeof(size); break;
+    default:
+        *problem = "Could not read bser length";
+        return NULL;
     }
-    result = res;
-    res = NULL;
-done:
-    if (res) {
-        watchman_free_watch_list(res);
+    if (conn_want(conn, 3 + int_size, deadline)) {
+        return NULL;
     }
-    proto_free(obj);
-    return result;
-}
-
-#define WRITE_BOOL_STAT(stat, statobj, attr)                               \
-    proto_t attr = proto_object_get(statobj, #attr);                       \
-    if (!proto_is_null(attr)) {                                            \
-        PROTO_ASSERT(proto_is_boolean, attr, #attr " is not boolean: %s"); \
-        stat->attr = proto_is_true(attr);                                  \
+    const char *src = conn->rbuf + conn->rbuf_start + 3;
+    switch (int_size) {
+    case sizeof(v8):  memcpy(&v8, src, int_size);  size = v8;  break;
+    case sizeof(v16): memcpy(&v16, src, int_size); size = v16; break;
+    case sizeof(v32): memcpy(&v32, src, int_size); size = v32; break;
+    default:          memcpy(&size, src, int_size); break;
+    }
+    if (size <= 0) {
+        *problem = "Invalid bser length";
+        return NULL;
     }
+    conn->rbuf_start += 3 + int_size;
 
-#define WRITE_INT_STAT(stat, statobj, attr)                               \
-    proto_t attr = proto_object_get(statobj, #attr);                      \
-    if (!proto_is_null(attr)) {                                           \
-        PROTO_ASSERT(proto_is_integer, attr, #attr " is not an int: %s"); \
-        stat->attr = proto_integer_value(attr);                           \
+    /* From here on, failing leaves the stream inside this PDU */
+    uint8_t *content = malloc(size);
+    if (content == NULL) {
+        conn_mark_lost(conn);
+        *problem = "Could not allocate memory to hold data";
+        return NULL;
+    }
+    size_t have = conn_buffered(conn);
+    if (have > (size_t)size) {
+        have = size;
     }
+    memcpy(content, conn->rbuf + conn->rbuf_start, have);
+    conn->rbuf_start += have;
 
-#define WRITE_STR_STAT(stat, statobj, attr)                                \
-    proto_t attr = proto_object_get(statobj, #attr);                       \
-    if (!proto_is_null(attr)) {                                            \
-        PROTO_ASSERT(proto_is_string, attr, #attr " is not a string: %s"); \
-        stat->attr = proto_strdup(attr);                                   \
+    while (have < (size_t)size) {
+        ssize_t got = conn_transport(conn)->recv(conn, content + have,
+                                                 size - have, deadline);
+        if (got <= 0) {
+            if (got == 0) {
+                errno = 0;
+            }
+            conn_mark_lost(conn);
+            free(content);
+            return NULL;
+        }
+        have += got;
     }
+    return bser_parse_content(content, size, NULL);
+}
 
-#define WRITE_FLOAT_STAT(stat, statobj, attr)                           \
-    proto_t attr = proto_object_get(statobj, #attr);                    \
-    if (!proto_is_null(attr)) {                                         \
-        PROTO_ASSERT(proto_is_real, attr, #attr " is not a float: %s"); \
-        stat->attr = proto_real_value(attr);                            \
+/*
+ * Reads one newline-framed JSON response and parses it in place.
+ * Returns NULL with errno set (0 at EOF) if no complete line could be
+ * read.
+ */
+static bser_t *
+read_json_line(struct watchman_connection *conn,
+               const struct timespec *deadline)
+{
+    size_t scanned = 0;
+    char *newline;
+
+    /* Nothing may have been buffered yet, not even rbuf */
+    while (conn_buffered(conn) == scanned ||
+           !(newline = memchr(conn->rbuf + conn->rbuf_start + scanned, '\n',
+                              conn_buffered(conn) - scanned))) {
+        scanned = conn_buffered(conn);
+        if (conn_want(conn, scanned + 1, deadline)) {
+            return NULL;
+        }
+    }
+    size_t len = newline - (conn->rbuf + conn->rbuf_start) + 1;
+    char *line = malloc(len + 1);
+    if (line == NULL) {
+        return NULL;
     }
+    memcpy(line, conn->rbuf + conn->rbuf_start, len);
+    line[len] = '\0';
+    conn->rbuf_start += len;
+    return bser_parse_json(line, len, NULL);
+}
 
-static int
-watchman_send(struct watchman_connection *conn,
-              json_t *query, struct watchman_error *error)
+/*
+ * Reads one PDU.  'reply_due' is set when a request has been sent and
+ * not answered yet, so that timing out leaves its response to come.
+ */
+static proto_t
+read_response(struct watchman_connection *conn, int reply_due,
+              const struct timespec *deadline, struct watchman_error *error)
 {
-    int result;
+    bser_t* bser;
+
+    const char* problem = NULL;
+
+    errno = 0;
     if (use_bser_encoding) {
-        result = bser_write_to_file(query, conn->fp) == 0;
+        bser = read_bser_pdu(conn, deadline, &problem);
     } else {
-        result = json_dumpf(query, conn->fp, JSON_COMPACT);
-        fputc('\n', conn->fp);
+        bser = read_json_line(conn, deadline);
     }
-    if (result) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    if (bser == NULL) {
+        if (problem) {
+            watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
+                         "Can't parse result from watchman: %s", problem);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (reply_due || conn_has_input(conn)) {
+                conn_mark_lost(conn);
+            }
             watchman_err(error, WATCHMAN_ERR_TIMEOUT,
-                         "Timeout sending to watchman");
+                         "Timeout reading from watchman");
+        } else if (conn_buffered(conn) > 0) {
+            conn_check_lost(conn);
+            watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
+                         "Incomplete reply from watchman");
         } else {
-            char *dump = json_dumps(query, 0);
-            watchman_err(error, WATCHMAN_ERR_OTHER,
-                     "Failed to send watchman query %s", dump);
-            free(dump);
+            conn_check_lost(conn);
+            watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
+                         "Can't read result from watchman");
         }
-        return 1;
+        return proto_null();
     }
-    return 0;
+    /* Take ownership before the check below parses the top-level node */
+    proto_t proto = proto_from_bser(bser, 1);
+    if (bser_is_error(bser)) {
+        watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
+                     "Can't parse result from watchman: %s",
+                     bser_error_message(bser));
+        proto_free(proto);
+        return proto_null();
+    }
+    return proto;
 }
 
-char *
-watchman_clock(struct watchman_connection *conn,
-               const char *path,
-               unsigned int sync_timeout,
-               struct watchman_error *error)
+json_t *
+watchman_read_request(struct watchman_connection *conn,
+                      struct watchman_error *error)
 {
-    char *result = NULL;
-    json_t *query = json_array();
-    json_array_append_new(query, json_string("clock"));
-    json_array_append_new(query, json_string(path));
-    if (sync_timeout) {
-        json_t *options = json_object();
-        json_object_set_new(options, "sync_timeout", json_integer(sync_timeout));
-        json_array_append_new(query, options);
-    }
-
-    int ret = watchman_send(conn, query, error);
-    json_decref(query);
-    if (ret) {
-        return NULL;
-    }
-
-    proto_t obj = watchman_read(conn, error);
+    proto_t obj = read_response(conn, 0, NULL, error);
     if (proto_is_null(obj)) {
         return NULL;
     }
-    PROTO_ASSERT(proto_is_object, obj, "Got bogus value from clock %s");
-    proto_t clock = proto_object_get(obj, "clock");
-    PROTO_ASSERT(proto_is_string, clock, "Bad clock %s");
-    result = proto_strdup(clock);
-
-done:
+    json_error_t err;
+    json_t *json = bser2json(obj.bser, &err);
     proto_free(obj);
-    return result;
+    if (!json) {
+        watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
+                     "Can't decode request: %s", err.text);
+    }
+    return json;
 }
 
-static struct watchman_query_result *
-watchman_query_json(struct watchman_connection *conn,
-                    json_t *query,
-                    struct timeval *timeout,
+int
+watchman_send_reply(struct watchman_connection *conn, json_t *reply,
                     struct watchman_error *error)
 {
-    struct watchman_query_result *result = NULL;
-    struct watchman_query_result *res = NULL;
+    return watchman_send_deadline(conn, reply, NULL, error);
+}
 
-    if (watchman_send(conn, query, error)) {
-        return NULL;
+int
+watchman_wait(struct watchman_connection **conns, int nr, int *readable,
+              const struct timespec *deadline, struct watchman_error *error)
+{
+    struct pollfd *pfds = calloc(nr, sizeof(*pfds));
+    int i, ret, nr_ready = 0;
+
+    if (nr > 0 && pfds == NULL) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return -1;
     }
-    /* parse the result */
-    proto_t obj = watchman_read_with_timeout(conn, timeout, error);
-    if (proto_is_null(obj)) {
-        return NULL;
+    for (i = 0; i < nr; ++i) {
+        /* A queued request must go out before its response can arrive;
+         * if it can't, the next read reports why */
+        readable[i] = !conns[i]->fp || conn_has_input(conns[i]) ||
+            (conns[i]->session && conns[i]->session->nr_pending > 0) ||
+            conn_flush(conns[i], deadline) < 0;
+        nr_ready += readable[i];
+        pfds[i].fd = conns[i]->fp ? fileno(conns[i]->fp) : -1;
+        pfds[i].events = POLLIN;
+    }
+
+    /* Buffered responses are ready now, but still collect any others */
+    do {
+        ret = poll(pfds, nr, nr_ready ? 0 : deadline_remaining_ms(deadline));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "Error waiting for watchman: %s", strerror(errno));
+        free(pfds);
+        return -1;
     }
-    PROTO_ASSERT(proto_is_object, obj, "Failed to send watchman query %s");
+    for (i = 0; i < nr; ++i) {
+        /* Hangups and errors are reported by the next read */
+        if (!readable[i] && pfds[i].revents) {
+            readable[i] = 1;
+            nr_ready++;
+        }
+    }
+    free(pfds);
+    return nr_ready;
+}
 
-    proto_t jerror = proto_object_get(obj, "error");
-    if (!proto_is_null(jerror)) {
-        watchman_err(error, WATCHMAN_ERR_WATCHMAN_REPORTED,
-                     "Error result from watchman: %s",
-                     proto_strdup(jerror));
-        goto done;
+static proto_t
+watchman_read_with_timeout(struct watchman_connection *conn, struct timeval *timeout, struct watchman_error *error)
+{
+    int ret = 1;
+
+    if (!conn->fp) {
+        watchman_err(error, WATCHMAN_ERR_CONNECT,
+                     "Connection to watchman lost");
+        return proto_null();
+    }
+    if (conn_flush(conn, NULL) < 0) {
+        return read_response(conn, 1, NULL, error);
+    }
+    /* Buffered data would not wake up poll() */
+    if (!conn_has_input(conn) &&
+        (!timeout || timeout->tv_sec || timeout->tv_usec))
+        ret = block_on_read(fileno(conn->fp), timeout);
+    if (ret == -1) {
+        watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
+                     "Error encountered blocking on watchman");
+        return proto_null();
     }
 
-    res = calloc(1, sizeof(*res));
+    if (ret != 1) {
+        /* The response may still come */
+        conn_mark_lost(conn);
+        watchman_err(error, WATCHMAN_ERR_TIMEOUT,
+                     "timed out waiting for watchman");
+        return proto_null();
+    }
 
-    proto_t files = proto_object_get(obj, "files");
-    PROTO_ASSERT(proto_is_array, files, "Bad files %s");
+    return read_response(conn, 1, NULL, error);
+}
 
-    int nr = proto_array_size(files);
-    res->stats = calloc(nr, sizeof(*res->stats));
+static proto_t
+watchman_read(struct watchman_connection *conn, struct watchman_error *error)
+{
+  return watchman_read_with_timeout(conn, NULL, error);
+}
+
+/* Subscription notifications and log messages can arrive at any time */
+static int
+is_unilateral(proto_t obj)
+{
+    return proto_is_object(obj) &&
+        (proto_is_true(proto_object_get(obj, "unilateral")) ||
+         !proto_is_null(proto_object_get(obj, "subscription")) ||
+         !proto_is_null(proto_object_get(obj, "log")));
+}
+
+/* Keeps 'obj' for watchman_read_notification() if it is unilateral.
+ * Returns 1 if it was taken. */
+static int
+set_aside_unilateral(struct watchman_connection *conn, proto_t obj)
+{
+    if (proto_is_null(obj) || !is_unilateral(obj)) {
+        return 0;
+    }
+    struct watchman_session *session = conn_session(conn);
+    if (session && session->nr_pending == session->cap_pending) {
+        int cap = session->cap_pending ? session->cap_pending * 2 : 8;
+        proto_t *pending = realloc(session->pending, cap * sizeof(*pending));
+        if (pending) {
+            session->pending = pending;
+            session->cap_pending = cap;
+        }
+    }
+    if (!session || session->nr_pending == session->cap_pending) {
+        /* Losing a notification beats mistaking it for the response */
+        proto_free(obj);
+        return 1;
+    }
+    session->pending[session->nr_pending++] = obj;
+    return 1;
+}
 
+/* Reads the response to a command, setting unilateral PDUs aside */
+static proto_t
+read_reply(struct watchman_connection *conn, const struct timespec *deadline,
+           struct watchman_error *error)
+{
+    proto_t obj;
+    do {
+        obj = read_response(conn, 1, deadline, error);
+    } while (set_aside_unilateral(conn, obj));
+    return obj;
+}
+
+static struct watchman_root_state *
+session_root(struct watchman_session *session, const char *root,
+             const char *relative_root, int create)
+{
     int i;
-    for (i = 0; i < nr; ++i) {
-        struct watchman_stat *stat = res->stats + i;
-        proto_t statobj = proto_array_get(files, i);
-        if (proto_is_string(statobj)) {
-            /* then hopefully we only requested names */
-            stat->name = proto_strdup(statobj);
-            res->nr++;
+    for (i = 0; i < session->nr_roots; ++i) {
+        struct watchman_root_state *state = &session->roots[i];
+        if (!strcmp(state->root, root) &&
+            (state->relative_root == relative_root ||
+             (state->relative_root && relative_root &&
+              !strcmp(state->relative_root, relative_root)))) {
+            return state;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if (session->nr_roots == session->cap_roots) {
+        int cap = session->cap_roots ? session->cap_roots * 2 : 4;
+        struct watchman_root_state *roots =
+            realloc(session->roots, cap * sizeof(*roots));
+        if (!roots) {
+            return NULL;
+        }
+        session->roots = roots;
+        session->cap_roots = cap;
+    }
+    struct watchman_root_state *state = &session->roots[session->nr_roots++];
+    memset(state, 0, sizeof(*state));
+    state->root = strdup(root);
+    state->relative_root = relative_root ? strdup(relative_root) : NULL;
+    return state;
+}
+
+static void
+free_session(struct watchman_session *session)
+{
+    int i;
+    if (!session) {
+        return;
+    }
+    for (i = 0; i < session->nr_roots; ++i) {
+        free(session->roots[i].root);
+        free(session->roots[i].relative_root);
+        free(session->roots[i].clock);
+    }
+    free(session->roots);
+    for (i = 0; i < session->nr_subs; ++i) {
+        free(session->subs[i].root);
+        free(session->subs[i].resolved);
+        free(session->subs[i].name);
+        json_decref(session->subs[i].cmd);
+    }
+    free(session->subs);
+    for (i = 0; i < session->nr_pending; ++i) {
+        proto_free(session->pending[i]);
+    }
+    free(session->pending);
+    free(session);
+}
+
+/* Closes the socket and forgets anything read from it */
+static void
+conn_drop_socket(struct watchman_connection *conn)
+{
+    if (conn_transport(conn)->close) {
+        conn_transport(conn)->close(conn);
+    }
+    conn->transport = NULL;
+    conn->transport_data = NULL;
+    if (conn->fp) {
+        fclose(conn->fp);
+        conn->fp = NULL;
+    }
+    conn->rbuf_start = conn->rbuf_end = 0;
+}
+
+static int
+check_response(proto_t obj, struct watchman_error *error);
+
+/*
+ * Replaces a lost socket with a new connection, waiting between attempts
+ * as the policy says, and watches the roots that were watched before.
+ */
+static int
+reconnect(struct watchman_connection *conn, const struct timespec *deadline,
+          struct watchman_error *error)
+{
+    struct watchman_session *session = conn->session;
+    const struct watchman_reconnect_policy *policy = &session->policy;
+    struct timeval *timeouts = session->timeouts;
+    socklen_t len = sizeof(timeouts[0]);
+    int use_io_uring = conn->transport != NULL;
+    unsigned delay = policy->initial_delay_ms;
+    unsigned attempt;
+
+    /* Socket timeouts from watchman_connect() carry over, even past a
+     * reconnect that failed and left no socket to read them from */
+    if (conn->fp && !session->has_timeouts &&
+        getsockopt(fileno(conn->fp), SOL_SOCKET, SO_RCVTIMEO, &timeouts[0],
+                   &len) == 0 &&
+        getsockopt(fileno(conn->fp), SOL_SOCKET, SO_SNDTIMEO, &timeouts[1],
+                   &len) == 0) {
+        session->has_timeouts = 1;
+    }
+    conn_drop_socket(conn);
+
+    for (attempt = 0; !policy->max_attempts || attempt < policy->max_attempts;
+         ++attempt) {
+        struct watchman_error attempt_error;
+        int i;
+
+        if (attempt > 0) {
+            int left = deadline_remaining_ms(deadline);
+            if (left == 0) {
+                break;
+            }
+            poll(NULL, 0, left < 0 || (unsigned)left > delay ? (int)delay
+                                                              : left);
+            delay = delay * 2 < policy->max_delay_ms ? delay * 2
+                                                     : policy->max_delay_ms;
+        }
+        trace("Reconnecting to watchman, attempt %u", attempt + 1);
+
+        attempt_error.message = NULL;
+        struct watchman_connection *fresh =
+            connect_impl(NULL, deadline, &attempt_error);
+        if (!fresh) {
+            watchman_release_error(&attempt_error);
             continue;
         }
+        conn->fp = fresh->fp;
+        free(fresh);
+        if (session->has_timeouts) {
+            setsockopt(fileno(conn->fp), SOL_SOCKET, SO_RCVTIMEO,
+                       &timeouts[0], sizeof(timeouts[0]));
+            setsockopt(fileno(conn->fp), SOL_SOCKET, SO_SNDTIMEO,
+                       &timeouts[1], sizeof(timeouts[1]));
+        }
+        if (use_io_uring) {
+            watchman_io_uring_attach(conn);
+        }
 
-        PROTO_ASSERT(proto_is_object, statobj, "must be object: %s");
+        session->lost = 0;
+        for (i = 0; i < session->nr_roots && !session->lost; ++i) {
+            if (!session->roots[i].watched) {
+                continue;
+            }
+            json_t *cmd = simple_command("watch", session->roots[i].root,
+                                         NULL);
+            proto_t obj = proto_null();
+            if (!watchman_send_deadline(conn, cmd, deadline, &attempt_error)) {
+                obj = read_reply(conn, deadline, &attempt_error);
+            }
+            json_decref(cmd);
+            if (!proto_is_null(obj)) {
+                check_response(obj, &attempt_error);
+            }
+            watchman_release_error(&attempt_error);
+            attempt_error.message = NULL;
+        }
+        /* Subscriptions pick up from the last clock delivered */
+        for (i = 0; i < session->nr_subs && !session->lost; ++i) {
+            proto_t obj = proto_null();
+            if (!watchman_send_deadline(conn, session->subs[i].cmd, deadline,
+                                        &attempt_error)) {
+                obj = read_reply(conn, deadline, &attempt_error);
+            }
+            if (!proto_is_null(obj)) {
+                check_response(obj, &attempt_error);
+            }
+            watchman_release_error(&attempt_error);
+            attempt_error.message = NULL;
+        }
+        if (!session->lost) {
+            return 0;
+        }
+        conn_drop_socket(conn);
+    }
 
-        proto_t name = proto_object_get(statobj, "name");
-        PROTO_ASSERT(proto_is_string, name, "name must be string: %s");
-        stat->name = proto_strdup(name);
+    watchman_err(error, WATCHMAN_ERR_CONNECT,
+                 "Could not reconnect to watchman after %u attempts",
+                 attempt);
+    return 1;
+}
 
-        WRITE_BOOL_STAT(stat, statobj, exists);
-        WRITE_INT_STAT(stat, statobj, ctime);
-        WRITE_INT_STAT(stat, statobj, ctime_ms);
-        WRITE_INT_STAT(stat, statobj, ctime_us);
-        WRITE_INT_STAT(stat, statobj, ctime_ns);
-        WRITE_INT_STAT(stat, statobj, dev);
-        WRITE_INT_STAT(stat, statobj, gid);
-        WRITE_INT_STAT(stat, statobj, ino);
-        WRITE_INT_STAT(stat, statobj, mode);
-        WRITE_INT_STAT(stat, statobj, mtime);
-        WRITE_INT_STAT(stat, statobj, mtime_ms);
-        WRITE_INT_STAT(stat, statobj, mtime_us);
-        WRITE_INT_STAT(stat, statobj, mtime_ns);
-        WRITE_INT_STAT(stat, statobj, nlink);
-        WRITE_INT_STAT(stat, statobj, size);
-        WRITE_INT_STAT(stat, statobj, uid);
+/*
+ * Sends 'cmd' and reads the response, bounded by 'deadline' or, for the
+ * legacy API, 'timeout'.  If the connection is lost and reconnecting is
+ * enabled, reconnects and tries once more.
+ */
+static proto_t
+watchman_roundtrip(struct watchman_connection *conn, json_t *cmd,
+                   struct timeval *timeout, const struct timespec *deadline,
+                   struct watchman_error *error)
+{
+    int attempt;
+
+    for (attempt = 0; ; ++attempt) {
+        proto_t obj = proto_null();
+
+        if (conn_lost(conn)) {
+            watchman_err(error, WATCHMAN_ERR_CONNECT,
+                         "Connection to watchman lost");
+        } else if (!watchman_send_deadline(conn, cmd, deadline, error)) {
+            do {
+                obj = deadline ? read_response(conn, 1, deadline, error)
+                               : watchman_read_with_timeout(conn, timeout,
+                                                            error);
+            } while (set_aside_unilateral(conn, obj));
+            if (!proto_is_null(obj)) {
+                return obj;
+            }
+        }
+        struct watchman_session *session = conn->session;
+        if (attempt > 0 || !session || !session->reconnect ||
+            !conn_lost(conn)) {
+            return obj;
+        }
+        if (error) {
+            watchman_release_error(error);
+            error->message = NULL;
+        }
+        if (reconnect(conn, deadline, error)) {
+            return proto_null();
+        }
+    }
+}
 
-        WRITE_STR_STAT(stat, statobj, cclock);
-        WRITE_STR_STAT(stat, statobj, oclock);
+/* Checks a response for an error reported by watchman, keeping it */
+static int
+response_error(proto_t obj, struct watchman_error *error)
+{
+    if (!proto_is_object(obj)) {
+        char *bogus_text = proto_dumps(obj);
+        watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
+                     "Got non-object result from watchman : %s",
+                     bogus_text);
+        free(bogus_text);
+        return 1;
+    }
+    proto_t error_node = proto_object_get(obj, "error");
+    if (!proto_is_null(error_node)) {
+        char *message = proto_strdup(error_node);
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "Got error result from watchman : %s", message);
+        free(message);
+        return 1;
+    }
+    return 0;
+}
 
-        WRITE_FLOAT_STAT(stat, statobj, ctime_f);
-        WRITE_FLOAT_STAT(stat, statobj, mtime_f);
+/* As response_error(), but frees the response either way */
+static int
+check_response(proto_t obj, struct watchman_error *error)
+{
+    int ret = response_error(obj, error);
+    proto_free(obj);
+    return ret;
+}
 
-        /* the one we have to do manually because we don't
-         * want to use the name "new" */
-        proto_t newer = proto_object_get(statobj, "new");
-        if (!proto_is_null(newer)) {
-            stat->newer = proto_is_true(newer);
+struct watchman_response {
+    proto_t proto;
+};
+
+int
+watchman_command_raw(struct watchman_connection *conn, json_t *request,
+                     struct watchman_response **response,
+                     const struct timespec *deadline,
+                     struct watchman_error *error)
+{
+    *response = NULL;
+    proto_t obj = watchman_roundtrip(conn, request, NULL, deadline, error);
+    if (proto_is_null(obj)) {
+        return 1;
+    }
+    *response = malloc(sizeof(**response));
+    if (*response == NULL) {
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "Out of memory for watchman response");
+        proto_free(obj);
+        return 1;
+    }
+    (*response)->proto = obj;
+    return 0;
+}
+
+int
+watchman_command(struct watchman_connection *conn, json_t *request,
+                 struct watchman_response **response,
+                 const struct timespec *deadline,
+                 struct watchman_error *error)
+{
+    if (watchman_command_raw(conn, request, response, deadline, error)) {
+        return 1;
+    }
+    if (response_error((*response)->proto, error)) {
+        watchman_free_response(*response);
+        *response = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+bser_t *
+watchman_response_bser(struct watchman_response *response)
+{
+    return response->proto.bser;
+}
+
+void
+watchman_free_response(struct watchman_response *response)
+{
+    proto_free(response->proto);
+    free(response);
+}
+
+/* Runs a command made of 'name' and 'path', ignoring the response
+ * unless it reports an error */
+static int
+watchman_simple_roundtrip(struct watchman_connection *conn, const char *name,
+                          const char *path, const struct timespec *deadline,
+                          struct watchman_error *error)
+{
+    json_t *cmd = simple_command(name, path, NULL);
+    proto_t obj = watchman_roundtrip(conn, cmd, NULL, deadline, error);
+    json_decref(cmd);
+    if (proto_is_null(obj)) {
+        return 1;
+    }
+    return check_response(obj, error);
+}
+
+int
+watchman_watch_deadline(struct watchman_connection *conn, const char *path,
+                        const struct timespec *deadline,
+                        struct watchman_error *error)
+{
+    if (watchman_simple_roundtrip(conn, "watch", path, deadline, error)) {
+        return 1;
+    }
+    struct watchman_session *session = conn_session(conn);
+    struct watchman_root_state *state =
+        session ? session_root(session, path, NULL, 1) : NULL;
+    if (state) {
+        state->watched = 1;
+    }
+    return 0;
+}
+
+int
+watchman_watch(struct watchman_connection *conn,
+               const char *path, struct watchman_error *error)
+{
+    return watchman_watch_deadline(conn, path, NULL, error);
+}
+
+#define WATCHMAN_DEFAULT_IN_FLIGHT 64
+
+/* Whether a response can be read without waiting */
+static int
+conn_readable_now(struct watchman_connection *conn)
+{
+    struct pollfd pfd;
+
+    if (conn_has_input(conn)) {
+        return 1;
+    }
+    pfd.fd = fileno(conn->fp);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Reads the root (and, for watch-project, the relative path) from the
+ * response to watching 'path', and records the root as watched.  Frees
+ * 'obj'.  Returns 1 with 'error' filled in if the watch failed.
+ */
+static int
+watch_result(struct watchman_connection *conn, const char *path,
+             int project, proto_t obj, struct watchman_watch_result *result,
+             struct watchman_error *error)
+{
+    result->root = NULL;
+    result->relative_path = NULL;
+    if (proto_is_object(obj)) {
+        proto_t watch = proto_object_get(obj, "watch");
+        proto_t relative_path = proto_object_get(obj, "relative_path");
+        if (proto_is_string(watch)) {
+            result->root = proto_strdup(watch);
         }
-        res->nr++;
+        if (proto_is_string(relative_path)) {
+            result->relative_path = proto_strdup(relative_path);
+        }
+    }
+    if (check_response(obj, error)) {
+        goto fail;
+    }
+    if (!result->root) {
+        if (project) {
+            watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
+                         "Got no root from watchman watch-project");
+            goto fail;
+        }
+        result->root = strdup(path);
     }
 
-    proto_t version = proto_object_get(obj, "version");
-    PROTO_ASSERT(proto_is_string, version, "Bad version %s");
-    res->version = proto_strdup(version);
+    /* A project is re-established by watching its root */
+    struct watchman_session *session = conn_session(conn);
+    struct watchman_root_state *state =
+        session ? session_root(session, project ? result->root : path,
+                               NULL, 1)
+                : NULL;
+    if (state) {
+        state->watched = 1;
+    }
+    return 0;
+
+fail:
+    free(result->root);
+    free(result->relative_path);
+    result->root = NULL;
+    result->relative_path = NULL;
+    return 1;
+}
+
+static int
+watch_many_impl(struct watchman_connection *conn, int project,
+                const char *const *paths, int nr,
+                struct watchman_watch_result *results,
+                int max_in_flight, const struct timespec *deadline)
+{
+    const char *command = project ? "watch-project" : "watch";
+    struct watchman_error error;
+    int sent = 0, done = 0, failed = 0, reconnected = 0;
+
+    memset(results, 0, nr * sizeof(*results));
+    if (max_in_flight <= 0) {
+        max_in_flight = WATCHMAN_DEFAULT_IN_FLIGHT;
+    }
+
+    while (done < nr) {
+        error.message = NULL;
+        if (conn_lost(conn)) {
+            watchman_err(&error, WATCHMAN_ERR_CONNECT,
+                         "Connection to watchman lost");
+        } else if (sent < nr && sent - done < max_in_flight &&
+                   (sent == done || !conn_readable_now(conn))) {
+            /* Responses are taken as they arrive, so that neither side
+             * blocks on a full socket buffer */
+            json_t *cmd = simple_command(command, paths[sent], NULL);
+            int bad = watchman_send_deadline(conn, cmd, deadline, &error);
+            json_decref(cmd);
+            if (!bad) {
+                sent++;
+                continue;
+            }
+        } else {
+            proto_t obj = read_reply(conn, deadline, &error);
+            if (!proto_is_null(obj)) {
+                failed += watch_result(conn, paths[done], project, obj,
+                                       &results[done], &results[done].error);
+                done++;
+                continue;
+            }
+        }
+
+        /* Unanswered requests can be sent again on a new connection */
+        struct watchman_session *session = conn->session;
+        if (!reconnected && session && session->reconnect &&
+            conn_lost(conn)) {
+            reconnected = 1;
+            watchman_release_error(&error);
+            error.message = NULL;
+            if (!reconnect(conn, deadline, &error)) {
+                sent = done;
+                continue;
+            }
+        }
+        for (; done < nr; ++done, ++failed) {
+            results[done].error = error;
+            results[done].error.message =
+                error.message ? strdup(error.message) : NULL;
+        }
+        watchman_release_error(&error);
+    }
+    return failed;
+}
+
+int
+watchman_watch_many(struct watchman_connection *conn,
+                    const char *const *paths, int nr,
+                    struct watchman_watch_result *results,
+                    int max_in_flight, const struct timespec *deadline)
+{
+    return watch_many_impl(conn, 0, paths, nr, results, max_in_flight,
+                           deadline);
+}
+
+int
+watchman_watch_project_many(struct watchman_connection *conn,
+                            const char *const *paths, int nr,
+                            struct watchman_watch_result *results,
+                            int max_in_flight,
+                            const struct timespec *deadline)
+{
+    return watch_many_impl(conn, 1, paths, nr, results, max_in_flight,
+                           deadline);
+}
+
+void
+watchman_release_watch_results(struct watchman_watch_result *results,
+                               int nr)
+{
+    int i;
+    for (i = 0; i < nr; ++i) {
+        free(results[i].root);
+        results[i].root = NULL;
+        free(results[i].relative_path);
+        results[i].relative_path = NULL;
+        watchman_release_error(&results[i].error);
+        results[i].error.message = NULL;
+    }
+}
+
+int
+watchman_recrawl(struct watchman_connection *conn,
+               const char *path, struct watchman_error *error)
+{
+    return watchman_simple_roundtrip(conn, "debug-recrawl", path, NULL, error);
+}
+
+int
+watchman_watch_del(struct watchman_connection *conn,
+                   const char *path, struct watchman_error *error)
+{
+    if (watchman_simple_roundtrip(conn, "watch-del", path, NULL, error)) {
+        return 1;
+    }
+    struct watchman_root_state *state =
+        conn->session ? session_root(conn->session, path, NULL, 0) : NULL;
+    if (state) {
+        state->watched = 0;
+    }
+    return 0;
+}
+
+struct watchman_watch_project *
+watchman_watch_project_deadline(struct watchman_connection *conn,
+                                const char *path,
+                                const struct timespec *deadline,
+                                struct watchman_error *error)
+{
+    struct watchman_watch_result result;
+
+    json_t *cmd = simple_command("watch-project", path, NULL);
+    proto_t obj = watchman_roundtrip(conn, cmd, NULL, deadline, error);
+    json_decref(cmd);
+    if (proto_is_null(obj) ||
+        watch_result(conn, path, 1, obj, &result, error)) {
+        return NULL;
+    }
+    struct watchman_watch_project *project = malloc(sizeof(*project));
+    if (!project) {
+        free(result.root);
+        free(result.relative_path);
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return NULL;
+    }
+    project->root = result.root;
+    project->relative_path = result.relative_path;
+    return project;
+}
+
+struct watchman_watch_project *
+watchman_watch_project(struct watchman_connection *conn,
+                       const char *path, struct watchman_error *error)
+{
+    return watchman_watch_project_deadline(conn, path, NULL, error);
+}
+
+int
+watchman_connection_enable_reconnect(
+    struct watchman_connection *conn,
+    const struct watchman_reconnect_policy *policy)
+{
+    struct watchman_session *session = conn_session(conn);
+    if (!session) {
+        return 1;
+    }
+    if (policy) {
+        session->policy = *policy;
+    } else {
+        session->policy.initial_delay_ms = 100;
+        session->policy.max_delay_ms = 5000;
+        session->policy.max_attempts = 8;
+    }
+    if (session->policy.max_delay_ms < session->policy.initial_delay_ms) {
+        session->policy.max_delay_ms = session->policy.initial_delay_ms;
+    }
+    session->reconnect = 1;
+    return 0;
+}
+
+static struct watchman_expression *
+alloc_expr(enum watchman_expression_type ty)
+{
+    struct watchman_expression *expr;
+    expr = calloc(1, sizeof(*expr));
+    expr->ty = ty;
+    return expr;
+}
+
+struct watchman_expression *
+watchman_since_expression(const char *since, enum watchman_clockspec spec)
+{
+    assert(since);
+    struct watchman_expression *expr = alloc_expr(WATCHMAN_EXPR_TY_SINCE);
+    expr->e.since_expr.is_str = 1;
+    expr->e.since_expr.t.since = strdup(since);
+    expr->e.since_expr.clockspec = spec;
+    return expr;
+}
+
+struct watchman_expression *
+watchman_since_expression_time_t(time_t time, enum watchman_clockspec
+                                 spec)
+{
+    struct watchman_expression *expr = alloc_expr(WATCHMAN_EXPR_TY_SINCE);
+    expr->e.since_expr.is_str = 0;
+    expr->e.since_expr.t.time = time;
+    expr->e.since_expr.clockspec = spec;
+    return expr;
+}
+
+/* corresponds to enum watchman_expression_type */
+static char *ty_str[] = {
+    "allof",
+    "anyof",
+    "not",
+    "true",
+    "false",
+    "since",
+    "suffix",
+    "match",
+    "imatch",
+    "pcre",
+    "ipcre",
+    "name",
+    "iname",
+    "type",
+    "empty",
+    "exists"
+};
+
+/* corresponds to enum watchman_clockspec */
+static char *clockspec_str[] = {
+    NULL,
+    "oclock",
+    "cclock",
+    "mtime",
+    "ctime"
+};
+
+/* corresponds to enum watchman_basename */
+static char *basename_str[] = {
+    NULL,
+    "basename",
+    "wholename"
+};
+
+static json_t *
+json_string_from_char(char c)
+{
+    char str[2] = { c, 0 };
+    return json_string(str);
+}
+
+static json_t *
+json_string_or_array(int nr, char **items)
+{
+    if (nr == 1) {
+        return json_string(items[0]);
+    }
+    json_t *result = json_array();
+    int i;
+    for (i = 0; i < nr; ++i) {
+        json_array_append_new(result, json_string(items[i]));
+    }
+    return result;
+}
+
+static void
+since_to_json(json_t *result, const struct watchman_expression *expr)
+{
+    if (expr->e.since_expr.is_str) {
+        json_array_append_new(result, json_string(expr->e.since_expr.t.since));
+    } else {
+        json_array_append_new(result, json_integer(expr->e.since_expr.t.time));
+    }
+    if (expr->e.since_expr.clockspec) {
+        char *clockspec = clockspec_str[expr->e.since_expr.clockspec];
+        json_array_append_new(result, json_string(clockspec));
+    }
+}
+
+static json_t *
+to_json(const struct watchman_expression *expr)
+{
+    json_t *result = json_array();
+    json_t *arg;
+    json_array_append_new(result, json_string(ty_str[expr->ty]));
+
+    int i;
+    switch (expr->ty) {
+        case WATCHMAN_EXPR_TY_ALLOF:
+            /*-fallthrough*/
+        case WATCHMAN_EXPR_TY_ANYOF:
+            for (i = 0; i < expr->e.union_expr.nr; ++i) {
+                json_array_append_new(result,
+                                      to_json(expr->e.union_expr.clauses[i]));
+            }
+            break;
+        case WATCHMAN_EXPR_TY_NOT:
+            json_array_append_new(result, to_json(expr->e.not_expr.clause));
+            break;
+        case WATCHMAN_EXPR_TY_TRUE:
+            /*-fallthrough*/
+        case WATCHMAN_EXPR_TY_FALSE:
+            /*-fallthrough*/
+        case WATCHMAN_EXPR_TY_EMPTY:
+            /*-fallthrough*/
+        case WATCHMAN_EXPR_TY_EXISTS:
+            /* Nothing to do */
+            break;
+
+        case WATCHMAN_EXPR_TY_SINCE:
+            since_to_json(result, expr);
+            break;
+        case WATCHMAN_EXPR_TY_SUFFIX:
+            json_array_append_new(result,
+                                  json_string(expr->e.suffix_expr.suffix));
+            break;
+        case WATCHMAN_EXPR_TY_MATCH:
+                                   /*-fallthrough*/
+        case WATCHMAN_EXPR_TY_IMATCH:
+            /*-fallthrough*/
+        case WATCHMAN_EXPR_TY_PCRE:
+            /*-fallthrough*/
+        case WATCHMAN_EXPR_TY_IPCRE:
+            json_array_append_new(result,
+                                  json_string(expr->e.match_expr.match));
+            if (expr->e.match_expr.basename) {
+                char *base = basename_str[expr->e.match_expr.basename];
+                json_array_append_new(result, json_string(base));
+            }
+            break;
+        case WATCHMAN_EXPR_TY_NAME:
+            /*-fallthrough*/
+        case WATCHMAN_EXPR_TY_INAME:
+            arg =
+                json_string_or_array(expr->e.name_expr.nr,
+                                     expr->e.name_expr.names);
+            json_array_append_new(result, arg);
+            if (expr->e.name_expr.basename) {
+                char *base = basename_str[expr->e.name_expr.basename];
+                json_array_append_new(result, json_string(base));
+            }
+            break;
+        case WATCHMAN_EXPR_TY_TYPE:
+            json_array_append_new(result,
+                                  json_string_from_char(expr->e.
+                                                        type_expr.type));
+    }
+    return result;
+}
+
+/* corresponds to enum watchman_fields */
+static char *fields_str[] = {
+    "name",
+    "exists",
+    "cclock",
+    "oclock",
+    "ctime",
+    "ctime_ms",
+    "ctime_us",
+    "ctime_ns",
+    "ctime_f",
+    "mtime",
+    "mtime_ms",
+    "mtime_us",
+    "mtime_ns",
+    "mtime_f",
+    "size",
+    "uid",
+    "gid",
+    "ino",
+    "dev",
+    "nlink",
+    "new",
+    "mode"
+};
+
+json_t *
+fields_to_json(int fields)
+{
+    json_t *result = json_array();
+    int i = 0;
+    int mask;
+    for (mask = 1; mask < WATCHMAN_FIELD_END; mask *= 2) {
+        if (fields & mask) {
+            json_array_append_new(result, json_string(fields_str[i]));
+        }
+        ++i;
+    }
+    return result;
+}
+
+/*
+ * The representations of ctime and of mtime are consecutive fields, from
+ * seconds to float.  When more than one representation of a time is
+ * asked for, only its nanoseconds are requested from watchman, and the
+ * others are computed from them on decoding (see derive_time()), so that
+ * each file does not carry the same time several times over.
+ */
+enum {
+    TIME_SEC = 0x01,
+    TIME_MS = 0x02,
+    TIME_US = 0x04,
+    TIME_NS = 0x08,
+    TIME_F = 0x10,
+    TIME_ALL = 0x1f
+};
+
+static int
+plan_time(int fields, int first)
+{
+    int wanted = (fields / first) & TIME_ALL;
+    if (wanted & (wanted - 1)) {
+        fields &= ~(TIME_ALL * first);
+        fields |= TIME_NS * first;
+    }
+    return fields;
+}
+
+/* The fields to request from watchman in order to fill in 'fields' */
+static int
+wire_fields(int fields)
+{
+    fields = plan_time(fields, WATCHMAN_FIELD_CTIME);
+    return plan_time(fields, WATCHMAN_FIELD_MTIME);
+}
+
+static int64_t
+floor_div(int64_t n, int64_t d)
+{
+    return n / d - (n % d < 0);
+}
+
+/* Computes the representations in 'wanted' from the nanoseconds, the
+ * way watchman does (rounding towards earlier times) */
+static void
+derive_time(int wanted, int64_t *ns, time_t *sec, int64_t *ms, int64_t *us,
+            double *f)
+{
+    int64_t s = floor_div(*ns, 1000000000);
+    if (wanted & TIME_SEC) {
+        *sec = s;
+    }
+    if (wanted & TIME_MS) {
+        *ms = floor_div(*ns, 1000000);
+    }
+    if (wanted & TIME_US) {
+        *us = floor_div(*ns, 1000);
+    }
+    if (wanted & TIME_F) {
+        *f = s + (*ns - s * 1000000000) / 1e9;
+    }
+    if (!(wanted & TIME_NS)) {
+        *ns = 0;
+    }
+}
+
+/* Fills in what wire_fields() left out of 'fields' */
+static void
+derive_times(struct watchman_stat *stat, int fields)
+{
+    if (plan_time(fields, WATCHMAN_FIELD_CTIME) != fields) {
+        derive_time((fields / WATCHMAN_FIELD_CTIME) & TIME_ALL,
+                    &stat->ctime_ns, &stat->ctime, &stat->ctime_ms,
+                    &stat->ctime_us, &stat->ctime_f);
+    }
+    if (plan_time(fields, WATCHMAN_FIELD_MTIME) != fields) {
+        derive_time((fields / WATCHMAN_FIELD_MTIME) & TIME_ALL,
+                    &stat->mtime_ns, &stat->mtime, &stat->mtime_ms,
+                    &stat->mtime_us, &stat->mtime_f);
+    }
+}
+
+#define PROTO_ASSERT(cond, condarg, msg)                                \
+    if (!cond(condarg)) {                                               \
+        char *dump = proto_dumps(condarg);                              \
+        watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN, msg, dump);   \
+        free(dump);                                                     \
+        goto done;                                                      \
+    }
+
+struct watchman_watch_list *
+watchman_watch_list(struct watchman_connection *conn,
+                    struct watchman_error *error)
+{
+    struct watchman_watch_list *res = NULL;
+    struct watchman_watch_list *result = NULL;
+    json_t *cmd = simple_command("watch-list", NULL);
+    proto_t obj = watchman_roundtrip(conn, cmd, NULL, NULL, error);
+    json_decref(cmd);
+    if (proto_is_null(obj)) {
+        return NULL;
+    }
+    PROTO_ASSERT(proto_is_object, obj, "Got bogus value from watch-list %s");
+    proto_t roots = proto_object_get(obj, "roots");
+    PROTO_ASSERT(proto_is_array, roots, "Got bogus value from watch-list %s");
+
+    res = malloc(sizeof(*res));
+    int nr = proto_array_size(roots);
+    res->nr = 0;
+    res->roots = calloc(nr, sizeof(*res->roots));
+    int i;
+    for (i = 0; i < nr; ++i) {
+        proto_t root = proto_array_get(roots, i);
+        PROTO_ASSERT(proto_is_string, root,
+                    "Got non-string root from watch-list %s");
+        res->nr++;
+        res->roots[i] = proto_strdup(root);
+    }
+    result = res;
+    res = NULL;
+done:
+    if (res) {
+        watchman_free_watch_list(res);
+    }
+    proto_free(obj);
+    return result;
+}
+
+#define WRITE_BOOL_STAT(stat, statobj, attr)                               \
+    proto_t attr = proto_object_get(statobj, #attr);                       \
+    if (!proto_is_null(attr)) {                                            \
+        PROTO_ASSERT(proto_is_boolean, attr, #attr " is not boolean: %s"); \
+        stat->attr = proto_is_true(attr);                                  \
+    }
+
+#define WRITE_INT_STAT(stat, statobj, attr)                               \
+    proto_t attr = proto_object_get(statobj, #attr);                      \
+    if (!proto_is_null(attr)) {                                           \
+        PROTO_ASSERT(proto_is_integer, attr, #attr " is not an int: %s"); \
+        stat->attr = proto_integer_value(attr);                           \
+    }
+
+#define WRITE_STR_STAT(stat, statobj, attr)                                \
+    proto_t attr = proto_object_get(statobj, #attr);                       \
+    if (!proto_is_null(attr)) {                                            \
+        PROTO_ASSERT(proto_is_string, attr, #attr " is not a string: %s"); \
+        stat->attr = proto_strdup(attr);                                   \
+    }
+
+#define WRITE_FLOAT_STAT(stat, statobj, attr)                           \
+    proto_t attr = proto_object_get(statobj, #attr);                    \
+    if (!proto_is_null(attr)) {                                         \
+        PROTO_ASSERT(proto_is_real, attr, #attr " is not a float: %s"); \
+        stat->attr = proto_real_value(attr);                            \
+    }
+
+char *
+watchman_clock_deadline(struct watchman_connection *conn,
+                        const char *path,
+                        unsigned int sync_timeout,
+                        const struct timespec *deadline,
+                        struct watchman_error *error)
+{
+    char *result = NULL;
+    json_t *query = json_array();
+    json_array_append_new(query, json_string("clock"));
+    json_array_append_new(query, json_string(path));
+    if (sync_timeout) {
+        json_t *options = json_object();
+        json_object_set_new(options, "sync_timeout", json_integer(sync_timeout));
+        json_array_append_new(query, options);
+    }
+
+    proto_t obj = watchman_roundtrip(conn, query, NULL, deadline, error);
+    json_decref(query);
+    if (proto_is_null(obj)) {
+        return NULL;
+    }
+    PROTO_ASSERT(proto_is_object, obj, "Got bogus value from clock %s");
+    proto_t clock = proto_object_get(obj, "clock");
+    PROTO_ASSERT(proto_is_string, clock, "Bad clock %s");
+    result = proto_strdup(clock);
+
+done:
+    proto_free(obj);
+    return result;
+}
+
+char *
+watchman_clock(struct watchman_connection *conn,
+               const char *path,
+               unsigned int sync_timeout,
+               struct watchman_error *error)
+{
+    return watchman_clock_deadline(conn, path, sync_timeout, NULL, error);
+}
+
+/* Reads the files, clock and version from a query result or a
+ * subscription notification for 'fields' */
+static struct watchman_query_result *
+parse_query_result(proto_t obj, int fields, struct watchman_error *error)
+{
+    struct watchman_query_result *result = NULL;
+    struct watchman_query_result *res = calloc(1, sizeof(*res));
+
+    proto_t files = proto_object_get(obj, "files");
+    PROTO_ASSERT(proto_is_array, files, "Bad files %s");
+
+    int nr = proto_array_size(files);
+    res->stats = calloc(nr, sizeof(*res->stats));
+
+    int i;
+    for (i = 0; i < nr; ++i) {
+        struct watchman_stat *stat = res->stats + i;
+        proto_t statobj = proto_array_get(files, i);
+        if (proto_is_string(statobj)) {
+            /* then hopefully we only requested names */
+            stat->name = proto_strdup(statobj);
+            res->nr++;
+            continue;
+        }
+
+        PROTO_ASSERT(proto_is_object, statobj, "must be object: %s");
+
+        proto_t name = proto_object_get(statobj, "name");
+        PROTO_ASSERT(proto_is_string, name, "name must be string: %s");
+        stat->name = proto_strdup(name);
+
+        WRITE_BOOL_STAT(stat, statobj, exists);
+        WRITE_INT_STAT(stat, statobj, ctime);
+        WRITE_INT_STAT(stat, statobj, ctime_ms);
+        WRITE_INT_STAT(stat, statobj, ctime_us);
+        WRITE_INT_STAT(stat, statobj, ctime_ns);
+        WRITE_INT_STAT(stat, statobj, dev);
+        WRITE_INT_STAT(stat, statobj, gid);
+        WRITE_INT_STAT(stat, statobj, ino);
+        WRITE_INT_STAT(stat, statobj, mode);
+        WRITE_INT_STAT(stat, statobj, mtime);
+        WRITE_INT_STAT(stat, statobj, mtime_ms);
+        WRITE_INT_STAT(stat, statobj, mtime_us);
+        WRITE_INT_STAT(stat, statobj, mtime_ns);
+        WRITE_INT_STAT(stat, statobj, nlink);
+        WRITE_INT_STAT(stat, statobj, size);
+        WRITE_INT_STAT(stat, statobj, uid);
+
+        WRITE_STR_STAT(stat, statobj, cclock);
+        WRITE_STR_STAT(stat, statobj, oclock);
+
+        WRITE_FLOAT_STAT(stat, statobj, ctime_f);
+        WRITE_FLOAT_STAT(stat, statobj, mtime_f);
+
+        /* the one we have to do manually because we don't
+         * want to use the name "new" */
+        proto_t newer = proto_object_get(statobj, "new");
+        if (!proto_is_null(newer)) {
+            stat->newer = proto_is_true(newer);
+        }
+        derive_times(stat, fields);
+        res->nr++;
+    }
+
+    proto_t version = proto_object_get(obj, "version");
+    PROTO_ASSERT(proto_is_string, version, "Bad version %s");
+    res->version = proto_strdup(version);
+
+    proto_t clock = proto_object_get(obj, "clock");
+    PROTO_ASSERT(proto_is_string, clock, "Bad clock %s");
+    res->clock = proto_strdup(clock);
+
+    proto_t fresh = proto_object_get(obj, "is_fresh_instance");
+    PROTO_ASSERT(proto_is_boolean, fresh, "Bad is_fresh_instance %s");
+    res->is_fresh_instance = proto_is_true(fresh);
+
+    result = res;
+    res = NULL;
+done:
+    if (res) {
+        watchman_free_query_result(res);
+    }
+    return result;
+}
+
+static struct watchman_query_result *
+watchman_query_json(struct watchman_connection *conn,
+                    json_t *query, int fields,
+                    struct timeval *timeout,
+                    const struct timespec *deadline,
+                    struct watchman_error *error)
+{
+    struct watchman_query_result *result = NULL;
+
+    proto_t obj = watchman_roundtrip(conn, query, timeout, deadline, error);
+    if (proto_is_null(obj)) {
+        return NULL;
+    }
+    PROTO_ASSERT(proto_is_object, obj, "Failed to send watchman query %s");
+
+    proto_t jerror = proto_object_get(obj, "error");
+    if (!proto_is_null(jerror)) {
+        char *message = proto_strdup(jerror);
+        watchman_err(error, WATCHMAN_ERR_WATCHMAN_REPORTED,
+                     "Error result from watchman: %s", message);
+        free(message);
+        goto done;
+    }
+    result = parse_query_result(obj, fields, error);
+done:
+    proto_free(obj);
+    return result;
+}
+
+struct watchman_query *
+watchman_query(void)
+{
+    struct watchman_query *result = calloc(1, sizeof(*result));
+    result->sync_timeout = -1;
+    return result;
+}
+
+void
+watchman_free_query(struct watchman_query *query)
+{
+    if (query->since_is_str) {
+        free(query->s.str);
+        query->s.str = NULL;
+    }
+    if (query->nr_suffixes) {
+        int i;
+        for (i = 0; i < query->nr_suffixes; ++i) {
+            free(query->suffixes[i]);
+            query->suffixes[i] = NULL;
+        }
+        free(query->suffixes);
+        query->suffixes = NULL;
+    }
+    if (query->nr_paths) {
+        int i;
+        for (i = 0; i < query->nr_paths; ++i) {
+            free(query->paths[i].path);
+            query->paths[i].path = NULL;
+        }
+        free(query->paths);
+        query->paths = NULL;
+    }
+    int i;
+    for (i = 0; i < query->nr_defer; ++i) {
+        free(query->defer[i]);
+    }
+    free(query->defer);
+    for (i = 0; i < query->nr_drop; ++i) {
+        free(query->drop[i]);
+    }
+    free(query->drop);
+    free(query->relative_root);
+    free(query);
+}
+
+void
+watchman_query_add_suffix(struct watchman_query *query, const char *suffix)
+{
+    assert(suffix);
+    if (query->cap_suffixes == query->nr_suffixes) {
+        if (query->nr_suffixes == 0) {
+            query->cap_suffixes = 10;
+        } else {
+            query->cap_suffixes *= 2;
+        }
+        int new_size = sizeof(*query->suffixes) * query->cap_suffixes;
+        query->suffixes = realloc(query->suffixes, new_size);
+    }
+    query->suffixes[query->nr_suffixes] = strdup(suffix);
+    query->nr_suffixes++;
+}
+
+void
+watchman_query_add_path(struct watchman_query *query, const char *path, int depth)
+{
+    if (query->cap_paths == query->nr_paths) {
+        if (query->nr_paths == 0) {
+            query->cap_paths = 10;
+        } else {
+            query->cap_paths *= 2;
+        }
+        int new_size = sizeof(*query->paths) * query->cap_paths;
+        query->paths = realloc(query->paths, new_size);
+    }
+    query->paths[query->nr_paths].path = strdup(path);
+    query->paths[query->nr_paths].depth = depth;
+    query->nr_paths++;
+}
+
+void
+watchman_query_set_since_oclock(struct watchman_query *query, const char *since)
+{
+    if (query->since_is_str) {
+        free(query->s.str);
+    }
+    query->since_is_str = 1;
+    query->s.str = strdup(since);
+}
+
+void
+watchman_query_set_since_time_t(struct watchman_query *query, time_t since)
+{
+    if (query->since_is_str) {
+        free(query->s.str);
+    }
+    query->since_is_str = 1;
+    query->s.time = since;
+}
+
+void
+watchman_query_set_fields(struct watchman_query *query, int fields)
+{
+    query->fields = fields;
+}
+
+void
+watchman_query_set_empty_on_fresh(struct watchman_query *query,
+                                  bool empty_on_fresh)
+{
+    query->empty_on_fresh = empty_on_fresh;
+}
+
+void
+watchman_query_set_relative_root(struct watchman_query *query,
+                                 const char *relative_root)
+{
+    free(query->relative_root);
+    query->relative_root = relative_root ? strdup(relative_root) : NULL;
+}
+
+static int
+add_state_name(char ***names, int *nr, int *cap, const char *state,
+               struct watchman_error *error)
+{
+    assert(state);
+    if (*cap == *nr) {
+        int new_cap = *cap ? *cap * 2 : 4;
+        char **grown = realloc(*names, sizeof(**names) * new_cap);
+        if (!grown) {
+            watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+            return -1;
+        }
+        *names = grown;
+        *cap = new_cap;
+    }
+    char *name = strdup(state);
+    if (!name) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return -1;
+    }
+    (*names)[(*nr)++] = name;
+    return 0;
+}
+
+int
+watchman_query_add_defer(struct watchman_query *query, const char *state,
+                         struct watchman_error *error)
+{
+    return add_state_name(&query->defer, &query->nr_defer,
+                          &query->cap_defer, state, error);
+}
+
+int
+watchman_query_add_drop(struct watchman_query *query, const char *state,
+                        struct watchman_error *error)
+{
+    return add_state_name(&query->drop, &query->nr_drop, &query->cap_drop,
+                          state, error);
+}
+
+static json_t *
+json_path(struct watchman_pathspec *spec)
+{
+    if (spec->depth == -1) {
+        return json_string(spec->path);
+    }
+
+    json_t *obj = json_object();
+    json_object_set_new(obj, "depth", json_integer(spec->depth));
+    json_object_set_new(obj, "path", json_string(spec->path));
+    return obj;
+}
+
+/* Builds the object that describes a query or subscription */
+static json_t *
+query_to_json(const struct watchman_query *query,
+              const struct watchman_expression *expr)
+{
+    json_t *obj = json_object();
+    json_object_set_new(obj, "expression", to_json(expr));
+    if (query) {
+        if (query->fields) {
+            json_object_set_new(obj, "fields",
+                                fields_to_json(wire_fields(query->fields)));
+        }
+
+        if (query->empty_on_fresh) {
+            json_object_set_new(obj, "empty_on_fresh_instance",
+                                json_true());
+        }
+
+        if (query->s.time) {
+            if (query->since_is_str) {
+                json_object_set_new(obj, "since", json_string(query->s.str));
+            } else {
+                json_t *since = json_integer(query->s.time);
+                json_object_set_new(obj, "since", since);
+            }
+        }
+
+        if (query->nr_suffixes) {
+            /* Note that even if you have only one suffix,
+             * watchman requires this to be an array. */
+            int i;
+            json_t *suffixes = json_array();
+            for (i = 0; i < query->nr_suffixes; ++i) {
+                json_array_append_new(suffixes,
+                                      json_string(query->suffixes[i]));
+            }
+            json_object_set_new(obj, "suffix", suffixes);
+        }
+        if (query->nr_paths) {
+            int i;
+            json_t *paths = json_array();
+            for (i = 0; i < query->nr_paths; ++i) {
+                json_array_append_new(paths, json_path(&query->paths[i]));
+            }
+            json_object_set_new(obj, "path", paths);
+        }
+
+        if (query->all) {
+            json_object_set_new(obj, "all", json_string("all"));
+        }
+
+        if (query->sync_timeout >= 0) {
+            json_object_set_new(obj, "sync_timeout",
+                                json_integer(query->sync_timeout));
+        }
+
+        if (query->relative_root) {
+            json_object_set_new(obj, "relative_root",
+                                json_string(query->relative_root));
+        }
+    }
+    return obj;
+}
+
+char *
+watchman_query_key(const char *fs_path, const struct watchman_query *query,
+                   const struct watchman_expression *expr)
+{
+    json_t *json = json_array();
+    json_array_append_new(json, json_string("query"));
+    json_array_append_new(json, json_string(fs_path));
+    json_t *obj = query_to_json(query, expr);
+    /* Results are decoded for the fields asked for, not those sent */
+    if (query && query->fields) {
+        json_object_set_new(obj, "fields", fields_to_json(query->fields));
+    }
+    json_array_append_new(json, obj);
+    char *key = json_dumps(json, JSON_COMPACT | JSON_SORT_KEYS);
+    json_decref(json);
+    return key;
+}
+
+/* Either 'timeout' (legacy, only bounding the wait for the first byte of
+ * the response) or 'deadline' may be given.  A non-NULL 'since' overrides
+ * the query's own. */
+static struct watchman_query_result *
+do_query_impl(struct watchman_connection *conn,
+              const char *fs_path,
+              const struct watchman_query *query,
+              const struct watchman_expression *expr,
+              const char *since,
+              struct timeval *timeout,
+              const struct timespec *deadline,
+              struct watchman_error *error)
+{
+    /* construct the json */
+    json_t *json = json_array();
+    json_array_append_new(json, json_string("query"));
+    json_array_append_new(json, json_string(fs_path));
+    json_t *obj = query_to_json(query, expr);
+    if (since) {
+        json_object_set_new(obj, "since", json_string(since));
+    }
+    json_array_append_new(json, obj);
+
+    /* do the query */
+    struct watchman_query_result *r =
+        watchman_query_json(conn, json, query ? query->fields : 0, timeout,
+                            deadline, error);
+    json_decref(json);
+    return r;
+}
+
+struct watchman_query_result *
+watchman_do_query_timeout(struct watchman_connection *conn,
+                          const char *fs_path,
+                          const struct watchman_query *query,
+                          const struct watchman_expression *expr,
+                          struct timeval *timeout,
+                          struct watchman_error *error)
+{
+    return do_query_impl(conn, fs_path, query, expr, NULL, timeout, NULL,
+                         error);
+}
+
+struct watchman_query_result *
+watchman_do_query_deadline(struct watchman_connection *conn,
+                           const char *fs_path,
+                           const struct watchman_query *query,
+                           const struct watchman_expression *expr,
+                           const struct timespec *deadline,
+                           struct watchman_error *error)
+{
+    return do_query_impl(conn, fs_path, query, expr, NULL, NULL, deadline,
+                         error);
+}
+
+struct watchman_query_result *
+watchman_query_changes(struct watchman_connection *conn,
+                       const char *fs_path,
+                       const struct watchman_query *query,
+                       const struct watchman_expression *expr,
+                       const struct timespec *deadline,
+                       struct watchman_error *error)
+{
+    /* Scopes within a root see different changes, so each has a clock */
+    const char *relative_root = query ? query->relative_root : NULL;
+    struct watchman_session *session = conn_session(conn);
+    struct watchman_root_state *state =
+        session ? session_root(session, fs_path, relative_root, 1) : NULL;
+    if (!state) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return NULL;
+    }
+
+    struct watchman_query_result *result =
+        do_query_impl(conn, fs_path, query, expr,
+                      state->clock, NULL, deadline, error);
+    if (result) {
+        /* The state may have moved if a reconnect added roots */
+        state = session_root(session, fs_path, relative_root, 0);
+        free(state->clock);
+        state->clock = strdup(result->clock);
+    }
+    return result;
+}
+
+struct watchman_query_result *
+watchman_do_query(struct watchman_connection *conn,
+                  const char *fs_path,
+                  const struct watchman_query *query,
+                  const struct watchman_expression *expr,
+                  struct watchman_error *error)
+{
+  struct timeval unused = {0};
+  return watchman_do_query_timeout(conn, fs_path, query, expr, &unused, error);
+}
+
+/* Returns the value of 'field' in 'row', trying column '*col' (where it
+ * was in the previous row) first.  The rows of a compact array share
+ * their columns, so each field is only searched for once. */
+static bser_t *
+row_field(bser_t *row, const char *field, int *col)
+{
+    int nr = bser_object_size(row);
+    int i;
+
+    if (*col < nr &&
+        !bser_string_strcmp(field, bser_object_key_at(row, *col))) {
+        return bser_object_value_at(row, *col);
+    }
+    for (i = 0; i < nr; ++i) {
+        if (!bser_string_strcmp(field, bser_object_key_at(row, i))) {
+            *col = i;
+            return bser_object_value_at(row, i);
+        }
+    }
+    return NULL;
+}
+
+static int
+bind_value(bser_t *value, enum watchman_bind_type type, void *dest)
+{
+    switch (type) {
+    case WATCHMAN_BIND_STRVIEW:
+        if (bser_is_string(value)) {
+            struct watchman_strview view;
+            view.data = bser_string_value(value, &view.len);
+            memcpy(dest, &view, sizeof(view));
+            return 0;
+        }
+        break;
+    case WATCHMAN_BIND_I64:
+        if (bser_is_integer(value)) {
+            int64_t i64 = bser_integer_value(value);
+            memcpy(dest, &i64, sizeof(i64));
+            return 0;
+        }
+        break;
+    case WATCHMAN_BIND_DOUBLE:
+        if (bser_is_real(value) || bser_is_integer(value)) {
+            double d = bser_is_real(value) ? bser_real_value(value)
+                                           : bser_integer_value(value);
+            memcpy(dest, &d, sizeof(d));
+            return 0;
+        }
+        break;
+    case WATCHMAN_BIND_BOOL:
+        if (bser_is_boolean(value)) {
+            bool b = bser_is_true(value);
+            memcpy(dest, &b, sizeof(b));
+            return 0;
+        }
+        break;
+    }
+    return 1;
+}
+
+/* Decodes the rows of 'files' into 'records' as 'bindings' lay out */
+static int
+bind_rows(bser_t *files, const struct watchman_binding *bindings,
+          int nr_bindings, size_t record_size, char *records,
+          struct watchman_error *error)
+{
+    int *cols = calloc(nr_bindings ? nr_bindings : 1, sizeof(*cols));
+    int nr = bser_array_size(files);
+    int i, j, ret = 1;
+
+    if (!cols) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return 1;
+    }
+
+    for (i = 0; i < nr; ++i) {
+        bser_t *row = bser_array_get(files, i);
+        char *record = records + i * record_size;
+        int names_only = bser_is_string(row);
+        if (!names_only && !bser_is_object(row)) {
+            watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
+                         "Got a file that is not an object");
+            goto done;
+        }
+        for (j = 0; j < nr_bindings; ++j) {
+            const struct watchman_binding *binding = &bindings[j];
+            bser_t *value;
+            if (names_only) {
+                /* Watchman sends bare names when only they are asked for */
+                value = strcmp(binding->field, "name") ? NULL : row;
+            } else {
+                value = row_field(row, binding->field, &cols[j]);
+            }
+            /* Missing from a compact row, or not applicable to the file */
+            if (!value || bser_is_null(value) || bser_is_no_field(value)) {
+                continue;
+            }
+            if (bind_value(value, binding->type, record + binding->offset)) {
+                watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
+                             "Field %s has the wrong type", binding->field);
+                goto done;
+            }
+        }
+    }
+    ret = 0;
+done:
+    free(cols);
+    return ret;
+}
+
+struct watchman_bound_result *
+watchman_do_query_bound(struct watchman_connection *conn,
+                        const char *fs_path,
+                        const struct watchman_query *query,
+                        const struct watchman_expression *expr,
+                        const struct watchman_binding *bindings,
+                        int nr_bindings, size_t record_size,
+                        const struct timespec *deadline,
+                        struct watchman_error *error)
+{
+    struct watchman_bound_result *result = NULL;
+    struct watchman_bound_result *res = NULL;
+    struct watchman_response *response;
+    int i;
+
+    json_t *fields = json_array();
+    for (i = 0; i < nr_bindings; ++i) {
+        json_array_append_new(fields, json_string(bindings[i].field));
+    }
+    json_t *obj = query_to_json(query, expr);
+    json_object_set_new(obj, "fields", fields);
+    json_t *cmd = simple_command("query", fs_path, NULL);
+    json_array_append_new(cmd, obj);
+    int failed = watchman_command(conn, cmd, &response, deadline, error);
+    json_decref(cmd);
+    if (failed) {
+        return NULL;
+    }
 
-    proto_t clock = proto_object_get(obj, "clock");
+    res = calloc(1, sizeof(*res));
+    if (!res) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        watchman_free_response(response);
+        return NULL;
+    }
+    res->response = response;
+    proto_t top = response->proto;
+    proto_t clock = proto_object_get(top, "clock");
     PROTO_ASSERT(proto_is_string, clock, "Bad clock %s");
     res->clock = proto_strdup(clock);
 
-    proto_t fresh = proto_object_get(obj, "is_fresh_instance");
+    proto_t fresh = proto_object_get(top, "is_fresh_instance");
     PROTO_ASSERT(proto_is_boolean, fresh, "Bad is_fresh_instance %s");
     res->is_fresh_instance = proto_is_true(fresh);
 
+    proto_t files = proto_object_get(top, "files");
+    PROTO_ASSERT(proto_is_array, files, "Bad files %s");
+    res->nr = proto_array_size(files);
+    res->records = calloc(res->nr ? res->nr : 1, record_size);
+    if (!res->records) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        goto done;
+    }
+    if (bind_rows(files.bser, bindings, nr_bindings, record_size,
+                  res->records, error)) {
+        goto done;
+    }
+
     result = res;
     res = NULL;
 done:
     if (res) {
-        watchman_free_query_result(res);
+        watchman_free_bound_result(res);
     }
-    proto_free(obj);
     return result;
 }
 
-struct watchman_query *
-watchman_query(void)
+static json_t *
+json_string_array(int nr, char **items)
 {
-    struct watchman_query *result = calloc(1, sizeof(*result));
-    result->sync_timeout = -1;
+    json_t *result = json_array();
+    int i;
+    for (i = 0; i < nr; ++i) {
+        json_array_append_new(result, json_string(items[i]));
+    }
     return result;
 }
 
-void
-watchman_free_query(struct watchman_query *query)
+static struct watchman_subscription_state *
+session_subscription(struct watchman_session *session, const char *root,
+                     const char *name)
 {
-    if (query->since_is_str) {
-        free(query->s.str);
-        query->s.str = NULL;
-    }
-    if (query->nr_suffixes) {
-        int i;
-        for (i = 0; i < query->nr_suffixes; ++i) {
-            free(query->suffixes[i]);
-            query->suffixes[i] = NULL;
-        }
-        free(query->suffixes);
-        query->suffixes = NULL;
-    }
-    if (query->nr_paths) {
-        int i;
-        for (i = 0; i < query->nr_paths; ++i) {
-            free(query->paths[i].path);
-            query->paths[i].path = NULL;
+    int i;
+    for (i = 0; i < session->nr_subs; ++i) {
+        struct watchman_subscription_state *sub = &session->subs[i];
+        if ((!root || !strcmp(sub->root, root) ||
+             !strcmp(sub->resolved, root)) && !strcmp(sub->name, name)) {
+            return sub;
         }
-        free(query->paths);
-        query->paths = NULL;
     }
-    free(query);
+    return NULL;
 }
 
-void
-watchman_query_add_suffix(struct watchman_query *query, const char *suffix)
+/* Finds the subscription that the caller named with 'root', which may be
+ * spelled differently from when it was subscribed */
+static struct watchman_subscription_state *
+caller_subscription(struct watchman_session *session, const char *root,
+                    const char *name)
 {
-    assert(suffix);
-    if (query->cap_suffixes == query->nr_suffixes) {
-        if (query->nr_suffixes == 0) {
-            query->cap_suffixes = 10;
-        } else {
-            query->cap_suffixes *= 2;
+    struct watchman_subscription_state *sub =
+        session_subscription(session, root, name);
+    if (!sub) {
+        char *real = realpath(root, NULL);
+        sub = real ? session_subscription(session, real, name) : NULL;
+        free(real);
+    }
+    return sub;
+}
+
+/* Remembers a subscription; takes 'cmd' */
+static void
+add_subscription(struct watchman_connection *conn, const char *root,
+                 const char *resolved, const char *name, json_t *cmd,
+                 int fields)
+{
+    struct watchman_session *session = conn_session(conn);
+    struct watchman_subscription_state *sub =
+        session ? session_subscription(session, resolved, name) : NULL;
+    char *resolved_copy = strdup(resolved);
+    if (!resolved_copy) {
+        json_decref(cmd);
+        return;
+    }
+    if (sub) {
+        free(sub->resolved);
+        sub->resolved = resolved_copy;
+        json_decref(sub->cmd);
+        sub->cmd = cmd;
+        sub->fields = fields;
+        return;
+    }
+    if (session && session->nr_subs == session->cap_subs) {
+        int cap = session->cap_subs ? session->cap_subs * 2 : 4;
+        struct watchman_subscription_state *subs =
+            realloc(session->subs, cap * sizeof(*subs));
+        if (subs) {
+            session->subs = subs;
+            session->cap_subs = cap;
         }
-        int new_size = sizeof(*query->suffixes) * query->cap_suffixes;
-        query->suffixes = realloc(query->suffixes, new_size);
     }
-    query->suffixes[query->nr_suffixes] = strdup(suffix);
-    query->nr_suffixes++;
+    if (!session || session->nr_subs == session->cap_subs) {
+        free(resolved_copy);
+        json_decref(cmd);
+        return;
+    }
+    sub = &session->subs[session->nr_subs++];
+    sub->root = strdup(root);
+    sub->resolved = resolved_copy;
+    sub->name = strdup(name);
+    sub->cmd = cmd;
+    sub->fields = fields;
 }
 
-void
-watchman_query_add_path(struct watchman_query *query, const char *path, int depth)
+int
+watchman_subscribe(struct watchman_connection *conn, const char *root,
+                   const char *name, const struct watchman_query *query,
+                   const struct watchman_expression *expr,
+                   const struct timespec *deadline,
+                   struct watchman_error *error)
 {
-    if (query->cap_paths == query->nr_paths) {
-        if (query->nr_paths == 0) {
-            query->cap_paths = 10;
-        } else {
-            query->cap_paths *= 2;
+    json_t *obj = query_to_json(query, expr);
+    if (query && query->nr_defer) {
+        json_object_set_new(obj, "defer",
+                            json_string_array(query->nr_defer, query->defer));
+    }
+    if (query && query->nr_drop) {
+        json_object_set_new(obj, "drop",
+                            json_string_array(query->nr_drop, query->drop));
+    }
+    json_t *cmd = simple_command("subscribe", root, name, NULL);
+    json_array_append_new(cmd, obj);
+
+    proto_t res = watchman_roundtrip(conn, cmd, NULL, deadline, error);
+    if (proto_is_null(res) || response_error(res, error)) {
+        if (!proto_is_null(res)) {
+            proto_free(res);
         }
-        int new_size = sizeof(*query->paths) * query->cap_paths;
-        query->paths = realloc(query->paths, new_size);
+        json_decref(cmd);
+        return 1;
     }
-    query->paths[query->nr_paths].path = strdup(path);
-    query->paths[query->nr_paths].depth = depth;
-    query->nr_paths++;
+    /* Notifications name the root as watchman resolved it */
+    proto_t reported = proto_object_get(res, "root");
+    char *resolved = proto_is_string(reported) ? proto_strdup(reported)
+                                               : realpath(root, NULL);
+    proto_free(res);
+    add_subscription(conn, root, resolved ? resolved : root, name, cmd,
+                     query ? query->fields : 0);
+    free(resolved);
+    return 0;
 }
 
-void
-watchman_query_set_since_oclock(struct watchman_query *query, const char *since)
+int
+watchman_unsubscribe(struct watchman_connection *conn, const char *root,
+                     const char *name, const struct timespec *deadline,
+                     struct watchman_error *error)
 {
-    if (query->since_is_str) {
-        free(query->s.str);
+    json_t *cmd = simple_command("unsubscribe", root, name, NULL);
+    proto_t res = watchman_roundtrip(conn, cmd, NULL, deadline, error);
+    json_decref(cmd);
+    if (proto_is_null(res) || check_response(res, error)) {
+        return 1;
     }
-    query->since_is_str = 1;
-    query->s.str = strdup(since);
+    struct watchman_session *session = conn->session;
+    struct watchman_subscription_state *sub =
+        session ? caller_subscription(session, root, name) : NULL;
+    if (sub) {
+        free(sub->root);
+        free(sub->resolved);
+        free(sub->name);
+        json_decref(sub->cmd);
+        *sub = session->subs[--session->nr_subs];
+    }
+    return 0;
 }
 
-void
-watchman_query_set_since_time_t(struct watchman_query *query, time_t since)
+static int
+state_command(struct watchman_connection *conn, const char *command,
+              const char *root, const char *name, const char *metadata,
+              unsigned int sync_timeout, const struct timespec *deadline,
+              struct watchman_error *error)
 {
-    if (query->since_is_str) {
-        free(query->s.str);
+    json_t *cmd = simple_command(command, root, NULL);
+    json_t *options = json_object();
+    json_object_set_new(options, "name", json_string(name));
+    if (metadata) {
+        json_object_set_new(options, "metadata", json_string(metadata));
     }
-    query->since_is_str = 1;
-    query->s.time = since;
+    if (sync_timeout) {
+        json_object_set_new(options, "sync_timeout",
+                            json_integer(sync_timeout));
+    }
+    json_array_append_new(cmd, options);
+
+    proto_t res = watchman_roundtrip(conn, cmd, NULL, deadline, error);
+    json_decref(cmd);
+    if (proto_is_null(res)) {
+        return 1;
+    }
+    return check_response(res, error);
 }
 
-void
-watchman_query_set_fields(struct watchman_query *query, int fields)
+int
+watchman_state_enter(struct watchman_connection *conn, const char *root,
+                     const char *name, const char *metadata,
+                     unsigned int sync_timeout,
+                     const struct timespec *deadline,
+                     struct watchman_error *error)
 {
-    query->fields = fields;
+    return state_command(conn, "state-enter", root, name, metadata,
+                         sync_timeout, deadline, error);
 }
 
-void
-watchman_query_set_empty_on_fresh(struct watchman_query *query,
-                                  bool empty_on_fresh)
+int
+watchman_state_leave(struct watchman_connection *conn, const char *root,
+                     const char *name, const char *metadata,
+                     unsigned int sync_timeout,
+                     const struct timespec *deadline,
+                     struct watchman_error *error)
 {
-    query->empty_on_fresh = empty_on_fresh;
+    return state_command(conn, "state-leave", root, name, metadata,
+                         sync_timeout, deadline, error);
 }
 
-static json_t *
-json_path(struct watchman_pathspec *spec)
+#define OPTIONAL_STR(res, obj, attr, key)                                  \
+    proto_t attr = proto_object_get(obj, key);                             \
+    if (!proto_is_null(attr)) {                                            \
+        PROTO_ASSERT(proto_is_string, attr, key " is not a string: %s");   \
+        res->attr = proto_strdup(attr);                                    \
+    }
+
+static struct watchman_notification *
+parse_notification(proto_t obj, struct watchman_session *session,
+                   struct watchman_error *error)
 {
-    if (spec->depth == -1) {
-        return json_string(spec->path);
+    struct watchman_notification *result = NULL;
+    struct watchman_notification *res = calloc(1, sizeof(*res));
+
+    proto_t subscription = proto_object_get(obj, "subscription");
+    PROTO_ASSERT(proto_is_string, subscription, "Bad subscription %s");
+    res->subscription = proto_strdup(subscription);
+
+    OPTIONAL_STR(res, obj, root, "root");
+    OPTIONAL_STR(res, obj, state_enter, "state-enter");
+    OPTIONAL_STR(res, obj, state_leave, "state-leave");
+
+    proto_t metadata = proto_object_get(obj, "metadata");
+    if (!proto_is_null(metadata)) {
+        res->metadata = proto_dumps(metadata);
+    }
+    res->canceled = proto_is_true(proto_object_get(obj, "canceled"));
+
+    if (!proto_is_null(proto_object_get(obj, "files"))) {
+        struct watchman_subscription_state *sub = session
+            ? session_subscription(session, res->root, res->subscription)
+            : NULL;
+        res->result = parse_query_result(obj, sub ? sub->fields : 0, error);
+        if (!res->result) {
+            goto done;
+        }
     }
 
-    json_t *obj = json_object();
-    json_object_set_new(obj, "depth", json_integer(spec->depth));
-    json_object_set_new(obj, "path", json_string(spec->path));
-    return obj;
+    result = res;
+    res = NULL;
+done:
+    if (res) {
+        watchman_free_notification(res);
+    }
+    return result;
 }
 
-struct watchman_query_result *
-watchman_do_query_timeout(struct watchman_connection *conn,
-                          const char *fs_path,
-                          const struct watchman_query *query,
-                          const struct watchman_expression *expr,
-                          struct timeval *timeout,
-                          struct watchman_error *error)
+#undef OPTIONAL_STR
+
+/* Returns the next subscription PDU, from those set aside or the
+ * socket, reconnecting once if the connection was lost */
+static proto_t
+next_unilateral(struct watchman_connection *conn,
+                const struct timespec *deadline, struct watchman_error *error)
 {
-    /* construct the json */
-    json_t *json = json_array();
-    json_array_append_new(json, json_string("query"));
-    json_array_append_new(json, json_string(fs_path));
-    json_t *obj = json_object();
-    json_object_set_new(obj, "expression", to_json(expr));
-    if (query) {
-        if (query->fields) {
-            json_object_set_new(obj, "fields", fields_to_json(query->fields));
-        }
+    int reconnected = 0;
 
-        if (query->empty_on_fresh) {
-            json_object_set_new(obj, "empty_on_fresh_instance",
-                                json_true());
-        }
+    for (;;) {
+        struct watchman_session *session = conn->session;
+        proto_t obj;
 
-        if (query->s.time) {
-            if (query->since_is_str) {
-                json_object_set_new(obj, "since", json_string(query->s.str));
+        if (session && session->nr_pending > 0) {
+            obj = session->pending[0];
+            session->nr_pending--;
+            memmove(session->pending, session->pending + 1,
+                    session->nr_pending * sizeof(*session->pending));
+        } else {
+            if (!conn_lost(conn)) {
+                obj = read_response(conn, 0, deadline, error);
             } else {
-                json_t *since = json_integer(query->s.time);
-                json_object_set_new(obj, "since", since);
+                watchman_err(error, WATCHMAN_ERR_CONNECT,
+                             "Connection to watchman lost");
+                obj = proto_null();
             }
-        }
-
-        if (query->nr_suffixes) {
-            /* Note that even if you have only one suffix,
-             * watchman requires this to be an array. */
-            int i;
-            json_t *suffixes = json_array();
-            for (i = 0; i < query->nr_suffixes; ++i) {
-                json_array_append_new(suffixes,
-                                      json_string(query->suffixes[i]));
+            if (proto_is_null(obj)) {
+                /* Subscriptions are re-established on a new connection */
+                if (reconnected || !session || !session->reconnect ||
+                    !conn_lost(conn)) {
+                    return obj;
+                }
+                reconnected = 1;
+                if (error) {
+                    watchman_release_error(error);
+                    error->message = NULL;
+                }
+                if (reconnect(conn, deadline, error)) {
+                    return proto_null();
+                }
+                continue;
             }
-            json_object_set_new(obj, "suffix", suffixes);
-        }
-        if (query->nr_paths) {
-            int i;
-            json_t *paths = json_array();
-            for (i = 0; i < query->nr_paths; ++i) {
-                json_array_append_new(paths, json_path(&query->paths[i]));
+            if (!is_unilateral(obj)) {
+                watchman_err(error, WATCHMAN_ERR_WATCHMAN_BROKEN,
+                             "Got a response to no request from watchman");
+                proto_free(obj);
+                return proto_null();
             }
-            json_object_set_new(obj, "path", paths);
         }
-
-        if (query->all) {
-            json_object_set_new(obj, "all", json_string("all"));
+        if (proto_is_null(proto_object_get(obj, "subscription"))) {
+            /* Log messages have no reader */
+            proto_free(obj);
+            continue;
         }
+        return obj;
+    }
+}
 
-        if (query->sync_timeout >= 0) {
-            json_object_set_new(obj, "sync_timeout",
-                                json_integer(query->sync_timeout));
-        }
+struct watchman_notification *
+watchman_read_notification(struct watchman_connection *conn,
+                           const struct timespec *deadline,
+                           struct watchman_error *error)
+{
+    proto_t obj = next_unilateral(conn, deadline, error);
+    if (proto_is_null(obj)) {
+        return NULL;
     }
-    json_array_append_new(json, obj);
 
-    /* do the query */
-    struct watchman_query_result *r = watchman_query_json(conn, json, timeout, error);
-    json_decref(json);
-    return r;
+    struct watchman_session *session = conn->session;
+    struct watchman_notification *res =
+        parse_notification(obj, session, error);
+    proto_free(obj);
+    struct watchman_subscription_state *sub = res && session
+        ? session_subscription(session, res->root, res->subscription)
+        : NULL;
+    if (sub && res->result) {
+        json_object_set_new(json_array_get(sub->cmd, 3), "since",
+                            json_string(res->result->clock));
+    }
+    return res;
 }
 
-struct watchman_query_result *
-watchman_do_query(struct watchman_connection *conn,
-                  const char *fs_path,
-                  const struct watchman_query *query,
-                  const struct watchman_expression *expr,
-                  struct watchman_error *error)
+int
+watchman_read_unilateral(struct watchman_connection *conn,
+                         struct watchman_response **response,
+                         const struct timespec *deadline,
+                         struct watchman_error *error)
 {
-  struct timeval unused = {0};
-  return watchman_do_query_timeout(conn, fs_path, query, expr, &unused, error);
+    *response = NULL;
+    proto_t obj = next_unilateral(conn, deadline, error);
+    if (proto_is_null(obj)) {
+        return 1;
+    }
+    *response = malloc(sizeof(**response));
+    if (*response == NULL) {
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "Out of memory for watchman response");
+        proto_free(obj);
+        return 1;
+    }
+    (*response)->proto = obj;
+    return 0;
+}
+
+void
+watchman_free_notification(struct watchman_notification *notification)
+{
+    free(notification->subscription);
+    free(notification->root);
+    free(notification->state_enter);
+    free(notification->state_leave);
+    free(notification->metadata);
+    if (notification->result) {
+        watchman_free_query_result(notification->result);
+    }
+    free(notification);
+}
+
+void
+watchman_free_bound_result(struct watchman_bound_result *result)
+{
+    free(result->clock);
+    free(result->records);
+    watchman_free_response(result->response);
+    free(result);
 }
 
 void
@@ -1375,14 +3617,30 @@ watchman_free_expression(struct watchman_expression *expr)
     }
 }
 
+int
+watchman_connection_use_io_uring(struct watchman_connection *conn,
+                                 struct watchman_error *error)
+{
+    if (conn_lost(conn)) {
+        watchman_err(error, WATCHMAN_ERR_CONNECT,
+                     "Connection to watchman lost");
+        return 1;
+    }
+    /* Switching with a partial response buffered would lose data */
+    if (!conn_has_input(conn) && watchman_io_uring_attach(conn) == 0) {
+        return 0;
+    }
+    watchman_err(error, WATCHMAN_ERR_OTHER, "Can't use io_uring: %s",
+                 conn_has_input(conn) ? "connection is busy" : strerror(errno));
+    return 1;
+}
+
 void
 watchman_connection_close(struct watchman_connection *conn)
 {
-    if (!conn->fp) {
-        return;
-    }
-    fclose(conn->fp);
-    conn->fp = NULL;
+    conn_drop_socket(conn);
+    free(conn->rbuf);
+    free_session(conn->session);
     free(conn);
 }
 
@@ -1394,6 +3652,14 @@ watchman_release_error(struct watchman_error *error)
     }
 }
 
+void
+watchman_free_watch_project(struct watchman_watch_project *project)
+{
+    free(project->root);
+    free(project->relative_path);
+    free(project);
+}
+
 void
 watchman_free_watch_list(struct watchman_watch_list *list)
 {
@@ -1408,13 +3674,15 @@ watchman_free_watch_list(struct watchman_watch_list *list)
 }
 
 /* Not a _free_ function, since stats are allocated as a block. */
-static void
+void
 watchman_release_stat(struct watchman_stat *stat)
 {
-    if (stat->name) {
-        free(stat->name);
-        stat->name = NULL;
-    }
+    free(stat->name);
+    stat->name = NULL;
+    free(stat->oclock);
+    stat->oclock = NULL;
+    free(stat->cclock);
+    stat->cclock = NULL;
 }
 
 void
@@ -1566,16 +3834,9 @@ watchman_version(struct watchman_connection *conn,
                  struct watchman_version* version)
 {
     const char *result = NULL;
-    json_t *cmd = json_array();
-    json_array_append_new(cmd, json_string("version"));
-
-    int ret = watchman_send(conn, cmd, error);
+    json_t *cmd = simple_command("version", NULL);
+    proto_t obj = watchman_roundtrip(conn, cmd, NULL, NULL, error);
     json_decref(cmd);
-    if (ret) {
-        return -1;
-    }
-
-    proto_t obj = watchman_read(conn, error);
     if (proto_is_null(obj)) {
         return -1;
     }
@@ -1598,10 +3859,16 @@ int
 watchman_shutdown_server(struct watchman_connection *conn,
                          struct watchman_error *error)
 {
+    if (conn_lost(conn)) {
+        watchman_err(error, WATCHMAN_ERR_CONNECT,
+                     "Connection to watchman lost");
+        return -1;
+    }
     json_t *cmd = json_array();
     json_array_append_new(cmd, json_string("shutdown-server"));
 
-    int ret = watchman_send(conn, cmd, error);
+    /* Not retried: reconnecting would start a new server */
+    int ret = watchman_send_deadline(conn, cmd, NULL, error);
     json_decref(cmd);
 
     if (ret) {
@@ -34,8 +34,34 @@ enum watchman_fields {
     WATCHMAN_FIELD_END = 0x00400000
 };
 
+struct watchman_transport;
+struct watchman_session;
+struct watchman_response;
+/* From jansson.h and bser.h */
+struct json_t;
+struct bser;
+
 struct watchman_connection {
     FILE *fp;
+    /* Private: data received from watchman that has not been consumed */
+    char *rbuf;
+    size_t rbuf_start;
+    size_t rbuf_end;
+    size_t rbuf_cap;
+    /* Private: how bytes are moved; NULL means plain reads and writes */
+    const struct watchman_transport *transport;
+    void *transport_data;
+    /* Private: watched roots and clocks, for reconnecting and resuming */
+    struct watchman_session *session;
+};
+
+struct watchman_reconnect_policy {
+    /* Wait before the second attempt; doubled after each failed attempt */
+    unsigned initial_delay_ms;
+    unsigned max_delay_ms;
+    /* Attempts per lost connection; 0 for no limit other than the
+     * deadline of the call that noticed the loss */
+    unsigned max_attempts;
 };
 
 enum watchman_expression_type {
@@ -167,11 +193,207 @@ struct watchman_query_result {
     struct watchman_stat *stats;
 };
 
+/* A string inside a response; not NUL-terminated */
+struct watchman_strview {
+    const char *data;
+    size_t len;
+};
+
+enum watchman_bind_type {
+    WATCHMAN_BIND_STRVIEW,  /* struct watchman_strview */
+    WATCHMAN_BIND_I64,      /* int64_t */
+    WATCHMAN_BIND_DOUBLE,   /* double; integers are converted */
+    WATCHMAN_BIND_BOOL      /* bool */
+};
+
+/* Where to store one watchman field in a caller-defined record */
+struct watchman_binding {
+    const char *field;
+    size_t offset;
+    enum watchman_bind_type type;
+};
+
+struct watchman_bound_result {
+    char *clock;
+    unsigned is_fresh_instance:1;
+
+    int nr;
+    /* 'nr' records of the size passed to watchman_do_query_bound() */
+    void *records;
+    /* Holds the data the string views point into */
+    struct watchman_response *response;
+};
+
 struct watchman_watch_list {
     int nr;
     char **roots;
 };
 
+/* Where watchman_watch_project() watches a directory from */
+struct watchman_watch_project {
+    char *root;
+    /* The directory relative to root, or NULL if it is the root */
+    char *relative_path;
+};
+
+/* The outcome of watching one root with watchman_watch_many() */
+struct watchman_watch_result {
+    /* The root watchman is watching, or NULL if the watch failed */
+    char *root;
+    /* As in struct watchman_watch_project, for watch-project */
+    char *relative_path;
+    /* Filled in if the watch failed; message is NULL otherwise */
+    struct watchman_error error;
+};
+
+/* Something a subscription reported; see watchman_read_notification() */
+struct watchman_notification {
+    char *subscription;
+    char *root;
+    /* Set when a state was entered or left; such notifications carry no
+     * files */
+    char *state_enter;
+    char *state_leave;
+    /* The state's metadata as JSON text, if any */
+    char *metadata;
+    /* Set if watchman ended the subscription, e.g. because its root went
+     * away */
+    unsigned canceled:1;
+    /* The changes, as for a query; NULL if there are none */
+    struct watchman_query_result *result;
+};
+
+/**
+ * A compact, sorted set of names (such as those of a large query
+ * result), which shares the directory prefixes that neighbouring names
+ * have in common rather than storing each name whole.  Names can be
+ * looked up by binary search, or iterated over by prefix with a
+ * cursor.
+ */
+struct watchman_name_store;
+
+struct watchman_name_cursor {
+    const struct watchman_name_store *store;
+    /* Of the name last returned, in sorted order */
+    int index;
+    /* The name last returned */
+    char *name;
+    size_t len;
+    /* Private */
+    char *prefix;
+    size_t offset;
+    unsigned unread:1;
+};
+
+/**
+ * A table of file states in shared memory, kept up to date by one
+ * process (see watchman_shm_update()) for any number of others to look
+ * files up in without talking to watchman.
+ */
+struct watchman_shm_table;
+
+struct watchman_shm_stat {
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t ino;
+    uint32_t mode;
+};
+
+/* The fields the table is filled from */
+#define WATCHMAN_SHM_FIELDS                                               \
+    (WATCHMAN_FIELD_NAME | WATCHMAN_FIELD_EXISTS | WATCHMAN_FIELD_SIZE |  \
+     WATCHMAN_FIELD_MODE | WATCHMAN_FIELD_INO | WATCHMAN_FIELD_MTIME_NS | \
+     WATCHMAN_FIELD_CTIME_NS)
+
+/**
+ * An append-only file of the changes under one root, from which a process
+ * can catch up later without having kept a subscription open (see
+ * watchman_journal_since()).
+ */
+struct watchman_journal;
+
+/* The fields a journal keeps */
+#define WATCHMAN_JOURNAL_FIELDS \
+    (WATCHMAN_FIELD_NAME | WATCHMAN_FIELD_EXISTS | WATCHMAN_FIELD_NEWER)
+
+/**
+ * Results of queries kept in memory and shared between threads, so that
+ * repeating a query costs little or nothing (see watchman_cached_query()).
+ */
+struct watchman_query_cache;
+
+/* The outcome of one root's query with watchman_query_roots() */
+struct watchman_root_query_result {
+    /* NULL if the query failed */
+    struct watchman_query_result *result;
+    /* Filled in if the query failed; message is NULL otherwise */
+    struct watchman_error error;
+};
+
+/* How an entry of a result differs from the file (see
+ * watchman_verify_result()) */
+enum watchman_mismatch {
+    WATCHMAN_MISMATCH_EXISTS = 1 << 0,
+    WATCHMAN_MISMATCH_SIZE = 1 << 1,
+    WATCHMAN_MISMATCH_MTIME = 1 << 2,
+    WATCHMAN_MISMATCH_INO = 1 << 3,
+    WATCHMAN_MISMATCH_MODE = 1 << 4,
+    /* The file could not be looked at, for a reason other than not
+     * existing */
+    WATCHMAN_MISMATCH_UNREADABLE = 1 << 5
+};
+
+/**
+ * Hashes files' contents on a pool of threads, remembering the hashes of
+ * files that haven't changed since (see watchman_hasher_create()).
+ */
+struct watchman_hasher;
+
+/* Also compute each file's SHA-1 */
+#define WATCHMAN_HASH_SHA1 0x1
+
+/* What the hasher found for one file */
+struct watchman_file_hash {
+    /* Valid for the duration of the callback */
+    const char *name;
+    /* 0, or the errno value for why the file couldn't be hashed: ENOENT
+     * if it is gone, EINVAL if it isn't a regular file, EAGAIN if it kept
+     * changing while being read */
+    int error;
+    /* Set if the hashes were remembered rather than computed */
+    unsigned cached:1;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    /* XXH64 of the contents (see watchman_xxh64()) */
+    uint64_t hash;
+    /* If WATCHMAN_HASH_SHA1 was given */
+    unsigned char sha1[20];
+};
+
+typedef void (*watchman_hash_callback)(const struct watchman_file_hash *hash,
+                                       void *arg);
+
+/**
+ * Totals per directory of the files under it, kept up to date as results
+ * are applied (see watchman_dir_index_create()).
+ */
+struct watchman_dir_index;
+
+/* The fields a result needs for a directory index */
+#define WATCHMAN_DIR_INDEX_FIELDS                                          \
+    (WATCHMAN_FIELD_NAME | WATCHMAN_FIELD_EXISTS | WATCHMAN_FIELD_SIZE |   \
+     WATCHMAN_FIELD_MTIME_NS | WATCHMAN_FIELD_MODE)
+
+/* What is under a directory, at any depth; directories don't count */
+struct watchman_dir_totals {
+    int64_t nr_files;
+    int64_t size;
+    /* The newest file's mtime, or 0 if there are no files */
+    int64_t max_mtime_ns;
+};
+
 struct watchman_pathspec {
     int depth;
     char *path;
@@ -195,6 +417,18 @@ struct watchman_query {
 
     /* negative for unset */
     int64_t sync_timeout;
+
+    /* Scopes the query (and the names it returns) to this directory */
+    char *relative_root;
+
+    /* For subscriptions: states during which notifications are held
+     * back (and then coalesced) or dropped */
+    int nr_defer;
+    int cap_defer;
+    char **defer;
+    int nr_drop;
+    int cap_drop;
+    char **drop;
 };
 
 struct watchman_expression {
@@ -224,12 +458,252 @@ void watchman_set_error_handle(FILE* fp);
 
 struct watchman_connection *
 watchman_connect(struct timeval timeout, struct watchman_error *error);
+
+/**
+ * Adopts 'fd', a socket already connected to watchman (for example one
+ * inherited from a parent, or received over SCM_RIGHTS), without running
+ * get-sockname or connecting.  The socket is put in blocking mode.  On
+ * success the connection owns 'fd' and closes it; on error, 'fd' is left
+ * open.
+ */
+struct watchman_connection *
+watchman_connection_from_fd(int fd, struct watchman_error *error);
+
+/**
+ * Connects to an engine inside this process, for hosts where watchman
+ * isn't available.  It crawls and watches roots itself (with inotify),
+ * and answers watch, watch-project, watch-list, watch-del, clock, query,
+ * recrawl and version much as watchman would, with its own clocks;
+ * subscriptions are not supported.  State lasts as long as the process
+ * and is shared by all its embedded connections.  Fails if the library
+ * was built without --enable-embedded.
+ */
+struct watchman_connection *
+watchman_connect_embedded(struct watchman_error *error);
+
+/**
+ * Deadlines are absolute CLOCK_MONOTONIC times, so they are not affected
+ * by wall-clock changes.  The _deadline variants bound the whole operation
+ * (running get-sockname, connecting, sending the request and reading the
+ * entire response) by a single deadline.  A NULL deadline means no limit.
+ */
+struct timespec
+watchman_deadline(struct timeval timeout);
+struct watchman_connection *
+watchman_connect_deadline(const struct timespec *deadline,
+                          struct watchman_error *error);
+int
+watchman_watch_deadline(struct watchman_connection *connection,
+                        const char *path, const struct timespec *deadline,
+                        struct watchman_error *error);
+char *
+watchman_clock_deadline(struct watchman_connection *conn,
+                        const char *path,
+                        unsigned int sync_timeout,
+                        const struct timespec *deadline,
+                        struct watchman_error *error);
+struct watchman_query_result *
+watchman_do_query_deadline(struct watchman_connection *conn,
+                           const char *fs_path,
+                           const struct watchman_query *query,
+                           const struct watchman_expression *expr,
+                           const struct timespec *deadline,
+                           struct watchman_error *error);
+
+/**
+ * Connects without blocking: watchman_connect_start() spawns get-sockname
+ * (or, if WATCHMAN_SOCK is set, starts connecting to it) and returns at
+ * once.  Wait for watchman_connect_fd() to be ready for 'events' (it may
+ * change as the connect progresses, and may wake early), then call
+ * watchman_connect_poll(), which returns 0 while still in progress, or 1
+ * with '*conn' set, or -1 with 'error' filled in.  Once it returns
+ * nonzero, the op has been freed.  watchman_connect_finish() blocks until
+ * done or 'deadline' passes, and always frees the op.
+ * watchman_connect_cancel() abandons it, killing get-sockname.
+ */
+struct watchman_connect_op;
+
+struct watchman_connect_op *
+watchman_connect_start(struct watchman_error *error);
+int
+watchman_connect_fd(const struct watchman_connect_op *op, short *events);
+int
+watchman_connect_poll(struct watchman_connect_op *op,
+                      struct watchman_connection **conn,
+                      struct watchman_error *error);
+struct watchman_connection *
+watchman_connect_finish(struct watchman_connect_op *op,
+                        const struct timespec *deadline,
+                        struct watchman_error *error);
+void
+watchman_connect_cancel(struct watchman_connect_op *op);
+
+/**
+ * Waits until at least one of the 'nr' connections in 'conns' has data
+ * to read (or has been closed by the server), or 'deadline' passes.
+ * Sets readable[i] to 1 for each ready connection and 0 for the rest.
+ * Returns the number of ready connections, 0 on timeout, or -1 on error.
+ * There is no limit on the fd numbers of the connections.
+ */
+int
+watchman_wait(struct watchman_connection **conns, int nr, int *readable,
+              const struct timespec *deadline, struct watchman_error *error);
+
+/**
+ * Makes the connection survive daemon restarts and dropped sockets: when
+ * a call finds the connection lost, it reconnects (backing off as
+ * 'policy' says; NULL for 100ms doubling up to 5s, 8 attempts), watches
+ * again every root it had watched, and retries once.  Returns 1 if out of
+ * memory.
+ */
+int
+watchman_connection_enable_reconnect(
+    struct watchman_connection *conn,
+    const struct watchman_reconnect_policy *policy);
+
+/**
+ * Runs 'query' on 'fs_path' since the clock of the previous call for the
+ * same root on this connection (overriding the query's own since), so
+ * that only changes are returned.  The first call returns everything.
+ * If watchman lost its state in the meantime (for example because the
+ * daemon restarted), the result has is_fresh_instance set and lists
+ * every file rather than a delta.
+ */
+struct watchman_query_result *
+watchman_query_changes(struct watchman_connection *conn,
+                       const char *fs_path,
+                       const struct watchman_query *query,
+                       const struct watchman_expression *expr,
+                       const struct timespec *deadline,
+                       struct watchman_error *error);
+/**
+ * Subscribes to changes under 'root' matching 'query' and 'expr'.  Use
+ * watchman_query_add_defer() and watchman_query_add_drop() to hold back
+ * or discard notifications while a state (see watchman_state_enter())
+ * is asserted; held-back changes arrive as one notification when the
+ * state is left.  Notifications are read with
+ * watchman_read_notification(); any that arrive while waiting for the
+ * response to another command are kept until then.
+ */
+int
+watchman_subscribe(struct watchman_connection *conn, const char *root,
+                   const char *name, const struct watchman_query *query,
+                   const struct watchman_expression *expr,
+                   const struct timespec *deadline,
+                   struct watchman_error *error);
+int
+watchman_unsubscribe(struct watchman_connection *conn, const char *root,
+                     const char *name, const struct timespec *deadline,
+                     struct watchman_error *error);
+/**
+ * Returns the next subscription notification, waiting for one until
+ * 'deadline' (NULL to wait as long as it takes).  On reconnecting,
+ * subscriptions are re-established from the clock of the last
+ * notification read.
+ */
+struct watchman_notification *
+watchman_read_notification(struct watchman_connection *conn,
+                           const struct timespec *deadline,
+                           struct watchman_error *error);
+/**
+ * Asserts (or releases) the named state on 'root', e.g. for the length
+ * of a checkout, so that subscribers deferring or dropping it are not
+ * flooded with partial changes.  'metadata' (may be NULL) is passed on
+ * to subscribers.  A non-zero 'sync_timeout' (ms) makes watchman catch
+ * up with the filesystem first.  Watchman releases the states of a
+ * connection when it closes, so they don't survive a reconnect.
+ */
+int
+watchman_state_enter(struct watchman_connection *conn, const char *root,
+                     const char *name, const char *metadata,
+                     unsigned int sync_timeout,
+                     const struct timespec *deadline,
+                     struct watchman_error *error);
+int
+watchman_state_leave(struct watchman_connection *conn, const char *root,
+                     const char *name, const char *metadata,
+                     unsigned int sync_timeout,
+                     const struct timespec *deadline,
+                     struct watchman_error *error);
+/**
+ * Runs any command, given as a jansson array such as ["find", root],
+ * for which there is no wrapper.  On success, '*response' is set to the
+ * response, which must be freed with watchman_free_response().  A
+ * response reporting an error is turned into 'error' instead.  Commands
+ * that change the connection's state (subscribe, state-enter, ...)
+ * should go through their own wrappers, or they will not be restored
+ * on reconnecting.
+ */
+int
+watchman_command(struct watchman_connection *conn, struct json_t *request,
+                 struct watchman_response **response,
+                 const struct timespec *deadline,
+                 struct watchman_error *error);
+/**
+ * As watchman_read_notification(), but hands back the subscription PDU
+ * as it came, for callers that pass it on or want fields that struct
+ * watchman_notification does not have.
+ */
+int
+watchman_read_unilateral(struct watchman_connection *conn,
+                         struct watchman_response **response,
+                         const struct timespec *deadline,
+                         struct watchman_error *error);
+/**
+ * Returns the response as a lazily parsed bser node (see bser.h),
+ * pointing straight into the bytes read from watchman, whichever
+ * protocol is in use.  It stays valid until the response is freed.
+ */
+struct bser *
+watchman_response_bser(struct watchman_response *response);
+void
+watchman_free_response(struct watchman_response *response);
 int
 watchman_watch(struct watchman_connection *connection, const char *path,
                struct watchman_error *error);
+/**
+ * Watches the 'nr' roots in 'paths', sending up to 'max_in_flight'
+ * requests (0 for a default of 64) before waiting for their responses,
+ * instead of one round trip per root.  Fills in results[i] for paths[i]
+ * and returns the number of roots that could not be watched.  Release
+ * the results with watchman_release_watch_results().
+ */
+int
+watchman_watch_many(struct watchman_connection *conn,
+                    const char *const *paths, int nr,
+                    struct watchman_watch_result *results,
+                    int max_in_flight, const struct timespec *deadline);
+/**
+ * As watchman_watch_many(), but with watch-project: directories inside
+ * the same project share one watched root.
+ */
+int
+watchman_watch_project_many(struct watchman_connection *conn,
+                            const char *const *paths, int nr,
+                            struct watchman_watch_result *results,
+                            int max_in_flight,
+                            const struct timespec *deadline);
+void
+watchman_release_watch_results(struct watchman_watch_result *results,
+                               int nr);
 int
 watchman_watch_del(struct watchman_connection *connection, const char *path,
                    struct watchman_error *error);
+/**
+ * Watches the project containing 'path' (the nearest directory above it
+ * with a .watchmanconfig or VCS directory, or 'path' itself), so that
+ * sibling directories share one root on the daemon.  Pass the
+ * relative_path of the result to watchman_query_set_relative_root() to
+ * scope queries to 'path'.
+ */
+struct watchman_watch_project *
+watchman_watch_project(struct watchman_connection *connection,
+                       const char *path, struct watchman_error *error);
+struct watchman_watch_project *
+watchman_watch_project_deadline(struct watchman_connection *connection,
+                                const char *path,
+                                const struct timespec *deadline,
+                                struct watchman_error *error);
 struct watchman_watch_list *
 watchman_watch_list(struct watchman_connection *connection,
                     struct watchman_error *error);
@@ -285,6 +759,25 @@ watchman_do_query_timeout(struct watchman_connection *conn,
                           const struct watchman_expression *expr,
                           struct timeval *timeout,
                           struct watchman_error *error);
+/**
+ * Runs 'query', decoding each file straight into a record of
+ * 'record_size' bytes as laid out by the 'nr_bindings' entries of
+ * 'bindings', such as
+ * { "mtime_ns", offsetof(struct rec, mtime), WATCHMAN_BIND_I64 }.
+ * The fields requested are those of the bindings, whatever the query
+ * says.  Fields a file lacks are left zeroed.  Free the result with
+ * watchman_free_bound_result(), which also invalidates the string
+ * views.
+ */
+struct watchman_bound_result *
+watchman_do_query_bound(struct watchman_connection *conn,
+                        const char *fs_path,
+                        const struct watchman_query *query,
+                        const struct watchman_expression *expr,
+                        const struct watchman_binding *bindings,
+                        int nr_bindings, size_t record_size,
+                        const struct timespec *deadline,
+                        struct watchman_error *error);
 struct watchman_query *
 watchman_query(void);
 void
@@ -301,6 +794,15 @@ void
 watchman_query_set_empty_on_fresh(struct watchman_query *query,
                                   bool empty_on_fresh);
 void
+watchman_query_set_relative_root(struct watchman_query *query,
+                                 const char *relative_root);
+int
+watchman_query_add_defer(struct watchman_query *query, const char *state,
+                         struct watchman_error *error);
+int
+watchman_query_add_drop(struct watchman_query *query, const char *state,
+                        struct watchman_error *error);
+void
 watchman_free_expression(struct watchman_expression *expr);
 void
 watchman_free_query_result(struct watchman_query_result *res);
@@ -309,7 +811,273 @@ watchman_free_query(struct watchman_query *query);
 void
 watchman_free_watch_list(struct watchman_watch_list *list);
 void
+watchman_free_watch_project(struct watchman_watch_project *project);
+void
+watchman_free_notification(struct watchman_notification *notification);
+void
+watchman_free_bound_result(struct watchman_bound_result *result);
+
+/* Builds a store of 'nr' names, which are copied; duplicates are kept
+ * once.  Returns NULL if out of memory. */
+struct watchman_name_store *
+watchman_name_store(const char *const *names, int nr);
+struct watchman_name_store *
+watchman_name_store_from_result(const struct watchman_query_result *result);
+/* The number of names, and the memory the store takes up */
+int
+watchman_name_store_size(const struct watchman_name_store *store);
+size_t
+watchman_name_store_bytes(const struct watchman_name_store *store);
+/* Returns the index of 'name' in sorted order, or -1 if it is absent */
+int
+watchman_name_store_find(const struct watchman_name_store *store,
+                         const char *name);
+/* Returns a copy of the name at 'index' for the caller to free */
+char *
+watchman_name_store_get(const struct watchman_name_store *store, int index);
+/**
+ * Positions 'cursor' so that watchman_name_cursor_next() returns each
+ * name starting with 'prefix' ("" for all of them) in order, then NULL.
+ * A returned name stays valid until the next call.  Returns 1 if out
+ * of memory.  Release the cursor with watchman_name_cursor_release().
+ */
+int
+watchman_name_store_seek(const struct watchman_name_store *store,
+                         const char *prefix,
+                         struct watchman_name_cursor *cursor);
+const char *
+watchman_name_cursor_next(struct watchman_name_cursor *cursor);
+void
+watchman_name_cursor_release(struct watchman_name_cursor *cursor);
+void
+watchman_free_name_store(struct watchman_name_store *store);
+
+/**
+ * Creates the table at 'path' (e.g. under /dev/shm) for the files under
+ * 'root', with room for 3/4 of 'nr_slots' (rounded up to a power of two)
+ * files whose names total 'arena_size' bytes.  The file replaces any
+ * table already at 'path'.  Only the creating process may update it;
+ * if it dies without closing the table, readers go on answering from
+ * the last update.
+ */
+struct watchman_shm_table *
+watchman_shm_create(const char *path, const char *root,
+                    unsigned int nr_slots, size_t arena_size,
+                    struct watchman_error *error);
+/**
+ * Brings the table up to date with a since-query on its root.  The
+ * first call loads every file, after which readers start answering.
+ * If the table runs out of room, readers stop answering and this fails;
+ * create a larger one.
+ */
+int
+watchman_shm_update(struct watchman_shm_table *table,
+                    struct watchman_connection *conn,
+                    const struct timespec *deadline,
+                    struct watchman_error *error);
+/* As watchman_shm_update(), for a result the caller got (e.g. from a
+ * subscription with WATCHMAN_SHM_FIELDS) */
+int
+watchman_shm_apply(struct watchman_shm_table *table,
+                   const struct watchman_query_result *result,
+                   struct watchman_error *error);
+/* Maps an existing table read-only */
+struct watchman_shm_table *
+watchman_shm_open(const char *path, struct watchman_error *error);
+/**
+ * Looks up 'name' (relative to the root) without taking any lock.
+ * Returns 1 with 'stat' filled in if the file exists, 0 if it does not,
+ * or -1 if the table can't tell: it is still loading, full, or its
+ * writer has closed it (reopen it, or ask watchman instead).
+ */
+int
+watchman_shm_lookup(const struct watchman_shm_table *table, const char *name,
+                    struct watchman_shm_stat *stat);
+/* Unmaps the table; the writer closing it makes readers' lookups fail */
+void
+watchman_shm_close(struct watchman_shm_table *table);
+/**
+ * Opens the journal at 'path' for appending, creating it if need be.  An
+ * existing journal must be for 'root', and an entry left half-written by
+ * a crash is dropped.  Only one process may write a journal at a time.
+ */
+struct watchman_journal *
+watchman_journal_open(const char *path, const char *root,
+                      struct watchman_error *error);
+/* Appends the names, flags and clock of 'result' (e.g. from a
+ * subscription with WATCHMAN_JOURNAL_FIELDS) */
+int
+watchman_journal_append(struct watchman_journal *journal,
+                        const struct watchman_query_result *result,
+                        struct watchman_error *error);
+/* Appends the changes since the last update (see watchman_query_changes()) */
+int
+watchman_journal_update(struct watchman_journal *journal,
+                        struct watchman_connection *conn,
+                        const struct timespec *deadline,
+                        struct watchman_error *error);
+void
+watchman_journal_close(struct watchman_journal *journal);
+/**
+ * Maps the journal at 'path' and returns each file changed after 'clock'
+ * (NULL for all) once, with 'exists' as last recorded and 'newer' set if
+ * it was created since, and the clock of the last entry.  If the journal
+ * can't account for everything since 'clock' (it starts later, or
+ * watchman lost its state in between), is_fresh_instance is set and the
+ * caller has to ask watchman instead.  It may be read while written.
+ */
+struct watchman_query_result *
+watchman_journal_since(const char *path, const char *clock,
+                       struct watchman_error *error);
+/* Keeps at most 'max_entries' results, dropping the least recently used;
+ * returns NULL if out of memory */
+struct watchman_query_cache *
+watchman_query_cache_create(int max_entries);
+/**
+ * As watchman_do_query_deadline(), but answered from 'cache' if the same
+ * query on the same root was answered before and nothing under the
+ * query's relative_root has changed since; watchman is only asked for
+ * the changes since the cached result's clock.  Threads making the same
+ * query while it is in flight wait for it and share its result.  Each
+ * thread needs its own connection.  The result is the caller's to free.
+ */
+struct watchman_query_result *
+watchman_cached_query(struct watchman_query_cache *cache,
+                      struct watchman_connection *conn, const char *fs_path,
+                      const struct watchman_query *query,
+                      const struct watchman_expression *expr,
+                      const struct timespec *deadline,
+                      struct watchman_error *error);
+/**
+ * Promises that every notification of a subscription on all of 'root'
+ * will be passed to watchman_query_cache_notify(), so that queries on it
+ * are answered from memory without asking watchman until one reports a
+ * change.  Queries must name the root as 'root' does, or as watchman
+ * resolves it.  Returns 1 if out of memory.
+ */
+int
+watchman_query_cache_attach(struct watchman_query_cache *cache,
+                            const char *root, struct watchman_error *error);
+/* Invalidates the results for the notification's root if it has changes,
+ * and detaches the root if the subscription was canceled */
+void
+watchman_query_cache_notify(struct watchman_query_cache *cache,
+                            const struct watchman_notification *note);
+/* No other thread may be using the cache */
+void
+watchman_query_cache_free(struct watchman_query_cache *cache);
+/**
+ * As watchman_do_query_deadline(), but split by the query's paths (see
+ * watchman_query_add_path()) into up to 'nr_conns' parts, each sent on
+ * its own connection from its own thread, so that watchman walks and the
+ * client decodes them in parallel.  The parts' files follow the order of
+ * the paths; if paths overlap, a file under several is listed once, where
+ * it first appears.
+ * The merged clock is the earliest of the parts', so that a query since
+ * it misses nothing; it fails if watchman restarted in between.  The
+ * connections must not be used elsewhere meanwhile.
+ */
+struct watchman_query_result *
+watchman_fanout_query(struct watchman_connection *const *conns, int nr_conns,
+                      const char *fs_path,
+                      const struct watchman_query *query,
+                      const struct watchman_expression *expr,
+                      const struct timespec *deadline,
+                      struct watchman_error *error);
+/**
+ * Runs the query on each of the 'nr_roots' roots, spread over the
+ * 'nr_conns' connections as watchman_fanout_query() does.  Fills in
+ * results[i] for roots[i] and returns the number of roots whose query
+ * failed.  Release the results with watchman_release_root_query_results().
+ */
+int
+watchman_query_roots(struct watchman_connection *const *conns, int nr_conns,
+                     const char *const *roots, int nr_roots,
+                     const struct watchman_query *query,
+                     const struct watchman_expression *expr,
+                     struct watchman_root_query_result *results,
+                     const struct timespec *deadline);
+void
+watchman_release_root_query_results(struct watchman_root_query_result *results,
+                                    int nr);
+/**
+ * Checks each file of 'result', whose names are relative to 'root', on
+ * up to 'nr_threads' threads (0 for one per CPU), against the fields of
+ * 'fields' it was queried with: whether it exists, its size, its mtime
+ * (the finest asked for), inode and mode.  Symlinks are not followed.
+ * If 'mismatches' is not NULL, it gets how each entry differs, as
+ * WATCHMAN_MISMATCH_* flags.  With 'refresh' set, each entry found is
+ * updated from the file, and one found gone has exists cleared.  Returns
+ * the number of entries that differ, or -1 if 'root' can't be opened.
+ */
+int
+watchman_verify_result(const char *root, struct watchman_query_result *result,
+                       int fields, int nr_threads, int refresh,
+                       unsigned *mismatches, struct watchman_error *error);
+/**
+ * Starts 'nr_threads' threads (0 for one per CPU) that hash the files
+ * named to watchman_hasher_add(), relative to 'root', and pass each
+ * outcome to 'callback', which is called from those threads, several at
+ * once.  At most 'queue_size' names (0 for a few per thread) wait to be
+ * hashed; adding more waits for room.  A file whose inode, size and
+ * mtime are as when it was last hashed is not read again.
+ */
+struct watchman_hasher *
+watchman_hasher_create(const char *root, int nr_threads, int queue_size,
+                       int flags, watchman_hash_callback callback, void *arg,
+                       struct watchman_error *error);
+/* Queues 'name' to be hashed; returns 1 if out of memory */
+int
+watchman_hasher_add(struct watchman_hasher *hasher, const char *name);
+/* Queues each file of 'result', for example a since-query's or a
+ * subscription's; deleted files are reported with ENOENT and forgotten */
+int
+watchman_hasher_add_result(struct watchman_hasher *hasher,
+                           const struct watchman_query_result *result);
+/* Waits until everything queued has been passed to the callback */
+void
+watchman_hasher_wait(struct watchman_hasher *hasher);
+/* Finishes what is queued, then stops the threads */
+void
+watchman_hasher_free(struct watchman_hasher *hasher);
+/* The XXH64 hash, with seed 0, of 'len' bytes */
+uint64_t
+watchman_xxh64(const void *data, size_t len);
+/**
+ * Creates an empty directory index.  Applying a fresh-instance result to
+ * it fills it; applying later since-results, for example a
+ * subscription's, updates the totals of just the directories above each
+ * changed file.  Looking up a directory's totals costs a hash of its
+ * path.  An index may be read while another thread applies results.
+ */
+struct watchman_dir_index *
+watchman_dir_index_create(void);
+/* Applies each entry of 'result', queried with at least
+ * WATCHMAN_DIR_INDEX_FIELDS; returns 1 if out of memory */
+int
+watchman_dir_index_apply(struct watchman_dir_index *index,
+                         const struct watchman_query_result *result,
+                         struct watchman_error *error);
+/* The totals for 'dir', relative to the root ("" for the root itself);
+ * all 0 if there are no files under it */
+void
+watchman_dir_index_totals(struct watchman_dir_index *index, const char *dir,
+                          struct watchman_dir_totals *totals);
+void
+watchman_dir_index_free(struct watchman_dir_index *index);
+void
 watchman_release_error(struct watchman_error *error);
+/**
+ * Moves the connection's I/O onto io_uring: each request is submitted
+ * together with the read of its response, into a registered buffer.
+ * Only deadlines (not the socket timeouts set by watchman_connect())
+ * bound I/O on such a connection.  Returns 1 and fills in 'error' if the
+ * library was built without --enable-io-uring or the kernel refuses; the
+ * connection then keeps working as before.
+ */
+int
+watchman_connection_use_io_uring(struct watchman_connection *conn,
+                                 struct watchman_error *error);
 void
 watchman_connection_close(struct watchman_connection *connection);
 int
@@ -0,0 +1,429 @@
+#include "watchman_private.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Entries are keyed by the query as it would be sent, with the fields
+ * asked for (see watchman_query_key()).  A result is reused once watchman says nothing
+ * changed since its clock, or, for roots whose subscription feeds the
+ * cache, as long as no notification has come in since it was fetched.
+ * One thread at a time fetches or checks an entry; the others making
+ * the same query wait on the cache's condition variable and copy what
+ * it got.
+ */
+
+struct cache_entry {
+    char *key;
+    uint64_t hash;
+    char *root;
+    /* NULL until a fetch succeeds */
+    struct watchman_query_result *result;
+    /* The root's generation when the result was fetched; 0 if the root
+     * was not attached */
+    unsigned long generation;
+    unsigned long last_used;
+    /* Bumped each time a fetch or check finishes */
+    unsigned long seq;
+    /* Threads waiting for the fetch in flight; the entry is kept until
+     * they have looked at it */
+    int waiters;
+    /* Set while one thread fetches or checks the result */
+    unsigned busy:1;
+    /* Whether the last fetch or check succeeded */
+    unsigned ok:1;
+};
+
+/* A root whose subscription feeds the cache */
+struct cache_root {
+    char *root;
+    /* 'root' as watchman names it in notifications, with symlinks and
+     * ".." resolved */
+    char *resolved;
+    /* Changes with each notification that has changes */
+    unsigned long generation;
+};
+
+struct watchman_query_cache {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int max_entries;
+    int nr_entries;
+    int cap_entries;
+    struct cache_entry **entries;
+    int nr_roots;
+    int cap_roots;
+    struct cache_root *roots;
+    /* Source of generations, so that no two are the same */
+    unsigned long generations;
+    /* Source of last_used */
+    unsigned long tick;
+};
+
+static char *
+dup_or_null(const char *str)
+{
+    return str ? strdup(str) : NULL;
+}
+
+/* Returns NULL if out of memory */
+static struct watchman_query_result *
+copy_result(const struct watchman_query_result *result)
+{
+    struct watchman_query_result *copy = malloc(sizeof(*copy));
+    if (!copy) {
+        return NULL;
+    }
+    *copy = *result;
+    copy->version = dup_or_null(result->version);
+    copy->clock = dup_or_null(result->clock);
+    copy->stats = calloc(result->nr ? result->nr : 1, sizeof(*copy->stats));
+    int i, failed = !copy->stats || (result->version && !copy->version) ||
+                    (result->clock && !copy->clock);
+    for (i = 0; !failed && i < result->nr; ++i) {
+        const struct watchman_stat *stat = &result->stats[i];
+        copy->stats[i] = *stat;
+        copy->stats[i].name = dup_or_null(stat->name);
+        copy->stats[i].oclock = dup_or_null(stat->oclock);
+        copy->stats[i].cclock = dup_or_null(stat->cclock);
+        failed = (stat->name && !copy->stats[i].name) ||
+                 (stat->oclock && !copy->stats[i].oclock) ||
+                 (stat->cclock && !copy->stats[i].cclock);
+    }
+    if (failed) {
+        /* Only the entries up to the failed one were filled in */
+        copy->nr = i;
+        watchman_free_query_result(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+static struct cache_root *
+find_root(struct watchman_query_cache *cache, const char *root)
+{
+    int i;
+    for (i = 0; i < cache->nr_roots; ++i) {
+        if (!strcmp(cache->roots[i].root, root) ||
+            !strcmp(cache->roots[i].resolved, root)) {
+            return &cache->roots[i];
+        }
+    }
+    return NULL;
+}
+
+static struct cache_entry *
+find_entry(struct watchman_query_cache *cache, const char *key,
+           uint64_t hash)
+{
+    int i;
+    for (i = 0; i < cache->nr_entries; ++i) {
+        struct cache_entry *entry = cache->entries[i];
+        if (entry->hash == hash && !strcmp(entry->key, key)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Takes over 'key', unless out of memory, when it returns NULL */
+static struct cache_entry *
+add_entry(struct watchman_query_cache *cache, char *key, uint64_t hash,
+          const char *root)
+{
+    if (cache->nr_entries == cache->cap_entries) {
+        int cap = cache->cap_entries ? cache->cap_entries * 2 : 8;
+        struct cache_entry **entries =
+            realloc(cache->entries, sizeof(*entries) * cap);
+        if (!entries) {
+            return NULL;
+        }
+        cache->entries = entries;
+        cache->cap_entries = cap;
+    }
+    struct cache_entry *entry = calloc(1, sizeof(*entry));
+    if (!entry || !(entry->root = strdup(root))) {
+        free(entry);
+        return NULL;
+    }
+    entry->key = key;
+    entry->hash = hash;
+    cache->entries[cache->nr_entries++] = entry;
+    return entry;
+}
+
+static void
+free_entry(struct cache_entry *entry)
+{
+    if (entry->result) {
+        watchman_free_query_result(entry->result);
+    }
+    free(entry->root);
+    free(entry->key);
+    free(entry);
+}
+
+/* Drops the least recently used entries no thread is looking at until
+ * there are at most max_entries */
+static void
+trim(struct watchman_query_cache *cache)
+{
+    while (cache->nr_entries > cache->max_entries) {
+        int i, lru = -1;
+        for (i = 0; i < cache->nr_entries; ++i) {
+            struct cache_entry *entry = cache->entries[i];
+            if (entry->busy || entry->waiters) {
+                continue;
+            }
+            if (lru < 0 || entry->last_used < cache->entries[lru]->last_used) {
+                lru = i;
+            }
+        }
+        if (lru < 0) {
+            return;
+        }
+        free_entry(cache->entries[lru]);
+        cache->entries[lru] = cache->entries[--cache->nr_entries];
+    }
+}
+
+/* Asks watchman for the names of everything under the query's
+ * relative_root that changed since 'clock' */
+static struct watchman_query_result *
+changes_since(struct watchman_connection *conn, const char *fs_path,
+              const struct watchman_query *query, const char *clock,
+              const struct timespec *deadline, struct watchman_error *error)
+{
+    /* Not the query's own expression or generators: those could hide a
+     * deletion of something the cached result lists */
+    struct watchman_query *check = watchman_query();
+    watchman_query_set_fields(check, WATCHMAN_FIELD_NAME);
+    watchman_query_set_since_oclock(check, clock);
+    watchman_query_set_empty_on_fresh(check, 1);
+    if (query) {
+        watchman_query_set_relative_root(check, query->relative_root);
+        check->sync_timeout = query->sync_timeout;
+    }
+    struct watchman_expression *expr = watchman_true_expression();
+    struct watchman_query_result *result =
+        watchman_do_query_deadline(conn, fs_path, check, expr, deadline,
+                                   error);
+    watchman_free_expression(expr);
+    watchman_free_query(check);
+    return result;
+}
+
+struct watchman_query_cache *
+watchman_query_cache_create(int max_entries)
+{
+    struct watchman_query_cache *cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->done, NULL);
+    cache->max_entries = max_entries > 0 ? max_entries : 1;
+    return cache;
+}
+
+struct watchman_query_result *
+watchman_cached_query(struct watchman_query_cache *cache,
+                      struct watchman_connection *conn, const char *fs_path,
+                      const struct watchman_query *query,
+                      const struct watchman_expression *expr,
+                      const struct timespec *deadline,
+                      struct watchman_error *error)
+{
+    char *key = watchman_query_key(fs_path, query, expr);
+    if (!key) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return NULL;
+    }
+    uint64_t hash = watchman_fnv1a(key, strlen(key));
+    struct watchman_query_result *result = NULL;
+    /* Set if the result couldn't be copied for the caller */
+    int oom = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    struct cache_entry *entry = find_entry(cache, key, hash);
+    if (entry) {
+        free(key);
+    } else if (!(entry = add_entry(cache, key, hash, fs_path))) {
+        pthread_mutex_unlock(&cache->lock);
+        free(key);
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return NULL;
+    }
+    entry->last_used = ++cache->tick;
+
+    struct cache_root *root;
+    for (;;) {
+        if (entry->busy) {
+            unsigned long seq = entry->seq;
+            entry->waiters++;
+            while (entry->busy) {
+                pthread_cond_wait(&cache->done, &cache->lock);
+            }
+            entry->waiters--;
+            if (entry->seq != seq && entry->ok) {
+                result = copy_result(entry->result);
+                oom = !result;
+                goto done;
+            }
+            /* It failed; try for ourselves */
+            continue;
+        }
+        root = find_root(cache, fs_path);
+        if (root && entry->result && entry->generation == root->generation) {
+            result = copy_result(entry->result);
+            oom = !result;
+            goto done;
+        }
+        break;
+    }
+
+    /* Nobody else touches the entry's result while it is busy */
+    entry->busy = 1;
+    unsigned long generation = root ? root->generation : 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    struct watchman_query_result *fetched = NULL;
+    char *clock = NULL;
+    int failed = 0;
+    if (entry->result && !root) {
+        struct watchman_query_result *changes =
+            changes_since(conn, fs_path, query, entry->result->clock,
+                          deadline, error);
+        if (!changes) {
+            failed = 1;
+        } else {
+            if (!changes->is_fresh_instance && changes->nr == 0) {
+                clock = changes->clock;
+                changes->clock = NULL;
+            }
+            watchman_free_query_result(changes);
+        }
+    }
+    if (!failed && !clock) {
+        fetched = watchman_do_query_deadline(conn, fs_path, query, expr,
+                                             deadline, error);
+        failed = !fetched;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if (fetched) {
+        if (entry->result) {
+            watchman_free_query_result(entry->result);
+        }
+        entry->result = fetched;
+        entry->generation = generation;
+    } else if (clock) {
+        /* The result is as good as one taken now */
+        free(entry->result->clock);
+        entry->result->clock = clock;
+    }
+    entry->busy = 0;
+    entry->ok = !failed;
+    entry->seq++;
+    if (!failed) {
+        result = copy_result(entry->result);
+        oom = !result;
+    }
+    pthread_cond_broadcast(&cache->done);
+done:
+    trim(cache);
+    pthread_mutex_unlock(&cache->lock);
+    if (oom) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+    }
+    return result;
+}
+
+int
+watchman_query_cache_attach(struct watchman_query_cache *cache,
+                            const char *root, struct watchman_error *error)
+{
+    int failed = 0;
+    /* Resolved the way watchman resolves it */
+    char *resolved = realpath(root, NULL);
+    if (!resolved) {
+        resolved = strdup(root);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if (!resolved) {
+        failed = 1;
+    } else if (!find_root(cache, root) && !find_root(cache, resolved)) {
+        if (cache->nr_roots == cache->cap_roots) {
+            int cap = cache->cap_roots ? cache->cap_roots * 2 : 4;
+            struct cache_root *roots =
+                realloc(cache->roots, sizeof(*roots) * cap);
+            if (roots) {
+                cache->roots = roots;
+                cache->cap_roots = cap;
+            }
+        }
+        char *copy = cache->nr_roots < cache->cap_roots ? strdup(root) : NULL;
+        if (copy) {
+            struct cache_root *new_root = &cache->roots[cache->nr_roots++];
+            new_root->root = copy;
+            new_root->resolved = resolved;
+            new_root->generation = ++cache->generations;
+            resolved = NULL;
+        } else {
+            failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(resolved);
+    if (failed) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+    }
+    return failed;
+}
+
+void
+watchman_query_cache_notify(struct watchman_query_cache *cache,
+                            const struct watchman_notification *note)
+{
+    if (!note->root) {
+        return;
+    }
+    if (!note->canceled &&
+        (!note->result ||
+         (!note->result->nr && !note->result->is_fresh_instance))) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    struct cache_root *root = find_root(cache, note->root);
+    if (root && note->canceled) {
+        /* Its results are checked with watchman from now on */
+        free(root->root);
+        free(root->resolved);
+        *root = cache->roots[--cache->nr_roots];
+    } else if (root) {
+        root->generation = ++cache->generations;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+watchman_query_cache_free(struct watchman_query_cache *cache)
+{
+    int i;
+    for (i = 0; i < cache->nr_entries; ++i) {
+        free_entry(cache->entries[i]);
+    }
+    free(cache->entries);
+    for (i = 0; i < cache->nr_roots; ++i) {
+        free(cache->roots[i].root);
+        free(cache->roots[i].resolved);
+    }
+    free(cache->roots);
+    pthread_cond_destroy(&cache->done);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
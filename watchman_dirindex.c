@@ -0,0 +1,413 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "watchman_private.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Every directory with files somewhere under it has a node holding the
+ * totals of its whole subtree, found by its path in a hash table, so a
+ * query is one lookup.  A file's node points at its directory; adding,
+ * removing or changing a file adjusts the totals of each directory up
+ * to the root.  Counts and sizes are sums, so that is all they need.  A
+ * newest mtime can only be raised that way: when the newest file of a
+ * directory goes away or gets older, that directory's newest mtime is
+ * worked out again from its own files and subdirectories, and so on up
+ * for as long as the old value was the newest there too.  Directories
+ * left with no files under them are dropped.
+ */
+
+struct node {
+    char *path;
+    uint64_t hash;
+    /* The next node in the hash bucket */
+    struct node *next;
+};
+
+struct dir_node {
+    struct node node;
+    struct dir_node *parent;
+    /* This directory's subdirectories, and its place among its parent's */
+    struct dir_node *children;
+    struct dir_node *prev_sibling;
+    struct dir_node *next_sibling;
+    /* The files directly in this directory */
+    struct file_node *files;
+    struct watchman_dir_totals totals;
+};
+
+struct file_node {
+    struct node node;
+    struct dir_node *dir;
+    struct file_node *prev;
+    struct file_node *next;
+    int64_t size;
+    int64_t mtime_ns;
+};
+
+struct table {
+    struct node **buckets;
+    size_t nr_buckets;
+    size_t nr;
+};
+
+struct watchman_dir_index {
+    pthread_rwlock_t lock;
+    struct table dirs;
+    struct table files;
+    struct dir_node *root;
+};
+
+static struct node **
+table_find(struct table *table, const char *path, size_t len, uint64_t hash)
+{
+    struct node **node = &table->buckets[hash % table->nr_buckets];
+    while (*node && ((*node)->hash != hash || strncmp((*node)->path, path,
+                                                      len) ||
+                     (*node)->path[len])) {
+        node = &(*node)->next;
+    }
+    return node;
+}
+
+static int
+table_init(struct table *table)
+{
+    table->nr_buckets = 1024;
+    table->nr = 0;
+    table->buckets = calloc(table->nr_buckets, sizeof(*table->buckets));
+    return table->buckets == NULL;
+}
+
+/* Adds 'node', whose path and hash are set */
+static void
+table_add(struct table *table, struct node *node)
+{
+    if (table->nr >= table->nr_buckets) {
+        size_t nr = table->nr_buckets * 2, i;
+        struct node **buckets = calloc(nr, sizeof(*buckets));
+        for (i = 0; buckets && i < table->nr_buckets; ++i) {
+            struct node *moved = table->buckets[i], *next;
+            for (; moved; moved = next) {
+                next = moved->next;
+                moved->next = buckets[moved->hash % nr];
+                buckets[moved->hash % nr] = moved;
+            }
+        }
+        if (buckets) {
+            free(table->buckets);
+            table->buckets = buckets;
+            table->nr_buckets = nr;
+        }
+    }
+    struct node **bucket = &table->buckets[node->hash % table->nr_buckets];
+    node->next = *bucket;
+    *bucket = node;
+    table->nr++;
+}
+
+static void
+table_remove(struct table *table, struct node *node)
+{
+    struct node **link = table_find(table, node->path, strlen(node->path),
+                                    node->hash);
+    *link = node->next;
+    table->nr--;
+}
+
+static void
+table_clear(struct table *table)
+{
+    size_t i;
+    for (i = 0; i < table->nr_buckets; ++i) {
+        struct node *node = table->buckets[i], *next;
+        for (; node; node = next) {
+            next = node->next;
+            free(node->path);
+            free(node);
+        }
+        table->buckets[i] = NULL;
+    }
+    table->nr = 0;
+}
+
+static struct dir_node *
+find_dir(struct watchman_dir_index *index, const char *path, size_t len)
+{
+    struct node **node =
+        table_find(&index->dirs, path, len, watchman_fnv1a(path, len));
+    return (struct dir_node *)*node;
+}
+
+/* Returns the node for the directory 'path' (of 'len' bytes), creating it
+ * and its missing parents */
+static struct dir_node *
+get_dir(struct watchman_dir_index *index, const char *path, size_t len)
+{
+    struct dir_node *dir = find_dir(index, path, len);
+    if (dir) {
+        return dir;
+    }
+    size_t parent_len = len;
+    while (parent_len && path[parent_len - 1] != '/') {
+        --parent_len;
+    }
+    struct dir_node *parent =
+        get_dir(index, path, parent_len ? parent_len - 1 : 0);
+    if (!parent || !(dir = calloc(1, sizeof(*dir))) ||
+        !(dir->node.path = strndup(path, len))) {
+        free(dir);
+        return NULL;
+    }
+    dir->node.hash = watchman_fnv1a(path, len);
+    dir->parent = parent;
+    dir->next_sibling = parent->children;
+    if (parent->children) {
+        parent->children->prev_sibling = dir;
+    }
+    parent->children = dir;
+    table_add(&index->dirs, &dir->node);
+    return dir;
+}
+
+/* Works out the newest mtime of 'dir' from what is directly in it */
+static int64_t
+newest_in(const struct dir_node *dir)
+{
+    int64_t newest = 0;
+    const struct file_node *file;
+    const struct dir_node *child;
+    for (file = dir->files; file; file = file->next) {
+        if (file->mtime_ns > newest) {
+            newest = file->mtime_ns;
+        }
+    }
+    for (child = dir->children; child; child = child->next_sibling) {
+        if (child->totals.max_mtime_ns > newest) {
+            newest = child->totals.max_mtime_ns;
+        }
+    }
+    return newest;
+}
+
+/* Accounts for a file in 'dir' going from 'old_mtime' to 'new_mtime',
+ * either of which is 0 for no file */
+static void
+update_newest(struct dir_node *dir, int64_t old_mtime, int64_t new_mtime)
+{
+    for (; dir; dir = dir->parent) {
+        int64_t newest = dir->totals.max_mtime_ns;
+        if (new_mtime > newest) {
+            dir->totals.max_mtime_ns = new_mtime;
+        } else if (old_mtime == newest && new_mtime < newest) {
+            /* That was the newest here; it may not be any more */
+            dir->totals.max_mtime_ns = newest_in(dir);
+        } else {
+            return;
+        }
+        if (dir->totals.max_mtime_ns == newest) {
+            return;
+        }
+        /* What the parent sees changes from this directory's newest */
+        old_mtime = newest;
+        new_mtime = dir->totals.max_mtime_ns;
+    }
+}
+
+static void
+add_totals(struct dir_node *dir, int64_t nr_files, int64_t size)
+{
+    for (; dir; dir = dir->parent) {
+        dir->totals.nr_files += nr_files;
+        dir->totals.size += size;
+    }
+}
+
+/* Drops 'dir' and its parents as long as they have no files under them */
+static void
+prune(struct watchman_dir_index *index, struct dir_node *dir)
+{
+    while (dir != index->root && !dir->totals.nr_files) {
+        struct dir_node *parent = dir->parent;
+        if (dir->prev_sibling) {
+            dir->prev_sibling->next_sibling = dir->next_sibling;
+        } else {
+            parent->children = dir->next_sibling;
+        }
+        if (dir->next_sibling) {
+            dir->next_sibling->prev_sibling = dir->prev_sibling;
+        }
+        table_remove(&index->dirs, &dir->node);
+        free(dir->node.path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+static void
+remove_file(struct watchman_dir_index *index, struct file_node *file)
+{
+    struct dir_node *dir = file->dir;
+    if (file->prev) {
+        file->prev->next = file->next;
+    } else {
+        dir->files = file->next;
+    }
+    if (file->next) {
+        file->next->prev = file->prev;
+    }
+    table_remove(&index->files, &file->node);
+    add_totals(dir, -1, -file->size);
+    update_newest(dir, file->mtime_ns, 0);
+    free(file->node.path);
+    free(file);
+    prune(index, dir);
+}
+
+/* Applies one entry of a result */
+static int
+apply_stat(struct watchman_dir_index *index, const struct watchman_stat *stat)
+{
+    size_t len = strlen(stat->name);
+    uint64_t hash = watchman_fnv1a(stat->name, len);
+    struct file_node *file = (struct file_node *)*table_find(
+        &index->files, stat->name, len, hash);
+
+    if (!stat->exists || S_ISDIR(stat->mode)) {
+        if (file) {
+            remove_file(index, file);
+        }
+        return 0;
+    }
+    if (file) {
+        int64_t old_mtime = file->mtime_ns;
+        add_totals(file->dir, 0, stat->size - file->size);
+        file->size = stat->size;
+        file->mtime_ns = stat->mtime_ns;
+        update_newest(file->dir, old_mtime, stat->mtime_ns);
+        return 0;
+    }
+
+    const char *slash = strrchr(stat->name, '/');
+    struct dir_node *dir =
+        get_dir(index, stat->name, slash ? (size_t)(slash - stat->name) : 0);
+    if (!dir || !(file = calloc(1, sizeof(*file))) ||
+        !(file->node.path = strdup(stat->name))) {
+        free(file);
+        if (dir) {
+            prune(index, dir);
+        }
+        return 1;
+    }
+    file->node.hash = hash;
+    file->dir = dir;
+    file->size = stat->size;
+    file->mtime_ns = stat->mtime_ns;
+    file->next = dir->files;
+    if (dir->files) {
+        dir->files->prev = file;
+    }
+    dir->files = file;
+    table_add(&index->files, &file->node);
+    add_totals(dir, 1, file->size);
+    update_newest(dir, 0, file->mtime_ns);
+    return 0;
+}
+
+static void
+clear(struct watchman_dir_index *index)
+{
+    table_clear(&index->files);
+    /* The root is in the table too */
+    table_clear(&index->dirs);
+    index->root = NULL;
+}
+
+static int
+make_root(struct watchman_dir_index *index)
+{
+    index->root = calloc(1, sizeof(*index->root));
+    if (!index->root || !(index->root->node.path = strdup(""))) {
+        free(index->root);
+        index->root = NULL;
+        return 1;
+    }
+    index->root->node.hash = watchman_fnv1a("", 0);
+    table_add(&index->dirs, &index->root->node);
+    return 0;
+}
+
+struct watchman_dir_index *
+watchman_dir_index_create(void)
+{
+    struct watchman_dir_index *index = calloc(1, sizeof(*index));
+    if (!index) {
+        return NULL;
+    }
+    if (table_init(&index->dirs) || table_init(&index->files) ||
+        make_root(index)) {
+        free(index->dirs.buckets);
+        free(index->files.buckets);
+        free(index);
+        return NULL;
+    }
+    pthread_rwlock_init(&index->lock, NULL);
+    return index;
+}
+
+int
+watchman_dir_index_apply(struct watchman_dir_index *index,
+                         const struct watchman_query_result *result,
+                         struct watchman_error *error)
+{
+    int i, failed = 0;
+
+    pthread_rwlock_wrlock(&index->lock);
+    if (result->is_fresh_instance) {
+        /* The result has everything there is */
+        clear(index);
+        failed = make_root(index);
+    }
+    for (i = 0; !failed && i < result->nr; ++i) {
+        if (result->stats[i].name) {
+            failed = apply_stat(index, &result->stats[i]);
+        }
+    }
+    pthread_rwlock_unlock(&index->lock);
+    if (failed) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+    }
+    return failed;
+}
+
+void
+watchman_dir_index_totals(struct watchman_dir_index *index, const char *dir,
+                          struct watchman_dir_totals *totals)
+{
+    size_t len = strlen(dir);
+    /* "dir/" is "dir" */
+    while (len && dir[len - 1] == '/') {
+        --len;
+    }
+    pthread_rwlock_rdlock(&index->lock);
+    struct dir_node *node = index->root ? find_dir(index, dir, len) : NULL;
+    if (node) {
+        *totals = node->totals;
+    } else {
+        memset(totals, 0, sizeof(*totals));
+    }
+    pthread_rwlock_unlock(&index->lock);
+}
+
+void
+watchman_dir_index_free(struct watchman_dir_index *index)
+{
+    clear(index);
+    free(index->dirs.buckets);
+    free(index->files.buckets);
+    pthread_rwlock_destroy(&index->lock);
+    free(index);
+}
@@ -0,0 +1,1881 @@
+#define _GNU_SOURCE
+
+#include "watchman_private.h"
+
+#include <errno.h>
+
+#ifdef WATCHMAN_EMBEDDED
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <jansson.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * An in-process stand-in for watchman, for hosts that have none.  It
+ * serves the other end of a socketpair with the same protocol, so the
+ * rest of the library cannot tell the difference.
+ *
+ * Each watched root is crawled by a pool of threads, which also add an
+ * inotify watch per directory; a thread per root then applies the
+ * inotify events to an in-memory index, one tick of the root's clock per
+ * change.  Files are kept in a hash table by name and on a list ordered
+ * by when they last changed, so that a query since a clock only visits
+ * what changed after it.  Deleted files stay in the index for a while,
+ * so that such queries can report them; as in watchman, they are
+ * forgotten after GC_AGE_SECONDS, and a since-query from before the last
+ * deletion forgotten is a fresh instance.  Clocks look like watchman's;
+ * a root is renumbered (and since-queries against the old number become
+ * fresh instances, so its deleted files are forgotten at once) when
+ * inotify drops events and the root has to be recrawled.
+ * Syncing works as in watchman: a cookie file is created in the root,
+ * and the caller waits until its event has been seen.
+ *
+ * Only what the library itself sends is understood: watch, watch-project,
+ * watch-list, watch-del, clock, query, debug-recrawl and version.
+ * Subscriptions and states are not supported, pcre terms use POSIX
+ * extended regular expressions, and "empty" only matches files.
+ */
+
+/* The watchman release whose protocol the engine speaks */
+#define EMBEDDED_VERSION "4.9.0"
+#define COOKIE_PREFIX ".watchman-cookie-"
+#define DEFAULT_SYNC_TIMEOUT 60000
+#define MAX_CRAWLERS 16
+/* How long deleted files are remembered; watchman's gc_age_seconds */
+#ifndef GC_AGE_SECONDS
+#define GC_AGE_SECONDS 43200
+#endif
+/* How often an idle root looks for deleted files to forget */
+#define GC_INTERVAL_MS (3600 * 1000)
+#define WATCH_MASK                                                   \
+    (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | \
+     IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF |  \
+     IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+struct embedded_file {
+    char *name;
+    uint64_t hash;
+    mode_t mode;
+    off_t size;
+    ino_t ino;
+    dev_t dev;
+    nlink_t nlink;
+    uid_t uid;
+    gid_t gid;
+    struct timespec mtime;
+    struct timespec ctime;
+    unsigned exists:1;
+    /* The ticks at which it last came into being and last changed, for
+     * cclock and oclock */
+    uint64_t created_tick;
+    uint64_t changed_tick;
+    /* When the last change was seen, for since-queries by time */
+    time_t changed_at;
+    /* The list by last change, newest first */
+    struct embedded_file *newer;
+    struct embedded_file *older;
+    /* While deleted, the list of deleted files by deletion, oldest
+     * first */
+    struct embedded_file *next_gone;
+    struct embedded_file *prev_gone;
+};
+
+struct embedded_root {
+    char *path;
+    /* Part of the root's clocks; changes when events were lost */
+    int number;
+    uint64_t tick;
+    /* Set once the first crawl is in the index */
+    unsigned crawled:1;
+    /* Set by watch-del; the last reference frees the root */
+    unsigned removed:1;
+    int refs;
+    int inotify_fd;
+    /* Written to stop the root's thread */
+    int stop_pipe[2];
+    pthread_t thread;
+    unsigned has_thread:1;
+    /* Directory names, relative to the root, by watch descriptor */
+    char **dirs;
+    int cap_dirs;
+    struct embedded_file **table;
+    size_t table_cap;
+    size_t nr_files;
+    struct embedded_file *newest;
+    struct embedded_file *oldest_gone;
+    struct embedded_file *newest_gone;
+    /* The tick and time of the newest deletion forgotten; since-queries
+     * from before it are fresh instances */
+    uint64_t forgot_tick;
+    time_t forgot_at;
+    /* The last cookie created, and the last one seen */
+    unsigned long cookie_serial;
+    unsigned long cookie_seen;
+};
+
+/* What a "since" refers to */
+enum since_kind {
+    SINCE_NONE,
+    /* A clock of the root's current number */
+    SINCE_TICKS,
+    /* A clock the root can't account for */
+    SINCE_FRESH,
+    SINCE_TIME
+};
+
+struct since {
+    enum since_kind kind;
+    uint64_t ticks;
+    time_t time;
+};
+
+enum term_op {
+    TERM_ALLOF,
+    TERM_ANYOF,
+    TERM_NOT,
+    TERM_TRUE,
+    TERM_FALSE,
+    TERM_EXISTS,
+    TERM_EMPTY,
+    TERM_SUFFIX,
+    TERM_MATCH,
+    TERM_PCRE,
+    TERM_NAME,
+    TERM_TYPE,
+    TERM_SINCE
+};
+
+/* A compiled expression term; strings are borrowed from the request */
+struct term {
+    enum term_op op;
+    int nr;
+    struct term **args;
+    const char *str;
+    const char **names;
+    int nr_names;
+    int wholename;
+    int icase;
+    regex_t re;
+    unsigned has_re:1;
+    char type;
+    struct since since;
+    /* For since terms: "oclock", "cclock", "mtime" or "ctime" */
+    const char *field;
+};
+
+/* What a crawl found in one directory, or everywhere */
+struct crawl_item {
+    char *name;
+    struct stat st;
+};
+
+struct crawl_watch {
+    int wd;
+    char *dir;
+};
+
+struct crawl {
+    struct embedded_root *root;
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    char **todo;
+    int nr_todo;
+    int cap_todo;
+    /* Crawlers reading a directory, which may add more */
+    int busy;
+    struct crawl_item *items;
+    size_t nr_items;
+    size_t cap_items;
+    struct crawl_watch *watches;
+    int nr_watches;
+    int cap_watches;
+    /* Set if a directory could not be watched for want of resources */
+    int err;
+};
+
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Broadcast when a cookie is seen or a crawl is merged */
+static pthread_cond_t engine_changed = PTHREAD_COND_INITIALIZER;
+static struct embedded_root **roots;
+static int nr_roots;
+static int next_root_number;
+static time_t engine_start;
+
+static char *
+join_path(const char *dir, const char *name)
+{
+    if (!*dir) {
+        return strdup(name);
+    }
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if (path) {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+    }
+    return path;
+}
+
+static int
+is_vcs_dir(const char *name)
+{
+    return !strcmp(name, ".git") || !strcmp(name, ".hg") ||
+           !strcmp(name, ".svn");
+}
+
+static int
+is_cookie(const char *name)
+{
+    return !strncmp(name, COOKIE_PREFIX, strlen(COOKIE_PREFIX));
+}
+
+static struct embedded_file *
+find_file(struct embedded_root *root, const char *name)
+{
+    if (!root->table_cap) {
+        return NULL;
+    }
+    uint64_t hash = watchman_fnv1a(name, strlen(name));
+    size_t i = hash & (root->table_cap - 1);
+    for (; root->table[i]; i = (i + 1) & (root->table_cap - 1)) {
+        struct embedded_file *file = root->table[i];
+        if (file->hash == hash && !strcmp(file->name, name)) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+static int
+grow_table(struct embedded_root *root)
+{
+    size_t cap = root->table_cap ? root->table_cap * 2 : 1024;
+    struct embedded_file **table = calloc(cap, sizeof(*table));
+    if (!table) {
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < root->table_cap; ++i) {
+        struct embedded_file *file = root->table[i];
+        if (file) {
+            size_t j = file->hash & (cap - 1);
+            while (table[j]) {
+                j = (j + 1) & (cap - 1);
+            }
+            table[j] = file;
+        }
+    }
+    free(root->table);
+    root->table = table;
+    root->table_cap = cap;
+    return 0;
+}
+
+static struct embedded_file *
+add_file(struct embedded_root *root, const char *name)
+{
+    if ((root->nr_files + 1) * 2 > root->table_cap && grow_table(root)) {
+        return NULL;
+    }
+    struct embedded_file *file = calloc(1, sizeof(*file));
+    if (!file || !(file->name = strdup(name))) {
+        free(file);
+        return NULL;
+    }
+    file->hash = watchman_fnv1a(name, strlen(name));
+    size_t i = file->hash & (root->table_cap - 1);
+    while (root->table[i]) {
+        i = (i + 1) & (root->table_cap - 1);
+    }
+    root->table[i] = file;
+    root->nr_files++;
+    return file;
+}
+
+static void
+unlink_recent(struct embedded_root *root, struct embedded_file *file)
+{
+    if (file->newer) {
+        file->newer->older = file->older;
+    } else if (root->newest == file) {
+        root->newest = file->older;
+    }
+    if (file->older) {
+        file->older->newer = file->newer;
+    }
+    file->newer = file->older = NULL;
+}
+
+static void
+add_gone(struct embedded_root *root, struct embedded_file *file)
+{
+    file->prev_gone = root->newest_gone;
+    file->next_gone = NULL;
+    if (root->newest_gone) {
+        root->newest_gone->next_gone = file;
+    } else {
+        root->oldest_gone = file;
+    }
+    root->newest_gone = file;
+}
+
+static void
+remove_gone(struct embedded_root *root, struct embedded_file *file)
+{
+    if (!file->prev_gone && root->oldest_gone != file) {
+        /* Not on the list, as a file just added isn't */
+        return;
+    }
+    if (file->prev_gone) {
+        file->prev_gone->next_gone = file->next_gone;
+    } else {
+        root->oldest_gone = file->next_gone;
+    }
+    if (file->next_gone) {
+        file->next_gone->prev_gone = file->prev_gone;
+    } else {
+        root->newest_gone = file->prev_gone;
+    }
+    file->next_gone = file->prev_gone = NULL;
+}
+
+/* Drops a deleted file from the index altogether */
+static void
+forget_file(struct embedded_root *root, struct embedded_file *file)
+{
+    size_t mask = root->table_cap - 1;
+    size_t i = file->hash & mask, j;
+    while (root->table[i] != file) {
+        i = (i + 1) & mask;
+    }
+    /* Moves back whatever would no longer be found past the hole */
+    for (j = (i + 1) & mask; root->table[j]; j = (j + 1) & mask) {
+        size_t home = root->table[j]->hash & mask;
+        if (i <= j ? home <= i || home > j : home <= i && home > j) {
+            root->table[i] = root->table[j];
+            i = j;
+        }
+    }
+    root->table[i] = NULL;
+    root->nr_files--;
+
+    if (file->changed_tick > root->forgot_tick) {
+        root->forgot_tick = file->changed_tick;
+    }
+    if (file->changed_at > root->forgot_at) {
+        root->forgot_at = file->changed_at;
+    }
+    remove_gone(root, file);
+    unlink_recent(root, file);
+    free(file->name);
+    free(file);
+}
+
+/* Forgets the files deleted more than GC_AGE_SECONDS ago */
+static void
+age_out(struct embedded_root *root)
+{
+    time_t cutoff = time(NULL) - GC_AGE_SECONDS;
+    while (root->oldest_gone && root->oldest_gone->changed_at < cutoff) {
+        forget_file(root, root->oldest_gone);
+    }
+}
+
+static int
+same_stat(const struct embedded_file *file, const struct stat *st)
+{
+    return file->mode == st->st_mode && file->size == st->st_size &&
+           file->ino == st->st_ino && file->dev == st->st_dev &&
+           file->nlink == st->st_nlink && file->uid == st->st_uid &&
+           file->gid == st->st_gid &&
+           file->mtime.tv_sec == st->st_mtim.tv_sec &&
+           file->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           file->ctime.tv_sec == st->st_ctim.tv_sec &&
+           file->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/* Records that 'name' now has 'st', or is gone if 'st' is NULL, taking
+ * a tick if that is news */
+static void
+note_file(struct embedded_root *root, const char *name, const struct stat *st)
+{
+    struct embedded_file *file = find_file(root, name);
+
+    if (!st) {
+        if (!file || !file->exists) {
+            return;
+        }
+        file->exists = 0;
+        add_gone(root, file);
+    } else {
+        if (!file && !(file = add_file(root, name))) {
+            return;
+        }
+        if (file->exists && same_stat(file, st)) {
+            return;
+        }
+        if (!file->exists) {
+            file->created_tick = root->tick + 1;
+            remove_gone(root, file);
+        }
+        file->exists = 1;
+        file->mode = st->st_mode;
+        file->size = st->st_size;
+        file->ino = st->st_ino;
+        file->dev = st->st_dev;
+        file->nlink = st->st_nlink;
+        file->uid = st->st_uid;
+        file->gid = st->st_gid;
+        file->mtime = st->st_mtim;
+        file->ctime = st->st_ctim;
+    }
+    file->changed_tick = ++root->tick;
+    file->changed_at = time(NULL);
+    unlink_recent(root, file);
+    file->older = root->newest;
+    if (root->newest) {
+        root->newest->newer = file;
+    }
+    root->newest = file;
+}
+
+static void
+set_dir(struct embedded_root *root, int wd, const char *dir)
+{
+    if (wd >= root->cap_dirs) {
+        int cap = root->cap_dirs ? root->cap_dirs : 64;
+        while (cap <= wd) {
+            cap *= 2;
+        }
+        char **dirs = realloc(root->dirs, sizeof(*dirs) * cap);
+        if (!dirs) {
+            return;
+        }
+        memset(dirs + root->cap_dirs, 0,
+               sizeof(*dirs) * (cap - root->cap_dirs));
+        root->dirs = dirs;
+        root->cap_dirs = cap;
+    }
+    free(root->dirs[wd]);
+    root->dirs[wd] = dir ? strdup(dir) : NULL;
+}
+
+/* Whether 'name' is 'dir' or under it */
+static int
+is_under(const char *name, const char *dir, size_t dir_len)
+{
+    return !strncmp(name, dir, dir_len) &&
+           (name[dir_len] == '/' || name[dir_len] == '\0');
+}
+
+/* Marks everything under the directory 'dir' gone and stops watching it */
+static void
+note_gone_under(struct embedded_root *root, const char *dir)
+{
+    size_t len = strlen(dir), i;
+    for (i = 0; i < root->table_cap; ++i) {
+        struct embedded_file *file = root->table[i];
+        if (file && file->exists && is_under(file->name, dir, len) &&
+            file->name[len]) {
+            note_file(root, file->name, NULL);
+        }
+    }
+    int wd;
+    for (wd = 0; wd < root->cap_dirs; ++wd) {
+        if (root->dirs[wd] && is_under(root->dirs[wd], dir, len)) {
+            inotify_rm_watch(root->inotify_fd, wd);
+            set_dir(root, wd, NULL);
+        }
+    }
+}
+
+static void
+free_root(struct embedded_root *root)
+{
+    size_t i;
+    for (i = 0; i < root->table_cap; ++i) {
+        if (root->table[i]) {
+            free(root->table[i]->name);
+            free(root->table[i]);
+        }
+    }
+    free(root->table);
+    int wd;
+    for (wd = 0; wd < root->cap_dirs; ++wd) {
+        free(root->dirs[wd]);
+    }
+    free(root->dirs);
+    if (root->inotify_fd >= 0) {
+        close(root->inotify_fd);
+    }
+    if (root->stop_pipe[0] >= 0) {
+        close(root->stop_pipe[0]);
+        close(root->stop_pipe[1]);
+    }
+    free(root->path);
+    free(root);
+}
+
+static void
+unref_root(struct embedded_root *root)
+{
+    if (--root->refs == 0 && root->removed) {
+        free_root(root);
+    }
+}
+
+static void *
+grow_array(void *array, int *cap, size_t size)
+{
+    int new_cap = *cap ? *cap * 2 : 16;
+    void *grown = realloc(array, size * new_cap);
+    if (grown) {
+        *cap = new_cap;
+    }
+    return grown;
+}
+
+/* Reads the directory 'dir', watching it first so that nothing created
+ * meanwhile is missed */
+static void
+crawl_dir(struct crawl *crawl, char *dir)
+{
+    struct embedded_root *root = crawl->root;
+    char *path = join_path(root->path, dir);
+    struct crawl_item *items = NULL;
+    size_t nr_items = 0, cap_items = 0;
+    char **subdirs = NULL;
+    int nr_subdirs = 0, cap_subdirs = 0;
+    int err = 0;
+
+    int wd = path ? inotify_add_watch(root->inotify_fd, path, WATCH_MASK) : -1;
+    if (wd < 0 && (errno == ENOSPC || errno == ENOMEM)) {
+        err = errno;
+    }
+    DIR *dirp = wd >= 0 ? opendir(path) : NULL;
+    struct dirent *entry;
+    while (dirp && (entry = readdir(dirp))) {
+        const char *name = entry->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..") ||
+            (!*dir && is_cookie(name))) {
+            continue;
+        }
+        if (nr_items == cap_items) {
+            size_t cap = cap_items ? cap_items * 2 : 64;
+            struct crawl_item *grown = realloc(items, sizeof(*items) * cap);
+            if (!grown) {
+                break;
+            }
+            items = grown;
+            cap_items = cap;
+        }
+        struct crawl_item *item = &items[nr_items];
+        if (fstatat(dirfd(dirp), name, &item->st, AT_SYMLINK_NOFOLLOW) ||
+            !(item->name = join_path(dir, name))) {
+            continue;
+        }
+        nr_items++;
+        if (S_ISDIR(item->st.st_mode) && !is_vcs_dir(name)) {
+            if (nr_subdirs == cap_subdirs) {
+                char **grown = grow_array(subdirs, &cap_subdirs,
+                                          sizeof(*subdirs));
+                if (!grown) {
+                    continue;
+                }
+                subdirs = grown;
+            }
+            subdirs[nr_subdirs++] = strdup(item->name);
+        }
+    }
+    if (dirp) {
+        closedir(dirp);
+    }
+    free(path);
+
+    pthread_mutex_lock(&crawl->lock);
+    if (err) {
+        crawl->err = err;
+    }
+    if (wd >= 0) {
+        if (crawl->nr_watches == crawl->cap_watches) {
+            struct crawl_watch *grown =
+                grow_array(crawl->watches, &crawl->cap_watches,
+                           sizeof(*crawl->watches));
+            if (grown) {
+                crawl->watches = grown;
+            }
+        }
+        if (crawl->nr_watches < crawl->cap_watches) {
+            crawl->watches[crawl->nr_watches].wd = wd;
+            crawl->watches[crawl->nr_watches++].dir = dir;
+            dir = NULL;
+        }
+    }
+    if (crawl->nr_items + nr_items > crawl->cap_items) {
+        size_t cap = crawl->cap_items ? crawl->cap_items : 1024;
+        while (cap < crawl->nr_items + nr_items) {
+            cap *= 2;
+        }
+        struct crawl_item *grown =
+            realloc(crawl->items, sizeof(*crawl->items) * cap);
+        if (grown) {
+            crawl->items = grown;
+            crawl->cap_items = cap;
+        }
+    }
+    size_t i;
+    for (i = 0; i < nr_items; ++i) {
+        if (crawl->nr_items < crawl->cap_items) {
+            crawl->items[crawl->nr_items++] = items[i];
+        } else {
+            free(items[i].name);
+        }
+    }
+    int j;
+    for (j = 0; j < nr_subdirs; ++j) {
+        if (crawl->nr_todo == crawl->cap_todo) {
+            char **grown = grow_array(crawl->todo, &crawl->cap_todo,
+                                      sizeof(*crawl->todo));
+            if (!grown) {
+                free(subdirs[j]);
+                continue;
+            }
+            crawl->todo = grown;
+        }
+        crawl->todo[crawl->nr_todo++] = subdirs[j];
+    }
+    crawl->busy--;
+    pthread_cond_broadcast(&crawl->more);
+    pthread_mutex_unlock(&crawl->lock);
+    free(dir);
+    free(items);
+    free(subdirs);
+}
+
+static void *
+crawler(void *arg)
+{
+    struct crawl *crawl = arg;
+
+    pthread_mutex_lock(&crawl->lock);
+    for (;;) {
+        while (!crawl->nr_todo && crawl->busy) {
+            pthread_cond_wait(&crawl->more, &crawl->lock);
+        }
+        if (!crawl->nr_todo) {
+            break;
+        }
+        char *dir = crawl->todo[--crawl->nr_todo];
+        crawl->busy++;
+        pthread_mutex_unlock(&crawl->lock);
+        crawl_dir(crawl, dir);
+        pthread_mutex_lock(&crawl->lock);
+    }
+    pthread_mutex_unlock(&crawl->lock);
+    return NULL;
+}
+
+/* Crawls 'dir' of the root with up to 'nr_threads' threads, the caller's
+ * included; the caller merges and releases the crawl */
+static int
+crawl_root(struct crawl *crawl, struct embedded_root *root, const char *dir,
+           int nr_threads)
+{
+    memset(crawl, 0, sizeof(*crawl));
+    crawl->root = root;
+    pthread_mutex_init(&crawl->lock, NULL);
+    pthread_cond_init(&crawl->more, NULL);
+    crawl->todo = malloc(sizeof(*crawl->todo));
+    if (!crawl->todo || !(crawl->todo[0] = strdup(dir))) {
+        return -1;
+    }
+    crawl->nr_todo = crawl->cap_todo = 1;
+
+    pthread_t threads[MAX_CRAWLERS];
+    int i, nr_started = 0;
+    for (i = 1; i < nr_threads && i < MAX_CRAWLERS; ++i) {
+        if (pthread_create(&threads[nr_started], NULL, crawler, crawl)) {
+            break;
+        }
+        nr_started++;
+    }
+    crawler(crawl);
+    for (i = 0; i < nr_started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    return 0;
+}
+
+/* Puts what the crawl found into the index */
+static void
+merge_crawl(struct crawl *crawl)
+{
+    struct embedded_root *root = crawl->root;
+    size_t i;
+    for (i = 0; i < crawl->nr_items; ++i) {
+        note_file(root, crawl->items[i].name, &crawl->items[i].st);
+    }
+    int j;
+    for (j = 0; j < crawl->nr_watches; ++j) {
+        set_dir(root, crawl->watches[j].wd, crawl->watches[j].dir);
+    }
+}
+
+static void
+release_crawl(struct crawl *crawl)
+{
+    size_t i;
+    for (i = 0; i < crawl->nr_items; ++i) {
+        free(crawl->items[i].name);
+    }
+    free(crawl->items);
+    int j;
+    for (j = 0; j < crawl->nr_watches; ++j) {
+        free(crawl->watches[j].dir);
+    }
+    free(crawl->watches);
+    for (j = 0; j < crawl->nr_todo; ++j) {
+        free(crawl->todo[j]);
+    }
+    free(crawl->todo);
+    pthread_cond_destroy(&crawl->more);
+    pthread_mutex_destroy(&crawl->lock);
+}
+
+static int
+crawler_count(void)
+{
+    int nr = watchman_nr_cpus();
+    return nr > MAX_CRAWLERS ? MAX_CRAWLERS : nr;
+}
+
+/* Looks at 'name' again after an event; new directories are added to
+ * 'new_dirs' to be crawled */
+static void
+refresh(struct embedded_root *root, const char *name, char ***new_dirs,
+        int *nr_new_dirs, int *cap_new_dirs)
+{
+    char *path = join_path(root->path, name);
+    if (!path) {
+        return;
+    }
+    struct embedded_file *file = find_file(root, name);
+    int was_dir = file && file->exists && S_ISDIR(file->mode);
+    struct stat st;
+    int gone = lstat(path, &st) != 0;
+    free(path);
+
+    note_file(root, name, gone ? NULL : &st);
+    if (was_dir && (gone || !S_ISDIR(st.st_mode))) {
+        note_gone_under(root, name);
+    }
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    if (!gone && S_ISDIR(st.st_mode) && !was_dir && !is_vcs_dir(base)) {
+        if (*nr_new_dirs == *cap_new_dirs) {
+            char **grown = grow_array(*new_dirs, cap_new_dirs,
+                                      sizeof(**new_dirs));
+            if (!grown) {
+                return;
+            }
+            *new_dirs = grown;
+        }
+        (*new_dirs)[(*nr_new_dirs)++] = strdup(name);
+    }
+}
+
+/* Starts the root over, after inotify lost events: everything is crawled
+ * again under a new number, so that older clocks are fresh instances */
+static void
+recrawl(struct embedded_root *root)
+{
+    struct crawl crawl;
+    int wd;
+
+    pthread_mutex_lock(&engine_lock);
+    for (wd = 0; wd < root->cap_dirs; ++wd) {
+        set_dir(root, wd, NULL);
+    }
+    pthread_mutex_unlock(&engine_lock);
+    int failed = crawl_root(&crawl, root, "", crawler_count());
+    pthread_mutex_lock(&engine_lock);
+    size_t i;
+    for (i = 0; i < root->table_cap; ++i) {
+        struct embedded_file *file = root->table[i];
+        if (file && file->exists) {
+            /* Whatever the crawl doesn't find again is gone */
+            file->exists = 0;
+            add_gone(root, file);
+        }
+    }
+    root->number = ++next_root_number;
+    if (!failed) {
+        merge_crawl(&crawl);
+    }
+    /* No clock can ask about deletions from before the new number */
+    while (root->oldest_gone) {
+        forget_file(root, root->oldest_gone);
+    }
+    pthread_cond_broadcast(&engine_changed);
+    pthread_mutex_unlock(&engine_lock);
+    release_crawl(&crawl);
+}
+
+/* Applies the root's inotify events to its index until stopped */
+static void *
+watch_root(void *arg)
+{
+    struct embedded_root *root = arg;
+    /* Aligned for the events read into it */
+    union {
+        struct inotify_event event;
+        char buf[65536];
+    } events;
+    char *buf = events.buf;
+
+    for (;;) {
+        struct pollfd pfds[2] = {{root->inotify_fd, POLLIN, 0},
+                                 {root->stop_pipe[0], POLLIN, 0}};
+        int ready = poll(pfds, 2, GC_INTERVAL_MS);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfds[1].revents) {
+            break;
+        }
+        if (!ready) {
+            pthread_mutex_lock(&engine_lock);
+            age_out(root);
+            pthread_mutex_unlock(&engine_lock);
+            continue;
+        }
+        ssize_t len = read(root->inotify_fd, buf, sizeof(events.buf));
+        if (len <= 0) {
+            if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            break;
+        }
+
+        char **new_dirs = NULL;
+        int nr_new_dirs = 0, cap_new_dirs = 0, overflow = 0;
+        char *p;
+        pthread_mutex_lock(&engine_lock);
+        for (p = buf; p < buf + len;) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(*event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflow = 1;
+                continue;
+            }
+            if (event->wd < 0 || event->wd >= root->cap_dirs ||
+                !root->dirs[event->wd]) {
+                continue;
+            }
+            const char *dir = root->dirs[event->wd];
+            if (event->mask & IN_IGNORED) {
+                set_dir(root, event->wd, NULL);
+                continue;
+            }
+            if (!event->len) {
+                /* The directory itself; the root's own are of no
+                 * interest */
+                if (*dir) {
+                    /* A copy, since refresh() may stop watching it */
+                    char *copy = strdup(dir);
+                    if (copy) {
+                        refresh(root, copy, &new_dirs, &nr_new_dirs,
+                                &cap_new_dirs);
+                        free(copy);
+                    }
+                }
+                continue;
+            }
+            if (!*dir && is_cookie(event->name)) {
+                const char *serial = strrchr(event->name, '-');
+                unsigned long seen = strtoul(serial + 1, NULL, 10);
+                if (seen > root->cookie_seen) {
+                    root->cookie_seen = seen;
+                }
+                continue;
+            }
+            char *name = join_path(dir, event->name);
+            if (name) {
+                refresh(root, name, &new_dirs, &nr_new_dirs, &cap_new_dirs);
+                free(name);
+            }
+        }
+        age_out(root);
+        pthread_mutex_unlock(&engine_lock);
+
+        /* New directories may have been filled before they were watched */
+        int i;
+        for (i = 0; i < nr_new_dirs; ++i) {
+            struct crawl crawl;
+            if (!overflow) {
+                if (!crawl_root(&crawl, root, new_dirs[i], 1)) {
+                    pthread_mutex_lock(&engine_lock);
+                    merge_crawl(&crawl);
+                    pthread_mutex_unlock(&engine_lock);
+                    overflow = crawl.err != 0;
+                }
+                release_crawl(&crawl);
+            }
+            free(new_dirs[i]);
+        }
+        free(new_dirs);
+        if (overflow) {
+            recrawl(root);
+        }
+
+        pthread_mutex_lock(&engine_lock);
+        pthread_cond_broadcast(&engine_changed);
+        pthread_mutex_unlock(&engine_lock);
+    }
+    return NULL;
+}
+
+static struct embedded_root *
+find_root(const char *path)
+{
+    int i;
+    for (i = 0; i < nr_roots; ++i) {
+        if (!strcmp(roots[i]->path, path)) {
+            return roots[i];
+        }
+    }
+    return NULL;
+}
+
+/* Waits, with the lock held, for the root to be crawled; returns 1 if it
+ * was removed instead */
+static int
+wait_crawled(struct embedded_root *root)
+{
+    root->refs++;
+    while (!root->crawled && !root->removed) {
+        pthread_cond_wait(&engine_changed, &engine_lock);
+    }
+    int removed = root->removed;
+    unref_root(root);
+    return removed;
+}
+
+/* Returns the watched root at 'path', crawled, or NULL with 'error' set */
+static struct embedded_root *
+resolve_root(const char *path, char **error)
+{
+    struct embedded_root *root = find_root(path);
+    if (!root) {
+        char *real = realpath(path, NULL);
+        root = real ? find_root(real) : NULL;
+        free(real);
+    }
+    if (!root || wait_crawled(root)) {
+        if (asprintf(error, "unable to resolve root %s: directory %s is "
+                     "not watched", path, path) < 0) {
+            *error = NULL;
+        }
+        return NULL;
+    }
+    return root;
+}
+
+/* Returns the root watching 'path', watching and crawling it first if need
+ * be; called with the lock held */
+static struct embedded_root *
+watch(const char *path, char **error)
+{
+    struct embedded_root *root = find_root(path);
+    if (root) {
+        return wait_crawled(root) ? watch(path, error) : root;
+    }
+
+    struct embedded_root **grown =
+        realloc(roots, sizeof(*roots) * (nr_roots + 1));
+    root = calloc(1, sizeof(*root));
+    if (!grown || !root || !(root->path = strdup(path))) {
+        if (grown) {
+            roots = grown;
+        }
+        free(root);
+        *error = strdup("out of memory");
+        return NULL;
+    }
+    roots = grown;
+    root->stop_pipe[0] = root->stop_pipe[1] = -1;
+    root->inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (root->inotify_fd < 0 || pipe(root->stop_pipe)) {
+        if (asprintf(error, "unable to watch %s: %s", path,
+                     strerror(errno)) < 0) {
+            *error = NULL;
+        }
+        free_root(root);
+        return NULL;
+    }
+    root->number = ++next_root_number;
+    root->refs = 1;
+    roots[nr_roots++] = root;
+
+    /* Others asking for the root meanwhile wait for the crawl */
+    struct crawl crawl;
+    pthread_mutex_unlock(&engine_lock);
+    int failed = crawl_root(&crawl, root, "", crawler_count());
+    pthread_mutex_lock(&engine_lock);
+    if (!failed && !crawl.err && !root->removed) {
+        merge_crawl(&crawl);
+        root->crawled = 1;
+        root->has_thread =
+            !pthread_create(&root->thread, NULL, watch_root, root);
+    }
+    if (!root->has_thread) {
+        int i;
+        for (i = 0; i < nr_roots && roots[i] != root; ++i) {
+        }
+        if (i < nr_roots) {
+            roots[i] = roots[--nr_roots];
+        }
+        if (asprintf(error, "unable to watch %s: %s", path,
+                     crawl.err ? strerror(crawl.err)
+                               : "could not crawl it") < 0) {
+            *error = NULL;
+        }
+        root->removed = 1;
+        root->crawled = 0;
+        pthread_cond_broadcast(&engine_changed);
+        unref_root(root);
+        root = NULL;
+    } else {
+        pthread_cond_broadcast(&engine_changed);
+        root->refs--;
+    }
+    release_crawl(&crawl);
+    return root;
+}
+
+static void
+unwatch(struct embedded_root *root)
+{
+    int i;
+    for (i = 0; i < nr_roots && roots[i] != root; ++i) {
+    }
+    roots[i] = roots[--nr_roots];
+    root->removed = 1;
+    root->refs++;
+    if (write(root->stop_pipe[1], "", 1) < 0) {
+        /* The thread is gone already */
+    }
+    pthread_mutex_unlock(&engine_lock);
+    pthread_join(root->thread, NULL);
+    pthread_mutex_lock(&engine_lock);
+    pthread_cond_broadcast(&engine_changed);
+    unref_root(root);
+}
+
+/* Waits until the index has every change made before now, for up to
+ * 'timeout' ms; returns 1 on timing out */
+static int
+sync_root(struct embedded_root *root, int64_t timeout)
+{
+    char *path;
+    unsigned long serial = ++root->cookie_serial;
+    if (asprintf(&path, "%s/" COOKIE_PREFIX "%d-%lu", root->path,
+                 (int)getpid(), serial) < 0) {
+        return 0;
+    }
+    int fd = open(path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        /* Nothing can be changing in a root we can't write to */
+        free(path);
+        return 0;
+    }
+    close(fd);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    root->refs++;
+    int timed_out = 0;
+    while (root->cookie_seen < serial && !root->removed && !timed_out) {
+        timed_out = pthread_cond_timedwait(&engine_changed, &engine_lock,
+                                           &deadline) == ETIMEDOUT;
+    }
+    timed_out = root->cookie_seen < serial;
+    unref_root(root);
+    unlink(path);
+    free(path);
+    return timed_out;
+}
+
+static char *
+make_clock(const struct embedded_root *root, uint64_t tick)
+{
+    char *clock;
+    if (asprintf(&clock, "c:%ld:%d:%d:%llu", (long)engine_start,
+                 (int)getpid(), root->number,
+                 (unsigned long long)tick) < 0) {
+        return NULL;
+    }
+    return clock;
+}
+
+static int
+parse_since(const struct embedded_root *root, json_t *value,
+            struct since *since)
+{
+    if (json_is_integer(value)) {
+        since->time = json_integer_value(value);
+        /* Deletions since then may have been forgotten */
+        since->kind =
+            since->time < root->forgot_at ? SINCE_FRESH : SINCE_TIME;
+        return 0;
+    }
+    if (!json_is_string(value)) {
+        return -1;
+    }
+    const char *clock = json_string_value(value);
+    char *current = make_clock(root, 0);
+    size_t prefix_len, current_prefix;
+    uint64_t ticks, zero;
+    since->kind = SINCE_FRESH;
+    if (current &&
+        !watchman_split_clock(clock, strlen(clock), &prefix_len, &ticks) &&
+        !watchman_split_clock(current, strlen(current), &current_prefix,
+                              &zero) &&
+        prefix_len == current_prefix && !memcmp(clock, current, prefix_len) &&
+        ticks <= root->tick && ticks >= root->forgot_tick) {
+        since->kind = SINCE_TICKS;
+        since->ticks = ticks;
+    }
+    free(current);
+    return 0;
+}
+
+static void
+free_term(struct term *term)
+{
+    if (!term) {
+        return;
+    }
+    int i;
+    for (i = 0; i < term->nr; ++i) {
+        free_term(term->args[i]);
+    }
+    free(term->args);
+    free(term->names);
+    if (term->has_re) {
+        regfree(&term->re);
+    }
+    free(term);
+}
+
+/* Reads the optional "basename"/"wholename" argument at 'index' */
+static int
+parse_scope(json_t *expr, size_t index, int *wholename)
+{
+    json_t *scope = json_array_get(expr, index);
+    if (!scope) {
+        return 0;
+    }
+    const char *str = json_string_value(scope);
+    if (!str || (strcmp(str, "basename") && strcmp(str, "wholename"))) {
+        return -1;
+    }
+    *wholename = !strcmp(str, "wholename");
+    return 0;
+}
+
+static struct term *
+compile_term(const struct embedded_root *root, json_t *expr, char **error)
+{
+    struct term *term = calloc(1, sizeof(*term));
+    const char *op = json_is_string(expr)
+                         ? json_string_value(expr)
+                         : json_string_value(json_array_get(expr, 0));
+    json_t *arg = json_array_get(expr, 1);
+    size_t i;
+
+    if (!term || !op) {
+        goto bad;
+    }
+    if (!strcmp(op, "allof") || !strcmp(op, "anyof") || !strcmp(op, "not")) {
+        term->op = op[0] == 'n' ? TERM_NOT
+                   : op[0] == 'a' && op[1] == 'l' ? TERM_ALLOF : TERM_ANYOF;
+        term->nr = json_array_size(expr) - 1;
+        if (term->nr < 1 || (term->op == TERM_NOT && term->nr != 1)) {
+            goto bad;
+        }
+        term->args = calloc(term->nr, sizeof(*term->args));
+        for (i = 0; term->args && i < (size_t)term->nr; ++i) {
+            term->args[i] = compile_term(root, json_array_get(expr, i + 1),
+                                         error);
+            if (!term->args[i]) {
+                free_term(term);
+                return NULL;
+            }
+        }
+        if (!term->args) {
+            goto bad;
+        }
+    } else if (!strcmp(op, "true")) {
+        term->op = TERM_TRUE;
+    } else if (!strcmp(op, "false")) {
+        term->op = TERM_FALSE;
+    } else if (!strcmp(op, "exists")) {
+        term->op = TERM_EXISTS;
+    } else if (!strcmp(op, "empty")) {
+        term->op = TERM_EMPTY;
+    } else if (!strcmp(op, "suffix")) {
+        term->op = TERM_SUFFIX;
+        if (!(term->str = json_string_value(arg))) {
+            goto bad;
+        }
+    } else if (!strcmp(op, "match") || !strcmp(op, "imatch")) {
+        term->op = TERM_MATCH;
+        term->icase = op[0] == 'i';
+        if (!(term->str = json_string_value(arg)) ||
+            parse_scope(expr, 2, &term->wholename)) {
+            goto bad;
+        }
+    } else if (!strcmp(op, "pcre") || !strcmp(op, "ipcre")) {
+        term->op = TERM_PCRE;
+        if (!(term->str = json_string_value(arg)) ||
+            parse_scope(expr, 2, &term->wholename) ||
+            regcomp(&term->re, term->str, REG_EXTENDED | REG_NOSUB |
+                                          (op[0] == 'i' ? REG_ICASE : 0))) {
+            goto bad;
+        }
+        term->has_re = 1;
+    } else if (!strcmp(op, "name") || !strcmp(op, "iname")) {
+        term->op = TERM_NAME;
+        term->icase = op[0] == 'i';
+        term->nr_names = json_is_array(arg) ? (int)json_array_size(arg) : 1;
+        term->names = calloc(term->nr_names ? term->nr_names : 1,
+                             sizeof(*term->names));
+        if (!term->names || parse_scope(expr, 2, &term->wholename)) {
+            goto bad;
+        }
+        for (i = 0; i < (size_t)term->nr_names; ++i) {
+            json_t *name = json_is_array(arg) ? json_array_get(arg, i) : arg;
+            if (!(term->names[i] = json_string_value(name))) {
+                goto bad;
+            }
+        }
+    } else if (!strcmp(op, "type")) {
+        term->op = TERM_TYPE;
+        const char *type = json_string_value(arg);
+        if (!type || strlen(type) != 1) {
+            goto bad;
+        }
+        term->type = type[0];
+    } else if (!strcmp(op, "since")) {
+        term->op = TERM_SINCE;
+        json_t *field = json_array_get(expr, 2);
+        term->field = field ? json_string_value(field) : "oclock";
+        if (!term->field || parse_since(root, arg, &term->since) ||
+            (strcmp(term->field, "oclock") && strcmp(term->field, "cclock") &&
+             strcmp(term->field, "mtime") && strcmp(term->field, "ctime"))) {
+            goto bad;
+        }
+    } else {
+        if (asprintf(error, "unsupported expression term '%s'", op) < 0) {
+            *error = NULL;
+        }
+        free_term(term);
+        return NULL;
+    }
+    return term;
+
+bad:
+    if (asprintf(error, "invalid expression term '%s'", op ? op : "") < 0) {
+        *error = NULL;
+    }
+    free_term(term);
+    return NULL;
+}
+
+static char
+file_type(mode_t mode)
+{
+    return S_ISREG(mode) ? 'f' : S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l'
+           : S_ISBLK(mode) ? 'b' : S_ISCHR(mode) ? 'c' : S_ISFIFO(mode) ? 'p'
+           : S_ISSOCK(mode) ? 's' : '?';
+}
+
+static int
+has_suffix(const char *name, const char *suffix)
+{
+    size_t len = strlen(name), suffix_len = strlen(suffix);
+    return len > suffix_len && name[len - suffix_len - 1] == '.' &&
+           !strcasecmp(name + len - suffix_len, suffix);
+}
+
+static int
+eval_since(const struct term *term, const struct embedded_file *file)
+{
+    const struct since *since = &term->since;
+    if (!strcmp(term->field, "mtime") || !strcmp(term->field, "ctime")) {
+        time_t t = term->field[0] == 'm' ? file->mtime.tv_sec
+                                         : file->ctime.tv_sec;
+        return since->kind == SINCE_TIME ? t > since->time : 1;
+    }
+    uint64_t tick = term->field[0] == 'o' ? file->changed_tick
+                                          : file->created_tick;
+    switch (since->kind) {
+        case SINCE_TICKS:
+            return tick > since->ticks;
+        case SINCE_TIME:
+            return file->changed_at > since->time;
+        default:
+            return 1;
+    }
+}
+
+/* 'name' is relative to the query's relative_root */
+static int
+eval_term(const struct term *term, const struct embedded_file *file,
+          const char *name)
+{
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    const char *subject = term->wholename ? name : base;
+    int i;
+
+    switch (term->op) {
+        case TERM_ALLOF:
+            for (i = 0; i < term->nr; ++i) {
+                if (!eval_term(term->args[i], file, name)) {
+                    return 0;
+                }
+            }
+            return 1;
+        case TERM_ANYOF:
+            for (i = 0; i < term->nr; ++i) {
+                if (eval_term(term->args[i], file, name)) {
+                    return 1;
+                }
+            }
+            return 0;
+        case TERM_NOT:
+            return !eval_term(term->args[0], file, name);
+        case TERM_TRUE:
+            return 1;
+        case TERM_FALSE:
+            return 0;
+        case TERM_EXISTS:
+            return file->exists;
+        case TERM_EMPTY:
+            return file->exists && S_ISREG(file->mode) && file->size == 0;
+        case TERM_SUFFIX:
+            return has_suffix(name, term->str);
+        case TERM_MATCH:
+            return !fnmatch(term->str, subject,
+                            FNM_PERIOD | (term->wholename ? FNM_PATHNAME : 0) |
+                            (term->icase ? FNM_CASEFOLD : 0));
+        case TERM_PCRE:
+            return !regexec(&term->re, subject, 0, NULL, 0);
+        case TERM_NAME:
+            for (i = 0; i < term->nr_names; ++i) {
+                if (term->icase ? !strcasecmp(term->names[i], subject)
+                                : !strcmp(term->names[i], subject)) {
+                    return 1;
+                }
+            }
+            return 0;
+        case TERM_TYPE:
+            return file_type(file->mode) == term->type;
+        case TERM_SINCE:
+            return eval_since(term, file);
+    }
+    return 0;
+}
+
+/* Whether 'name' is picked by the query's suffix and path generators */
+static int
+generated(json_t *spec, const char *name)
+{
+    json_t *suffixes = json_object_get(spec, "suffix");
+    json_t *paths = json_object_get(spec, "path");
+    size_t i;
+
+    if (!suffixes && !paths) {
+        return 1;
+    }
+    if (json_is_string(suffixes)) {
+        if (has_suffix(name, json_string_value(suffixes))) {
+            return 1;
+        }
+    }
+    for (i = 0; i < json_array_size(suffixes); ++i) {
+        const char *suffix = json_string_value(json_array_get(suffixes, i));
+        if (suffix && has_suffix(name, suffix)) {
+            return 1;
+        }
+    }
+    for (i = 0; i < json_array_size(paths); ++i) {
+        json_t *path = json_array_get(paths, i);
+        json_int_t depth = -1;
+        if (json_is_object(path)) {
+            depth = json_integer_value(json_object_get(path, "depth"));
+            path = json_object_get(path, "path");
+        }
+        const char *dir = json_string_value(path);
+        if (!dir) {
+            continue;
+        }
+        size_t len = strlen(dir);
+        const char *rest = name;
+        if (len) {
+            if (!is_under(name, dir, len) || !name[len]) {
+                continue;
+            }
+            rest = name + len + 1;
+        }
+        json_int_t slashes = 0;
+        for (; *rest; ++rest) {
+            slashes += *rest == '/';
+        }
+        if (depth < 0 || slashes <= depth) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static json_t *
+time_json(const struct timespec *t, const char *unit)
+{
+    if (!*unit) {
+        return json_integer(t->tv_sec);
+    }
+    if (!strcmp(unit, "_ms")) {
+        return json_integer((json_int_t)t->tv_sec * 1000 +
+                            t->tv_nsec / 1000000);
+    }
+    if (!strcmp(unit, "_us")) {
+        return json_integer((json_int_t)t->tv_sec * 1000000 +
+                            t->tv_nsec / 1000);
+    }
+    if (!strcmp(unit, "_ns")) {
+        return json_integer((json_int_t)t->tv_sec * 1000000000 + t->tv_nsec);
+    }
+    return json_real(t->tv_sec + t->tv_nsec / 1e9);
+}
+
+static json_t *
+file_json(const struct embedded_root *root, const struct embedded_file *file,
+          const char *name, json_t *fields, const struct since *since)
+{
+    const char *only = json_array_size(fields) == 1
+                           ? json_string_value(json_array_get(fields, 0))
+                           : NULL;
+    if (only && !strcmp(only, "name")) {
+        return json_string(name);
+    }
+
+    json_t *obj = json_object();
+    size_t i;
+    for (i = 0; i < json_array_size(fields); ++i) {
+        const char *field = json_string_value(json_array_get(fields, i));
+        json_t *value = NULL;
+        if (!field) {
+            continue;
+        }
+        if (!strcmp(field, "name")) {
+            value = json_string(name);
+        } else if (!strcmp(field, "exists")) {
+            value = json_boolean(file->exists);
+        } else if (!strcmp(field, "new")) {
+            value = json_boolean(since->kind == SINCE_TICKS &&
+                                 file->created_tick > since->ticks);
+        } else if (!strcmp(field, "size")) {
+            value = json_integer(file->size);
+        } else if (!strcmp(field, "mode")) {
+            value = json_integer(file->mode);
+        } else if (!strcmp(field, "uid")) {
+            value = json_integer(file->uid);
+        } else if (!strcmp(field, "gid")) {
+            value = json_integer(file->gid);
+        } else if (!strcmp(field, "ino")) {
+            value = json_integer(file->ino);
+        } else if (!strcmp(field, "dev")) {
+            value = json_integer(file->dev);
+        } else if (!strcmp(field, "nlink")) {
+            value = json_integer(file->nlink);
+        } else if (!strncmp(field, "mtime", 5)) {
+            value = time_json(&file->mtime, field + 5);
+        } else if (!strncmp(field, "ctime", 5)) {
+            value = time_json(&file->ctime, field + 5);
+        } else if (!strcmp(field, "oclock") || !strcmp(field, "cclock")) {
+            char *clock = make_clock(root, field[0] == 'o'
+                                               ? file->changed_tick
+                                               : file->created_tick);
+            value = clock ? json_string(clock) : NULL;
+            free(clock);
+        } else if (!strcmp(field, "type")) {
+            char type[2] = {file_type(file->mode), 0};
+            value = json_string(type);
+        }
+        if (value) {
+            json_object_set_new(obj, field, value);
+        }
+    }
+    return obj;
+}
+
+/* Adds the file to 'files' if the query wants it */
+static void
+consider(const struct embedded_root *root, const struct embedded_file *file,
+         json_t *spec, const char *relative_root, const struct term *expr,
+         json_t *fields, const struct since *since, json_t *files)
+{
+    const char *name = file->name;
+    if (relative_root) {
+        size_t len = strlen(relative_root);
+        if (!is_under(name, relative_root, len) || !name[len]) {
+            return;
+        }
+        name += len + 1;
+    }
+    if (generated(spec, name) && (!expr || eval_term(expr, file, name))) {
+        json_array_append_new(files, file_json(root, file, name, fields,
+                                               since));
+    }
+}
+
+static json_t *
+query(struct embedded_root *root, json_t *spec, char **error)
+{
+    json_t *since_json = json_object_get(spec, "since");
+    json_t *sync = json_object_get(spec, "sync_timeout");
+    const char *relative_root =
+        json_string_value(json_object_get(spec, "relative_root"));
+    json_t *fields = json_object_get(spec, "fields");
+    json_t *default_fields = NULL;
+    struct since since = {SINCE_NONE, 0, 0};
+    struct term *expr = NULL;
+
+    if (!json_is_object(spec)) {
+        *error = strdup("query must be an object");
+        return NULL;
+    }
+    int64_t timeout = sync ? json_integer_value(sync) : DEFAULT_SYNC_TIMEOUT;
+    if (timeout > 0 && sync_root(root, timeout)) {
+        *error = strdup("sync_timeout expired");
+        return NULL;
+    }
+    if (root->removed) {
+        *error = strdup("root was deleted");
+        return NULL;
+    }
+    if (since_json && parse_since(root, since_json, &since)) {
+        *error = strdup("invalid since");
+        return NULL;
+    }
+    json_t *expr_json = json_object_get(spec, "expression");
+    if (expr_json && !(expr = compile_term(root, expr_json, error))) {
+        return NULL;
+    }
+    if (!fields) {
+        fields = default_fields = json_array();
+        json_array_append_new(fields, json_string("name"));
+        json_array_append_new(fields, json_string("exists"));
+        json_array_append_new(fields, json_string("new"));
+        json_array_append_new(fields, json_string("size"));
+        json_array_append_new(fields, json_string("mode"));
+    }
+    if (relative_root && !*relative_root) {
+        relative_root = NULL;
+    }
+
+    int fresh = since.kind == SINCE_NONE || since.kind == SINCE_FRESH;
+    json_t *files = json_array();
+    if (since.kind == SINCE_TICKS || since.kind == SINCE_TIME) {
+        /* Only what changed since, newest first, including deletions */
+        const struct embedded_file *file;
+        for (file = root->newest; file; file = file->older) {
+            if (since.kind == SINCE_TICKS ? file->changed_tick <= since.ticks
+                                          : file->changed_at <= since.time) {
+                break;
+            }
+            consider(root, file, spec, relative_root, expr, fields, &since,
+                     files);
+        }
+    } else if (!json_is_true(json_object_get(spec,
+                                             "empty_on_fresh_instance"))) {
+        size_t i;
+        for (i = 0; i < root->table_cap; ++i) {
+            const struct embedded_file *file = root->table[i];
+            if (file && file->exists) {
+                consider(root, file, spec, relative_root, expr, fields,
+                         &since, files);
+            }
+        }
+    }
+    free_term(expr);
+    json_decref(default_fields);
+
+    json_t *result = json_object();
+    char *clock = make_clock(root, root->tick);
+    json_object_set_new(result, "clock", json_string(clock ? clock : ""));
+    free(clock);
+    json_object_set_new(result, "is_fresh_instance", json_boolean(fresh));
+    json_object_set_new(result, "files", files);
+    return result;
+}
+
+/* Finds the directory to watch for watch-project: the nearest one up from
+ * 'path' that looks like the top of a project */
+static char *
+project_root(const char *path)
+{
+    static const char *markers[] = {".watchmanconfig", ".git", ".hg",
+                                    ".svn"};
+    char *dir = strdup(path);
+    while (dir) {
+        size_t i;
+        for (i = 0; i < sizeof(markers) / sizeof(*markers); ++i) {
+            char *marker = join_path(dir, markers[i]);
+            int found = marker && !access(marker, F_OK);
+            free(marker);
+            if (found) {
+                return dir;
+            }
+        }
+        char *slash = strrchr(dir, '/');
+        if (!slash || slash == dir) {
+            break;
+        }
+        *slash = '\0';
+    }
+    free(dir);
+    return strdup(path);
+}
+
+static json_t *
+handle(json_t *request, char **error)
+{
+    const char *command = json_string_value(json_array_get(request, 0));
+    const char *path = json_string_value(json_array_get(request, 1));
+    json_t *reply = NULL;
+    struct embedded_root *root;
+
+    if (!command) {
+        *error = strdup("invalid command");
+        return NULL;
+    }
+    if (!strcmp(command, "version")) {
+        return json_object();
+    }
+    if (!strcmp(command, "watch-list")) {
+        json_t *list = json_array();
+        int i;
+        for (i = 0; i < nr_roots; ++i) {
+            json_array_append_new(list, json_string(roots[i]->path));
+        }
+        reply = json_object();
+        json_object_set_new(reply, "roots", list);
+        return reply;
+    }
+    if (!path && (!strcmp(command, "watch") ||
+                  !strcmp(command, "watch-project") ||
+                  !strcmp(command, "watch-del") ||
+                  !strcmp(command, "clock") || !strcmp(command, "query") ||
+                  !strcmp(command, "debug-recrawl"))) {
+        if (asprintf(error, "%s needs a path", command) < 0) {
+            *error = NULL;
+        }
+        return NULL;
+    }
+
+    if (!strcmp(command, "watch") || !strcmp(command, "watch-project")) {
+        char *real = realpath(path, NULL);
+        struct stat st;
+        if (!real || stat(real, &st) || !S_ISDIR(st.st_mode)) {
+            if (asprintf(error, "unable to resolve root %s: %s", path,
+                         real ? "not a directory" : strerror(errno)) < 0) {
+                *error = NULL;
+            }
+            free(real);
+            return NULL;
+        }
+        int project = command[5] == '-';
+        char *top = project ? project_root(real) : strdup(real);
+        root = top ? watch(top, error) : NULL;
+        if (root) {
+            reply = json_object();
+            json_object_set_new(reply, "watch", json_string(root->path));
+            json_object_set_new(reply, "watcher", json_string("inotify"));
+            size_t len = strlen(top);
+            if (project && real[len]) {
+                json_object_set_new(reply, "relative_path",
+                                    json_string(real + len + 1));
+            }
+        }
+        free(top);
+        free(real);
+        return reply;
+    }
+    if (!strcmp(command, "watch-del")) {
+        if (!(root = resolve_root(path, error))) {
+            return NULL;
+        }
+        reply = json_object();
+        json_object_set_new(reply, "watch-del", json_true());
+        json_object_set_new(reply, "root", json_string(root->path));
+        unwatch(root);
+        return reply;
+    }
+    if (!strcmp(command, "clock")) {
+        json_t *options = json_array_get(request, 2);
+        json_t *sync = json_object_get(options, "sync_timeout");
+        if (!(root = resolve_root(path, error))) {
+            return NULL;
+        }
+        if (sync && json_integer_value(sync) > 0 &&
+            sync_root(root, json_integer_value(sync))) {
+            *error = strdup("sync_timeout expired");
+            return NULL;
+        }
+        char *clock = make_clock(root, root->tick);
+        reply = json_object();
+        json_object_set_new(reply, "clock", json_string(clock ? clock : ""));
+        free(clock);
+        return reply;
+    }
+    if (!strcmp(command, "query")) {
+        if (!(root = resolve_root(path, error))) {
+            return NULL;
+        }
+        root->refs++;
+        reply = query(root, json_array_get(request, 2), error);
+        unref_root(root);
+        return reply;
+    }
+    if (!strcmp(command, "debug-recrawl")) {
+        if (!(root = resolve_root(path, error))) {
+            return NULL;
+        }
+        root->refs++;
+        pthread_mutex_unlock(&engine_lock);
+        recrawl(root);
+        pthread_mutex_lock(&engine_lock);
+        unref_root(root);
+        reply = json_object();
+        json_object_set_new(reply, "recrawl", json_true());
+        return reply;
+    }
+    if (asprintf(error, "%s is not supported by the embedded engine",
+                 command) < 0) {
+        *error = NULL;
+    }
+    return NULL;
+}
+
+/* Serves one connection until the library closes its end */
+static void *
+serve(void *arg)
+{
+    struct watchman_connection *conn = arg;
+    json_t *request;
+
+    while ((request = watchman_read_request(conn, NULL))) {
+        char *error = NULL;
+        pthread_mutex_lock(&engine_lock);
+        json_t *reply = handle(request, &error);
+        pthread_mutex_unlock(&engine_lock);
+        json_decref(request);
+        if (!reply) {
+            reply = json_object();
+            json_object_set_new(reply, "error",
+                                json_string(error ? error : "out of memory"));
+        }
+        free(error);
+        json_object_set_new(reply, "version", json_string(EMBEDDED_VERSION));
+        int failed = watchman_send_reply(conn, reply, NULL);
+        json_decref(reply);
+        if (failed) {
+            break;
+        }
+    }
+    watchman_connection_close(conn);
+    return NULL;
+}
+
+struct watchman_connection *
+watchman_connect_embedded(struct watchman_error *error)
+{
+    int fds[2];
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+        watchman_err(error, WATCHMAN_ERR_CONNECT,
+                     "Can't start the embedded engine: %s", strerror(errno));
+        return NULL;
+    }
+    pthread_mutex_lock(&engine_lock);
+    if (!engine_start) {
+        engine_start = time(NULL);
+    }
+    pthread_mutex_unlock(&engine_lock);
+
+    struct watchman_connection *server =
+        watchman_connection_from_fd(fds[1], error);
+    if (!server) {
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+    struct watchman_connection *conn =
+        watchman_connection_from_fd(fds[0], error);
+    if (!conn) {
+        watchman_connection_close(server);
+        close(fds[0]);
+        return NULL;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int failed = pthread_create(&thread, &attr, serve, server);
+    pthread_attr_destroy(&attr);
+    if (failed) {
+        watchman_connection_close(server);
+        watchman_connection_close(conn);
+        watchman_err(error, WATCHMAN_ERR_CONNECT,
+                     "Can't start the embedded engine: %s", strerror(failed));
+        return NULL;
+    }
+    return conn;
+}
+
+#else
+
+struct watchman_connection *
+watchman_connect_embedded(struct watchman_error *error)
+{
+    watchman_err(error, WATCHMAN_ERR_CONNECT,
+                 "libwatchman was built without --enable-embedded");
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,378 @@
+#include "watchman_private.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The queries to run are laid out as tasks up front.  Each connection
+ * gets a worker thread (the caller's thread works the first) which
+ * takes the next task until there are none left, so that a slow part
+ * doesn't hold up the others' connections.
+ */
+
+struct fanout_task {
+    const char *fs_path;
+    const struct watchman_query *query;
+    /* A copy of the caller's query that shares its strings, but for a
+     * share of its paths */
+    struct watchman_query part;
+    struct watchman_query_result *result;
+    struct watchman_error error;
+};
+
+struct fanout {
+    pthread_mutex_t lock;
+    struct fanout_task *tasks;
+    int nr_tasks;
+    /* The next task to take */
+    int next;
+    const struct watchman_expression *expr;
+    const struct timespec *deadline;
+};
+
+struct fanout_worker {
+    struct fanout *fanout;
+    struct watchman_connection *conn;
+    pthread_t thread;
+};
+
+static void *
+run_tasks(void *arg)
+{
+    struct fanout_worker *worker = arg;
+    struct fanout *fanout = worker->fanout;
+
+    for (;;) {
+        pthread_mutex_lock(&fanout->lock);
+        int i = fanout->next++;
+        pthread_mutex_unlock(&fanout->lock);
+        if (i >= fanout->nr_tasks) {
+            break;
+        }
+        struct fanout_task *task = &fanout->tasks[i];
+        task->error.message = NULL;
+        task->result = watchman_do_query_deadline(worker->conn,
+                                                  task->fs_path, task->query,
+                                                  fanout->expr,
+                                                  fanout->deadline,
+                                                  &task->error);
+    }
+    return NULL;
+}
+
+static void
+run_fanout(struct watchman_connection *const *conns, int nr_conns,
+           struct fanout *fanout)
+{
+    int nr_workers = nr_conns < fanout->nr_tasks ? nr_conns : fanout->nr_tasks;
+    struct fanout_worker first = {.fanout = fanout, .conn = conns[0]};
+    struct fanout_worker *workers = NULL;
+    int i, nr_started = 0;
+
+    pthread_mutex_init(&fanout->lock, NULL);
+    if (nr_workers > 1) {
+        workers = calloc(nr_workers - 1, sizeof(*workers));
+    }
+    /* Should threads run short, fewer workers take more tasks each */
+    for (i = 0; workers && i < nr_workers - 1; ++i) {
+        workers[i].fanout = fanout;
+        workers[i].conn = conns[i + 1];
+        if (pthread_create(&workers[i].thread, NULL, run_tasks,
+                           &workers[i])) {
+            break;
+        }
+        nr_started++;
+    }
+    run_tasks(&first);
+    for (i = 0; i < nr_started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
+    pthread_mutex_destroy(&fanout->lock);
+}
+
+/* Finds the part with the earliest clock; returns -1 if they are from
+ * different watchman instances */
+static int
+earliest_clock(struct fanout_task *tasks, int nr)
+{
+    int i, earliest = 0;
+    const char *first = tasks[0].result->clock;
+    size_t first_len = first ? strlen(first) : 0, first_prefix;
+    uint64_t earliest_ticks;
+    int exact = !first ||
+                watchman_split_clock(first, first_len, &first_prefix,
+                                     &earliest_ticks);
+
+    for (i = 1; i < nr; ++i) {
+        const char *clock = tasks[i].result->clock;
+        size_t len = clock ? strlen(clock) : 0, prefix;
+        uint64_t ticks;
+        if (exact) {
+            if (!clock || !first || strcmp(clock, first)) {
+                return -1;
+            }
+            continue;
+        }
+        if (!clock || watchman_split_clock(clock, len, &prefix, &ticks) ||
+            prefix != first_prefix || memcmp(clock, first, prefix)) {
+            return -1;
+        }
+        if (ticks < earliest_ticks) {
+            earliest = i;
+            earliest_ticks = ticks;
+        }
+    }
+    return earliest;
+}
+
+/* Whether 'path' is or contains 'other' */
+static int
+path_covers(const char *path, const char *other)
+{
+    size_t len = strlen(path);
+    if (!len || !strcmp(path, ".")) {
+        return 1;
+    }
+    return !strncmp(path, other, len) && (!other[len] || other[len] == '/');
+}
+
+/* Whether a file could be found under two of the query's paths */
+static int
+paths_overlap(const struct watchman_query *query)
+{
+    int i, j;
+    for (i = 0; i < query->nr_paths; ++i) {
+        for (j = 0; j < query->nr_paths; ++j) {
+            if (i != j && path_covers(query->paths[i].path,
+                                      query->paths[j].path)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+struct named_stat {
+    const char *name;
+    int index;
+};
+
+static int
+compare_named_stats(const void *a, const void *b)
+{
+    const struct named_stat *x = a, *y = b;
+    int diff = strcmp(x->name, y->name);
+    return diff ? diff : x->index - y->index;
+}
+
+/* Drops all but the first entry for each name, keeping the order; returns
+ * 1 if out of memory */
+static int
+drop_duplicates(struct watchman_query_result *result)
+{
+    size_t nr_alloc = result->nr ? result->nr : 1;
+    struct named_stat *names = malloc(sizeof(*names) * nr_alloc);
+    unsigned char *dropped = calloc(nr_alloc, 1);
+    if (!names || !dropped) {
+        free(names);
+        free(dropped);
+        return 1;
+    }
+    int i, nr = 0;
+    for (i = 0; i < result->nr; ++i) {
+        /* Without names there is nothing to tell entries apart by */
+        if (result->stats[i].name) {
+            names[nr].name = result->stats[i].name;
+            names[nr].index = i;
+            nr++;
+        }
+    }
+    qsort(names, nr, sizeof(*names), compare_named_stats);
+    for (i = 1; i < nr; ++i) {
+        if (!strcmp(names[i].name, names[i - 1].name)) {
+            dropped[names[i].index] = 1;
+        }
+    }
+    free(names);
+
+    nr = 0;
+    for (i = 0; i < result->nr; ++i) {
+        if (dropped[i]) {
+            watchman_release_stat(&result->stats[i]);
+        } else {
+            result->stats[nr++] = result->stats[i];
+        }
+    }
+    result->nr = nr;
+    free(dropped);
+    return 0;
+}
+
+/* Merges the parts' results, taking over their contents.  With 'dedupe'
+ * set, a file found by more than one part is only listed once. */
+static struct watchman_query_result *
+merge_results(struct fanout_task *tasks, int nr, int dedupe,
+              struct watchman_error *error)
+{
+    int i, total = 0;
+
+    for (i = 0; i < nr; ++i) {
+        if (!tasks[i].result) {
+            if (error) {
+                *error = tasks[i].error;
+                tasks[i].error.message = NULL;
+            }
+            return NULL;
+        }
+        total += tasks[i].result->nr;
+    }
+    int earliest = earliest_clock(tasks, nr);
+    if (earliest < 0) {
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "watchman restarted during the query");
+        return NULL;
+    }
+
+    struct watchman_query_result *merged = calloc(1, sizeof(*merged));
+    struct watchman_stat *stats =
+        malloc(sizeof(*stats) * (total ? total : 1));
+    if (!merged || !stats) {
+        free(merged);
+        free(stats);
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return NULL;
+    }
+    merged->version = tasks[0].result->version;
+    tasks[0].result->version = NULL;
+    merged->clock = tasks[earliest].result->clock;
+    tasks[earliest].result->clock = NULL;
+    merged->stats = stats;
+    for (i = 0; i < nr; ++i) {
+        struct watchman_query_result *part = tasks[i].result;
+        merged->is_fresh_instance |= part->is_fresh_instance;
+        memcpy(stats + merged->nr, part->stats, sizeof(*stats) * part->nr);
+        merged->nr += part->nr;
+        /* The names now belong to the merged result */
+        part->nr = 0;
+    }
+    if (dedupe && drop_duplicates(merged)) {
+        watchman_free_query_result(merged);
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return NULL;
+    }
+    return merged;
+}
+
+static void
+release_tasks(struct fanout_task *tasks, int nr)
+{
+    int i;
+    for (i = 0; i < nr; ++i) {
+        if (tasks[i].result) {
+            watchman_free_query_result(tasks[i].result);
+        }
+        watchman_release_error(&tasks[i].error);
+    }
+    free(tasks);
+}
+
+struct watchman_query_result *
+watchman_fanout_query(struct watchman_connection *const *conns, int nr_conns,
+                      const char *fs_path,
+                      const struct watchman_query *query,
+                      const struct watchman_expression *expr,
+                      const struct timespec *deadline,
+                      struct watchman_error *error)
+{
+    if (nr_conns < 1) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "No connections to query on");
+        return NULL;
+    }
+    int nr_paths = query ? query->nr_paths : 0;
+    int nr_parts = nr_paths < nr_conns ? nr_paths : nr_conns;
+    if (nr_parts <= 1) {
+        return watchman_do_query_deadline(conns[0], fs_path, query, expr,
+                                          deadline, error);
+    }
+
+    struct fanout_task *tasks = calloc(nr_parts, sizeof(*tasks));
+    if (!tasks) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < nr_parts; ++i) {
+        /* Consecutive paths, so that the parts merge in path order */
+        int begin = i * nr_paths / nr_parts;
+        int end = (i + 1) * nr_paths / nr_parts;
+        tasks[i].fs_path = fs_path;
+        tasks[i].part = *query;
+        tasks[i].part.paths = query->paths + begin;
+        tasks[i].part.nr_paths = end - begin;
+        tasks[i].part.cap_paths = end - begin;
+        tasks[i].query = &tasks[i].part;
+    }
+
+    struct fanout fanout = {.tasks = tasks, .nr_tasks = nr_parts,
+                            .expr = expr, .deadline = deadline};
+    run_fanout(conns, nr_conns, &fanout);
+    struct watchman_query_result *result =
+        merge_results(tasks, nr_parts, paths_overlap(query), error);
+    release_tasks(tasks, nr_parts);
+    return result;
+}
+
+int
+watchman_query_roots(struct watchman_connection *const *conns, int nr_conns,
+                     const char *const *roots, int nr_roots,
+                     const struct watchman_query *query,
+                     const struct watchman_expression *expr,
+                     struct watchman_root_query_result *results,
+                     const struct timespec *deadline)
+{
+    int i, failed = 0;
+
+    memset(results, 0, nr_roots * sizeof(*results));
+    struct fanout_task *tasks =
+        nr_conns < 1 ? NULL : calloc(nr_roots ? nr_roots : 1, sizeof(*tasks));
+    if (!tasks) {
+        for (i = 0; i < nr_roots; ++i) {
+            watchman_err(&results[i].error, WATCHMAN_ERR_OTHER,
+                         nr_conns < 1 ? "No connections to query on"
+                                      : "Out of memory");
+        }
+        return nr_roots;
+    }
+    for (i = 0; i < nr_roots; ++i) {
+        tasks[i].fs_path = roots[i];
+        tasks[i].query = query;
+    }
+
+    struct fanout fanout = {.tasks = tasks, .nr_tasks = nr_roots,
+                            .expr = expr, .deadline = deadline};
+    run_fanout(conns, nr_conns, &fanout);
+    for (i = 0; i < nr_roots; ++i) {
+        results[i].result = tasks[i].result;
+        results[i].error = tasks[i].error;
+        failed += !tasks[i].result;
+    }
+    free(tasks);
+    return failed;
+}
+
+void
+watchman_release_root_query_results(struct watchman_root_query_result *results,
+                                    int nr)
+{
+    int i;
+    for (i = 0; i < nr; ++i) {
+        if (results[i].result) {
+            watchman_free_query_result(results[i].result);
+            results[i].result = NULL;
+        }
+        watchman_release_error(&results[i].error);
+        results[i].error.message = NULL;
+    }
+}
@@ -0,0 +1,650 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "watchman_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Names go into a bounded ring; adding to a full ring waits, so a
+ * producer reading a large result or a stream of notifications never
+ * runs far ahead of the workers.  A worker looks the file up first, and
+ * if its inode, size and mtime are those of the last time it was hashed,
+ * reports the cached hashes without reading it.  Otherwise it reads and
+ * hashes the file a chunk at a time, and then checks that the file didn't
+ * change while it was being read.  The file is read rather than mapped:
+ * a file truncated under a mapping would kill the process with SIGBUS.
+ */
+
+#define MAX_HASHERS 64
+/* Times to hash a file that keeps changing while it is read */
+#define HASH_ATTEMPTS 3
+#define HASH_CHUNK 65536
+
+struct hash_entry {
+    char *name;
+    uint64_t name_hash;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    uint64_t hash;
+    unsigned char sha1[20];
+    struct hash_entry *next;
+};
+
+struct watchman_hasher {
+    pthread_mutex_t lock;
+    /* Signalled when names are added, or the workers are to stop */
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    /* Signalled when the last pending name is done */
+    pthread_cond_t idle;
+    int rootfd;
+    int flags;
+    watchman_hash_callback callback;
+    void *arg;
+    /* The ring of names to hash */
+    char **queue;
+    int queue_size;
+    int head;
+    int nr_queued;
+    /* Names queued or being hashed */
+    int nr_pending;
+    unsigned stopping:1;
+    /* The cache, by name */
+    struct hash_entry **buckets;
+    size_t nr_buckets;
+    size_t nr_entries;
+    pthread_t threads[MAX_HASHERS];
+    int nr_threads;
+};
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Little-endian loads; compilers turn these into single loads where
+ * that is what they are */
+static uint32_t
+read32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+static uint64_t
+read64(const unsigned char *p)
+{
+    return read32(p) | (uint64_t)read32(p + 4) << 32;
+}
+
+static uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t
+xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+struct xxh64 {
+    uint64_t v[4];
+    unsigned char buf[32];
+    size_t buffered;
+    uint64_t total;
+};
+
+static void
+xxh64_init(struct xxh64 *state)
+{
+    state->v[0] = PRIME64_1 + PRIME64_2;
+    state->v[1] = PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = -PRIME64_1;
+    state->buffered = 0;
+    state->total = 0;
+}
+
+/* The four lanes are independent, so they run in parallel in the CPU */
+static void
+xxh64_stripe(struct xxh64 *state, const unsigned char *p)
+{
+    state->v[0] = xxh64_round(state->v[0], read64(p));
+    state->v[1] = xxh64_round(state->v[1], read64(p + 8));
+    state->v[2] = xxh64_round(state->v[2], read64(p + 16));
+    state->v[3] = xxh64_round(state->v[3], read64(p + 24));
+}
+
+static void
+xxh64_update(struct xxh64 *state, const unsigned char *p, size_t len)
+{
+    state->total += len;
+    if (state->buffered) {
+        size_t take = 32 - state->buffered < len ? 32 - state->buffered : len;
+        memcpy(state->buf + state->buffered, p, take);
+        state->buffered += take;
+        p += take;
+        len -= take;
+        if (state->buffered < 32) {
+            return;
+        }
+        xxh64_stripe(state, state->buf);
+        state->buffered = 0;
+    }
+    for (; len >= 32; p += 32, len -= 32) {
+        xxh64_stripe(state, p);
+    }
+    memcpy(state->buf, p, len);
+    state->buffered = len;
+}
+
+static uint64_t
+xxh64_digest(const struct xxh64 *state)
+{
+    const unsigned char *p = state->buf, *end = p + state->buffered;
+    uint64_t h;
+
+    if (state->total >= 32) {
+        h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) +
+            rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        h = xxh64_merge(h, state->v[0]);
+        h = xxh64_merge(h, state->v[1]);
+        h = xxh64_merge(h, state->v[2]);
+        h = xxh64_merge(h, state->v[3]);
+    } else {
+        h = PRIME64_5;
+    }
+    h += state->total;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t
+watchman_xxh64(const void *data, size_t len)
+{
+    struct xxh64 state;
+    xxh64_init(&state);
+    xxh64_update(&state, data, len);
+    return xxh64_digest(&state);
+}
+
+static uint32_t
+rotl32(uint32_t x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+struct sha1 {
+    uint32_t h[5];
+    unsigned char buf[64];
+    size_t buffered;
+    uint64_t total;
+};
+
+static void
+sha1_init(struct sha1 *state)
+{
+    state->h[0] = 0x67452301;
+    state->h[1] = 0xEFCDAB89;
+    state->h[2] = 0x98BADCFE;
+    state->h[3] = 0x10325476;
+    state->h[4] = 0xC3D2E1F0;
+    state->buffered = 0;
+    state->total = 0;
+}
+
+static void
+sha1_block(struct sha1 *state, const unsigned char *block)
+{
+    uint32_t w[80], a, b, c, d, e;
+    int i;
+
+    for (i = 0; i < 16; ++i) {
+        const unsigned char *p = block + i * 4;
+        w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+               (uint32_t)p[2] << 8 | p[3];
+    }
+    for (; i < 80; ++i) {
+        w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    a = state->h[0];
+    b = state->h[1];
+    c = state->h[2];
+    d = state->h[3];
+    e = state->h[4];
+    for (i = 0; i < 80; ++i) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t t = rotl32(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl32(b, 30);
+        b = a;
+        a = t;
+    }
+    state->h[0] += a;
+    state->h[1] += b;
+    state->h[2] += c;
+    state->h[3] += d;
+    state->h[4] += e;
+}
+
+static void
+sha1_update(struct sha1 *state, const unsigned char *p, size_t len)
+{
+    state->total += len;
+    if (state->buffered) {
+        size_t take = 64 - state->buffered < len ? 64 - state->buffered : len;
+        memcpy(state->buf + state->buffered, p, take);
+        state->buffered += take;
+        p += take;
+        len -= take;
+        if (state->buffered < 64) {
+            return;
+        }
+        sha1_block(state, state->buf);
+        state->buffered = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) {
+        sha1_block(state, p);
+    }
+    memcpy(state->buf, p, len);
+    state->buffered = len;
+}
+
+static void
+sha1_digest(struct sha1 *state, unsigned char *digest)
+{
+    /* A 1 bit, zeros and the length in bits */
+    uint64_t bits = state->total * 8;
+    unsigned char pad[72] = {0x80};
+    size_t pad_len = state->buffered < 56 ? 56 - state->buffered
+                                          : 120 - state->buffered;
+    int i;
+    for (i = 0; i < 8; ++i) {
+        pad[pad_len + i] = bits >> (56 - i * 8);
+    }
+    sha1_update(state, pad, pad_len + 8);
+    for (i = 0; i < 20; ++i) {
+        digest[i] = state->h[i / 4] >> (24 - (i % 4) * 8);
+    }
+}
+
+static struct hash_entry **
+find_entry(struct watchman_hasher *hasher, const char *name, uint64_t hash)
+{
+    struct hash_entry **entry = &hasher->buckets[hash % hasher->nr_buckets];
+    while (*entry && ((*entry)->name_hash != hash ||
+                      strcmp((*entry)->name, name))) {
+        entry = &(*entry)->next;
+    }
+    return entry;
+}
+
+static void
+grow_cache(struct watchman_hasher *hasher)
+{
+    size_t nr = hasher->nr_buckets * 2, i;
+    struct hash_entry **buckets = calloc(nr, sizeof(*buckets));
+    if (!buckets) {
+        return;
+    }
+    for (i = 0; i < hasher->nr_buckets; ++i) {
+        struct hash_entry *entry = hasher->buckets[i], *next;
+        for (; entry; entry = next) {
+            next = entry->next;
+            entry->next = buckets[entry->name_hash % nr];
+            buckets[entry->name_hash % nr] = entry;
+        }
+    }
+    free(hasher->buckets);
+    hasher->buckets = buckets;
+    hasher->nr_buckets = nr;
+}
+
+static int64_t
+mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static int
+same_file(const struct stat *a, const struct stat *b)
+{
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           mtime_ns(a) == mtime_ns(b);
+}
+
+/* Reads and hashes the open file 'fd' into 'out'; returns 0, or an errno
+ * value */
+static int
+hash_fd(struct watchman_hasher *hasher, int fd, struct watchman_file_hash *out)
+{
+    unsigned char buf[HASH_CHUNK];
+    struct xxh64 xxh;
+    struct sha1 sha;
+    ssize_t len;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    xxh64_init(&xxh);
+    sha1_init(&sha);
+    while ((len = read(fd, buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        xxh64_update(&xxh, buf, len);
+        if (hasher->flags & WATCHMAN_HASH_SHA1) {
+            sha1_update(&sha, buf, len);
+        }
+    }
+    out->hash = xxh64_digest(&xxh);
+    if (hasher->flags & WATCHMAN_HASH_SHA1) {
+        sha1_digest(&sha, out->sha1);
+    }
+    return 0;
+}
+
+/* Hashes the file 'name', or finds it in the cache */
+static void
+hash_file(struct watchman_hasher *hasher, const char *name)
+{
+    struct watchman_file_hash out;
+    uint64_t name_hash = watchman_fnv1a(name, strlen(name));
+    struct stat st, after;
+    int attempt, fd = -1;
+
+    memset(&out, 0, sizeof(out));
+    out.name = name;
+    if (fstatat(hasher->rootfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+        out.error = errno;
+        goto done;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        /* Directories, symlinks and the like have no contents to hash */
+        out.error = EINVAL;
+        goto done;
+    }
+
+    pthread_mutex_lock(&hasher->lock);
+    struct hash_entry *entry = *find_entry(hasher, name, name_hash);
+    if (entry && entry->ino == (uint64_t)st.st_ino &&
+        entry->size == st.st_size && entry->mtime_ns == mtime_ns(&st)) {
+        out.cached = 1;
+        out.hash = entry->hash;
+        memcpy(out.sha1, entry->sha1, sizeof(out.sha1));
+    }
+    pthread_mutex_unlock(&hasher->lock);
+    if (out.cached) {
+        goto done;
+    }
+
+    for (attempt = 0; attempt < HASH_ATTEMPTS; ++attempt) {
+        fd = openat(hasher->rootfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0 || fstat(fd, &st)) {
+            out.error = errno;
+            goto done;
+        }
+        out.error = S_ISREG(st.st_mode) ? hash_fd(hasher, fd, &out) : EINVAL;
+        /* A write meanwhile may have torn what was read */
+        if (out.error || (!fstat(fd, &after) && same_file(&st, &after))) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+        out.error = EAGAIN;
+    }
+
+done:
+    if (fd >= 0) {
+        close(fd);
+    }
+    pthread_mutex_lock(&hasher->lock);
+    struct hash_entry **slot = find_entry(hasher, name, name_hash);
+    if (out.error && *slot) {
+        struct hash_entry *gone = *slot;
+        *slot = gone->next;
+        free(gone->name);
+        free(gone);
+        hasher->nr_entries--;
+    } else if (!out.error && !out.cached) {
+        if (!*slot && (*slot = calloc(1, sizeof(**slot)))) {
+            (*slot)->name = strdup(name);
+            if (!(*slot)->name) {
+                /* Out of memory; the file just goes uncached */
+                free(*slot);
+                *slot = NULL;
+            } else {
+                (*slot)->name_hash = name_hash;
+                hasher->nr_entries++;
+            }
+        }
+        if (*slot) {
+            (*slot)->ino = st.st_ino;
+            (*slot)->size = st.st_size;
+            (*slot)->mtime_ns = mtime_ns(&st);
+            (*slot)->hash = out.hash;
+            memcpy((*slot)->sha1, out.sha1, sizeof(out.sha1));
+        }
+        if (hasher->nr_entries > hasher->nr_buckets) {
+            grow_cache(hasher);
+        }
+    }
+    pthread_mutex_unlock(&hasher->lock);
+
+    if (!out.error) {
+        out.ino = st.st_ino;
+        out.size = st.st_size;
+        out.mtime_ns = mtime_ns(&st);
+    }
+    hasher->callback(&out, hasher->arg);
+}
+
+static void *
+run_hasher(void *arg)
+{
+    struct watchman_hasher *hasher = arg;
+
+    pthread_mutex_lock(&hasher->lock);
+    for (;;) {
+        while (!hasher->nr_queued && !hasher->stopping) {
+            pthread_cond_wait(&hasher->not_empty, &hasher->lock);
+        }
+        if (!hasher->nr_queued) {
+            break;
+        }
+        char *name = hasher->queue[hasher->head];
+        hasher->head = (hasher->head + 1) % hasher->queue_size;
+        hasher->nr_queued--;
+        pthread_cond_signal(&hasher->not_full);
+        pthread_mutex_unlock(&hasher->lock);
+
+        hash_file(hasher, name);
+        free(name);
+
+        pthread_mutex_lock(&hasher->lock);
+        if (--hasher->nr_pending == 0) {
+            pthread_cond_broadcast(&hasher->idle);
+        }
+    }
+    pthread_mutex_unlock(&hasher->lock);
+    return NULL;
+}
+
+struct watchman_hasher *
+watchman_hasher_create(const char *root, int nr_threads, int queue_size,
+                       int flags, watchman_hash_callback callback, void *arg,
+                       struct watchman_error *error)
+{
+    struct watchman_hasher *hasher = calloc(1, sizeof(*hasher));
+    if (!hasher) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return NULL;
+    }
+    hasher->rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (hasher->rootfd < 0) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Can't open %s: %s", root,
+                     strerror(errno));
+        free(hasher);
+        return NULL;
+    }
+    if (nr_threads <= 0) {
+        nr_threads = watchman_nr_cpus();
+    }
+    if (nr_threads > MAX_HASHERS) {
+        nr_threads = MAX_HASHERS;
+    }
+    hasher->queue_size = queue_size > 0 ? queue_size : nr_threads * 4;
+    hasher->queue = calloc(hasher->queue_size, sizeof(*hasher->queue));
+    hasher->nr_buckets = 1024;
+    hasher->buckets = calloc(hasher->nr_buckets, sizeof(*hasher->buckets));
+    hasher->flags = flags;
+    hasher->callback = callback;
+    hasher->arg = arg;
+    pthread_mutex_init(&hasher->lock, NULL);
+    pthread_cond_init(&hasher->not_empty, NULL);
+    pthread_cond_init(&hasher->not_full, NULL);
+    pthread_cond_init(&hasher->idle, NULL);
+
+    while (hasher->queue && hasher->buckets &&
+           hasher->nr_threads < nr_threads &&
+           !pthread_create(&hasher->threads[hasher->nr_threads], NULL,
+                           run_hasher, hasher)) {
+        hasher->nr_threads++;
+    }
+    if (!hasher->nr_threads) {
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "Can't start the hashing threads");
+        watchman_hasher_free(hasher);
+        return NULL;
+    }
+    return hasher;
+}
+
+int
+watchman_hasher_add(struct watchman_hasher *hasher, const char *name)
+{
+    char *copy = strdup(name);
+    if (!copy) {
+        return 1;
+    }
+    pthread_mutex_lock(&hasher->lock);
+    while (hasher->nr_queued == hasher->queue_size) {
+        pthread_cond_wait(&hasher->not_full, &hasher->lock);
+    }
+    int tail = (hasher->head + hasher->nr_queued) % hasher->queue_size;
+    hasher->queue[tail] = copy;
+    hasher->nr_queued++;
+    hasher->nr_pending++;
+    pthread_cond_signal(&hasher->not_empty);
+    pthread_mutex_unlock(&hasher->lock);
+    return 0;
+}
+
+int
+watchman_hasher_add_result(struct watchman_hasher *hasher,
+                           const struct watchman_query_result *result)
+{
+    int i;
+    for (i = 0; i < result->nr; ++i) {
+        if (result->stats[i].name &&
+            watchman_hasher_add(hasher, result->stats[i].name)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void
+watchman_hasher_wait(struct watchman_hasher *hasher)
+{
+    pthread_mutex_lock(&hasher->lock);
+    while (hasher->nr_pending) {
+        pthread_cond_wait(&hasher->idle, &hasher->lock);
+    }
+    pthread_mutex_unlock(&hasher->lock);
+}
+
+void
+watchman_hasher_free(struct watchman_hasher *hasher)
+{
+    int i;
+
+    pthread_mutex_lock(&hasher->lock);
+    hasher->stopping = 1;
+    pthread_cond_broadcast(&hasher->not_empty);
+    pthread_mutex_unlock(&hasher->lock);
+    /* The workers finish what is queued first */
+    for (i = 0; i < hasher->nr_threads; ++i) {
+        pthread_join(hasher->threads[i], NULL);
+    }
+
+    size_t j;
+    for (j = 0; hasher->buckets && j < hasher->nr_buckets; ++j) {
+        struct hash_entry *entry = hasher->buckets[j], *next;
+        for (; entry; entry = next) {
+            next = entry->next;
+            free(entry->name);
+            free(entry);
+        }
+    }
+    free(hasher->buckets);
+    free(hasher->queue);
+    pthread_cond_destroy(&hasher->idle);
+    pthread_cond_destroy(&hasher->not_full);
+    pthread_cond_destroy(&hasher->not_empty);
+    pthread_mutex_destroy(&hasher->lock);
+    close(hasher->rootfd);
+    free(hasher);
+}
@@ -0,0 +1,474 @@
+#include "watchman_private.h"
+#include "bser.h"
+#include "bser_parse.h"
+#include "bser_write.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+/*
+ * A journal is a file of BSER PDUs.  The first names the root; each of
+ * the others is one delta, {"clock", "is_fresh_instance", "files"},
+ * whose files are {"name", "exists", "new"} objects, so that they are
+ * written as a compact array: a file costs its name and two bytes of
+ * flags.  The file is only appended to, with one write() per delta, and
+ * readers map it (see bser_file_open()), walking back from the end so
+ * that only the deltas they need are parsed.
+ */
+
+#define JOURNAL_VERSION 1
+
+struct watchman_journal {
+    int fd;
+    char *root;
+    /* Where the last complete delta ends */
+    off_t size;
+};
+
+/* A file as last seen while walking back through the deltas */
+struct journal_entry {
+    const char *name;
+    size_t len;
+    /* Deltas walked before this one; lower is more recent */
+    int order;
+    unsigned exists:1;
+    unsigned newer:1;
+};
+
+static int
+append_pdu(struct watchman_journal *journal, json_t *json,
+           struct watchman_error *error)
+{
+    size_t content = bser_encoding_size(json);
+    size_t total = bser_header_size(content) + content;
+    char *buf = malloc(total);
+    size_t done = 0;
+
+    if (!buf) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return 1;
+    }
+    if (bser_write_to_buffer(json, content, buf, total) != total) {
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "Can't encode journal entry");
+        free(buf);
+        return 1;
+    }
+    while (done < total) {
+        ssize_t n = write(journal->fd, buf + done, total - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            int saved = errno;
+            /* Readers stop at a torn entry, so don't leave one */
+            if (ftruncate(journal->fd, journal->size)) {
+                /* The next open drops it instead */
+            }
+            watchman_err(error, WATCHMAN_ERR_OTHER,
+                         "Can't append to journal: %s",
+                         n < 0 ? strerror(saved) : "short write");
+            free(buf);
+            return 1;
+        }
+        done += n;
+    }
+    journal->size += total;
+    free(buf);
+    return 0;
+}
+
+/* Checks that PDU 0 is a journal header, for 'root' if that is set */
+static int
+check_header(bser_file_t *file, const char *path, const char *root,
+             struct watchman_error *error)
+{
+    bser_t header;
+    int ret = 0;
+
+    if (file->nr_pdus == 0) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "%s is not a journal", path);
+        return 1;
+    }
+    bser_file_pdu(file, 0, &header);
+    bser_t *version = bser_is_object(&header)
+        ? bser_object_get(&header, "journal") : NULL;
+    bser_t *header_root = bser_is_object(&header)
+        ? bser_object_get(&header, "root") : NULL;
+    if (!version || !bser_is_integer(version) ||
+        bser_integer_value(version) != JOURNAL_VERSION ||
+        !header_root || !bser_is_string(header_root)) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "%s is not a journal", path);
+        ret = 1;
+    } else if (root && bser_string_strcmp(root, header_root)) {
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "%s is the journal of another root", path);
+        ret = 1;
+    }
+    bser_free_contents(&header);
+    return ret;
+}
+
+struct watchman_journal *
+watchman_journal_open(const char *path, const char *root,
+                      struct watchman_error *error)
+{
+    struct watchman_journal *journal = calloc(1, sizeof(*journal));
+    if (!journal || !(journal->root = strdup(root))) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        free(journal);
+        return NULL;
+    }
+    journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal->fd < 0) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Can't open %s: %s", path,
+                     strerror(errno));
+        goto fail;
+    }
+    if (flock(journal->fd, LOCK_EX | LOCK_NB)) {
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "%s is being written by another process", path);
+        goto fail;
+    }
+
+    bser_file_t *file = bser_file_open(path);
+    if (!file) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Can't map %s: %s", path,
+                     strerror(errno));
+        goto fail;
+    }
+    if (file->datalen == 0) {
+        bser_file_close(file);
+        json_t *header = json_object();
+        json_object_set_new(header, "journal", json_integer(JOURNAL_VERSION));
+        json_object_set_new(header, "root", json_string(root));
+        int ret = append_pdu(journal, header, error);
+        json_decref(header);
+        if (ret) {
+            goto fail;
+        }
+        return journal;
+    }
+    if (check_header(file, path, root, error)) {
+        bser_file_close(file);
+        goto fail;
+    }
+    bser_pdu_t *last = &file->pdus[file->nr_pdus - 1];
+    journal->size = last->offset + last->length;
+    bser_file_close(file);
+    /* Drop whatever a crashed writer left after the last whole entry */
+    if (ftruncate(journal->fd, journal->size)) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Can't truncate %s: %s",
+                     path, strerror(errno));
+        goto fail;
+    }
+    return journal;
+
+fail:
+    watchman_journal_close(journal);
+    return NULL;
+}
+
+int
+watchman_journal_append(struct watchman_journal *journal,
+                        const struct watchman_query_result *result,
+                        struct watchman_error *error)
+{
+    int i;
+
+    if (!result->clock) {
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "Can't journal a result without a clock");
+        return 1;
+    }
+    json_t *delta = json_object();
+    json_t *files = json_array();
+    json_object_set_new(delta, "clock", json_string(result->clock));
+    json_object_set_new(delta, "is_fresh_instance",
+                        json_boolean(result->is_fresh_instance));
+    for (i = 0; i < result->nr; ++i) {
+        const struct watchman_stat *stat = &result->stats[i];
+        json_t *file = json_object();
+        json_object_set_new(file, "name", json_string(stat->name));
+        json_object_set_new(file, "exists", json_boolean(stat->exists));
+        json_object_set_new(file, "new", json_boolean(stat->newer));
+        json_array_append_new(files, file);
+    }
+    json_object_set_new(delta, "files", files);
+    int ret = append_pdu(journal, delta, error);
+    json_decref(delta);
+    return ret;
+}
+
+int
+watchman_journal_update(struct watchman_journal *journal,
+                        struct watchman_connection *conn,
+                        const struct timespec *deadline,
+                        struct watchman_error *error)
+{
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_JOURNAL_FIELDS);
+    struct watchman_expression *expr = watchman_true_expression();
+    struct watchman_query_result *result =
+        watchman_query_changes(conn, journal->root, query, expr, deadline,
+                               error);
+    watchman_free_expression(expr);
+    watchman_free_query(query);
+    if (!result) {
+        return 1;
+    }
+    int ret = watchman_journal_append(journal, result, error);
+    watchman_free_query_result(result);
+    return ret;
+}
+
+void
+watchman_journal_close(struct watchman_journal *journal)
+{
+    if (journal->fd >= 0) {
+        close(journal->fd);
+    }
+    free(journal->root);
+    free(journal);
+}
+
+int
+watchman_split_clock(const char *clock, size_t len, size_t *prefix_len,
+                     uint64_t *ticks)
+{
+    size_t colon = len;
+
+    if (len < 2 || clock[0] != 'c' || clock[1] != ':') {
+        return 1;
+    }
+    while (colon > 2 && clock[colon - 1] != ':') {
+        --colon;
+    }
+    if (colon == 2 || colon == len) {
+        return 1;
+    }
+    *ticks = 0;
+    for (size_t i = colon; i < len; ++i) {
+        if (clock[i] < '0' || clock[i] > '9') {
+            return 1;
+        }
+        *ticks = *ticks * 10 + (clock[i] - '0');
+    }
+    *prefix_len = colon;
+    return 0;
+}
+
+/* Returns 1 if a delta with 'clock' has nothing after 'since' in it */
+static int
+clock_not_after(const char *clock, size_t len, const char *since,
+                size_t since_len, int *same_instance)
+{
+    size_t prefix_len, since_prefix_len;
+    uint64_t ticks, since_ticks;
+
+    if (watchman_split_clock(clock, len, &prefix_len, &ticks) ||
+        watchman_split_clock(since, since_len, &since_prefix_len,
+                             &since_ticks)) {
+        *same_instance = len == since_len && !memcmp(clock, since, len);
+        return *same_instance;
+    }
+    *same_instance = prefix_len == since_prefix_len &&
+                     !memcmp(clock, since, prefix_len);
+    return *same_instance && ticks <= since_ticks;
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+    const struct journal_entry *x = a, *y = b;
+    int cmp = memcmp(x->name, y->name, x->len < y->len ? x->len : y->len);
+    if (cmp) {
+        return cmp;
+    }
+    if (x->len != y->len) {
+        return x->len < y->len ? -1 : 1;
+    }
+    return x->order - y->order;
+}
+
+/* Adds the files of a delta to 'entries' */
+static int
+add_entries(bser_t *files, int order, struct journal_entry **entries,
+            int *nr, int *cap)
+{
+    size_t i, nr_files = bser_array_size(files);
+
+    for (i = 0; i < nr_files; ++i) {
+        bser_t *file = bser_array_get(files, i);
+        bser_t *name = bser_is_object(file)
+            ? bser_object_get(file, "name") : NULL;
+        bser_t *exists = name ? bser_object_get(file, "exists") : NULL;
+        bser_t *newer = name ? bser_object_get(file, "new") : NULL;
+        if (!name || !bser_is_string(name)) {
+            return 1;
+        }
+        if (*nr == *cap) {
+            int new_cap = *cap ? *cap * 2 : 64;
+            struct journal_entry *grown =
+                realloc(*entries, new_cap * sizeof(**entries));
+            if (!grown) {
+                return 1;
+            }
+            *entries = grown;
+            *cap = new_cap;
+        }
+        struct journal_entry *entry = &(*entries)[(*nr)++];
+        /* Strings point into the mapping, which outlives the nodes */
+        entry->name = bser_string_value(name, &entry->len);
+        entry->order = order;
+        entry->exists = exists && bser_is_true(exists);
+        entry->newer = newer && bser_is_true(newer);
+    }
+    return 0;
+}
+
+/* Turns the entries into a result with each file once, as of its most
+ * recent entry, and new if any of its entries was */
+static int
+fill_result(struct watchman_query_result *result,
+            struct journal_entry *entries, int nr)
+{
+    int i, n = 0;
+
+    if (nr > 0) {
+        qsort(entries, nr, sizeof(*entries), compare_entries);
+    }
+    result->stats = calloc(nr ? nr : 1, sizeof(*result->stats));
+    if (!result->stats) {
+        return 1;
+    }
+    for (i = 0; i < nr; ++i) {
+        struct journal_entry *entry = &entries[i];
+        if (n > 0 && entries[i - 1].len == entry->len &&
+            !memcmp(entries[i - 1].name, entry->name, entry->len)) {
+            result->stats[n - 1].newer |= entry->newer;
+            continue;
+        }
+        struct watchman_stat *stat = &result->stats[n];
+        stat->name = malloc(entry->len + 1);
+        if (!stat->name) {
+            return 1;
+        }
+        memcpy(stat->name, entry->name, entry->len);
+        stat->name[entry->len] = '\0';
+        stat->exists = entry->exists;
+        stat->newer = entry->newer;
+        result->nr = ++n;
+    }
+    return 0;
+}
+
+struct watchman_query_result *
+watchman_journal_since(const char *path, const char *clock,
+                       struct watchman_error *error)
+{
+    struct watchman_query_result *result = NULL;
+    struct journal_entry *entries = NULL;
+    int nr_entries = 0, cap_entries = 0;
+    size_t since_len = clock ? strlen(clock) : 0;
+    /* Until a delta not after 'clock' turns up */
+    int fresh = 1;
+    size_t i;
+
+    bser_file_t *file = bser_file_open(path);
+    if (!file) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Can't open %s: %s", path,
+                     strerror(errno));
+        return NULL;
+    }
+    if (check_header(file, path, NULL, error)) {
+        goto done;
+    }
+    result = calloc(1, sizeof(*result));
+    if (!result) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        goto done;
+    }
+
+    for (i = file->nr_pdus - 1; i > 0; --i) {
+        bser_t delta;
+        bser_file_pdu(file, i, &delta);
+        bser_t *delta_clock = bser_is_object(&delta)
+            ? bser_object_get(&delta, "clock") : NULL;
+        bser_t *delta_fresh = delta_clock
+            ? bser_object_get(&delta, "is_fresh_instance") : NULL;
+        bser_t *files = delta_clock ? bser_object_get(&delta, "files")
+                                    : NULL;
+        if (!delta_clock || !bser_is_string(delta_clock) || !files ||
+            !bser_is_array(files)) {
+            bser_free_contents(&delta);
+            watchman_err(error, WATCHMAN_ERR_OTHER,
+                         "Bad entry in journal %s", path);
+            goto fail;
+        }
+        size_t len;
+        const char *value = bser_string_value(delta_clock, &len);
+        if (!result->clock) {
+            result->clock = malloc(len + 1);
+            if (!result->clock) {
+                bser_free_contents(&delta);
+                watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+                goto fail;
+            }
+            memcpy(result->clock, value, len);
+            result->clock[len] = '\0';
+        }
+        int same_instance = 0;
+        if (clock && clock_not_after(value, len, clock, since_len,
+                                     &same_instance)) {
+            bser_free_contents(&delta);
+            fresh = 0;
+            break;
+        }
+        int is_fresh = delta_fresh && bser_is_true(delta_fresh);
+        /* Something happened in between that 'clock' can't see past */
+        if (!same_instance || is_fresh) {
+            result->is_fresh_instance = 1;
+        }
+        int ret = add_entries(files, file->nr_pdus - i, &entries,
+                              &nr_entries, &cap_entries);
+        bser_free_contents(&delta);
+        if (ret) {
+            watchman_err(error, WATCHMAN_ERR_OTHER,
+                         "Bad entry in journal %s", path);
+            goto fail;
+        }
+        /* A fresh instance lists every file there is, so older deltas
+         * could only bring back files deleted since */
+        if (is_fresh) {
+            break;
+        }
+    }
+    /* The journal starts after 'clock' */
+    if (fresh) {
+        result->is_fresh_instance = 1;
+    }
+    if (!result->clock && clock && !(result->clock = strdup(clock))) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        goto fail;
+    }
+    if (fill_result(result, entries, nr_entries)) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        goto fail;
+    }
+    goto done;
+
+fail:
+    watchman_free_query_result(result);
+    result = NULL;
+done:
+    free(entries);
+    bser_file_close(file);
+    return result;
+}
@@ -0,0 +1,336 @@
+#include "watchman.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Names are kept sorted and deduplicated, in blocks of NAMES_PER_BLOCK.
+ * Each entry is the length of the prefix it shares with the name before
+ * it, the length of the rest, and the rest's bytes; the lengths are
+ * varints.  The first entry of a block (a restart point) shares nothing,
+ * so it can be read without decoding what comes before it.  Lookups
+ * binary-search the restart points and then decode at most one block.
+ */
+#define NAMES_PER_BLOCK 16
+
+struct watchman_name_store {
+    int nr;
+    int nr_blocks;
+    /* Offset in 'data' of the first entry of each block */
+    size_t *restarts;
+    uint8_t *data;
+    size_t len;
+    /* Of the longest name, so that decoding buffers never grow */
+    size_t max_len;
+};
+
+static size_t
+put_varint(uint8_t *out, size_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80) {
+        if (out) {
+            out[n] = (value & 0x7f) | 0x80;
+        }
+        value >>= 7;
+        ++n;
+    }
+    if (out) {
+        out[n] = value;
+    }
+    return n + 1;
+}
+
+static size_t
+get_varint(const uint8_t *data, size_t *offset)
+{
+    size_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = data[(*offset)++];
+        value |= (size_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+/* Decodes the entry at '*offset' over the previous name in 'name' */
+static void
+decode_entry(const struct watchman_name_store *store, size_t *offset,
+             char *name, size_t *len)
+{
+    size_t shared = get_varint(store->data, offset);
+    size_t rest = get_varint(store->data, offset);
+    memcpy(name + shared, store->data + *offset, rest);
+    *offset += rest;
+    *len = shared + rest;
+    name[*len] = '\0';
+}
+
+static int
+compare_bytes(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp) {
+        return cmp;
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/* Returns the last block whose first name is not after 'key', or 0 */
+static int
+block_for(const struct watchman_name_store *store, const char *key,
+          size_t key_len)
+{
+    int lo = 0, hi = store->nr_blocks - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        size_t offset = store->restarts[mid];
+        get_varint(store->data, &offset);
+        size_t len = get_varint(store->data, &offset);
+        const char *first = (const char *)store->data + offset;
+        if (compare_bytes(first, len, key, key_len) <= 0) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/* Decodes names into 'cursor' up to the first that is not before 'key',
+ * leaving its index at store->nr if there is none */
+static void
+lower_bound(struct watchman_name_cursor *cursor, const char *key)
+{
+    const struct watchman_name_store *store = cursor->store;
+    size_t key_len = strlen(key);
+
+    if (store->nr == 0) {
+        cursor->index = 0;
+        return;
+    }
+    int block = block_for(store, key, key_len);
+    cursor->index = block * NAMES_PER_BLOCK;
+    cursor->offset = store->restarts[block];
+    for (; cursor->index < store->nr; ++cursor->index) {
+        decode_entry(store, &cursor->offset, cursor->name, &cursor->len);
+        if (compare_bytes(cursor->name, cursor->len, key, key_len) >= 0) {
+            return;
+        }
+    }
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+struct watchman_name_store *
+watchman_name_store(const char *const *names, int nr)
+{
+    struct watchman_name_store *store = calloc(1, sizeof(*store));
+    const char **sorted = malloc((nr ? nr : 1) * sizeof(*sorted));
+    int i, n = 0;
+    size_t *lens = NULL;
+
+    if (!store || !sorted) {
+        goto fail;
+    }
+    for (i = 0; i < nr; ++i) {
+        sorted[i] = names[i];
+    }
+    qsort(sorted, nr, sizeof(*sorted), compare_names);
+    for (i = 0; i < nr; ++i) {
+        if (n == 0 || strcmp(sorted[n - 1], sorted[i])) {
+            sorted[n++] = sorted[i];
+        }
+    }
+    store->nr = n;
+    store->nr_blocks = (n + NAMES_PER_BLOCK - 1) / NAMES_PER_BLOCK;
+
+    /* Size everything up first, so that it takes one allocation */
+    lens = malloc((n ? n : 1) * 2 * sizeof(*lens));
+    if (!lens) {
+        goto fail;
+    }
+    for (i = 0; i < n; ++i) {
+        size_t len = strlen(sorted[i]);
+        size_t shared = 0;
+        if (i % NAMES_PER_BLOCK) {
+            size_t prev_len = lens[2 * (i - 1)];
+            while (shared < len && shared < prev_len &&
+                   sorted[i][shared] == sorted[i - 1][shared]) {
+                ++shared;
+            }
+        }
+        lens[2 * i] = len;
+        lens[2 * i + 1] = shared;
+        store->len += put_varint(NULL, shared) +
+                      put_varint(NULL, len - shared) + len - shared;
+        if (len > store->max_len) {
+            store->max_len = len;
+        }
+    }
+
+    store->restarts = malloc((store->nr_blocks ? store->nr_blocks : 1) *
+                             sizeof(*store->restarts));
+    store->data = malloc(store->len ? store->len : 1);
+    if (!store->restarts || !store->data) {
+        goto fail;
+    }
+    size_t offset = 0;
+    for (i = 0; i < n; ++i) {
+        size_t len = lens[2 * i];
+        size_t shared = lens[2 * i + 1];
+        if (i % NAMES_PER_BLOCK == 0) {
+            store->restarts[i / NAMES_PER_BLOCK] = offset;
+        }
+        offset += put_varint(store->data + offset, shared);
+        offset += put_varint(store->data + offset, len - shared);
+        memcpy(store->data + offset, sorted[i] + shared, len - shared);
+        offset += len - shared;
+    }
+
+    free(lens);
+    free(sorted);
+    return store;
+
+fail:
+    free(lens);
+    free(sorted);
+    if (store) {
+        watchman_free_name_store(store);
+    }
+    return NULL;
+}
+
+struct watchman_name_store *
+watchman_name_store_from_result(const struct watchman_query_result *result)
+{
+    const char **names = malloc((result->nr ? result->nr : 1) *
+                                sizeof(*names));
+    int i;
+
+    if (!names) {
+        return NULL;
+    }
+    for (i = 0; i < result->nr; ++i) {
+        names[i] = result->stats[i].name;
+    }
+    struct watchman_name_store *store = watchman_name_store(names,
+                                                            result->nr);
+    free(names);
+    return store;
+}
+
+int
+watchman_name_store_size(const struct watchman_name_store *store)
+{
+    return store->nr;
+}
+
+size_t
+watchman_name_store_bytes(const struct watchman_name_store *store)
+{
+    return sizeof(*store) + store->len +
+           store->nr_blocks * sizeof(*store->restarts);
+}
+
+int
+watchman_name_store_find(const struct watchman_name_store *store,
+                         const char *name)
+{
+    struct watchman_name_cursor cursor;
+    int index = -1;
+
+    if (watchman_name_store_seek(store, name, &cursor)) {
+        return -1;
+    }
+    if (cursor.index < store->nr && !strcmp(cursor.name, name)) {
+        index = cursor.index;
+    }
+    watchman_name_cursor_release(&cursor);
+    return index;
+}
+
+char *
+watchman_name_store_get(const struct watchman_name_store *store, int index)
+{
+    if (index < 0 || index >= store->nr) {
+        return NULL;
+    }
+    char *name = malloc(store->max_len + 1);
+    if (!name) {
+        return NULL;
+    }
+    size_t offset = store->restarts[index / NAMES_PER_BLOCK];
+    size_t len;
+    int i;
+    for (i = index - index % NAMES_PER_BLOCK; i <= index; ++i) {
+        decode_entry(store, &offset, name, &len);
+    }
+    return name;
+}
+
+int
+watchman_name_store_seek(const struct watchman_name_store *store,
+                         const char *prefix,
+                         struct watchman_name_cursor *cursor)
+{
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->store = store;
+    cursor->prefix = strdup(prefix);
+    cursor->name = malloc(store->max_len + 1);
+    if (!cursor->prefix || !cursor->name) {
+        watchman_name_cursor_release(cursor);
+        return 1;
+    }
+    cursor->name[0] = '\0';
+    lower_bound(cursor, prefix);
+    cursor->unread = 1;
+    return 0;
+}
+
+const char *
+watchman_name_cursor_next(struct watchman_name_cursor *cursor)
+{
+    const struct watchman_name_store *store = cursor->store;
+
+    if (cursor->index >= store->nr) {
+        return NULL;
+    }
+    if (cursor->unread) {
+        cursor->unread = 0;
+    } else if (++cursor->index < store->nr) {
+        decode_entry(store, &cursor->offset, cursor->name, &cursor->len);
+    } else {
+        return NULL;
+    }
+    /* Names with the prefix are contiguous, so the first without ends it */
+    if (strncmp(cursor->name, cursor->prefix, strlen(cursor->prefix))) {
+        cursor->index = store->nr;
+        return NULL;
+    }
+    return cursor->name;
+}
+
+void
+watchman_name_cursor_release(struct watchman_name_cursor *cursor)
+{
+    free(cursor->prefix);
+    free(cursor->name);
+    cursor->prefix = NULL;
+    cursor->name = NULL;
+}
+
+void
+watchman_free_name_store(struct watchman_name_store *store)
+{
+    free(store->restarts);
+    free(store->data);
+    free(store);
+}
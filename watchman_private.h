@@ -0,0 +1,51 @@
+#ifndef LIBWATCHMAN_WATCHMAN_PRIVATE_H_
+#define LIBWATCHMAN_WATCHMAN_PRIVATE_H_
+
+#include "watchman.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fills in 'error', if there is one, and logs the message as a warning */
+void watchman_err(struct watchman_error *error, enum watchman_error_code code,
+                  const char *message, ...)
+    __attribute__ ((format(printf, 3, 4)));
+
+/* The query as watchman would be sent it, but with the fields the caller
+ * asked for, as compact JSON with sorted keys, so that equal queries have
+ * equal keys; free() it */
+char *watchman_query_key(const char *fs_path,
+                         const struct watchman_query *query,
+                         const struct watchman_expression *expr);
+
+/* As watchman_command(), but a response reporting an error is handed
+ * back like any other, so that only a failed connection fails */
+int watchman_command_raw(struct watchman_connection *conn,
+                         struct json_t *request,
+                         struct watchman_response **response,
+                         const struct timespec *deadline,
+                         struct watchman_error *error);
+
+/* Frees the strings a query result's stat owns */
+void watchman_release_stat(struct watchman_stat *stat);
+
+/* Read a PDU sent to this end of a connection and answer it, for the
+ * embedded engine, which serves the other end */
+struct json_t *watchman_read_request(struct watchman_connection *conn,
+                                     struct watchman_error *error);
+int watchman_send_reply(struct watchman_connection *conn, struct json_t *reply,
+                        struct watchman_error *error);
+
+/* Splits a clock "c:<instance>:<ticks>" at the last colon, into the part
+ * that names the daemon instance and root, and its tick count.  Returns
+ * 1 for clocks of any other kind, which can only be matched exactly. */
+int watchman_split_clock(const char *clock, size_t len, size_t *prefix_len,
+                         uint64_t *ticks);
+
+/* The 64-bit FNV-1a hash of 'len' bytes at 'data' */
+uint64_t watchman_fnv1a(const char *data, size_t len);
+
+/* The number of CPUs online, and at least 1 */
+int watchman_nr_cpus(void);
+
+#endif /* ndef LIBWATCHMAN_WATCHMAN_PRIVATE_H_ */
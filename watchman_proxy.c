@@ -0,0 +1,1091 @@
+/*
+ * watchman-proxy: shares watchman between many local clients.
+ *
+ *     watchman-proxy SOCKET
+ *
+ * Clients connect to SOCKET (for example by setting WATCHMAN_SOCK to it)
+ * and speak the BSER (version 1 or 2) or JSON protocol, just as they
+ * would to watchman.
+ * The proxy holds one upstream connection per root.  Subscriptions with
+ * the same root and query share one upstream subscription, whose
+ * notifications are passed on to every subscriber under the name each
+ * one chose, and identical read-only requests that arrive together are
+ * sent upstream once.
+ *
+ * It runs on a single thread, so a slow upstream request holds up the
+ * others; each one is bounded by UPSTREAM_TIMEOUT_SEC.  States entered
+ * with state-enter belong to the shared upstream connection, so they
+ * outlive a client that does not leave them.
+ */
+#include "watchman.h"
+#include "bser.h"
+#include "bser_parse.h"
+#include "bser_private.h"
+#include "bser_write.h"
+#include "watchman_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define UPSTREAM_TIMEOUT_SEC 300
+/* A client that lets this much output pile up is dropped */
+#define MAX_PENDING_OUTPUT (64 << 20)
+#define READ_CHUNK 65536
+/* What BSER version 2 adds to the header: a capabilities word */
+#define BSER_V2_EXTRA 4
+
+struct client {
+    int fd;
+    /* Replies use the protocol of the client's last request: 0 for JSON,
+     * else the BSER version */
+    int bser;
+    int dead;
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    char *out;
+    size_t out_start;
+    size_t out_len;
+    size_t out_cap;
+};
+
+struct upstream {
+    /* NULL for requests that name no root */
+    char *root;
+    struct watchman_connection *conn;
+};
+
+struct subscriber {
+    struct client *client;
+    char *name;
+};
+
+struct subscription {
+    struct upstream *up;
+    /* The query, if the subscription can be shared */
+    char *key;
+    /* The name used upstream */
+    char *name;
+    json_t *query;
+    struct subscriber *subscribers;
+    int nr_subscribers;
+};
+
+struct request {
+    struct client *client;
+    json_t *cmd;
+    /* Set for requests whose response can be shared */
+    char *key;
+    int done;
+};
+
+static struct client **clients;
+static int nr_clients;
+static struct upstream **upstreams;
+static int nr_upstreams;
+static struct subscription **subs;
+static int nr_subs;
+static int next_sub_id;
+static const char *sock_path;
+/* From the first upstream response, for the replies made here */
+static char *upstream_version;
+static volatile sig_atomic_t stopping;
+
+static void *
+xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size ? size : 1);
+    if (!ptr) {
+        fprintf(stderr, "watchman-proxy: out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static char *
+xstrdup(const char *s)
+{
+    char *copy = strdup(s);
+    if (!copy) {
+        fprintf(stderr, "watchman-proxy: out of memory\n");
+        exit(1);
+    }
+    return copy;
+}
+
+static struct timespec
+upstream_deadline(void)
+{
+    struct timeval timeout = {UPSTREAM_TIMEOUT_SEC, 0};
+    return watchman_deadline(timeout);
+}
+
+/* Writes as much pending output as the client will take */
+static void
+client_flush(struct client *client)
+{
+    while (!client->dead && client->out_start < client->out_len) {
+        ssize_t n = write(client->fd, client->out + client->out_start,
+                          client->out_len - client->out_start);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                client->dead = 1;
+            }
+            break;
+        }
+        client->out_start += n;
+    }
+    if (client->out_start == client->out_len) {
+        client->out_start = client->out_len = 0;
+    }
+}
+
+/* Returns room for 'len' more bytes of output, or NULL if the client
+ * has fallen too far behind */
+static char *
+client_reserve(struct client *client, size_t len)
+{
+    if (client->out_len - client->out_start + len > MAX_PENDING_OUTPUT) {
+        client->dead = 1;
+        return NULL;
+    }
+    if (client->out_start > 0) {
+        memmove(client->out, client->out + client->out_start,
+                client->out_len - client->out_start);
+        client->out_len -= client->out_start;
+        client->out_start = 0;
+    }
+    if (client->out_len + len > client->out_cap) {
+        size_t cap = client->out_cap ? client->out_cap : READ_CHUNK;
+        while (cap < client->out_len + len) {
+            cap *= 2;
+        }
+        client->out = xrealloc(client->out, cap);
+        client->out_cap = cap;
+    }
+    char *room = client->out + client->out_len;
+    client->out_len += len;
+    return room;
+}
+
+static void
+client_send(struct client *client, json_t *json)
+{
+    if (client->dead) {
+        return;
+    }
+    if (client->bser) {
+        size_t content = bser_encoding_size(json);
+        size_t total = bser_header_size(content) + content;
+        /* Version 2 has a capabilities word after the magic */
+        size_t extra = client->bser == 2 ? BSER_V2_EXTRA : 0;
+        char *room = client_reserve(client, extra + total);
+        if (room && bser_write_to_buffer(json, content, room + extra,
+                                         total) != total) {
+            client->dead = 1;
+        } else if (room && extra) {
+            /* Over the version 1 magic; no capabilities */
+            memset(room, 0, 2 + extra);
+            room[1] = 2;
+        }
+    } else {
+        char *text = json_dumps(json, JSON_COMPACT);
+        if (!text) {
+            client->dead = 1;
+            return;
+        }
+        size_t len = strlen(text);
+        char *room = client_reserve(client, len + 1);
+        if (room) {
+            memcpy(room, text, len);
+            room[len] = '\n';
+        }
+        free(text);
+    }
+    client_flush(client);
+}
+
+static void
+client_send_error(struct client *client, const char *message)
+{
+    json_t *reply = json_object();
+    if (upstream_version) {
+        json_object_set_new(reply, "version", json_string(upstream_version));
+    }
+    json_object_set_new(reply, "error", json_string(message));
+    client_send(client, reply);
+    json_decref(reply);
+}
+
+/* Returns the length of the first request in 'data', 0 if it has not all
+ * arrived, or -1 if the data is not a request */
+static ssize_t
+request_length(const char *data, size_t len)
+{
+    const uint8_t *in = (const uint8_t *)data;
+    size_t int_size;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (in[0] != 0) {
+        const char *newline = memchr(data, '\n', len);
+        return newline ? newline - data + 1 : 0;
+    }
+    if (len < 2) {
+        return 0;
+    }
+    if (in[1] != 1 && in[1] != 2) {
+        return -1;
+    }
+    /* The magic, then in version 2 the capabilities */
+    size_t header = in[1] == 2 ? 2 + BSER_V2_EXTRA : 2;
+    if (len < header + 1) {
+        return 0;
+    }
+    switch (in[header]) {
+        case BSER_TAG_INT8:
+            int_size = 1;
+            break;
+        case BSER_TAG_INT16:
+            int_size = 2;
+            break;
+        case BSER_TAG_INT32:
+            int_size = 4;
+            break;
+        case BSER_TAG_INT64:
+            int_size = 8;
+            break;
+        default:
+            return -1;
+    }
+    if (len < header + 1 + int_size) {
+        return 0;
+    }
+    int64_t content = 0;
+    switch (int_size) {
+        case 1: {
+            int8_t v;
+            memcpy(&v, in + header + 1, sizeof(v));
+            content = v;
+            break;
+        }
+        case 2: {
+            int16_t v;
+            memcpy(&v, in + header + 1, sizeof(v));
+            content = v;
+            break;
+        }
+        case 4: {
+            int32_t v;
+            memcpy(&v, in + header + 1, sizeof(v));
+            content = v;
+            break;
+        }
+        default:
+            memcpy(&content, in + header + 1, sizeof(content));
+    }
+    if (content < 0 ||
+        content > SSIZE_MAX - (int64_t)(header + 1 + int_size)) {
+        return -1;
+    }
+    size_t total = header + 1 + int_size + content;
+    return len >= total ? (ssize_t)total : 0;
+}
+
+static json_t *
+decode_bser(char *pdu, size_t len)
+{
+    bser_t bser;
+    json_error_t err;
+
+    if (pdu[1] == 2) {
+        /* Past the capabilities, the rest is a version 1 PDU but for the
+         * magic, which can go where the capabilities end */
+        pdu += BSER_V2_EXTRA;
+        len -= BSER_V2_EXTRA;
+        pdu[0] = 0;
+        pdu[1] = 1;
+    }
+
+    bser_parse_buffer((uint8_t *)pdu, len, &bser);
+    /* The parsing state is ours to free once the tree is converted */
+    bser_buffer_t *buffer = bser_is_unparsed(&bser) ? bser.value.unparsed
+                                                    : NULL;
+    json_t *json = bser2json(&bser, &err);
+    bser_free_contents(&bser);
+    free(buffer);
+    return json;
+}
+
+static struct upstream *
+upstream_for(const char *root, struct watchman_error *error)
+{
+    int i;
+    for (i = 0; i < nr_upstreams; ++i) {
+        const char *other = upstreams[i]->root;
+        if (root ? other && !strcmp(root, other) : !other) {
+            return upstreams[i];
+        }
+    }
+    struct timespec deadline = upstream_deadline();
+    struct watchman_connection *conn = watchman_connect_deadline(&deadline,
+                                                                 error);
+    if (!conn) {
+        return NULL;
+    }
+    struct upstream *up = xrealloc(NULL, sizeof(*up));
+    up->root = root ? xstrdup(root) : NULL;
+    up->conn = conn;
+    upstreams = xrealloc(upstreams, (nr_upstreams + 1) * sizeof(*upstreams));
+    upstreams[nr_upstreams++] = up;
+    return up;
+}
+
+static void
+free_subscription(struct subscription *sub)
+{
+    int i;
+    for (i = 0; i < nr_subs; ++i) {
+        if (subs[i] == sub) {
+            subs[i] = subs[--nr_subs];
+            break;
+        }
+    }
+    for (i = 0; i < sub->nr_subscribers; ++i) {
+        free(sub->subscribers[i].name);
+    }
+    free(sub->subscribers);
+    free(sub->key);
+    free(sub->name);
+    json_decref(sub->query);
+    free(sub);
+}
+
+/* Forgets a connection that failed.  Its subscribers are disconnected,
+ * as watchman would on going away, so that they start over. */
+static void
+drop_upstream(struct upstream *up)
+{
+    int i;
+    for (i = nr_subs - 1; i >= 0; --i) {
+        struct subscription *sub = subs[i];
+        if (sub->up == up) {
+            int j;
+            for (j = 0; j < sub->nr_subscribers; ++j) {
+                sub->subscribers[j].client->dead = 1;
+            }
+            free_subscription(sub);
+        }
+    }
+    for (i = 0; i < nr_upstreams; ++i) {
+        if (upstreams[i] == up) {
+            upstreams[i] = upstreams[--nr_upstreams];
+            break;
+        }
+    }
+    watchman_connection_close(up->conn);
+    free(up->root);
+    free(up);
+}
+
+/* Runs 'cmd' upstream.  Returns the response, or NULL with 'error'
+ * filled in; the connection is dropped unless watchman reported the
+ * error itself. */
+static json_t *
+upstream_command(struct upstream *up, json_t *cmd,
+                 struct watchman_error *error)
+{
+    struct timespec deadline = upstream_deadline();
+    struct watchman_response *response;
+    json_error_t err;
+
+    if (watchman_command_raw(up->conn, cmd, &response, &deadline, error)) {
+        drop_upstream(up);
+        return NULL;
+    }
+    json_t *json = bser2json(watchman_response_bser(response), &err);
+    watchman_free_response(response);
+    if (!json) {
+        error->message = xstrdup(err.text);
+        error->code = WATCHMAN_ERR_WATCHMAN_BROKEN;
+        drop_upstream(up);
+        return NULL;
+    }
+    if (!upstream_version) {
+        const char *version = json_string_value(json_object_get(json,
+                                                                "version"));
+        if (version) {
+            upstream_version = xstrdup(version);
+        }
+    }
+    /* The connection is still good when watchman reports an error */
+    const char *message = json_string_value(json_object_get(json, "error"));
+    if (message) {
+        error->message = xstrdup(message);
+        error->code = WATCHMAN_ERR_OTHER;
+        json_decref(json);
+        return NULL;
+    }
+    return json;
+}
+
+static void
+end_subscription(struct subscription *sub)
+{
+    struct upstream *up = sub->up;
+    struct watchman_error error;
+    json_t *cmd = json_array();
+
+    json_array_append_new(cmd, json_string("unsubscribe"));
+    json_array_append_new(cmd, json_string(up->root));
+    json_array_append_new(cmd, json_string(sub->name));
+    free_subscription(sub);
+    json_t *response = upstream_command(up, cmd, &error);
+    if (response) {
+        json_decref(response);
+    } else {
+        watchman_release_error(&error);
+    }
+    json_decref(cmd);
+}
+
+/* Returns 1 if 'client' had a subscription called 'name' on 'root' */
+static int
+remove_subscriber(struct client *client, const char *root, const char *name)
+{
+    int i, j;
+    for (i = 0; i < nr_subs; ++i) {
+        struct subscription *sub = subs[i];
+        if (strcmp(sub->up->root, root)) {
+            continue;
+        }
+        for (j = 0; j < sub->nr_subscribers; ++j) {
+            struct subscriber *subscriber = &sub->subscribers[j];
+            if (subscriber->client == client &&
+                !strcmp(subscriber->name, name)) {
+                free(subscriber->name);
+                *subscriber = sub->subscribers[--sub->nr_subscribers];
+                if (sub->nr_subscribers == 0) {
+                    end_subscription(sub);
+                }
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void
+add_subscriber(struct subscription *sub, struct client *client,
+               const char *name)
+{
+    sub->subscribers = xrealloc(sub->subscribers,
+                                (sub->nr_subscribers + 1) *
+                                sizeof(*sub->subscribers));
+    sub->subscribers[sub->nr_subscribers].client = client;
+    sub->subscribers[sub->nr_subscribers].name = xstrdup(name);
+    sub->nr_subscribers++;
+}
+
+static json_t *
+subscribe_reply(const char *name, json_t *clock)
+{
+    json_t *reply = json_object();
+    if (upstream_version) {
+        json_object_set_new(reply, "version", json_string(upstream_version));
+    }
+    json_object_set_new(reply, "subscribe", json_string(name));
+    if (clock) {
+        json_object_set(reply, "clock", clock);
+    }
+    return reply;
+}
+
+/* Adds a subscriber to a running subscription.  It missed the initial
+ * results, so they are made up from a query; later notifications may
+ * repeat some of the changes, which subscribers have to allow for anyway. */
+static void
+join_subscription(struct subscription *sub, struct client *client,
+                  const char *name)
+{
+    struct watchman_error error;
+    json_t *query = json_deep_copy(sub->query);
+    json_t *cmd = json_array();
+
+    json_object_del(query, "defer");
+    json_object_del(query, "drop");
+    json_object_del(query, "defer_vcs");
+    json_array_append_new(cmd, json_string("query"));
+    json_array_append_new(cmd, json_string(sub->up->root));
+    json_array_append_new(cmd, query);
+    json_t *result = upstream_command(sub->up, cmd, &error);
+    json_decref(cmd);
+    if (!result) {
+        client_send_error(client, error.message);
+        watchman_release_error(&error);
+        return;
+    }
+    add_subscriber(sub, client, name);
+    json_t *reply = subscribe_reply(name, json_object_get(result, "clock"));
+    client_send(client, reply);
+    json_decref(reply);
+
+    json_object_set_new(result, "subscription", json_string(name));
+    json_object_set_new(result, "root", json_string(sub->up->root));
+    json_object_set_new(result, "unilateral", json_true());
+    client_send(client, result);
+    json_decref(result);
+}
+
+static void
+subscribe(struct client *client, json_t *cmd)
+{
+    const char *root = json_string_value(json_array_get(cmd, 1));
+    const char *name = json_string_value(json_array_get(cmd, 2));
+    json_t *query = json_array_get(cmd, 3);
+    struct watchman_error error;
+    int i;
+
+    if (!root || !name || !json_is_object(query)) {
+        client_send_error(client, "subscribe takes a root, a name and "
+                                  "a query");
+        return;
+    }
+    /* As with watchman, subscribing again under a name replaces it */
+    remove_subscriber(client, root, name);
+    struct upstream *up = upstream_for(root, &error);
+    if (!up) {
+        client_send_error(client, error.message);
+        watchman_release_error(&error);
+        return;
+    }
+
+    /* Subscriptions from a given clock can't be joined midway */
+    char *key = NULL;
+    if (!json_object_get(query, "since")) {
+        key = json_dumps(query, JSON_COMPACT | JSON_SORT_KEYS);
+    }
+    for (i = 0; key && i < nr_subs; ++i) {
+        if (subs[i]->up == up && subs[i]->key && !strcmp(subs[i]->key, key)) {
+            free(key);
+            join_subscription(subs[i], client, name);
+            return;
+        }
+    }
+
+    char upstream_name[32];
+    snprintf(upstream_name, sizeof(upstream_name), "proxy-%d", next_sub_id++);
+    json_t *upstream_cmd = json_array();
+    json_array_append_new(upstream_cmd, json_string("subscribe"));
+    json_array_append_new(upstream_cmd, json_string(root));
+    json_array_append_new(upstream_cmd, json_string(upstream_name));
+    json_array_append(upstream_cmd, query);
+    json_t *response = upstream_command(up, upstream_cmd, &error);
+    json_decref(upstream_cmd);
+    if (!response) {
+        free(key);
+        client_send_error(client, error.message);
+        watchman_release_error(&error);
+        return;
+    }
+
+    struct subscription *sub = xrealloc(NULL, sizeof(*sub));
+    sub->up = up;
+    sub->key = key;
+    sub->name = xstrdup(upstream_name);
+    sub->query = json_incref(query);
+    sub->subscribers = NULL;
+    sub->nr_subscribers = 0;
+    add_subscriber(sub, client, name);
+    subs = xrealloc(subs, (nr_subs + 1) * sizeof(*subs));
+    subs[nr_subs++] = sub;
+
+    json_object_set_new(response, "subscribe", json_string(name));
+    client_send(client, response);
+    json_decref(response);
+}
+
+static void
+unsubscribe(struct client *client, json_t *cmd)
+{
+    const char *root = json_string_value(json_array_get(cmd, 1));
+    const char *name = json_string_value(json_array_get(cmd, 2));
+
+    if (!root || !name) {
+        client_send_error(client, "unsubscribe takes a root and a name");
+        return;
+    }
+    int deleted = remove_subscriber(client, root, name);
+    json_t *reply = json_object();
+    if (upstream_version) {
+        json_object_set_new(reply, "version", json_string(upstream_version));
+    }
+    json_object_set_new(reply, "unsubscribe", json_string(name));
+    json_object_set_new(reply, "deleted", json_boolean(deleted));
+    client_send(client, reply);
+    json_decref(reply);
+}
+
+static void
+get_sockname(struct client *client)
+{
+    json_t *reply = json_object();
+    if (upstream_version) {
+        json_object_set_new(reply, "version", json_string(upstream_version));
+    }
+    json_object_set_new(reply, "sockname", json_string(sock_path));
+    client_send(client, reply);
+    json_decref(reply);
+}
+
+/* Requests that only read, so that one response can answer them all */
+static int
+is_shareable(const char *name)
+{
+    static const char *const names[] = {
+        "query", "find", "since", "clock", "version", "watch-list",
+        "get-config", "watch", "watch-project", NULL
+    };
+    int i;
+    for (i = 0; names[i]; ++i) {
+        if (!strcmp(name, names[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Whether reqs[index] is the first of its client's requests still
+ * unanswered, so that answering it keeps the responses in order */
+static int
+is_next(struct request *reqs, int index)
+{
+    int i;
+    for (i = 0; i < index; ++i) {
+        if (reqs[i].client == reqs[index].client && !reqs[i].done) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Sends reqs[index] upstream, answering every later request in the
+ * batch that is the same with the same response, as long as it is
+ * next in line for its client */
+static void
+forward(struct request *reqs, int nr, int index)
+{
+    json_t *cmd = reqs[index].cmd;
+    const char *root = json_string_value(json_array_get(cmd, 1));
+    struct watchman_error error;
+    json_t *response = NULL;
+    int i;
+
+    struct upstream *up = upstream_for(root, &error);
+    if (up) {
+        response = upstream_command(up, cmd, &error);
+    }
+    for (i = index; i < nr; ++i) {
+        if (i != index && (!reqs[index].key || !reqs[i].key ||
+                           reqs[i].done ||
+                           strcmp(reqs[index].key, reqs[i].key) ||
+                           !is_next(reqs, i))) {
+            continue;
+        }
+        reqs[i].done = 1;
+        if (response) {
+            client_send(reqs[i].client, response);
+        } else {
+            client_send_error(reqs[i].client, error.message);
+        }
+    }
+    if (response) {
+        json_decref(response);
+    } else {
+        watchman_release_error(&error);
+    }
+}
+
+static void
+handle_requests(struct request *reqs, int nr)
+{
+    int i;
+    for (i = 0; i < nr; ++i) {
+        const char *name = json_string_value(json_array_get(reqs[i].cmd, 0));
+        if (name && is_shareable(name)) {
+            reqs[i].key = json_dumps(reqs[i].cmd,
+                                     JSON_COMPACT | JSON_SORT_KEYS);
+        }
+    }
+    for (i = 0; i < nr; ++i) {
+        struct client *client = reqs[i].client;
+        const char *name = json_string_value(json_array_get(reqs[i].cmd, 0));
+        if (reqs[i].done) {
+            continue;
+        }
+        if (!name) {
+            client_send_error(client, "invalid command (expected an array "
+                                      "with some elements!)");
+        } else if (!strcmp(name, "get-sockname")) {
+            get_sockname(client);
+        } else if (!strcmp(name, "subscribe")) {
+            subscribe(client, reqs[i].cmd);
+        } else if (!strcmp(name, "unsubscribe")) {
+            unsubscribe(client, reqs[i].cmd);
+        } else {
+            forward(reqs, nr, i);
+        }
+        reqs[i].done = 1;
+    }
+}
+
+/* Passes one notification on to the subscribers it is for */
+static void
+read_notification(struct upstream *up)
+{
+    struct timespec deadline = upstream_deadline();
+    struct watchman_response *response;
+    struct watchman_error error;
+    json_error_t err;
+    int i, j;
+
+    if (watchman_read_unilateral(up->conn, &response, &deadline, &error)) {
+        watchman_release_error(&error);
+        drop_upstream(up);
+        return;
+    }
+    json_t *json = bser2json(watchman_response_bser(response), &err);
+    watchman_free_response(response);
+    if (!json) {
+        drop_upstream(up);
+        return;
+    }
+    const char *name = json_string_value(json_object_get(json,
+                                                         "subscription"));
+    for (i = 0; name && i < nr_subs; ++i) {
+        struct subscription *sub = subs[i];
+        if (sub->up != up || strcmp(sub->name, name)) {
+            continue;
+        }
+        /* 'name' belongs to 'json', which is about to change */
+        name = NULL;
+        for (j = 0; j < sub->nr_subscribers; ++j) {
+            json_object_set_new(json, "subscription",
+                                json_string(sub->subscribers[j].name));
+            client_send(sub->subscribers[j].client, json);
+        }
+    }
+    json_decref(json);
+}
+
+static void
+read_upstreams(void)
+{
+    struct timeval tv_zero = {0, 0};
+    struct timespec now = watchman_deadline(tv_zero);
+    struct watchman_error error;
+
+    for (;;) {
+        int nr = nr_upstreams;
+        struct upstream **ready = xrealloc(NULL, nr * sizeof(*ready));
+        struct watchman_connection **conns = xrealloc(NULL,
+                                                      nr * sizeof(*conns));
+        int *readable = xrealloc(NULL, nr * sizeof(*readable));
+        int i, nr_ready;
+
+        for (i = 0; i < nr; ++i) {
+            ready[i] = upstreams[i];
+            conns[i] = upstreams[i]->conn;
+        }
+        nr_ready = watchman_wait(conns, nr, readable, &now, &error);
+        if (nr_ready < 0) {
+            watchman_release_error(&error);
+        }
+        for (i = 0; nr_ready > 0 && i < nr; ++i) {
+            if (readable[i]) {
+                /* Responses are all read as they come, so whatever turns
+                 * up is a notification (or a hangup) */
+                read_notification(ready[i]);
+            }
+        }
+        free(ready);
+        free(conns);
+        free(readable);
+        if (nr_ready <= 0) {
+            return;
+        }
+    }
+}
+
+/* Reads what the client has sent, adding each complete request to the
+ * batch */
+static void
+read_client(struct client *client, struct request **reqs, int *nr_reqs)
+{
+    for (;;) {
+        if (client->in_cap - client->in_len < READ_CHUNK) {
+            client->in_cap = client->in_cap ? client->in_cap * 2 : READ_CHUNK;
+            client->in = xrealloc(client->in, client->in_cap);
+        }
+        ssize_t n = read(client->fd, client->in + client->in_len,
+                         client->in_cap - client->in_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            client->dead = 1;
+            return;
+        }
+        client->in_len += n;
+    }
+
+    size_t start = 0;
+    for (;;) {
+        char *request = client->in + start;
+        ssize_t len = request_length(request, client->in_len - start);
+        if (len < 0) {
+            client->dead = 1;
+            return;
+        }
+        if (len == 0) {
+            break;
+        }
+        json_error_t err;
+        json_t *cmd;
+        client->bser = request[0] == 0 ? request[1] : 0;
+        if (client->bser) {
+            cmd = decode_bser(request, len);
+        } else {
+            cmd = json_loadb(request, len, 0, &err);
+        }
+        start += len;
+        /* Anything that is not a command is still answered in turn */
+        *reqs = xrealloc(*reqs, (*nr_reqs + 1) * sizeof(**reqs));
+        (*reqs)[*nr_reqs].client = client;
+        (*reqs)[*nr_reqs].cmd = cmd;
+        (*reqs)[*nr_reqs].key = NULL;
+        (*reqs)[*nr_reqs].done = 0;
+        (*nr_reqs)++;
+    }
+    memmove(client->in, client->in + start, client->in_len - start);
+    client->in_len -= start;
+}
+
+static void
+accept_clients(int listen_fd)
+{
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        struct client *client = xrealloc(NULL, sizeof(*client));
+        memset(client, 0, sizeof(*client));
+        client->fd = fd;
+        client->bser = 1;
+        clients = xrealloc(clients, (nr_clients + 1) * sizeof(*clients));
+        clients[nr_clients++] = client;
+    }
+}
+
+static void
+remove_dead_clients(void)
+{
+    int i, j, k;
+    for (i = nr_clients - 1; i >= 0; --i) {
+        struct client *client = clients[i];
+        if (!client->dead) {
+            continue;
+        }
+        for (j = nr_subs - 1; j >= 0; --j) {
+            struct subscription *sub = subs[j];
+            for (k = sub->nr_subscribers - 1; k >= 0; --k) {
+                if (sub->subscribers[k].client == client) {
+                    free(sub->subscribers[k].name);
+                    sub->subscribers[k] =
+                        sub->subscribers[--sub->nr_subscribers];
+                }
+            }
+            if (sub->nr_subscribers == 0) {
+                end_subscription(sub);
+                /* Ending it may have dropped the upstream, and with it
+                 * any number of other subscriptions */
+                j = nr_subs;
+            }
+        }
+        close(client->fd);
+        free(client->in);
+        free(client->out);
+        free(client);
+        clients[i] = clients[--nr_clients];
+        /* Dropping an upstream may have killed clients already passed */
+        i = nr_clients;
+    }
+}
+
+static int
+listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "watchman-proxy: socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("watchman-proxy: socket");
+        return -1;
+    }
+    /* Take over the path only if nothing answers on it */
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "watchman-proxy: %s is already in use\n", path);
+        close(fd);
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "watchman-proxy: can't listen on %s: %s\n", path,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static void
+handle_stop(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct sigaction action;
+    int i;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s SOCKET\n", argv[0]);
+        return 2;
+    }
+    sock_path = argv[1];
+    const char *upstream_sock = getenv("WATCHMAN_SOCK");
+    if (upstream_sock && !strcmp(upstream_sock, sock_path)) {
+        fprintf(stderr, "watchman-proxy: WATCHMAN_SOCK names the proxy "
+                        "itself\n");
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int listen_fd = listen_on(sock_path);
+    if (listen_fd < 0) {
+        return 1;
+    }
+
+    struct pollfd *pfds = NULL;
+    while (!stopping) {
+        int nr_pfds = 1 + nr_clients + nr_upstreams;
+        pfds = xrealloc(pfds, nr_pfds * sizeof(*pfds));
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        for (i = 0; i < nr_clients; ++i) {
+            pfds[1 + i].fd = clients[i]->fd;
+            pfds[1 + i].events = POLLIN;
+            if (clients[i]->out_len > clients[i]->out_start) {
+                pfds[1 + i].events |= POLLOUT;
+            }
+        }
+        for (i = 0; i < nr_upstreams; ++i) {
+            /* One that lost its socket fails its next command, and is
+             * dropped then */
+            struct watchman_connection *conn = upstreams[i]->conn;
+            pfds[1 + nr_clients + i].fd = conn->fp ? fileno(conn->fp) : -1;
+            pfds[1 + nr_clients + i].events = POLLIN;
+        }
+        if (poll(pfds, nr_pfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("watchman-proxy: poll");
+            break;
+        }
+
+        /* Gather every request that has arrived, so that the same ones
+         * can be answered together */
+        struct request *reqs = NULL;
+        int nr_reqs = 0;
+        int nr_polled = nr_clients;
+        for (i = 0; i < nr_polled; ++i) {
+            if (pfds[1 + i].revents & POLLOUT) {
+                client_flush(clients[i]);
+            }
+            if (pfds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                read_client(clients[i], &reqs, &nr_reqs);
+            }
+        }
+        if (pfds[0].revents & POLLIN) {
+            accept_clients(listen_fd);
+        }
+        handle_requests(reqs, nr_reqs);
+        for (i = 0; i < nr_reqs; ++i) {
+            json_decref(reqs[i].cmd);
+            free(reqs[i].key);
+        }
+        free(reqs);
+
+        /* Includes notifications that came in with responses */
+        read_upstreams();
+        remove_dead_clients();
+    }
+
+    free(pfds);
+    close(listen_fd);
+    unlink(sock_path);
+    for (i = 0; i < nr_clients; ++i) {
+        clients[i]->dead = 1;
+    }
+    remove_dead_clients();
+    while (nr_upstreams > 0) {
+        drop_upstream(upstreams[0]);
+    }
+    free(upstream_version);
+    return 0;
+}
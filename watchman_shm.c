@@ -0,0 +1,414 @@
+#include "watchman_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The table is a file (normally under /dev/shm) mapped by one writer and
+ * any number of readers.  It holds an open-addressed hash table of slots,
+ * followed by an append-only arena of names.  Each slot is guarded by a
+ * sequence lock: the writer makes the sequence odd while it changes the
+ * slot and even again afterwards, and a reader retries if the sequence
+ * was odd or changed under it.  Readers never write to the mapping, so
+ * they take no locks and cannot hold up the writer.
+ *
+ * Slots are never freed: a file that goes away keeps its slot with
+ * 'exists' cleared, so that probe chains stay intact.
+ */
+
+#define SHM_MAGIC 0x313030304d48534dULL /* "MSHM0001" */
+#define SHM_MIN_SLOTS 16
+/* A reader gives up on a slot the writer seems to have died updating */
+#define SHM_READ_ATTEMPTS 100000
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+
+struct shm_header {
+    uint64_t magic;
+    /* A power of two */
+    uint64_t nr_slots;
+    uint64_t nr_used;
+    uint64_t arena_size;
+    uint64_t arena_used;
+    /* Readers only answer while this is set: once the writer has loaded
+     * every file, and until it closes the table or runs out of room */
+    uint64_t valid;
+};
+
+struct shm_slot {
+    uint64_t seq;
+    /* 0 for an empty slot */
+    uint64_t hash;
+    uint64_t name_off;
+    uint64_t name_len;
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t ino;
+    uint64_t mode;
+    uint64_t exists;
+};
+
+struct watchman_shm_table {
+    void *map;
+    size_t map_len;
+    struct shm_header *header;
+    struct shm_slot *slots;
+    char *arena;
+    /* Only set for the writer */
+    char *root;
+};
+
+/* A hash of 0 marks an empty slot */
+static uint64_t
+name_hash(const char *name, size_t len)
+{
+    uint64_t hash = watchman_fnv1a(name, len);
+    return hash ? hash : 1;
+}
+
+static size_t
+map_size(uint64_t nr_slots, uint64_t arena_size)
+{
+    return sizeof(struct shm_header) + nr_slots * sizeof(struct shm_slot) +
+           arena_size;
+}
+
+static struct watchman_shm_table *
+table_from_map(void *map, size_t map_len)
+{
+    struct watchman_shm_table *table = calloc(1, sizeof(*table));
+    if (!table) {
+        return NULL;
+    }
+    table->map = map;
+    table->map_len = map_len;
+    table->header = map;
+    table->slots = (struct shm_slot *)(table->header + 1);
+    table->arena = (char *)(table->slots + table->header->nr_slots);
+    return table;
+}
+
+struct watchman_shm_table *
+watchman_shm_create(const char *path, const char *root,
+                    unsigned int nr_slots, size_t arena_size,
+                    struct watchman_error *error)
+{
+    uint64_t slots = SHM_MIN_SLOTS;
+    while (slots < nr_slots) {
+        slots *= 2;
+    }
+    size_t len = map_size(slots, arena_size);
+
+    /* Readers of a previous table keep it until they see it retired */
+    char *tmp = malloc(strlen(path) + 32);
+    if (!tmp) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        return NULL;
+    }
+    sprintf(tmp, "%s.%d.tmp", path, (int)getpid());
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Can't create %s: %s",
+                     tmp, strerror(errno));
+        free(tmp);
+        return NULL;
+    }
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, len) == 0) {
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Can't map %s: %s",
+                     tmp, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return NULL;
+    }
+
+    struct shm_header *header = map;
+    header->nr_slots = slots;
+    header->arena_size = arena_size;
+    header->magic = SHM_MAGIC;
+    struct watchman_shm_table *table = table_from_map(map, len);
+    if (table) {
+        table->root = strdup(root);
+    }
+    if (!table || !table->root || rename(tmp, path)) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Can't create %s: %s",
+                     path, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        if (table) {
+            free(table->root);
+            free(table);
+        }
+        munmap(map, len);
+        return NULL;
+    }
+    free(tmp);
+    return table;
+}
+
+struct watchman_shm_table *
+watchman_shm_open(const char *path, struct watchman_error *error)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Can't open %s: %s",
+                     path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct shm_header)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Can't map %s", path);
+        return NULL;
+    }
+
+    const struct shm_header *header = map;
+    uint64_t slots = header->nr_slots;
+    if (header->magic != SHM_MAGIC || slots == 0 ||
+        (slots & (slots - 1)) ||
+        map_size(slots, header->arena_size) != (size_t)st.st_size) {
+        watchman_err(error, WATCHMAN_ERR_OTHER,
+                     "%s is not a watchman file table", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    struct watchman_shm_table *table = table_from_map(map, st.st_size);
+    if (!table) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+        munmap(map, st.st_size);
+    }
+    return table;
+}
+
+/* Copies a consistent snapshot of 'slot'.  Returns 1 if the writer kept
+ * it busy for too long */
+static int
+read_slot(const struct shm_slot *slot, struct shm_slot *copy)
+{
+    int attempt;
+    for (attempt = 0; attempt < SHM_READ_ATTEMPTS; ++attempt) {
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        copy->hash = LOAD(&slot->hash);
+        copy->name_off = LOAD(&slot->name_off);
+        copy->name_len = LOAD(&slot->name_len);
+        copy->size = LOAD(&slot->size);
+        copy->mtime_ns = LOAD(&slot->mtime_ns);
+        copy->ctime_ns = LOAD(&slot->ctime_ns);
+        copy->ino = LOAD(&slot->ino);
+        copy->mode = LOAD(&slot->mode);
+        copy->exists = LOAD(&slot->exists);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (!(seq & 1) && seq == LOAD(&slot->seq)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int
+watchman_shm_lookup(const struct watchman_shm_table *table, const char *name,
+                    struct watchman_shm_stat *stat)
+{
+    const struct shm_header *header = table->header;
+    if (!__atomic_load_n(&header->valid, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    size_t len = strlen(name);
+    uint64_t hash = name_hash(name, len);
+    uint64_t mask = header->nr_slots - 1;
+    uint64_t i;
+
+    for (i = 0; i <= mask; ++i) {
+        struct shm_slot copy;
+        if (read_slot(&table->slots[(hash + i) & mask], &copy)) {
+            return -1;
+        }
+        if (copy.hash == 0) {
+            return 0;
+        }
+        if (copy.hash == hash && copy.name_len == len &&
+            copy.name_off + len <= header->arena_size &&
+            !memcmp(table->arena + copy.name_off, name, len)) {
+            if (!copy.exists) {
+                return 0;
+            }
+            stat->size = copy.size;
+            stat->mtime_ns = copy.mtime_ns;
+            stat->ctime_ns = copy.ctime_ns;
+            stat->ino = copy.ino;
+            stat->mode = copy.mode;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+write_begin(struct shm_slot *slot)
+{
+    STORE(&slot->seq, slot->seq + 1);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+write_end(struct shm_slot *slot)
+{
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the slot of 'name', or the empty one it belongs in */
+static struct shm_slot *
+find_slot(struct watchman_shm_table *table, const char *name, size_t len,
+          uint64_t hash)
+{
+    uint64_t mask = table->header->nr_slots - 1;
+    uint64_t i;
+    for (i = 0; i <= mask; ++i) {
+        struct shm_slot *slot = &table->slots[(hash + i) & mask];
+        if (slot->hash == 0 ||
+            (slot->hash == hash && slot->name_len == len &&
+             !memcmp(table->arena + slot->name_off, name, len))) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/* Returns 1 if there is no room for a new name */
+static int
+put_stat(struct watchman_shm_table *table, const struct watchman_stat *stat,
+         char *seen)
+{
+    struct shm_header *header = table->header;
+    size_t len = strlen(stat->name);
+    uint64_t hash = name_hash(stat->name, len);
+    struct shm_slot *slot = find_slot(table, stat->name, len, hash);
+    int is_new = slot && slot->hash == 0;
+
+    /* A quarter of the slots are kept free, so that probes stay short */
+    if (!slot || (is_new &&
+                  ((header->nr_used + 1) * 4 > header->nr_slots * 3 ||
+                   header->arena_used + len > header->arena_size))) {
+        return 1;
+    }
+    if (is_new) {
+        memcpy(table->arena + header->arena_used, stat->name, len);
+    }
+
+    write_begin(slot);
+    if (is_new) {
+        STORE(&slot->name_off, header->arena_used);
+        STORE(&slot->name_len, len);
+        STORE(&slot->hash, hash);
+    }
+    STORE(&slot->size, stat->size);
+    STORE(&slot->mtime_ns, stat->mtime_ns);
+    STORE(&slot->ctime_ns, stat->ctime_ns);
+    STORE(&slot->ino, stat->ino);
+    STORE(&slot->mode, stat->mode);
+    STORE(&slot->exists, stat->exists);
+    write_end(slot);
+
+    if (is_new) {
+        header->arena_used += len;
+        header->nr_used++;
+    }
+    if (seen) {
+        seen[slot - table->slots] = 1;
+    }
+    return 0;
+}
+
+int
+watchman_shm_apply(struct watchman_shm_table *table,
+                   const struct watchman_query_result *result,
+                   struct watchman_error *error)
+{
+    struct shm_header *header = table->header;
+    char *seen = NULL;
+    int i;
+
+    /* A fresh instance lists every file; anything else is gone */
+    if (result->is_fresh_instance) {
+        seen = calloc(header->nr_slots, 1);
+        if (!seen) {
+            watchman_err(error, WATCHMAN_ERR_OTHER, "Out of memory");
+            return 1;
+        }
+    }
+    for (i = 0; i < result->nr; ++i) {
+        if (put_stat(table, &result->stats[i], seen)) {
+            __atomic_store_n(&header->valid, 0, __ATOMIC_RELEASE);
+            watchman_err(error, WATCHMAN_ERR_OTHER,
+                         "The file table is full at %d files",
+                         (int)header->nr_used);
+            free(seen);
+            return 1;
+        }
+    }
+    if (seen) {
+        uint64_t j;
+        for (j = 0; j < header->nr_slots; ++j) {
+            struct shm_slot *slot = &table->slots[j];
+            if (slot->hash && slot->exists && !seen[j]) {
+                write_begin(slot);
+                STORE(&slot->exists, 0);
+                write_end(slot);
+            }
+        }
+        free(seen);
+        __atomic_store_n(&header->valid, 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int
+watchman_shm_update(struct watchman_shm_table *table,
+                    struct watchman_connection *conn,
+                    const struct timespec *deadline,
+                    struct watchman_error *error)
+{
+    struct watchman_query *query = watchman_query();
+    watchman_query_set_fields(query, WATCHMAN_SHM_FIELDS);
+    struct watchman_expression *expr = watchman_true_expression();
+    struct watchman_query_result *result =
+        watchman_query_changes(conn, table->root, query, expr, deadline,
+                               error);
+    watchman_free_expression(expr);
+    watchman_free_query(query);
+    if (!result) {
+        return 1;
+    }
+    int ret = watchman_shm_apply(table, result, error);
+    watchman_free_query_result(result);
+    return ret;
+}
+
+void
+watchman_shm_close(struct watchman_shm_table *table)
+{
+    /* Without a writer, the table goes stale; send readers to watchman */
+    if (table->root) {
+        __atomic_store_n(&table->header->valid, 0, __ATOMIC_RELEASE);
+    }
+    munmap(table->map, table->map_len);
+    free(table->root);
+    free(table);
+}
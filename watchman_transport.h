@@ -0,0 +1,35 @@
+#ifndef LIBWATCHMAN_WATCHMAN_TRANSPORT_H_
+#define LIBWATCHMAN_WATCHMAN_TRANSPORT_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "watchman.h"
+
+/* How a connection moves bytes to and from the socket.  Deadlines are
+ * absolute CLOCK_MONOTONIC times; NULL means wait as long as it takes.
+ * Optional operations may be NULL. */
+struct watchman_transport {
+    /* Sends some of 'data'.  Returns the number of bytes accepted, or -1
+     * with errno set (EAGAIN if the deadline passed) */
+    ssize_t (*send)(struct watchman_connection *conn, const void *data,
+                    size_t len, const struct timespec *deadline);
+    /* Receives up to 'len' bytes.  Returns the number of bytes received,
+     * 0 at EOF, or -1 with errno set (EAGAIN if the deadline passed) */
+    ssize_t (*recv)(struct watchman_connection *conn, void *buf, size_t len,
+                    const struct timespec *deadline);
+    /* Sends anything accepted by send() but not yet written.  Returns 0,
+     * or -1 with errno set */
+    int (*flush)(struct watchman_connection *conn,
+                 const struct timespec *deadline);
+    /* Number of received bytes held by the transport itself */
+    size_t (*buffered)(struct watchman_connection *conn);
+    /* Releases transport_data; the socket is closed by the caller */
+    void (*close)(struct watchman_connection *conn);
+};
+
+/* Switches 'conn' to the io_uring transport.  Returns 0, or -1 with errno
+ * set (ENOSYS if the library was built without --enable-io-uring) */
+int watchman_io_uring_attach(struct watchman_connection *conn);
+
+#endif /* ndef LIBWATCHMAN_WATCHMAN_TRANSPORT_H_ */
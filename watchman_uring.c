@@ -0,0 +1,460 @@
+#include "watchman_transport.h"
+
+#include <errno.h>
+
+#ifdef WATCHMAN_IO_URING
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+/*
+ * An io_uring transport, driven through the raw system calls so that
+ * there is no dependency on liburing.  Each connection gets a small ring
+ * and one registered receive buffer.  A request is not written when it
+ * is sent; it is queued, and the next receive submits the send and a
+ * fixed-buffer read as one linked pair, so a whole request and the first
+ * 64KB of its response cost a single io_uring_enter().
+ */
+
+#define URING_ENTRIES 8
+#define URING_RECV_SIZE 65536
+
+/* user_data of each operation; one of each can be in flight */
+enum uring_op {
+    URING_SEND = 1 << 0,
+    URING_RECV = 1 << 1,
+    URING_TIMEOUT = 1 << 2,
+    URING_TIMEOUT_REMOVE = 1 << 3,
+    URING_CANCEL_SEND = 1 << 4,
+    URING_CANCEL_RECV = 1 << 5
+};
+#define URING_NR_OPS 6
+
+struct uring {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    /* Queued entries not yet made visible to the kernel */
+    unsigned queued;
+    /* Operations whose completion has not been reaped */
+    unsigned in_flight;
+    int results[URING_NR_OPS];
+    struct __kernel_timespec deadline;
+    /* Registered receive buffer, and the part not handed out yet */
+    char *recv_buf;
+    size_t recv_start;
+    size_t recv_end;
+    /* Request bytes accepted by send() but not yet written */
+    char *send_buf;
+    size_t send_len;
+    size_t send_cap;
+};
+
+static int
+op_index(unsigned op)
+{
+    int i = 0;
+    while (!(op & 1)) {
+        op >>= 1;
+        i++;
+    }
+    return i;
+}
+
+static struct io_uring_sqe *
+uring_queue(struct uring *ring, int opcode, unsigned op)
+{
+    unsigned tail = *ring->sq_tail + ring->queued;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = -1;
+    sqe->user_data = op;
+    ring->sq_array[index] = index;
+    ring->queued++;
+    ring->in_flight |= op;
+    ring->results[op_index(op)] = 0;
+    return sqe;
+}
+
+static void
+uring_reap(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        ring->results[op_index(cqe->user_data)] = cqe->res;
+        ring->in_flight &= ~(unsigned)cqe->user_data;
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Submits what is queued and waits for at least one completion */
+static int
+uring_enter(struct uring *ring)
+{
+    unsigned to_submit = ring->queued;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued,
+                     __ATOMIC_RELEASE);
+    ring->queued = 0;
+    for (;;) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0) {
+            uring_reap(ring);
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+        /* The entries were consumed even though the wait was interrupted */
+        to_submit = 0;
+    }
+}
+
+/*
+ * Runs the queued operations to completion.  If 'deadline' passes first,
+ * they are cancelled and 1 is returned.
+ */
+static int
+uring_run(struct uring *ring, const struct timespec *deadline)
+{
+    const unsigned io = URING_SEND | URING_RECV;
+    int timed_out = 0;
+
+    if (deadline) {
+        ring->deadline.tv_sec = deadline->tv_sec;
+        ring->deadline.tv_nsec = deadline->tv_nsec;
+        struct io_uring_sqe *sqe = uring_queue(ring, IORING_OP_TIMEOUT,
+                                               URING_TIMEOUT);
+        sqe->addr = (uintptr_t)&ring->deadline;
+        sqe->len = 1;
+        sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    }
+
+    while (ring->in_flight) {
+        if (uring_enter(ring) < 0) {
+            return -1;
+        }
+        if ((ring->in_flight & URING_TIMEOUT) && !(ring->in_flight & io) &&
+            !(ring->in_flight & URING_TIMEOUT_REMOVE)) {
+            struct io_uring_sqe *sqe = uring_queue(ring,
+                                                   IORING_OP_TIMEOUT_REMOVE,
+                                                   URING_TIMEOUT_REMOVE);
+            sqe->addr = URING_TIMEOUT;
+        }
+        if (deadline && !timed_out && !(ring->in_flight & URING_TIMEOUT) &&
+            ring->results[op_index(URING_TIMEOUT)] == -ETIME &&
+            (ring->in_flight & io)) {
+            timed_out = 1;
+            if (ring->in_flight & URING_SEND) {
+                uring_queue(ring, IORING_OP_ASYNC_CANCEL,
+                            URING_CANCEL_SEND)->addr = URING_SEND;
+            }
+            if (ring->in_flight & URING_RECV) {
+                uring_queue(ring, IORING_OP_ASYNC_CANCEL,
+                            URING_CANCEL_RECV)->addr = URING_RECV;
+            }
+        }
+    }
+    return timed_out;
+}
+
+/*
+ * Writes queued request bytes and, if 'recv' is set, reads into the
+ * receive buffer in the same submission.  Returns 0, or -1 with errno
+ * set.
+ */
+static int
+uring_exchange(struct watchman_connection *conn, int recv,
+               const struct timespec *deadline)
+{
+    struct uring *ring = conn->transport_data;
+    int fd = fileno(conn->fp);
+
+    for (;;) {
+        unsigned ops = 0;
+        if (ring->send_len > 0) {
+            struct io_uring_sqe *sqe = uring_queue(ring, IORING_OP_SEND,
+                                                   URING_SEND);
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t)ring->send_buf;
+            sqe->len = ring->send_len;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            if (recv) {
+                sqe->flags |= IOSQE_IO_LINK;
+            }
+            ops |= URING_SEND;
+        }
+        if (recv) {
+            struct io_uring_sqe *sqe = uring_queue(ring, IORING_OP_READ_FIXED,
+                                                   URING_RECV);
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t)ring->recv_buf;
+            sqe->len = URING_RECV_SIZE;
+            sqe->off = (uint64_t)-1;
+            sqe->buf_index = 0;
+            ops |= URING_RECV;
+        }
+        if (!ops) {
+            return 0;
+        }
+
+        int ret = uring_run(ring, deadline);
+        if (ret < 0) {
+            return -1;
+        }
+
+        if (ops & URING_SEND) {
+            int sent = ring->results[op_index(URING_SEND)];
+            if (sent < 0 && sent != -ECANCELED) {
+                errno = -sent;
+                return -1;
+            }
+            if (sent > 0) {
+                ring->send_len -= sent;
+                memmove(ring->send_buf, ring->send_buf + sent,
+                        ring->send_len);
+            }
+        }
+        int got = (ops & URING_RECV) ? ring->results[op_index(URING_RECV)]
+                                     : -ECANCELED;
+        if (got >= 0) {
+            ring->recv_start = 0;
+            ring->recv_end = got;
+            return 0;
+        }
+        if (ret == 1) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (got != -ECANCELED) {
+            errno = -got;
+            return -1;
+        }
+        /* A short send broke the link; go again with the rest */
+        if (!recv && ring->send_len == 0) {
+            return 0;
+        }
+    }
+}
+
+static ssize_t
+uring_send(struct watchman_connection *conn, const void *data, size_t len,
+           const struct timespec *deadline)
+{
+    struct uring *ring = conn->transport_data;
+
+    if (ring->send_len + len > ring->send_cap) {
+        size_t cap = ring->send_cap ? ring->send_cap : 4096;
+        while (cap < ring->send_len + len) {
+            cap *= 2;
+        }
+        char *buf = realloc(ring->send_buf, cap);
+        if (buf == NULL) {
+            return -1;
+        }
+        ring->send_buf = buf;
+        ring->send_cap = cap;
+    }
+    memcpy(ring->send_buf + ring->send_len, data, len);
+    ring->send_len += len;
+    return len;
+}
+
+static ssize_t
+uring_recv(struct watchman_connection *conn, void *buf, size_t len,
+           const struct timespec *deadline)
+{
+    struct uring *ring = conn->transport_data;
+
+    if (ring->recv_start == ring->recv_end) {
+        if (uring_exchange(conn, 1, deadline) < 0) {
+            return -1;
+        }
+    }
+    size_t avail = ring->recv_end - ring->recv_start;
+    if (len > avail) {
+        len = avail;
+    }
+    memcpy(buf, ring->recv_buf + ring->recv_start, len);
+    ring->recv_start += len;
+    return len;
+}
+
+static int
+uring_flush(struct watchman_connection *conn, const struct timespec *deadline)
+{
+    return uring_exchange(conn, 0, deadline);
+}
+
+static size_t
+uring_buffered(struct watchman_connection *conn)
+{
+    struct uring *ring = conn->transport_data;
+    return ring->recv_end - ring->recv_start;
+}
+
+static void
+uring_free(struct uring *ring)
+{
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+        ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->recv_buf);
+    free(ring->send_buf);
+    free(ring);
+}
+
+static void
+uring_close(struct watchman_connection *conn)
+{
+    uring_free(conn->transport_data);
+    conn->transport_data = NULL;
+}
+
+static const struct watchman_transport uring_transport = {
+    uring_send,
+    uring_recv,
+    uring_flush,
+    uring_buffered,
+    uring_close
+};
+
+static int
+uring_map(struct uring *ring, struct io_uring_params *p)
+{
+    ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p->cq_off.cqes +
+        p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        return -1;
+    }
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            return -1;
+        }
+    }
+    ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p->sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p->cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+int
+watchman_io_uring_attach(struct watchman_connection *conn)
+{
+    struct io_uring_params params;
+    struct uring *ring;
+    int saved;
+
+    if (conn->transport != NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return -1;
+    }
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0 || uring_map(ring, &params) < 0) {
+        goto fail;
+    }
+
+    struct iovec iov;
+    if (posix_memalign((void **)&ring->recv_buf, 4096, URING_RECV_SIZE)) {
+        ring->recv_buf = NULL;
+        errno = ENOMEM;
+        goto fail;
+    }
+    iov.iov_base = ring->recv_buf;
+    iov.iov_len = URING_RECV_SIZE;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+                &iov, 1) < 0) {
+        goto fail;
+    }
+
+    conn->transport = &uring_transport;
+    conn->transport_data = ring;
+    return 0;
+
+fail:
+    saved = errno;
+    uring_free(ring);
+    errno = saved;
+    return -1;
+}
+
+#else
+
+int
+watchman_io_uring_attach(struct watchman_connection *conn)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,227 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "watchman_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The files are looked up relative to one descriptor for the root, so
+ * each lookup only walks the name itself.  Threads take the entries a
+ * batch at a time; most of the time goes into the kernel's metadata
+ * lookups, which run in parallel for different directories, and on cold
+ * caches many lookups in flight keep the disk busy.
+ */
+
+/* Entries a thread takes at a time */
+#define VERIFY_BATCH 256
+#define MAX_VERIFIERS 64
+
+struct verify {
+    pthread_mutex_t lock;
+    int rootfd;
+    struct watchman_query_result *result;
+    int fields;
+    int refresh;
+    unsigned *mismatches;
+    /* The next entry to take */
+    int next;
+};
+
+struct verifier {
+    struct verify *verify;
+    pthread_t thread;
+    /* The number of entries this thread found to differ */
+    int nr_mismatched;
+};
+
+static int64_t
+to_units(const struct timespec *t, int64_t per_second)
+{
+    return (int64_t)t->tv_sec * per_second +
+           t->tv_nsec / (1000000000 / per_second);
+}
+
+/* Compares the finest of the mtimes asked for */
+static int
+mtime_differs(const struct watchman_stat *stat, const struct stat *st,
+              int fields)
+{
+    if (fields & WATCHMAN_FIELD_MTIME_NS) {
+        return stat->mtime_ns != to_units(&st->st_mtim, 1000000000);
+    }
+    if (fields & WATCHMAN_FIELD_MTIME_US) {
+        return stat->mtime_us != to_units(&st->st_mtim, 1000000);
+    }
+    if (fields & WATCHMAN_FIELD_MTIME_MS) {
+        return stat->mtime_ms != to_units(&st->st_mtim, 1000);
+    }
+    if (fields & WATCHMAN_FIELD_MTIME_F) {
+        double diff = stat->mtime_f - (st->st_mtim.tv_sec +
+                                       st->st_mtim.tv_nsec / 1e9);
+        /* A double only holds about microseconds for current times */
+        return diff > 1e-6 || diff < -1e-6;
+    }
+    if (fields & WATCHMAN_FIELD_MTIME) {
+        return stat->mtime != st->st_mtim.tv_sec;
+    }
+    return 0;
+}
+
+static void
+refresh_stat(struct watchman_stat *stat, const struct stat *st)
+{
+    stat->exists = 1;
+    stat->size = st->st_size;
+    stat->mode = st->st_mode;
+    stat->ino = st->st_ino;
+    stat->dev = st->st_dev;
+    stat->nlink = st->st_nlink;
+    stat->uid = st->st_uid;
+    stat->gid = st->st_gid;
+    stat->mtime = st->st_mtim.tv_sec;
+    stat->mtime_ms = to_units(&st->st_mtim, 1000);
+    stat->mtime_us = to_units(&st->st_mtim, 1000000);
+    stat->mtime_ns = to_units(&st->st_mtim, 1000000000);
+    stat->mtime_f = st->st_mtim.tv_sec + st->st_mtim.tv_nsec / 1e9;
+    stat->ctime = st->st_ctim.tv_sec;
+    stat->ctime_ms = to_units(&st->st_ctim, 1000);
+    stat->ctime_us = to_units(&st->st_ctim, 1000000);
+    stat->ctime_ns = to_units(&st->st_ctim, 1000000000);
+    stat->ctime_f = st->st_ctim.tv_sec + st->st_ctim.tv_nsec / 1e9;
+}
+
+static unsigned
+verify_one(struct verify *verify, struct watchman_stat *stat)
+{
+    int fields = verify->fields;
+    /* Without the exists field, a result only lists files that exist */
+    int expected = !(fields & WATCHMAN_FIELD_EXISTS) || stat->exists;
+    struct stat st;
+    unsigned mismatch = 0;
+
+    if (!stat->name) {
+        return WATCHMAN_MISMATCH_UNREADABLE;
+    }
+    if (fstatat(verify->rootfd, stat->name, &st, AT_SYMLINK_NOFOLLOW)) {
+        if (errno != ENOENT && errno != ENOTDIR) {
+            return WATCHMAN_MISMATCH_UNREADABLE;
+        }
+        if (expected) {
+            mismatch = WATCHMAN_MISMATCH_EXISTS;
+            if (verify->refresh) {
+                stat->exists = 0;
+            }
+        }
+        return mismatch;
+    }
+
+    if (!expected) {
+        mismatch = WATCHMAN_MISMATCH_EXISTS;
+    } else {
+        if ((fields & WATCHMAN_FIELD_SIZE) && stat->size != st.st_size) {
+            mismatch |= WATCHMAN_MISMATCH_SIZE;
+        }
+        if (mtime_differs(stat, &st, fields)) {
+            mismatch |= WATCHMAN_MISMATCH_MTIME;
+        }
+        /* As truncated to the result's int */
+        if ((fields & WATCHMAN_FIELD_INO) && stat->ino != (int)st.st_ino) {
+            mismatch |= WATCHMAN_MISMATCH_INO;
+        }
+        if ((fields & WATCHMAN_FIELD_MODE) &&
+            stat->mode != (int)st.st_mode) {
+            mismatch |= WATCHMAN_MISMATCH_MODE;
+        }
+    }
+    if (verify->refresh) {
+        refresh_stat(stat, &st);
+    }
+    return mismatch;
+}
+
+static void *
+run_verifier(void *arg)
+{
+    struct verifier *verifier = arg;
+    struct verify *verify = verifier->verify;
+    int nr = verify->result->nr;
+
+    for (;;) {
+        pthread_mutex_lock(&verify->lock);
+        int begin = verify->next;
+        int end = nr - begin > VERIFY_BATCH ? begin + VERIFY_BATCH : nr;
+        verify->next = end;
+        pthread_mutex_unlock(&verify->lock);
+        if (begin >= end) {
+            break;
+        }
+        int i;
+        for (i = begin; i < end; ++i) {
+            unsigned mismatch =
+                verify_one(verify, &verify->result->stats[i]);
+            if (verify->mismatches) {
+                verify->mismatches[i] = mismatch;
+            }
+            verifier->nr_mismatched += mismatch != 0;
+        }
+    }
+    return NULL;
+}
+
+int
+watchman_verify_result(const char *root, struct watchman_query_result *result,
+                       int fields, int nr_threads, int refresh,
+                       unsigned *mismatches, struct watchman_error *error)
+{
+    int rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootfd < 0) {
+        watchman_err(error, WATCHMAN_ERR_OTHER, "Can't open %s: %s", root,
+                     strerror(errno));
+        return -1;
+    }
+
+    if (nr_threads <= 0) {
+        nr_threads = watchman_nr_cpus();
+    }
+    int nr_batches = (result->nr + VERIFY_BATCH - 1) / VERIFY_BATCH;
+    if (nr_threads > nr_batches) {
+        nr_threads = nr_batches ? nr_batches : 1;
+    }
+    if (nr_threads > MAX_VERIFIERS) {
+        nr_threads = MAX_VERIFIERS;
+    }
+
+    struct verify verify = {.rootfd = rootfd, .result = result,
+                            .fields = fields, .refresh = refresh,
+                            .mismatches = mismatches};
+    struct verifier verifiers[MAX_VERIFIERS];
+    int i, nr_started = 0, nr_mismatched = 0;
+    pthread_mutex_init(&verify.lock, NULL);
+    /* The caller's thread is the first verifier */
+    for (i = 0; i < nr_threads; ++i) {
+        verifiers[i].verify = &verify;
+        verifiers[i].nr_mismatched = 0;
+    }
+    for (i = 1; i < nr_threads; ++i) {
+        if (pthread_create(&verifiers[i].thread, NULL, run_verifier,
+                           &verifiers[i])) {
+            break;
+        }
+        nr_started++;
+    }
+    run_verifier(&verifiers[0]);
+    nr_mismatched = verifiers[0].nr_mismatched;
+    for (i = 1; i <= nr_started; ++i) {
+        pthread_join(verifiers[i].thread, NULL);
+        nr_mismatched += verifiers[i].nr_mismatched;
+    }
+    pthread_mutex_destroy(&verify.lock);
+    close(rootfd);
+    return nr_mismatched;
+}